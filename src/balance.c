@@ -629,22 +629,11 @@ static NTSTATUS write_metadata_items(_Requires_exclusive_lock_held_(_Curr_->tree
             if (ref->type == TYPE_TREE_BLOCK_REF) {
                 KEY* firstitem;
                 root* r = NULL;
-                LIST_ENTRY* le3;
                 tree* t;
 
                 firstitem = (KEY*)&mr->data[1];
 
-                le3 = Vcb->roots.Flink;
-                while (le3 != &Vcb->roots) {
-                    root* r2 = CONTAINING_RECORD(le3, root, list_entry);
-
-                    if (r2->id == ref->tbr.offset) {
-                        r = r2;
-                        break;
-                    }
-
-                    le3 = le3->Flink;
-                }
+                r = find_root_by_id(Vcb, ref->tbr.offset);
 
                 if (!r) {
                     ERR("could not find subvol with id %I64x\n", ref->tbr.offset);
@@ -841,22 +830,11 @@ static NTSTATUS write_metadata_items(_Requires_exclusive_lock_held_(_Curr_->tree
                             }
                         }
                     } else if (ref->top && ref->type == TYPE_TREE_BLOCK_REF) {
-                        LIST_ENTRY* le3;
-                        root* r = NULL;
+                        root* r;
 
                         // alter ROOT_ITEM
 
-                        le3 = Vcb->roots.Flink;
-                        while (le3 != &Vcb->roots) {
-                            root* r2 = CONTAINING_RECORD(le3, root, list_entry);
-
-                            if (r2->id == ref->tbr.offset) {
-                                r = r2;
-                                break;
-                            }
-
-                            le3 = le3->Flink;
-                        }
+                        r = find_root_by_id(Vcb, ref->tbr.offset);
 
                         if (r) {
                             r->treeholder.address = mr->new_address;
@@ -1217,25 +1195,14 @@ end:
 static NTSTATUS data_reloc_add_tree_edr(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, LIST_ENTRY* metadata_items,
                                         data_reloc* dr, EXTENT_DATA_REF* edr, LIST_ENTRY* rollback) {
     NTSTATUS Status;
-    LIST_ENTRY* le;
     KEY searchkey;
     traverse_ptr tp;
-    root* r = NULL;
+    root* r;
     metadata_reloc* mr;
     uint64_t last_tree = 0;
     data_reloc_ref* ref;
 
-    le = Vcb->roots.Flink;
-    while (le != &Vcb->roots) {
-        root* r2 = CONTAINING_RECORD(le, root, list_entry);
-
-        if (r2->id == edr->root) {
-            r = r2;
-            break;
-        }
-
-        le = le->Flink;
-    }
+    r = find_root_by_id(Vcb, edr->root);
 
     if (!r) {
         ERR("could not find subvol %I64x\n", edr->root);
@@ -1686,6 +1653,12 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, bool* change
 
     ExAcquireResourceExclusiveLite(&Vcb->tree_lock, true);
 
+    // Asynchronous data writes only start under the tree lock, so none can start now - but we
+    // mustn't copy extents whose data is still on its way to the disk, or which are about to be
+    // rolled back.
+    wait_for_inflight_writes(Vcb, NULL);
+    rollback_failed_async_writes(Vcb);
+
     searchkey.obj_id = c->offset;
     searchkey.obj_type = TYPE_EXTENT_ITEM;
     searchkey.offset = 0xffffffffffffffff;
@@ -19,6 +19,12 @@
 
 #include "blake2-impl.h"
 
+#if defined(_X86_) || defined(_AMD64_)
+#include <immintrin.h>
+#endif
+
+typedef void (*blake2b_block_func)(uint64_t* h, const uint8_t* block, const uint64_t* t, const uint64_t* f);
+
 static const uint64_t blake2b_IV[8] =
 {
   0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
@@ -138,7 +144,7 @@ static void blake2b_init( blake2b_state *S, size_t outlen )
     G(r,7,v[ 3],v[ 4],v[ 9],v[14]); \
   } while(0)
 
-static void blake2b_compress( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] )
+static void blake2b_block_ref( uint64_t* h, const uint8_t* block, const uint64_t* t, const uint64_t* f )
 {
   uint64_t m[16];
   uint64_t v[16];
@@ -149,17 +155,17 @@ static void blake2b_compress( blake2b_state *S, const uint8_t block[BLAKE2B_BLOC
   }
 
   for( i = 0; i < 8; ++i ) {
-    v[i] = S->h[i];
+    v[i] = h[i];
   }
 
   v[ 8] = blake2b_IV[0];
   v[ 9] = blake2b_IV[1];
   v[10] = blake2b_IV[2];
   v[11] = blake2b_IV[3];
-  v[12] = blake2b_IV[4] ^ S->t[0];
-  v[13] = blake2b_IV[5] ^ S->t[1];
-  v[14] = blake2b_IV[6] ^ S->f[0];
-  v[15] = blake2b_IV[7] ^ S->f[1];
+  v[12] = blake2b_IV[4] ^ t[0];
+  v[13] = blake2b_IV[5] ^ t[1];
+  v[14] = blake2b_IV[6] ^ f[0];
+  v[15] = blake2b_IV[7] ^ f[1];
 
   ROUND( 0 );
   ROUND( 1 );
@@ -175,13 +181,194 @@ static void blake2b_compress( blake2b_state *S, const uint8_t block[BLAKE2B_BLOC
   ROUND( 11 );
 
   for( i = 0; i < 8; ++i ) {
-    S->h[i] = S->h[i] ^ v[i] ^ v[i + 8];
+    h[i] = h[i] ^ v[i] ^ v[i + 8];
   }
 }
 
 #undef G
 #undef ROUND
 
+#if defined(_X86_) || defined(_AMD64_)
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define SSSE3_TARGET
+#define AVX2_TARGET
+#else
+#define SSSE3_TARGET __attribute__((target("ssse3")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+/*
+ * Vectorized versions of the above. Each row of the 4x4 state is kept in one AVX2
+ * register, or two SSE registers, so the four G functions of a column or diagonal
+ * step run in parallel. The rotations by 16 and 24 are done as byte shuffles.
+ */
+
+#define LOAD_MSG_128(r,i0,i1) _mm_set_epi64x( (int64_t)m[blake2b_sigma[r][i1]], (int64_t)m[blake2b_sigma[r][i0]] )
+
+#define G_128(x,y)                                                            \
+  do {                                                                        \
+    a##x = _mm_add_epi64( _mm_add_epi64( a##x, b##x ), y );                   \
+    d##x = _mm_shuffle_epi32( _mm_xor_si128( d##x, a##x ), _MM_SHUFFLE(2,3,0,1) ); \
+    c##x = _mm_add_epi64( c##x, d##x );                                       \
+    b##x = _mm_shuffle_epi8( _mm_xor_si128( b##x, c##x ), r24 );              \
+  } while(0)
+
+#define G2_128(x,y)                                                           \
+  do {                                                                        \
+    a##x = _mm_add_epi64( _mm_add_epi64( a##x, b##x ), y );                   \
+    d##x = _mm_shuffle_epi8( _mm_xor_si128( d##x, a##x ), r16 );              \
+    c##x = _mm_add_epi64( c##x, d##x );                                       \
+    b##x = _mm_xor_si128( b##x, c##x );                                       \
+    b##x = _mm_xor_si128( _mm_srli_epi64( b##x, 63 ), _mm_add_epi64( b##x, b##x ) ); \
+  } while(0)
+
+#define HALF_ROUND_128(r,o)                             \
+  do {                                                  \
+    G_128(l, LOAD_MSG_128(r, o + 0, o + 2));            \
+    G_128(h, LOAD_MSG_128(r, o + 4, o + 6));            \
+    G2_128(l, LOAD_MSG_128(r, o + 1, o + 3));           \
+    G2_128(h, LOAD_MSG_128(r, o + 5, o + 7));           \
+  } while(0)
+
+SSSE3_TARGET
+void blake2b_block_ssse3( uint64_t* h, const uint8_t* block, const uint64_t* t, const uint64_t* f )
+{
+  const __m128i r16 = _mm_setr_epi8( 2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9 );
+  const __m128i r24 = _mm_setr_epi8( 3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10 );
+  __m128i al, ah, bl, bh, cl, ch, dl, dh, t0, t1;
+  uint64_t m[16];
+  size_t i;
+
+  for( i = 0; i < 16; ++i ) {
+    m[i] = load64( block + i * sizeof( m[i] ) );
+  }
+
+  al = _mm_loadu_si128( (const __m128i*)&h[0] );
+  ah = _mm_loadu_si128( (const __m128i*)&h[2] );
+  bl = _mm_loadu_si128( (const __m128i*)&h[4] );
+  bh = _mm_loadu_si128( (const __m128i*)&h[6] );
+  cl = _mm_loadu_si128( (const __m128i*)&blake2b_IV[0] );
+  ch = _mm_loadu_si128( (const __m128i*)&blake2b_IV[2] );
+  dl = _mm_xor_si128( _mm_loadu_si128( (const __m128i*)&blake2b_IV[4] ), _mm_loadu_si128( (const __m128i*)t ) );
+  dh = _mm_xor_si128( _mm_loadu_si128( (const __m128i*)&blake2b_IV[6] ), _mm_loadu_si128( (const __m128i*)f ) );
+
+  for( i = 0; i < 12; ++i ) {
+    HALF_ROUND_128(i, 0);
+
+    /* diagonalize */
+    t0 = _mm_alignr_epi8( bh, bl, 8 );
+    t1 = _mm_alignr_epi8( bl, bh, 8 );
+    bl = t0;
+    bh = t1;
+
+    t0 = cl;
+    cl = ch;
+    ch = t0;
+
+    t0 = _mm_alignr_epi8( dh, dl, 8 );
+    t1 = _mm_alignr_epi8( dl, dh, 8 );
+    dl = t1;
+    dh = t0;
+
+    HALF_ROUND_128(i, 8);
+
+    /* undiagonalize */
+    t0 = _mm_alignr_epi8( bl, bh, 8 );
+    t1 = _mm_alignr_epi8( bh, bl, 8 );
+    bl = t0;
+    bh = t1;
+
+    t0 = cl;
+    cl = ch;
+    ch = t0;
+
+    t0 = _mm_alignr_epi8( dl, dh, 8 );
+    t1 = _mm_alignr_epi8( dh, dl, 8 );
+    dl = t1;
+    dh = t0;
+  }
+
+  _mm_storeu_si128( (__m128i*)&h[0], _mm_xor_si128( _mm_loadu_si128( (const __m128i*)&h[0] ), _mm_xor_si128( al, cl ) ) );
+  _mm_storeu_si128( (__m128i*)&h[2], _mm_xor_si128( _mm_loadu_si128( (const __m128i*)&h[2] ), _mm_xor_si128( ah, ch ) ) );
+  _mm_storeu_si128( (__m128i*)&h[4], _mm_xor_si128( _mm_loadu_si128( (const __m128i*)&h[4] ), _mm_xor_si128( bl, dl ) ) );
+  _mm_storeu_si128( (__m128i*)&h[6], _mm_xor_si128( _mm_loadu_si128( (const __m128i*)&h[6] ), _mm_xor_si128( bh, dh ) ) );
+}
+
+#undef LOAD_MSG_128
+#undef G_128
+#undef G2_128
+#undef HALF_ROUND_128
+
+#define LOAD_MSG_256(r,i0,i1,i2,i3) \
+  _mm256_set_epi64x( (int64_t)m[blake2b_sigma[r][i3]], (int64_t)m[blake2b_sigma[r][i2]], (int64_t)m[blake2b_sigma[r][i1]], (int64_t)m[blake2b_sigma[r][i0]] )
+
+#define G_256(r,o)                                                                    \
+  do {                                                                                \
+    a = _mm256_add_epi64( _mm256_add_epi64( a, b ), LOAD_MSG_256(r, o + 0, o + 2, o + 4, o + 6) ); \
+    d = _mm256_shuffle_epi32( _mm256_xor_si256( d, a ), _MM_SHUFFLE(2,3,0,1) );       \
+    c = _mm256_add_epi64( c, d );                                                     \
+    b = _mm256_shuffle_epi8( _mm256_xor_si256( b, c ), r24 );                         \
+    a = _mm256_add_epi64( _mm256_add_epi64( a, b ), LOAD_MSG_256(r, o + 1, o + 3, o + 5, o + 7) ); \
+    d = _mm256_shuffle_epi8( _mm256_xor_si256( d, a ), r16 );                         \
+    c = _mm256_add_epi64( c, d );                                                     \
+    b = _mm256_xor_si256( b, c );                                                     \
+    b = _mm256_xor_si256( _mm256_srli_epi64( b, 63 ), _mm256_add_epi64( b, b ) );     \
+  } while(0)
+
+AVX2_TARGET
+void blake2b_block_avx2( uint64_t* h, const uint8_t* block, const uint64_t* t, const uint64_t* f )
+{
+  const __m256i r16 = _mm256_setr_epi8( 2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+                                        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9 );
+  const __m256i r24 = _mm256_setr_epi8( 3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+                                        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10 );
+  __m256i a, b, c, d;
+  uint64_t m[16];
+  size_t i;
+
+  for( i = 0; i < 16; ++i ) {
+    m[i] = load64( block + i * sizeof( m[i] ) );
+  }
+
+  a = _mm256_loadu_si256( (const __m256i*)&h[0] );
+  b = _mm256_loadu_si256( (const __m256i*)&h[4] );
+  c = _mm256_loadu_si256( (const __m256i*)&blake2b_IV[0] );
+  d = _mm256_xor_si256( _mm256_loadu_si256( (const __m256i*)&blake2b_IV[4] ),
+                        _mm256_set_epi64x( (int64_t)f[1], (int64_t)f[0], (int64_t)t[1], (int64_t)t[0] ) );
+
+  for( i = 0; i < 12; ++i ) {
+    G_256(i, 0);
+
+    /* diagonalize */
+    b = _mm256_permute4x64_epi64( b, _MM_SHUFFLE(0,3,2,1) );
+    c = _mm256_permute4x64_epi64( c, _MM_SHUFFLE(1,0,3,2) );
+    d = _mm256_permute4x64_epi64( d, _MM_SHUFFLE(2,1,0,3) );
+
+    G_256(i, 8);
+
+    /* undiagonalize */
+    b = _mm256_permute4x64_epi64( b, _MM_SHUFFLE(2,1,0,3) );
+    c = _mm256_permute4x64_epi64( c, _MM_SHUFFLE(1,0,3,2) );
+    d = _mm256_permute4x64_epi64( d, _MM_SHUFFLE(0,3,2,1) );
+  }
+
+  _mm256_storeu_si256( (__m256i*)&h[0], _mm256_xor_si256( _mm256_loadu_si256( (const __m256i*)&h[0] ), _mm256_xor_si256( a, c ) ) );
+  _mm256_storeu_si256( (__m256i*)&h[4], _mm256_xor_si256( _mm256_loadu_si256( (const __m256i*)&h[4] ), _mm256_xor_si256( b, d ) ) );
+}
+
+#undef LOAD_MSG_256
+#undef G_256
+
+#endif
+
+blake2b_block_func blake2b_block = blake2b_block_ref;
+
+static void blake2b_compress( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] )
+{
+  blake2b_block( S->h, block, S->t, S->f );
+}
+
 static int blake2b_update( blake2b_state *S, const void *pin, size_t inlen )
 {
   const unsigned char * in = (const unsigned char *)pin;
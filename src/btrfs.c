@@ -64,6 +64,7 @@ PDRIVER_OBJECT drvobj;
 PDEVICE_OBJECT master_devobj, busobj;
 uint64_t num_reads = 0;
 LIST_ENTRY uid_map_list, gid_map_list;
+LIST_ENTRY uid_map_sid_hash[MAPPING_HASH_SIZE], uid_map_uid_hash[MAPPING_HASH_SIZE], gid_map_sid_hash[MAPPING_HASH_SIZE];
 LIST_ENTRY VcbList;
 ERESOURCE global_loading_lock;
 uint32_t debug_log_level = 0;
@@ -81,6 +82,8 @@ uint32_t mount_clear_cache = 0;
 uint32_t mount_allow_degraded = 0;
 uint32_t mount_readonly = 0;
 uint32_t mount_no_root_dir = 0;
+uint32_t mount_io_threads = 0;
+uint32_t mount_read_ahead_max = READ_AHEAD_MAX_DEFAULT;
 uint32_t no_pnp = 0;
 bool log_started = false;
 UNICODE_STRING log_device, log_file, registry_path;
@@ -95,6 +98,7 @@ tFsRtlGetNextExtraCreateParameter fFsRtlGetNextExtraCreateParameter;
 tFsRtlValidateReparsePointBuffer fFsRtlValidateReparsePointBuffer;
 tFsRtlCheckLockForOplockRequest fFsRtlCheckLockForOplockRequest;
 tFsRtlAreThereCurrentOrInProgressFileLocks fFsRtlAreThereCurrentOrInProgressFileLocks;
+tIoGetIoPriorityHint fIoGetIoPriorityHint;
 bool diskacc = false;
 void *notification_entry = NULL, *notification_entry2 = NULL, *notification_entry3 = NULL;
 ERESOURCE pdo_list_lock, mapping_lock;
@@ -119,7 +123,6 @@ static void init_serial(bool first_time);
 #endif
 
 static NTSTATUS close_file(_In_ PFILE_OBJECT FileObject, _In_ PIRP Irp);
-static void __stdcall do_xor_basic(uint8_t* buf1, uint8_t* buf2, uint32_t len);
 
 xor_func do_xor = do_xor_basic;
 
@@ -281,49 +284,6 @@ bool is_top_level(_In_ PIRP Irp) {
     return false;
 }
 
-static void __stdcall do_xor_basic(uint8_t* buf1, uint8_t* buf2, uint32_t len) {
-    uint32_t j;
-
-#if defined(_ARM_) || defined(_ARM64_)
-    uint64x2_t x1, x2;
-
-    if (((uintptr_t)buf1 & 0xf) == 0 && ((uintptr_t)buf2 & 0xf) == 0) {
-        while (len >= 16) {
-            x1 = vld1q_u64((const uint64_t*)buf1);
-            x2 = vld1q_u64((const uint64_t*)buf2);
-            x1 = veorq_u64(x1, x2);
-            vst1q_u64((uint64_t*)buf1, x1);
-
-            buf1 += 16;
-            buf2 += 16;
-            len -= 16;
-        }
-    }
-#endif
-
-#if defined(_AMD64_) || defined(_ARM64_)
-    while (len > 8) {
-        *(uint64_t*)buf1 ^= *(uint64_t*)buf2;
-        buf1 += 8;
-        buf2 += 8;
-        len -= 8;
-    }
-#endif
-
-    while (len > 4) {
-        *(uint32_t*)buf1 ^= *(uint32_t*)buf2;
-        buf1 += 4;
-        buf2 += 4;
-        len -= 4;
-    }
-
-    for (j = 0; j < len; j++) {
-        *buf1 ^= *buf2;
-        buf1++;
-        buf2++;
-    }
-}
-
 _Function_class_(DRIVER_UNLOAD)
 static void __stdcall DriverUnload(_In_ PDRIVER_OBJECT DriverObject) {
     UNICODE_STRING dosdevice_nameW;
@@ -772,193 +732,6 @@ static bool lie_about_fs_type() {
     return false;
 }
 
-// version of RtlUTF8ToUnicodeN for Vista and below
-NTSTATUS utf8_to_utf16(WCHAR* dest, ULONG dest_max, ULONG* dest_len, char* src, ULONG src_len) {
-    NTSTATUS Status = STATUS_SUCCESS;
-    uint8_t* in = (uint8_t*)src;
-    uint16_t* out = (uint16_t*)dest;
-    ULONG needed = 0, left = dest_max / sizeof(uint16_t);
-
-    for (ULONG i = 0; i < src_len; i++) {
-        uint32_t cp;
-
-        if (!(in[i] & 0x80))
-            cp = in[i];
-        else if ((in[i] & 0xe0) == 0xc0) {
-            if (i == src_len - 1 || (in[i+1] & 0xc0) != 0x80) {
-                cp = 0xfffd;
-                Status = STATUS_SOME_NOT_MAPPED;
-            } else {
-                cp = ((in[i] & 0x1f) << 6) | (in[i+1] & 0x3f);
-                i++;
-            }
-        } else if ((in[i] & 0xf0) == 0xe0) {
-            if (i >= src_len - 2 || (in[i+1] & 0xc0) != 0x80 || (in[i+2] & 0xc0) != 0x80) {
-                cp = 0xfffd;
-                Status = STATUS_SOME_NOT_MAPPED;
-            } else {
-                cp = ((in[i] & 0xf) << 12) | ((in[i+1] & 0x3f) << 6) | (in[i+2] & 0x3f);
-                i += 2;
-            }
-        } else if ((in[i] & 0xf8) == 0xf0) {
-            if (i >= src_len - 3 || (in[i+1] & 0xc0) != 0x80 || (in[i+2] & 0xc0) != 0x80 || (in[i+3] & 0xc0) != 0x80) {
-                cp = 0xfffd;
-                Status = STATUS_SOME_NOT_MAPPED;
-            } else {
-                cp = ((in[i] & 0x7) << 18) | ((in[i+1] & 0x3f) << 12) | ((in[i+2] & 0x3f) << 6) | (in[i+3] & 0x3f);
-                i += 3;
-            }
-        } else {
-            cp = 0xfffd;
-            Status = STATUS_SOME_NOT_MAPPED;
-        }
-
-        if (cp > 0x10ffff) {
-            cp = 0xfffd;
-            Status = STATUS_SOME_NOT_MAPPED;
-        }
-
-        if (dest) {
-            if (cp <= 0xffff) {
-                if (left < 1)
-                    return STATUS_BUFFER_OVERFLOW;
-
-                *out = (uint16_t)cp;
-                out++;
-
-                left--;
-            } else {
-                if (left < 2)
-                    return STATUS_BUFFER_OVERFLOW;
-
-                cp -= 0x10000;
-
-                *out = 0xd800 | ((cp & 0xffc00) >> 10);
-                out++;
-
-                *out = 0xdc00 | (cp & 0x3ff);
-                out++;
-
-                left -= 2;
-            }
-        }
-
-        if (cp <= 0xffff)
-            needed += sizeof(uint16_t);
-        else
-            needed += 2 * sizeof(uint16_t);
-    }
-
-    if (dest_len)
-        *dest_len = needed;
-
-    return Status;
-}
-
-// version of RtlUnicodeToUTF8N for Vista and below
-NTSTATUS utf16_to_utf8(char* dest, ULONG dest_max, ULONG* dest_len, WCHAR* src, ULONG src_len) {
-    NTSTATUS Status = STATUS_SUCCESS;
-    uint16_t* in = (uint16_t*)src;
-    uint8_t* out = (uint8_t*)dest;
-    ULONG in_len = src_len / sizeof(uint16_t);
-    ULONG needed = 0, left = dest_max;
-
-    for (ULONG i = 0; i < in_len; i++) {
-        uint32_t cp = *in;
-        in++;
-
-        if ((cp & 0xfc00) == 0xd800) {
-            if (i == in_len - 1 || (*in & 0xfc00) != 0xdc00) {
-                cp = 0xfffd;
-                Status = STATUS_SOME_NOT_MAPPED;
-            } else {
-                cp = (cp & 0x3ff) << 10;
-                cp |= *in & 0x3ff;
-                cp += 0x10000;
-
-                in++;
-                i++;
-            }
-        } else if ((cp & 0xfc00) == 0xdc00) {
-            cp = 0xfffd;
-            Status = STATUS_SOME_NOT_MAPPED;
-        }
-
-        if (cp > 0x10ffff) {
-            cp = 0xfffd;
-            Status = STATUS_SOME_NOT_MAPPED;
-        }
-
-        if (dest) {
-            if (cp < 0x80) {
-                if (left < 1)
-                    return STATUS_BUFFER_OVERFLOW;
-
-                *out = (uint8_t)cp;
-                out++;
-
-                left--;
-            } else if (cp < 0x800) {
-                if (left < 2)
-                    return STATUS_BUFFER_OVERFLOW;
-
-                *out = 0xc0 | ((cp & 0x7c0) >> 6);
-                out++;
-
-                *out = 0x80 | (cp & 0x3f);
-                out++;
-
-                left -= 2;
-            } else if (cp < 0x10000) {
-                if (left < 3)
-                    return STATUS_BUFFER_OVERFLOW;
-
-                *out = 0xe0 | ((cp & 0xf000) >> 12);
-                out++;
-
-                *out = 0x80 | ((cp & 0xfc0) >> 6);
-                out++;
-
-                *out = 0x80 | (cp & 0x3f);
-                out++;
-
-                left -= 3;
-            } else {
-                if (left < 4)
-                    return STATUS_BUFFER_OVERFLOW;
-
-                *out = 0xf0 | ((cp & 0x1c0000) >> 18);
-                out++;
-
-                *out = 0x80 | ((cp & 0x3f000) >> 12);
-                out++;
-
-                *out = 0x80 | ((cp & 0xfc0) >> 6);
-                out++;
-
-                *out = 0x80 | (cp & 0x3f);
-                out++;
-
-                left -= 4;
-            }
-        }
-
-        if (cp < 0x80)
-            needed++;
-        else if (cp < 0x800)
-            needed += 2;
-        else if (cp < 0x10000)
-            needed += 3;
-        else
-            needed += 4;
-    }
-
-    if (dest_len)
-        *dest_len = needed;
-
-    return Status;
-}
-
 _Dispatch_type_(IRP_MJ_QUERY_VOLUME_INFORMATION)
 _Function_class_(DRIVER_DISPATCH)
 static NTSTATUS __stdcall drv_query_volume_information(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
@@ -1224,6 +997,92 @@ static NTSTATUS __stdcall read_completion(_In_ PDEVICE_OBJECT DeviceObject, _In_
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
+#define ROOTS_HASH_INITIAL_SIZE 64
+
+static NTSTATUS init_roots_hash(_In_ device_extension* Vcb) {
+    Vcb->roots_hash = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY) * ROOTS_HASH_INITIAL_SIZE, ALLOC_TAG);
+    if (!Vcb->roots_hash) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (ULONG i = 0; i < ROOTS_HASH_INITIAL_SIZE; i++) {
+        InitializeListHead(&Vcb->roots_hash[i]);
+    }
+
+    Vcb->roots_hash_size = ROOTS_HASH_INITIAL_SIZE;
+    Vcb->num_roots = 0;
+
+    return STATUS_SUCCESS;
+}
+
+// Subvolume IDs are handed out sequentially, so the bottom bits of the ID make a perfectly good hash.
+static __inline LIST_ENTRY* root_hash_bucket(_In_ device_extension* Vcb, _In_ uint64_t id) {
+    return &Vcb->roots_hash[id & (Vcb->roots_hash_size - 1)];
+}
+
+// Returns false, leaving the old buckets alone, if we couldn't get the memory for the bigger table.
+static bool grow_roots_hash(_In_ device_extension* Vcb) {
+    LIST_ENTRY* buckets;
+    ULONG size = Vcb->roots_hash_size * 2;
+    LIST_ENTRY* le;
+
+    buckets = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY) * size, ALLOC_TAG);
+    if (!buckets)
+        return false;
+
+    for (ULONG i = 0; i < size; i++) {
+        InitializeListHead(&buckets[i]);
+    }
+
+    le = Vcb->roots.Flink;
+    while (le != &Vcb->roots) {
+        root* r = CONTAINING_RECORD(le, root, list_entry);
+
+        InsertTailList(&buckets[r->id & (size - 1)], &r->list_entry_hash);
+
+        le = le->Flink;
+    }
+
+    ExFreePool(Vcb->roots_hash);
+
+    Vcb->roots_hash = buckets;
+    Vcb->roots_hash_size = size;
+
+    return true;
+}
+
+static void add_root_to_list(_In_ device_extension* Vcb, _In_ root* r) {
+    InsertTailList(&Vcb->roots, &r->list_entry);
+    Vcb->num_roots++;
+
+    // grow_roots_hash rehashes r along with everything else - if it fails, r goes into the old table
+    if (Vcb->num_roots <= Vcb->roots_hash_size * 2 || !grow_roots_hash(Vcb))
+        InsertTailList(root_hash_bucket(Vcb, r->id), &r->list_entry_hash);
+}
+
+void remove_root_from_list(_In_ device_extension* Vcb, _In_ root* r) {
+    RemoveEntryList(&r->list_entry);
+    RemoveEntryList(&r->list_entry_hash);
+    Vcb->num_roots--;
+}
+
+root* find_root_by_id(_In_ device_extension* Vcb, _In_ uint64_t id) {
+    LIST_ENTRY* bucket = root_hash_bucket(Vcb, id);
+    LIST_ENTRY* le = bucket->Flink;
+
+    while (le != bucket) {
+        root* r = CONTAINING_RECORD(le, root, list_entry_hash);
+
+        if (r->id == id)
+            return r;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
 NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ uint64_t id,
                      _Out_ root** rootptr, _In_ bool no_tree, _In_ uint64_t offset, _In_opt_ PIRP Irp) {
     NTSTATUS Status;
@@ -1265,11 +1124,18 @@ NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) devi
     r->send_ops = 0;
     RtlZeroMemory(&r->root_item, sizeof(ROOT_ITEM));
     r->root_item.num_references = 1;
-    r->fcbs_version = 0;
     r->checked_for_orphans = true;
     r->dropped = false;
     InitializeListHead(&r->fcbs);
-    RtlZeroMemory(r->fcbs_ptrs, sizeof(LIST_ENTRY*) * 256);
+
+    Status = init_fcb_hash(r);
+    if (!NT_SUCCESS(Status)) {
+        ERR("init_fcb_hash returned %08lx\n", Status);
+        ExFreePool(ri);
+        ExFreePool(r->nonpaged);
+        ExFreePool(r);
+        return Status;
+    }
 
     RtlCopyMemory(ri, &r->root_item, sizeof(ROOT_ITEM));
 
@@ -1280,6 +1146,7 @@ NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) devi
     if (!NT_SUCCESS(Status)) {
         ERR("insert_tree_item returned %08lx\n", Status);
         ExFreePool(ri);
+        ExFreePool(r->fcbs_hash);
         ExFreePool(r->nonpaged);
         ExFreePool(r);
         return Status;
@@ -1287,7 +1154,7 @@ NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) devi
 
     ExInitializeResourceLite(&r->nonpaged->load_tree_lock);
 
-    InsertTailList(&Vcb->roots, &r->list_entry);
+    add_root_to_list(Vcb, r);
 
     if (!no_tree) {
         tree* t = ExAllocatePoolWithTag(PagedPool, sizeof(tree), ALLOC_TAG);
@@ -1296,6 +1163,9 @@ NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) devi
 
             delete_tree_item(Vcb, &tp);
 
+            remove_root_from_list(Vcb, r);
+            ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
+            ExFreePool(r->fcbs_hash);
             ExFreePool(r->nonpaged);
             ExFreePool(r);
             ExFreePool(ri);
@@ -1470,44 +1340,63 @@ end:
     return Status;
 }
 
+// FsRtl keeps an entry in DirNotifyList for every handle with a directory watch, until the
+// handle is cleaned up - if it's empty, there's nobody to tell.
+static __inline bool have_dir_watchers(_In_ device_extension* Vcb) {
+    return !IsListEmpty(&Vcb->DirNotifyList);
+}
+
 void send_notification_fileref(_In_ file_ref* fileref, _In_ ULONG filter_match, _In_ ULONG action, _In_opt_ PUNICODE_STRING stream) {
     UNICODE_STRING fn;
     NTSTATUS Status;
     ULONG reqlen;
     USHORT name_offset;
     fcb* fcb = fileref->fcb;
+    WCHAR buf[128];
 
-    fn.Length = fn.MaximumLength = 0;
-    Status = fileref_get_filename(fileref, &fn, NULL, &reqlen);
-    if (Status != STATUS_BUFFER_OVERFLOW) {
-        ERR("fileref_get_filename returned %08lx\n", Status);
-        return;
-    }
-
-    if (reqlen > 0xffff) {
-        WARN("reqlen was too long for FsRtlNotifyFilterReportChange\n");
+    if (!have_dir_watchers(fcb->Vcb))
         return;
-    }
 
-    fn.Buffer = ExAllocatePoolWithTag(PagedPool, reqlen, ALLOC_TAG);
-    if (!fn.Buffer) {
-        ERR("out of memory\n");
-        return;
-    }
+    // Try the stack buffer first - most paths fit, which saves walking up the tree twice.
 
-    fn.MaximumLength = (USHORT)reqlen;
+    fn.Buffer = buf;
     fn.Length = 0;
+    fn.MaximumLength = sizeof(buf);
 
     Status = fileref_get_filename(fileref, &fn, &name_offset, &reqlen);
+
+    if (Status == STATUS_BUFFER_OVERFLOW) {
+        if (reqlen > 0xffff) {
+            WARN("reqlen was too long for FsRtlNotifyFilterReportChange\n");
+            return;
+        }
+
+        fn.Buffer = ExAllocatePoolWithTag(PagedPool, reqlen, ALLOC_TAG);
+        if (!fn.Buffer) {
+            ERR("out of memory\n");
+            return;
+        }
+
+        fn.MaximumLength = (USHORT)reqlen;
+        fn.Length = 0;
+
+        Status = fileref_get_filename(fileref, &fn, &name_offset, &reqlen);
+    }
+
     if (!NT_SUCCESS(Status)) {
         ERR("fileref_get_filename returned %08lx\n", Status);
-        ExFreePool(fn.Buffer);
+
+        if (fn.Buffer != buf)
+            ExFreePool(fn.Buffer);
+
         return;
     }
 
     FsRtlNotifyFilterReportChange(fcb->Vcb->NotifySync, &fcb->Vcb->DirNotifyList, (PSTRING)&fn, name_offset,
                                   (PSTRING)stream, NULL, filter_match, action, NULL, NULL);
-    ExFreePool(fn.Buffer);
+
+    if (fn.Buffer != buf)
+        ExFreePool(fn.Buffer);
 }
 
 static void send_notification_fcb(_In_ file_ref* fileref, _In_ ULONG filter_match, _In_ ULONG action, _In_opt_ PUNICODE_STRING stream) {
@@ -1515,6 +1404,9 @@ static void send_notification_fcb(_In_ file_ref* fileref, _In_ ULONG filter_matc
     LIST_ENTRY* le;
     NTSTATUS Status;
 
+    if (!have_dir_watchers(fcb->Vcb))
+        return;
+
     // no point looking for hardlinks if st_nlink == 1
     if (fileref->fcb->inode_item.st_nlink == 1) {
         ExAcquireResourceExclusiveLite(&fcb->Vcb->fileref_lock, true);
@@ -1593,7 +1485,7 @@ static void send_notification_fcb(_In_ file_ref* fileref, _In_ ULONG filter_matc
     ExReleaseResourceLite(&fcb->Vcb->fileref_lock);
 }
 
-typedef struct {
+typedef struct _notification_fcb {
     file_ref* fileref;
     ULONG filter_match;
     ULONG action;
@@ -1604,12 +1496,24 @@ typedef struct {
 _Function_class_(IO_WORKITEM_ROUTINE)
 static void __stdcall notification_work_item(PDEVICE_OBJECT DeviceObject, PVOID con) {
     notification_fcb* nf = con;
+    device_extension* Vcb = nf->fileref->fcb->Vcb;
+    ULONG filter_match;
 
     UNUSED(DeviceObject);
 
+    // stop queue_notification_fcb adding any more to this one
+    ExAcquireFastMutex(&Vcb->notification_mutex);
+
+    if (nf->fileref->pending_notification == nf)
+        nf->fileref->pending_notification = NULL;
+
+    filter_match = nf->filter_match;
+
+    ExReleaseFastMutex(&Vcb->notification_mutex);
+
     ExAcquireResourceSharedLite(&nf->fileref->fcb->Vcb->tree_lock, TRUE); // protect us from fileref being reaped
 
-    send_notification_fcb(nf->fileref, nf->filter_match, nf->action, nf->stream);
+    send_notification_fcb(nf->fileref, filter_match, nf->action, nf->stream);
 
     free_fileref(nf->fileref);
 
@@ -1621,20 +1525,37 @@ static void __stdcall notification_work_item(PDEVICE_OBJECT DeviceObject, PVOID
 }
 
 void queue_notification_fcb(_In_ file_ref* fileref, _In_ ULONG filter_match, _In_ ULONG action, _In_opt_ PUNICODE_STRING stream) {
+    device_extension* Vcb = fileref->fcb->Vcb;
     notification_fcb* nf;
     PIO_WORKITEM work_item;
+    bool coalesce = action == FILE_ACTION_MODIFIED && !stream;
+
+    if (!have_dir_watchers(Vcb))
+        return;
+
+    // If this fileref already has a modification notification waiting for a worker thread, fold
+    // this one into it - otherwise bulk operations queue a work item per file per change.
+    if (coalesce) {
+        ExAcquireFastMutex(&Vcb->notification_mutex);
+
+        if (fileref->pending_notification) {
+            fileref->pending_notification->filter_match |= filter_match;
+            ExReleaseFastMutex(&Vcb->notification_mutex);
+            return;
+        }
+    }
 
     nf = ExAllocatePoolWithTag(PagedPool, sizeof(notification_fcb), ALLOC_TAG);
     if (!nf) {
         ERR("out of memory\n");
-        return;
+        goto end;
     }
 
     work_item = IoAllocateWorkItem(master_devobj);
     if (!work_item) {
         ERR("out of memory\n");
         ExFreePool(nf);
-        return;
+        goto end;
     }
 
     InterlockedIncrement(&fileref->refcount);
@@ -1645,7 +1566,14 @@ void queue_notification_fcb(_In_ file_ref* fileref, _In_ ULONG filter_match, _In
     nf->stream = stream;
     nf->work_item = work_item;
 
+    if (coalesce)
+        fileref->pending_notification = nf;
+
     IoQueueWorkItem(work_item, notification_work_item, DelayedWorkQueue, nf);
+
+end:
+    if (coalesce)
+        ExReleaseFastMutex(&Vcb->notification_mutex);
 }
 
 void mark_fcb_dirty(_In_ fcb* fcb) {
@@ -1697,20 +1625,12 @@ void free_fcb(_Inout_ fcb* fcb) {
 }
 
 void reap_fcb(fcb* fcb) {
-    uint8_t c = fcb->hash >> 24;
-
-    if (fcb->subvol && fcb->subvol->fcbs_ptrs[c] == &fcb->list_entry) {
-        if (fcb->list_entry.Flink != &fcb->subvol->fcbs && (CONTAINING_RECORD(fcb->list_entry.Flink, struct _fcb, list_entry)->hash >> 24) == c)
-            fcb->subvol->fcbs_ptrs[c] = fcb->list_entry.Flink;
-        else
-            fcb->subvol->fcbs_ptrs[c] = NULL;
-    }
-
     if (fcb->list_entry.Flink) {
-        RemoveEntryList(&fcb->list_entry);
+        remove_fcb_from_subvol(fcb);
 
         if (fcb->subvol && fcb->subvol->dropped && IsListEmpty(&fcb->subvol->fcbs)) {
             ExDeleteResourceLite(&fcb->subvol->nonpaged->load_tree_lock);
+            ExFreePool(fcb->subvol->fcbs_hash);
             ExFreePool(fcb->subvol->nonpaged);
             ExFreePool(fcb->subvol);
         }
@@ -1725,8 +1645,7 @@ void reap_fcb(fcb* fcb) {
 
     ExFreeToNPagedLookasideList(&fcb->Vcb->fcb_np_lookaside, fcb->nonpaged);
 
-    if (fcb->sd)
-        ExFreePool(fcb->sd);
+    free_fcb_sd(fcb);
 
     if (fcb->adsxattr.Buffer)
         ExFreePool(fcb->adsxattr.Buffer);
@@ -1856,6 +1775,12 @@ void reap_fileref(device_extension* Vcb, file_ref* fr) {
     if (fr->oldutf8.Buffer)
         ExFreePool(fr->oldutf8.Buffer);
 
+    if (fr->path) {
+        ExAcquireFastMutex(&Vcb->path_cache_mutex);
+        release_cached_path(fr->path);
+        ExReleaseFastMutex(&Vcb->path_cache_mutex);
+    }
+
     ExFreeToPagedLookasideList(&Vcb->fileref_lookaside, fr);
 }
 
@@ -1954,6 +1879,26 @@ static NTSTATUS close_file(_In_ PFILE_OBJECT FileObject, _In_ PIRP Irp) {
     return STATUS_SUCCESS;
 }
 
+// The threads drain their queues before exiting, so this can only be called once nothing
+// else will queue jobs for them.
+static void stop_io_threads(_In_ device_extension* Vcb, _In_ ULONG num_started) {
+    ULONG i;
+
+    Vcb->iothreads.quit = true;
+
+    if (num_started > 0)
+        KeReleaseSemaphore(&Vcb->iothreads.semaphore, IO_NO_INCREMENT, num_started, false);
+
+    for (i = 0; i < num_started; i++) {
+        KeWaitForSingleObject(&Vcb->iothreads.threads[i].finished, Executive, KernelMode, false, NULL);
+
+        ZwClose(Vcb->iothreads.threads[i].handle);
+    }
+
+    ExFreePool(Vcb->iothreads.threads);
+    Vcb->iothreads.threads = NULL;
+}
+
 void uninit(_In_ device_extension* Vcb) {
     uint64_t i;
     KIRQL irql;
@@ -2027,6 +1972,10 @@ void uninit(_In_ device_extension* Vcb) {
     if (!NT_SUCCESS(Status) && Status != STATUS_TOO_LATE)
         WARN("registry_mark_volume_unmounted returned %08lx\n", Status);
 
+    // I/O threads drain their queues before exiting, and may need the calc threads to do so
+
+    stop_io_threads(Vcb, Vcb->iothreads.num_threads);
+
     for (i = 0; i < Vcb->calcthreads.num_threads; i++) {
         Vcb->calcthreads.threads[i].quit = true;
     }
@@ -2082,10 +2031,17 @@ void uninit(_In_ device_extension* Vcb) {
         root* r = CONTAINING_RECORD(RemoveHeadList(&Vcb->roots), root, list_entry);
 
         ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
+        ExFreePool(r->fcbs_hash);
         ExFreePool(r->nonpaged);
         ExFreePool(r);
     }
 
+    ExFreePool(Vcb->roots_hash);
+
+    reap_async_writes(Vcb);
+    free_inode_ref_cache(Vcb);
+    free_sd_cache(Vcb);
+
     while (!IsListEmpty(&Vcb->chunks)) {
         chunk* c = CONTAINING_RECORD(RemoveHeadList(&Vcb->chunks), chunk, list_entry);
 
@@ -2247,6 +2203,9 @@ NTSTATUS delete_fileref(_In_ file_ref* fileref, _In_opt_ PFILE_OBJECT FileObject
     fileref->deleted = true;
     mark_fileref_dirty(fileref);
 
+    if (!fileref->fcb->ads)
+        forget_inode_ref(fileref->fcb->Vcb, fileref->fcb->subvol->id, fileref->fcb->inode);
+
     // delete INODE_ITEM (0x1)
 
     TRACE("nlink = %u\n", fileref->fcb->inode_item.st_nlink);
@@ -2304,7 +2263,7 @@ NTSTATUS delete_fileref(_In_ file_ref* fileref, _In_opt_ PFILE_OBJECT FileObject
 
                 // FIXME - we need a lock here
 
-                RemoveEntryList(&fileref->fcb->subvol->list_entry);
+                remove_root_from_list(fileref->fcb->Vcb, fileref->fcb->subvol);
 
                 InsertTailList(&fileref->fcb->Vcb->drop_roots, &fileref->fcb->subvol->list_entry);
 
@@ -2353,6 +2312,8 @@ NTSTATUS delete_fileref(_In_ file_ref* fileref, _In_opt_ PFILE_OBJECT FileObject
         ExFreePool(fileref->dc);
 
         fileref->dc = NULL;
+
+        invalidate_cached_path(fileref);
     }
 
     // update INODE_ITEM of parent
@@ -2950,6 +2911,7 @@ NTSTATUS dev_ioctl(_In_ PDEVICE_OBJECT DeviceObject, _In_ ULONG ControlCode, _In
 _Requires_exclusive_lock_held_(Vcb->tree_lock)
 static NTSTATUS add_root(_Inout_ device_extension* Vcb, _In_ uint64_t id, _In_ uint64_t addr,
                          _In_ uint64_t generation, _In_opt_ traverse_ptr* tp) {
+    NTSTATUS Status;
     root* r = ExAllocatePoolWithTag(PagedPool, sizeof(root), ALLOC_TAG);
     if (!r) {
         ERR("out of memory\n");
@@ -2965,15 +2927,21 @@ static NTSTATUS add_root(_Inout_ device_extension* Vcb, _In_ uint64_t id, _In_ u
     r->treeholder.generation = generation;
     r->parent = 0;
     r->send_ops = 0;
-    r->fcbs_version = 0;
     r->checked_for_orphans = false;
     r->dropped = false;
     InitializeListHead(&r->fcbs);
-    RtlZeroMemory(r->fcbs_ptrs, sizeof(LIST_ENTRY*) * 256);
+
+    Status = init_fcb_hash(r);
+    if (!NT_SUCCESS(Status)) {
+        ERR("init_fcb_hash returned %08lx\n", Status);
+        ExFreePool(r);
+        return Status;
+    }
 
     r->nonpaged = ExAllocatePoolWithTag(NonPagedPool, sizeof(root_nonpaged), ALLOC_TAG);
     if (!r->nonpaged) {
         ERR("out of memory\n");
+        ExFreePool(r->fcbs_hash);
         ExFreePool(r);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
@@ -2997,7 +2965,7 @@ static NTSTATUS add_root(_Inout_ device_extension* Vcb, _In_ uint64_t id, _In_ u
             r->lastinode = 0x100;
     }
 
-    InsertTailList(&Vcb->roots, &r->list_entry);
+    add_root_to_list(Vcb, r);
 
     switch (r->id) {
         case BTRFS_ROOT_ROOT:
@@ -3934,21 +3902,15 @@ static NTSTATUS load_sys_chunks(_In_ device_extension* Vcb) {
 
 _Ret_maybenull_
 root* find_default_subvol(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_opt_ PIRP Irp) {
-    LIST_ENTRY* le;
+    root* r;
 
     static const char fn[] = "default";
     static uint32_t crc32 = 0x8dbfc2d2;
 
     if (Vcb->options.subvol_id != 0) {
-        le = Vcb->roots.Flink;
-        while (le != &Vcb->roots) {
-            root* r = CONTAINING_RECORD(le, root, list_entry);
-
-            if (r->id == Vcb->options.subvol_id)
-                return r;
-
-            le = le->Flink;
-        }
+        r = find_root_by_id(Vcb, Vcb->options.subvol_id);
+        if (r)
+            return r;
     }
 
     if (Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_DEFAULT_SUBVOL) {
@@ -3994,31 +3956,15 @@ root* find_default_subvol(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_ex
             goto end;
         }
 
-        le = Vcb->roots.Flink;
-        while (le != &Vcb->roots) {
-            root* r = CONTAINING_RECORD(le, root, list_entry);
-
-            if (r->id == di->key.obj_id)
-                return r;
-
-            le = le->Flink;
-        }
+        r = find_root_by_id(Vcb, di->key.obj_id);
+        if (r)
+            return r;
 
         ERR("could not find root %I64x, using default instead\n", di->key.obj_id);
     }
 
 end:
-    le = Vcb->roots.Flink;
-    while (le != &Vcb->roots) {
-        root* r = CONTAINING_RECORD(le, root, list_entry);
-
-        if (r->id == BTRFS_ROOT_FSTREE)
-            return r;
-
-        le = le->Flink;
-    }
-
-    return NULL;
+    return find_root_by_id(Vcb, BTRFS_ROOT_FSTREE);
 }
 
 void init_file_cache(_In_ PFILE_OBJECT FileObject, _In_ CC_FILE_SIZES* ccfs) {
@@ -4093,6 +4039,52 @@ static NTSTATUS create_calc_threads(_In_ PDEVICE_OBJECT DeviceObject) {
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS create_io_threads(_In_ PDEVICE_OBJECT DeviceObject) {
+    device_extension* Vcb = DeviceObject->DeviceExtension;
+    OBJECT_ATTRIBUTES oa;
+    ULONG i;
+
+    Vcb->iothreads.num_threads = mount_io_threads != 0 ? mount_io_threads : get_num_of_processors();
+
+    Vcb->iothreads.threads = ExAllocatePoolWithTag(NonPagedPool, sizeof(drv_io_thread) * Vcb->iothreads.num_threads, ALLOC_TAG);
+    if (!Vcb->iothreads.threads) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (i = 0; i < BTRFS_IO_QUEUES; i++) {
+        InitializeListHead(&Vcb->iothreads.queues[i]);
+    }
+
+    KeInitializeSpinLock(&Vcb->iothreads.spinlock);
+    KeInitializeSemaphore(&Vcb->iothreads.semaphore, 0, MAXLONG);
+    Vcb->iothreads.reads_in_row = 0;
+    Vcb->iothreads.quit = false;
+
+    RtlZeroMemory(&Vcb->iothreads.stats, sizeof(btrfs_io_queue_stats));
+    Vcb->iothreads.stats.num_threads = Vcb->iothreads.num_threads;
+
+    RtlZeroMemory(Vcb->iothreads.threads, sizeof(drv_io_thread) * Vcb->iothreads.num_threads);
+
+    InitializeObjectAttributes(&oa, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    for (i = 0; i < Vcb->iothreads.num_threads; i++) {
+        NTSTATUS Status;
+
+        Vcb->iothreads.threads[i].DeviceObject = DeviceObject;
+        KeInitializeEvent(&Vcb->iothreads.threads[i].finished, NotificationEvent, false);
+
+        Status = PsCreateSystemThread(&Vcb->iothreads.threads[i].handle, 0, &oa, NULL, NULL, io_thread, &Vcb->iothreads.threads[i]);
+        if (!NT_SUCCESS(Status)) {
+            ERR("PsCreateSystemThread returned %08lx\n", Status);
+            stop_io_threads(Vcb, i);
+            return Status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
 static bool is_btrfs_volume(_In_ PDEVICE_OBJECT DeviceObject) {
     NTSTATUS Status;
     MOUNTDEV_NAME mdn, *mdn2;
@@ -4659,6 +4651,24 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     InitializeListHead(&Vcb->roots);
     InitializeListHead(&Vcb->drop_roots);
 
+    Status = init_roots_hash(Vcb);
+    if (!NT_SUCCESS(Status)) {
+        ERR("init_roots_hash returned %08lx\n", Status);
+        goto exit;
+    }
+
+    Status = init_inode_ref_cache(Vcb);
+    if (!NT_SUCCESS(Status)) {
+        ERR("init_inode_ref_cache returned %08lx\n", Status);
+        goto exit;
+    }
+
+    Status = init_sd_cache(Vcb);
+    if (!NT_SUCCESS(Status)) {
+        ERR("init_sd_cache returned %08lx\n", Status);
+        goto exit;
+    }
+
     Vcb->log_to_phys_loaded = false;
 
     add_root(Vcb, BTRFS_ROOT_CHUNK, Vcb->superblock.chunk_tree_addr, Vcb->superblock.chunk_root_generation, NULL);
@@ -4688,6 +4698,8 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     ExInitializeFastMutex(&Vcb->trees_list_mutex);
 
     InitializeListHead(&Vcb->DirNotifyList);
+    ExInitializeFastMutex(&Vcb->notification_mutex);
+    ExInitializeFastMutex(&Vcb->path_cache_mutex);
     InitializeListHead(&Vcb->scrub.errors);
 
     FsRtlNotifyInitializeSync(&Vcb->NotifySync);
@@ -4906,11 +4918,9 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     }
 
     Vcb->root_fileref->fcb = root_fcb;
-    InsertTailList(&root_fcb->subvol->fcbs, &root_fcb->list_entry);
+    add_fcb_to_subvol(root_fcb);
     InsertTailList(&Vcb->all_fcbs, &root_fcb->list_entry_all);
 
-    root_fcb->subvol->fcbs_ptrs[root_fcb->hash >> 24] = &root_fcb->list_entry;
-
     root_fcb->fileref = Vcb->root_fileref;
 
     root_ccb = ExAllocatePoolWithTag(PagedPool, sizeof(ccb), ALLOC_TAG);
@@ -4965,6 +4975,12 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
 
     KeInitializeEvent(&Vcb->flush_thread_finished, NotificationEvent, false);
 
+    KeInitializeSpinLock(&Vcb->inflight_writes_lock);
+    KeInitializeEvent(&Vcb->inflight_writes_event, NotificationEvent, true);
+    Vcb->inflight_writes_status = STATUS_SUCCESS;
+    InitializeListHead(&Vcb->async_writes_done);
+    InitializeListHead(&Vcb->async_writes_failed);
+
     InitializeObjectAttributes(&oa, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
 
     Status = PsCreateSystemThread(&Vcb->flush_thread_handle, 0, &oa, NULL, NULL, flush_thread, NewDeviceObject);
@@ -4979,6 +4995,12 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
         goto exit;
     }
 
+    Status = create_io_threads(NewDeviceObject);
+    if (!NT_SUCCESS(Status)) {
+        ERR("create_io_threads returned %08lx\n", Status);
+        goto exit;
+    }
+
     Status = registry_mark_volume_mounted(&Vcb->superblock.uuid);
     if (!NT_SUCCESS(Status))
         WARN("registry_mark_volume_mounted returned %08lx\n", Status);
@@ -5004,6 +5026,9 @@ exit:
 
     if (!NT_SUCCESS(Status)) {
         if (Vcb) {
+            if (Vcb->iothreads.threads)
+                stop_io_threads(Vcb, Vcb->iothreads.num_threads);
+
             if (init_lookaside) {
                 ExDeletePagedLookasideList(&Vcb->tree_data_lookaside);
                 ExDeletePagedLookasideList(&Vcb->traverse_ptr_lookaside);
@@ -5038,6 +5063,12 @@ exit:
             ExDeleteResourceLite(&Vcb->dirty_subvols_lock);
             ExDeleteResourceLite(&Vcb->scrub.stats_lock);
 
+            if (Vcb->roots_hash)
+                ExFreePool(Vcb->roots_hash);
+
+            free_inode_ref_cache(Vcb);
+            free_sd_cache(Vcb);
+
             if (Vcb->devices.Flink) {
                 while (!IsListEmpty(&Vcb->devices)) {
                     device* dev2 = CONTAINING_RECORD(RemoveHeadList(&Vcb->devices), device, list_entry);
@@ -5927,7 +5958,7 @@ static void init_serial(bool first_time) {
 
 #if defined(_X86_) || defined(_AMD64_)
 static void check_cpu() {
-    bool have_sse2 = false, have_sse42 = false, have_avx2 = false;
+    bool have_sse2 = false, have_ssse3 = false, have_sse41 = false, have_sse42 = false, have_avx2 = false, have_sha = false;
 
 #ifndef _MSC_VER
     {
@@ -5937,11 +5968,15 @@ static void check_cpu() {
 
         if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
             have_sse42 = ecx & bit_SSE4_2;
+            have_sse41 = ecx & bit_SSE4_1;
+            have_ssse3 = ecx & bit_SSSE3;
             have_sse2 = edx & bit_SSE2;
         }
 
-        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
             have_avx2 = ebx & bit_AVX2;
+            have_sha = ebx & bit_SHA;
+        }
 
         if (have_avx2) {
             // check Windows has enabled AVX2 - Windows 10 doesn't immediately
@@ -5963,10 +5998,13 @@ static void check_cpu() {
 
         __cpuid(cpu_info, 1);
         have_sse42 = cpu_info[2] & (1 << 20);
+        have_sse41 = cpu_info[2] & (1 << 19);
+        have_ssse3 = cpu_info[2] & (1 << 9);
         have_sse2 = cpu_info[3] & (1 << 26);
 
         __cpuidex(cpu_info, 7, 0);
         have_avx2 = cpu_info[1] & (1 << 5);
+        have_sha = cpu_info[1] & (1 << 29);
 
         if (have_avx2) {
             // check Windows has enabled AVX2 - Windows 10 doesn't immediately
@@ -5991,16 +6029,36 @@ static void check_cpu() {
     if (have_sse2) {
         TRACE("SSE2 is supported\n");
 
-        if (!have_avx2)
+        if (!have_avx2) {
             do_xor = do_xor_sse2;
+            ascii_widen = ascii_widen_sse2;
+            ascii_narrow = ascii_narrow_sse2;
+        }
     } else
         TRACE("SSE2 is not supported\n");
 
+    if (have_ssse3) {
+        TRACE("SSSE3 is supported\n");
+
+        if (!have_avx2)
+            blake2b_block = blake2b_block_ssse3;
+    } else
+        TRACE("SSSE3 is not supported\n");
+
     if (have_avx2) {
         TRACE("AVX2 is supported\n");
         do_xor = do_xor_avx2;
+        blake2b_block = blake2b_block_avx2;
+        ascii_widen = ascii_widen_avx2;
+        ascii_narrow = ascii_narrow_avx2;
     } else
         TRACE("AVX2 is not supported\n");
+
+    if (have_sha && have_sse41) {
+        TRACE("SHA extensions are supported\n");
+        sha256_block = sha256_block_shani;
+    } else
+        TRACE("SHA extensions are not supported\n");
 }
 #endif
 
@@ -6282,6 +6340,12 @@ NTSTATUS __stdcall DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_S
     InitializeListHead(&uid_map_list);
     InitializeListHead(&gid_map_list);
 
+    for (unsigned int i = 0; i < MAPPING_HASH_SIZE; i++) {
+        InitializeListHead(&uid_map_sid_hash[i]);
+        InitializeListHead(&uid_map_uid_hash[i]);
+        InitializeListHead(&gid_map_sid_hash[i]);
+    }
+
 #ifdef _DEBUG
     ExInitializeResourceLite(&log_lock);
 #endif
@@ -6381,7 +6445,11 @@ NTSTATUS __stdcall DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_S
 
         RtlInitUnicodeString(&name, L"FsRtlValidateReparsePointBuffer");
         fFsRtlValidateReparsePointBuffer = (tFsRtlValidateReparsePointBuffer)MmGetSystemRoutineAddress(&name);
+
+        RtlInitUnicodeString(&name, L"IoGetIoPriorityHint");
+        fIoGetIoPriorityHint = (tIoGetIoPriorityHint)MmGetSystemRoutineAddress(&name);
     } else {
+        fIoGetIoPriorityHint = NULL;
         fFsRtlGetEcpListFromIrp = NULL;
         fFsRtlGetNextExtraCreateParameter = NULL;
         fFsRtlValidateReparsePointBuffer = compat_FsRtlValidateReparsePointBuffer;
@@ -98,6 +98,11 @@
 #define COMPRESSED_EXTENT_SIZE 0x20000 // 128 KB
 
 #define READ_AHEAD_GRANULARITY COMPRESSED_EXTENT_SIZE // really ought to be a multiple of COMPRESSED_EXTENT_SIZE
+#define READ_AHEAD_MAX_DEFAULT 0x400000
+#define READ_AHEAD_MAX_LIMIT 0x4000000 // 64 MB
+
+#define ALLOC_WINDOW_WRITES 4 // reserve room for this many writes of the size that needed the window
+#define ALLOC_WINDOW_MAX 0x800000 // 8 MB, unless the write itself is bigger
 
 #ifndef IO_REPARSE_TAG_LX_SYMLINK
 
@@ -194,9 +199,12 @@ typedef struct _fcb_nonpaged {
     ERESOURCE resource;
     ERESOURCE paging_resource;
     ERESOURCE dir_children_lock;
+    LONG inflight_writes;
+    KEVENT inflight_writes_event;
 } fcb_nonpaged;
 
 struct _root;
+struct _chunk;
 
 typedef struct {
     uint64_t offset;
@@ -265,6 +273,7 @@ typedef struct _fcb {
     uint8_t type;
     INODE_ITEM inode_item;
     SECURITY_DESCRIPTOR* sd;
+    struct _sd_cache_entry* sd_entry;
     FILE_LOCK lock;
     bool deleted;
     PKTHREAD lazy_writer_thread;
@@ -285,6 +294,10 @@ typedef struct _fcb {
     bool case_sensitive_set;
     OPLOCK oplock;
 
+    struct _chunk* window_chunk;
+    uint64_t window_address;
+    uint64_t window_length;
+
     LIST_ENTRY dir_children_index;
     LIST_ENTRY dir_children_hash;
     LIST_ENTRY dir_children_hash_uc;
@@ -308,10 +321,20 @@ typedef struct _fcb {
     ANSI_STRING adsdata;
 
     LIST_ENTRY list_entry;
+    LIST_ENTRY list_entry_hash;
     LIST_ENTRY list_entry_all;
     LIST_ENTRY list_entry_dirty;
 } fcb;
 
+typedef struct _cached_path {
+    struct _cached_path* prefix; // the parent's path, or NULL if the parent is the root
+    LONG refcount;
+    ULONG generation;
+    USHORT length; // of the whole path
+    USHORT name_length;
+    WCHAR name[1]; // separator and last component
+} cached_path;
+
 typedef struct _file_ref {
     fcb* fcb;
     ANSI_STRING oldutf8;
@@ -325,6 +348,9 @@ typedef struct _file_ref {
     LONG open_count;
     struct _file_ref* parent;
     dir_child* dc;
+    struct _notification_fcb* pending_notification;
+    cached_path* path;
+    ULONG name_generation;
 
     bool dirty;
 
@@ -365,6 +391,8 @@ typedef struct _ccb {
     bool lxss;
     send_info* send;
     NTSTATUS send_status;
+    uint64_t read_ahead_next;
+    ULONG read_ahead_granularity;
 } ccb;
 
 struct _device_extension;
@@ -432,12 +460,14 @@ typedef struct _root {
     PEPROCESS reserved;
     uint64_t parent;
     LONG send_ops;
-    uint64_t fcbs_version;
     bool checked_for_orphans;
     bool dropped;
     LIST_ENTRY fcbs;
-    LIST_ENTRY* fcbs_ptrs[256];
+    LIST_ENTRY* fcbs_hash;
+    ULONG fcbs_hash_size;
+    ULONG num_fcbs;
     LIST_ENTRY list_entry;
+    LIST_ENTRY list_entry_hash;
     LIST_ENTRY list_entry_dirty;
 } root;
 
@@ -525,7 +555,7 @@ typedef struct {
     uint8_t data[1];
 } partial_stripe;
 
-typedef struct {
+typedef struct _chunk {
     CHUNK_ITEM* chunk_item;
     uint16_t size;
     uint64_t offset;
@@ -602,6 +632,8 @@ enum calc_thread_type {
     calc_thread_comp_zlib,
     calc_thread_comp_lzo,
     calc_thread_comp_zstd,
+    calc_thread_tree,
+    calc_thread_flush_fcbs,
 };
 
 typedef struct {
@@ -623,6 +655,14 @@ typedef struct {
     bool quit;
 } drv_calc_thread;
 
+typedef struct {
+    fcb** fcbs;
+    uint64_t* ii_offsets;
+    ULONG num_fcbs;
+    LIST_ENTRY batchlist;
+    NTSTATUS Status;
+} flush_fcb_part;
+
 typedef struct {
     ULONG num_threads;
     LIST_ENTRY job_list;
@@ -631,6 +671,29 @@ typedef struct {
     KEVENT event;
 } drv_calc_threads;
 
+enum io_queue {
+    io_queue_read = BTRFS_IO_QUEUE_READ,
+    io_queue_write = BTRFS_IO_QUEUE_WRITE,
+    io_queue_low = BTRFS_IO_QUEUE_LOW
+};
+
+typedef struct {
+    PDEVICE_OBJECT DeviceObject;
+    HANDLE handle;
+    KEVENT finished;
+} drv_io_thread;
+
+typedef struct {
+    ULONG num_threads;
+    KSPIN_LOCK spinlock;
+    KSEMAPHORE semaphore;
+    LIST_ENTRY queues[BTRFS_IO_QUEUES];
+    unsigned int reads_in_row;
+    bool quit;
+    drv_io_thread* threads;
+    btrfs_io_queue_stats stats;
+} drv_io_threads;
+
 typedef struct {
     bool ignore;
     bool compress;
@@ -641,6 +704,7 @@ typedef struct {
     uint32_t zstd_level;
     uint32_t flush_interval;
     uint32_t max_inline;
+    uint32_t read_ahead_max;
     uint64_t subvol_id;
     bool skip_balance;
     bool no_barrier;
@@ -719,6 +783,33 @@ typedef struct {
     LIST_ENTRY errors;
 } scrub_info;
 
+// Remembers which directory each recently-looked-up inode lives in, so that opening by file ID
+// doesn't have to search for an INODE_REF at every level of the path.
+typedef struct {
+    FAST_MUTEX mutex;
+    LIST_ENTRY* buckets;
+    LIST_ENTRY lru;
+    ULONG num_entries;
+    uint64_t hits;
+    uint64_t misses;
+} inode_ref_cache_info;
+
+// Most files either inherit one of a handful of security descriptors or have one of a handful
+// stored, so FCBs with identical SDs share a single refcounted copy.
+typedef struct {
+    FAST_MUTEX mutex;
+    LIST_ENTRY* buckets;
+    LIST_ENTRY* synth_buckets;
+    ULONG num_entries;
+    uint64_t bytes;
+    uint64_t bytes_saved;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t synth_hits;
+    uint64_t synth_misses;
+    ULONG synth_generation;
+} sd_cache_info;
+
 struct _volume_device_extension;
 
 typedef struct _device_extension {
@@ -753,12 +844,18 @@ typedef struct _device_extension {
     _Has_lock_level_(tree_lock) ERESOURCE tree_lock;
     PNOTIFY_SYNC NotifySync;
     LIST_ENTRY DirNotifyList;
+    FAST_MUTEX notification_mutex;
+    FAST_MUTEX path_cache_mutex;
+    ULONG path_cache_suspended;
     bool need_write;
     bool stats_changed;
     uint64_t data_flags;
     uint64_t metadata_flags;
     uint64_t system_flags;
     LIST_ENTRY roots;
+    LIST_ENTRY* roots_hash;
+    ULONG roots_hash_size;
+    ULONG num_roots;
     LIST_ENTRY drop_roots;
     root* chunk_root;
     root* root_root;
@@ -776,6 +873,7 @@ typedef struct _device_extension {
     LIST_ENTRY trees_hash;
     LIST_ENTRY* trees_ptrs[256];
     FAST_MUTEX trees_list_mutex;
+    uint64_t last_tree_alloc;
     LIST_ENTRY all_fcbs;
     LIST_ENTRY dirty_fcbs;
     ERESOURCE dirty_fcbs_lock;
@@ -787,7 +885,17 @@ typedef struct _device_extension {
     HANDLE flush_thread_handle;
     KTIMER flush_thread_timer;
     KEVENT flush_thread_finished;
+    LONG inflight_writes;
+    KSPIN_LOCK inflight_writes_lock;
+    KEVENT inflight_writes_event;
+    NTSTATUS inflight_writes_status;
+    LIST_ENTRY async_writes_done;
+    LIST_ENTRY async_writes_failed;
     drv_calc_threads calcthreads;
+    drv_io_threads iothreads;
+    btrfs_read_ahead_stats read_ahead_stats;
+    inode_ref_cache_info inode_ref_cache;
+    sd_cache_info sd_cache;
     balance_info balance;
     scrub_info scrub;
     ERESOURCE send_load_lock;
@@ -865,14 +973,22 @@ typedef struct pdo_device_extension {
     LIST_ENTRY list_entry;
 } pdo_device_extension;
 
+// The mappings are also hashed, by SID and by ID, as there can be thousands of them
+// on a domain-joined machine.
+#define MAPPING_HASH_BITS 10
+#define MAPPING_HASH_SIZE (1 << MAPPING_HASH_BITS)
+
 typedef struct {
     LIST_ENTRY listentry;
+    LIST_ENTRY list_entry_sid_hash;
+    LIST_ENTRY list_entry_uid_hash;
     PSID sid;
     uint32_t uid;
 } uid_map;
 
 typedef struct {
     LIST_ENTRY listentry;
+    LIST_ENTRY list_entry_sid_hash;
     PSID sid;
     uint32_t gid;
 } gid_map;
@@ -906,6 +1022,8 @@ typedef struct _write_data_context {
     bool need_wait;
     uint8_t *parity1, *parity2, *scratch;
     PMDL mdl, parity1_mdl, parity2_mdl;
+    void (*callback)(struct _write_data_context* wtc); // if set, called instead of setting Event
+    void* callback_context;
 } write_data_context;
 
 typedef struct {
@@ -940,6 +1058,10 @@ static __inline void release_fcb_lock(device_extension* Vcb) {
     ExReleaseResourceLite(&Vcb->fcb_lock);
 }
 
+static __inline LIST_ENTRY* fcb_hash_bucket(root* r, uint32_t hash) {
+    return &r->fcbs_hash[hash & (r->fcbs_hash_size - 1)];
+}
+
 static __inline void* map_user_buffer(PIRP Irp, ULONG priority) {
     if (!Irp->MdlAddress) {
         return Irp->UserBuffer;
@@ -1087,6 +1209,8 @@ void protect_superblocks(_Inout_ chunk* c);
 bool is_top_level(_In_ PIRP Irp);
 NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ uint64_t id,
                      _Out_ root** rootptr, _In_ bool no_tree, _In_ uint64_t offset, _In_opt_ PIRP Irp);
+root* find_root_by_id(_In_ device_extension* Vcb, _In_ uint64_t id);
+void remove_root_from_list(_In_ device_extension* Vcb, _In_ root* r);
 void uninit(_In_ device_extension* Vcb);
 NTSTATUS dev_ioctl(_In_ PDEVICE_OBJECT DeviceObject, _In_ ULONG ControlCode, _In_reads_bytes_opt_(InputBufferSize) PVOID InputBuffer, _In_ ULONG InputBufferSize,
                    _Out_writes_bytes_opt_(OutputBufferSize) PVOID OutputBuffer, _In_ ULONG OutputBufferSize, _In_ bool Override, _Out_opt_ IO_STATUS_BLOCK* iosb);
@@ -1126,8 +1250,6 @@ void reap_fcb(fcb* fcb);
 void reap_fcbs(device_extension* Vcb);
 void reap_fileref(device_extension* Vcb, file_ref* fr);
 void reap_filerefs(device_extension* Vcb, file_ref* fr);
-NTSTATUS utf8_to_utf16(WCHAR* dest, ULONG dest_max, ULONG* dest_len, char* src, ULONG src_len);
-NTSTATUS utf16_to_utf8(char* dest, ULONG dest_max, ULONG* dest_len, WCHAR* src, ULONG src_len);
 uint32_t get_num_of_processors();
 
 _Ret_maybenull_
@@ -1156,6 +1278,8 @@ extern uint32_t mount_clear_cache;
 extern uint32_t mount_allow_degraded;
 extern uint32_t mount_readonly;
 extern uint32_t mount_no_root_dir;
+extern uint32_t mount_io_threads;
+extern uint32_t mount_read_ahead_max;
 extern uint32_t no_pnp;
 
 #ifndef __GNUC__
@@ -1212,10 +1336,44 @@ void init_fast_io_dispatch(FAST_IO_DISPATCH** fiod);
 void calc_sha256(uint8_t* hash, const void* input, size_t len);
 #define SHA256_HASH_SIZE 32
 
+#if defined(_X86_) || defined(_AMD64_)
+void sha256_block_shani(uint32_t* h, const uint8_t* chunk);
+#endif
+
+typedef void (*sha256_block_func)(uint32_t* h, const uint8_t* chunk);
+
+extern sha256_block_func sha256_block;
+
+// in unicode.c
+NTSTATUS utf8_to_utf16(WCHAR* dest, ULONG dest_max, ULONG* dest_len, char* src, ULONG src_len);
+NTSTATUS utf16_to_utf8(char* dest, ULONG dest_max, ULONG* dest_len, WCHAR* src, ULONG src_len);
+
+#if defined(_X86_) || defined(_AMD64_)
+ULONG ascii_widen_sse2(uint16_t* out, const uint8_t* in, ULONG len);
+ULONG ascii_narrow_sse2(uint8_t* out, const uint16_t* in, ULONG len);
+ULONG ascii_widen_avx2(uint16_t* out, const uint8_t* in, ULONG len);
+ULONG ascii_narrow_avx2(uint8_t* out, const uint16_t* in, ULONG len);
+#endif
+
+typedef ULONG (*ascii_widen_func)(uint16_t* out, const uint8_t* in, ULONG len);
+typedef ULONG (*ascii_narrow_func)(uint8_t* out, const uint16_t* in, ULONG len);
+
+extern ascii_widen_func ascii_widen;
+extern ascii_narrow_func ascii_narrow;
+
 // in blake2b-ref.c
 void blake2b(void *out, size_t outlen, const void* in, size_t inlen);
 #define BLAKE2_HASH_SIZE 32
 
+#if defined(_X86_) || defined(_AMD64_)
+void blake2b_block_ssse3(uint64_t* h, const uint8_t* block, const uint64_t* t, const uint64_t* f);
+void blake2b_block_avx2(uint64_t* h, const uint8_t* block, const uint64_t* t, const uint64_t* f);
+#endif
+
+typedef void (*blake2b_block_func)(uint64_t* h, const uint8_t* block, const uint64_t* t, const uint64_t* f);
+
+extern blake2b_block_func blake2b_block;
+
 typedef struct {
     LIST_ENTRY* list;
     LIST_ENTRY* list_size;
@@ -1319,6 +1477,10 @@ NTSTATUS write_data(_In_ device_extension* Vcb, _In_ uint64_t address, _In_reads
 NTSTATUS write_data_complete(device_extension* Vcb, uint64_t address, void* data, uint32_t length, PIRP Irp, chunk* c, bool file_write,
                              uint64_t irp_offset, ULONG priority) __attribute__((nonnull(1,3)));
 void free_write_data_stripes(write_data_context* wtc) __attribute__((nonnull(1)));
+bool write_file_async(device_extension* Vcb, PIRP Irp) __attribute__((nonnull(1,2)));
+void wait_for_inflight_writes(device_extension* Vcb, fcb* fcb) __attribute__((nonnull(1)));
+void reap_async_writes(device_extension* Vcb) __attribute__((nonnull(1)));
+void rollback_failed_async_writes(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb) __attribute__((nonnull(1)));
 
 _Dispatch_type_(IRP_MJ_WRITE)
 _Function_class_(DRIVER_DISPATCH)
@@ -1336,6 +1498,7 @@ void get_raid56_lock_range(chunk* c, uint64_t address, uint64_t length, uint64_t
 NTSTATUS add_extent_to_fcb(_In_ fcb* fcb, _In_ uint64_t offset, _In_reads_bytes_(edsize) EXTENT_DATA* ed, _In_ uint16_t edsize,
                            _In_ bool unique, _In_opt_ _When_(return >= 0, __drv_aliasesMem) void* csum, _In_ LIST_ENTRY* rollback) __attribute__((nonnull(1,3,7)));
 void add_extent(_In_ fcb* fcb, _In_ LIST_ENTRY* prevextle, _In_ __drv_aliasesMem extent* newext) __attribute__((nonnull(1,2,3)));
+void release_alloc_window(fcb* fcb) __attribute__((nonnull(1)));
 
 // in dirctrl.c
 
@@ -1357,6 +1520,11 @@ _Function_class_(DRIVER_DISPATCH)
 NTSTATUS __stdcall drv_set_security(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
 
 void fcb_get_sd(fcb* fcb, struct _fcb* parent, bool look_for_xattr, PIRP Irp);
+NTSTATUS init_sd_cache(_In_ device_extension* Vcb);
+void free_sd_cache(_In_ device_extension* Vcb);
+void flush_sd_synth_cache(_In_ device_extension* Vcb);
+void share_fcb_sd(_In_ fcb* fcb);
+void free_fcb_sd(_In_ fcb* fcb);
 void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, uint32_t uid);
 void add_group_mapping(WCHAR* sidstring, ULONG sidstringlength, uint32_t gid);
 uint32_t sid_to_uid(PSID sid);
@@ -1385,10 +1553,15 @@ NTSTATUS __stdcall drv_set_ea(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
 bool has_open_children(file_ref* fileref);
 NTSTATUS stream_set_end_of_file_information(device_extension* Vcb, uint16_t end, fcb* fcb, file_ref* fileref, bool advance_only);
 NTSTATUS fileref_get_filename(file_ref* fileref, PUNICODE_STRING fn, USHORT* name_offset, ULONG* preqlen);
+void invalidate_cached_path(file_ref* fileref);
+void release_cached_path(cached_path* cp);
 void insert_dir_child_into_hash_lists(fcb* fcb, dir_child* dc);
 void remove_dir_child_from_hash_lists(fcb* fcb, dir_child* dc);
+NTSTATUS init_fcb_hash(root* r);
 void add_fcb_to_subvol(_In_ _Requires_exclusive_lock_held_(_Curr_->Vcb->fcb_lock) fcb* fcb);
 void remove_fcb_from_subvol(_In_ _Requires_exclusive_lock_held_(_Curr_->Vcb->fcb_lock) fcb* fcb);
+void replace_fcb_in_subvol(_In_ fcb* oldfcb, _In_ fcb* newfcb);
+fcb* find_fcb_in_subvol(_In_ _Requires_lock_held_(_Curr_->Vcb->fcb_lock) root* r, _In_ uint64_t inode, _In_ uint32_t hash);
 
 // in reparse.c
 NTSTATUS get_reparse_point(PFILE_OBJECT FileObject, void* buffer, DWORD buflen, ULONG_PTR* retlen);
@@ -1414,10 +1587,15 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
                             _In_ file_ref* sf, _In_ PUNICODE_STRING name, _In_ bool case_sensitive, _In_ bool lastpart, _In_ bool streampart,
                             _In_ POOL_TYPE pooltype, _Out_ file_ref** psf2, _In_opt_ PIRP Irp);
 fcb* create_fcb(device_extension* Vcb, POOL_TYPE pool_type);
+uint32_t calc_name_hash_uc(_In_ PUNICODE_STRING name);
+bool name_equal_uc(_In_ PUNICODE_STRING name_uc, _In_ PUNICODE_STRING name);
 NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, uint64_t* inode, dir_child** pdc, bool case_sensitive);
 uint32_t inherit_mode(fcb* parfcb, bool is_dir);
 file_ref* create_fileref(device_extension* Vcb);
 NTSTATUS open_fileref_by_inode(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb, root* subvol, uint64_t inode, file_ref** pfr, PIRP Irp);
+NTSTATUS init_inode_ref_cache(_In_ device_extension* Vcb);
+void free_inode_ref_cache(_In_ device_extension* Vcb);
+void forget_inode_ref(_In_ device_extension* Vcb, _In_ uint64_t subvol, _In_ uint64_t inode);
 
 // in fsctl.c
 NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP* Pirp, uint32_t type);
@@ -1447,6 +1625,8 @@ NTSTATUS insert_tree_item_batch(LIST_ENTRY* batchlist, device_extension* Vcb, ro
 NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* ps);
 NTSTATUS update_dev_item(device_extension* Vcb, device* device, PIRP Irp);
 void calc_tree_checksum(device_extension* Vcb, tree_header* th);
+void serialize_tree(device_extension* Vcb, tree* t, uint8_t* data);
+void flush_fcb_part_items(flush_fcb_part* part);
 
 // in read.c
 
@@ -1488,6 +1668,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
 void space_list_subtract(chunk* c, uint64_t address, uint64_t length, LIST_ENTRY* rollback);
 void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address, uint64_t length, chunk* c, LIST_ENTRY* rollback);
 void space_list_merge(LIST_ENTRY* spacelist, LIST_ENTRY* spacelist_size, LIST_ENTRY* deleting);
+void add_rollback_space(LIST_ENTRY* rollback, bool add, LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address, uint64_t length, chunk* c);
 NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, bool load_only, PIRP Irp);
 
 // in extent-tree.c
@@ -1503,6 +1684,8 @@ void update_extent_flags(device_extension* Vcb, uint64_t address, uint64_t flags
 NTSTATUS update_changed_extent_ref(device_extension* Vcb, chunk* c, uint64_t address, uint64_t size, uint64_t root, uint64_t objid, uint64_t offset,
                                    int32_t count, bool no_csum, bool superseded, PIRP Irp);
 void add_changed_extent_ref(chunk* c, uint64_t address, uint64_t size, uint64_t root, uint64_t objid, uint64_t offset, uint32_t count, bool no_csum);
+bool merge_changed_extents(chunk* c, uint64_t address, uint64_t size, uint64_t address2, uint64_t size2, uint64_t root, uint64_t objid,
+                           uint64_t offset, uint64_t offset2);
 uint64_t find_extent_shared_tree_refcount(device_extension* Vcb, uint64_t address, uint64_t parent, PIRP Irp);
 uint32_t find_extent_shared_data_refcount(device_extension* Vcb, uint64_t address, uint64_t parent, PIRP Irp);
 NTSTATUS decrease_extent_refcount(device_extension* Vcb, uint64_t address, uint64_t size, uint8_t type, void* data, KEY* firstitem,
@@ -1513,6 +1696,11 @@ uint64_t get_extent_data_ref_hash2(uint64_t root, uint64_t objid, uint64_t offse
 NTSTATUS do_read_job(PIRP Irp);
 NTSTATUS do_write_job(device_extension* Vcb, PIRP Irp);
 bool add_thread_job(device_extension* Vcb, PIRP Irp);
+bool lock_irp_buffer(PIRP Irp);
+void get_io_queue_stats(device_extension* Vcb, btrfs_io_queue_stats* stats);
+
+_Function_class_(KSTART_ROUTINE)
+void __stdcall io_thread(void* context);
 
 // in registry.c
 void read_registry(PUNICODE_STRING regpath, bool refresh);
@@ -1536,6 +1724,7 @@ void galois_divpower(uint8_t* data, uint8_t div, uint32_t readlen);
 uint8_t gpow2(uint8_t e);
 uint8_t gmul(uint8_t a, uint8_t b);
 uint8_t gdiv(uint8_t a, uint8_t b);
+void __stdcall do_xor_basic(uint8_t* buf1, uint8_t* buf2, uint32_t len);
 
 // in devctrl.c
 
@@ -1549,6 +1738,8 @@ _Function_class_(KSTART_ROUTINE)
 void __stdcall calc_thread(void* context);
 
 void do_calc_job(device_extension* Vcb, uint8_t* data, uint32_t sectors, void* csum);
+void do_calc_job_trees(device_extension* Vcb, tree** trees, uint8_t** bufs, ULONG num_trees);
+void do_calc_job_fcbs(device_extension* Vcb, flush_fcb_part* parts, ULONG num_parts);
 NTSTATUS add_calc_job_decomp(device_extension* Vcb, uint8_t compression, void* in, unsigned int inlen,
                              void* out, unsigned int outlen, unsigned int off, calc_job** pcj);
 NTSTATUS add_calc_job_comp(device_extension* Vcb, uint8_t compression, void* in, unsigned int inlen,
@@ -1804,6 +1995,8 @@ typedef BOOLEAN (__stdcall *tFsRtlCheckLockForOplockRequest)(PFILE_LOCK FileLock
 
 typedef BOOLEAN (__stdcall *tFsRtlAreThereCurrentOrInProgressFileLocks)(PFILE_LOCK FileLock);
 
+typedef IO_PRIORITY_HINT (__stdcall *tIoGetIoPriorityHint)(PIRP Irp);
+
 #ifndef _MSC_VER
 PEPROCESS __stdcall PsGetThreadProcess(_In_ PETHREAD Thread); // not in mingw
 #endif
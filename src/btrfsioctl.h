@@ -38,6 +38,10 @@
 #define FSCTL_BTRFS_RESIZE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x848, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
 #define IOCTL_BTRFS_UNLOAD CTL_CODE(FILE_DEVICE_UNKNOWN, 0x849, METHOD_NEITHER, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_GET_CSUM_INFO CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84a, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define FSCTL_BTRFS_GET_IO_QUEUE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84b, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_READ_AHEAD_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84c, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_INODE_REF_CACHE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84d, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_SD_CACHE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84e, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 typedef struct {
     uint64_t subvol;
@@ -287,3 +291,44 @@ typedef struct {
     uint64_t num_sectors;
     uint8_t data[1];
 } btrfs_csum_info;
+
+#define BTRFS_IO_QUEUE_READ     0
+#define BTRFS_IO_QUEUE_WRITE    1
+#define BTRFS_IO_QUEUE_LOW      2
+#define BTRFS_IO_QUEUES         3
+
+typedef struct {
+    uint32_t num_threads;
+    uint32_t queue_depth[BTRFS_IO_QUEUES];
+    uint32_t max_queue_depth[BTRFS_IO_QUEUES];
+    uint64_t jobs[BTRFS_IO_QUEUES];
+    uint64_t wait_time[BTRFS_IO_QUEUES]; // in 100ns units
+    uint64_t max_wait_time[BTRFS_IO_QUEUES];
+} btrfs_io_queue_stats;
+
+// Cached reads which read-ahead anticipated are cached_read_bytes - demand_read_bytes; anything
+// read ahead beyond that was wasted.
+typedef struct {
+    uint32_t read_ahead_max;
+    uint64_t cached_read_bytes; // asked for by cached reads
+    uint64_t read_ahead_bytes; // read from disk by Cc's read-ahead
+    uint64_t demand_read_bytes; // read from disk for other paging reads
+    uint64_t window_grows;
+    uint64_t window_shrinks;
+} btrfs_read_ahead_stats;
+
+typedef struct {
+    uint32_t num_entries;
+    uint64_t hits;
+    uint64_t misses;
+} btrfs_inode_ref_cache_stats;
+
+typedef struct {
+    uint32_t num_entries;
+    uint64_t bytes;
+    uint64_t bytes_saved;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t synth_hits;
+    uint64_t synth_misses;
+} btrfs_sd_cache_stats;
@@ -57,6 +57,15 @@ void calc_thread_main(device_extension* Vcb, calc_job* cj) {
                 cj2->out = (uint8_t*)cj2->out + Vcb->csum_size;
             break;
 
+            case calc_thread_tree:
+                cj2->in = (tree**)cj2->in + 1;
+                cj2->out = (uint8_t**)cj2->out + 1;
+            break;
+
+            case calc_thread_flush_fcbs:
+                cj2->in = (flush_fcb_part*)cj2->in + 1;
+            break;
+
             default:
                 break;
         }
@@ -87,6 +96,14 @@ void calc_thread_main(device_extension* Vcb, calc_job* cj) {
                 blake2b(dest, BLAKE2_HASH_SIZE, src, Vcb->superblock.sector_size);
             break;
 
+            case calc_thread_tree:
+                serialize_tree(Vcb, *(tree**)src, *(uint8_t**)dest);
+            break;
+
+            case calc_thread_flush_fcbs:
+                flush_fcb_part_items((flush_fcb_part*)src);
+            break;
+
             case calc_thread_decomp_zlib:
                 cj2->Status = zlib_decompress(src, cj2->inlen, dest, cj2->outlen);
 
@@ -138,46 +155,67 @@ void calc_thread_main(device_extension* Vcb, calc_job* cj) {
     }
 }
 
-void do_calc_job(device_extension* Vcb, uint8_t* data, uint32_t sectors, void* csum) {
+static void submit_calc_job(device_extension* Vcb, enum calc_thread_type type, void* in, void* out, LONG count) {
     KIRQL irql;
     calc_job cj;
 
-    cj.in = data;
-    cj.out = csum;
-    cj.left = cj.not_started = sectors;
+    cj.in = in;
+    cj.out = out;
+    cj.left = cj.not_started = count;
+    cj.type = type;
 
-    switch (Vcb->superblock.csum_type) {
-        case CSUM_TYPE_CRC32C:
-            cj.type = calc_thread_crc32c;
-        break;
+    KeInitializeEvent(&cj.event, NotificationEvent, false);
+
+    KeAcquireSpinLock(&Vcb->calcthreads.spinlock, &irql);
+
+    InsertTailList(&Vcb->calcthreads.job_list, &cj.list_entry);
+
+    KeSetEvent(&Vcb->calcthreads.event, 0, false);
+    KeClearEvent(&Vcb->calcthreads.event);
+
+    KeReleaseSpinLock(&Vcb->calcthreads.spinlock, irql);
+
+    calc_thread_main(Vcb, &cj);
+
+    KeWaitForSingleObject(&cj.event, Executive, KernelMode, false, NULL);
+}
+
+void do_calc_job(device_extension* Vcb, uint8_t* data, uint32_t sectors, void* csum) {
+    enum calc_thread_type type;
 
+    switch (Vcb->superblock.csum_type) {
         case CSUM_TYPE_XXHASH:
-            cj.type = calc_thread_xxhash;
+            type = calc_thread_xxhash;
         break;
 
         case CSUM_TYPE_SHA256:
-            cj.type = calc_thread_sha256;
+            type = calc_thread_sha256;
         break;
 
         case CSUM_TYPE_BLAKE2:
-            cj.type = calc_thread_blake2;
+            type = calc_thread_blake2;
         break;
-    }
 
-    KeInitializeEvent(&cj.event, NotificationEvent, false);
-
-    KeAcquireSpinLock(&Vcb->calcthreads.spinlock, &irql);
+        default:
+            type = calc_thread_crc32c;
+        break;
+    }
 
-    InsertTailList(&Vcb->calcthreads.job_list, &cj.list_entry);
+    submit_calc_job(Vcb, type, data, csum, sectors);
+}
 
-    KeSetEvent(&Vcb->calcthreads.event, 0, false);
-    KeClearEvent(&Vcb->calcthreads.event);
+void do_calc_job_trees(device_extension* Vcb, tree** trees, uint8_t** bufs, ULONG num_trees) {
+    if (num_trees == 0)
+        return;
 
-    KeReleaseSpinLock(&Vcb->calcthreads.spinlock, irql);
+    submit_calc_job(Vcb, calc_thread_tree, trees, bufs, num_trees);
+}
 
-    calc_thread_main(Vcb, &cj);
+void do_calc_job_fcbs(device_extension* Vcb, flush_fcb_part* parts, ULONG num_parts) {
+    if (num_parts == 0)
+        return;
 
-    KeWaitForSingleObject(&cj.event, Executive, KernelMode, false, NULL);
+    submit_calc_job(Vcb, calc_thread_flush_fcbs, parts, NULL, num_parts);
 }
 
 NTSTATUS add_calc_job_decomp(device_extension* Vcb, uint8_t compression, void* in, unsigned int inlen,
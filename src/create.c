@@ -139,6 +139,8 @@ fcb* create_fcb(device_extension* Vcb, POOL_TYPE pool_type) {
 
     ExInitializeResourceLite(&fcb->nonpaged->dir_children_lock);
 
+    KeInitializeEvent(&fcb->nonpaged->inflight_writes_event, NotificationEvent, true);
+
     FsRtlInitializeFileLock(&fcb->lock, NULL, NULL);
     FsRtlInitializeOplock(fcb_oplock(fcb));
 
@@ -175,29 +177,108 @@ file_ref* create_fileref(device_extension* Vcb) {
     return fr;
 }
 
+// Upcasing names ourselves, rather than through RtlUpcaseUnicodeString, means lookups don't
+// have to allocate. The results are the same, as non-ASCII characters still go through
+// RtlUpcaseUnicodeChar, which uses the same table.
+
+#define UPCASE_CHUNK 64
+#define NON_ASCII_MASK 0xff80ff80ff80ff80
+
+// Upcases four ASCII characters at once. Adding 0x1f to each character sets bit 7 of it if
+// it's 'a' or above, and adding 5 sets it if it's above 'z'; as they're all below 0x80,
+// nothing carries into the next one.
+static __inline uint64_t upcase_ascii4(uint64_t v) {
+    uint64_t ge_a = v + 0x001f001f001f001f;
+    uint64_t gt_z = v + 0x0005000500050005;
+
+    return v ^ ((ge_a & ~gt_z & 0x0080008000800080) >> 2);
+}
+
+static void upcase_chars(WCHAR* out, const WCHAR* in, ULONG len) {
+    ULONG i = 0;
+
+    while (i < len) {
+        WCHAR c;
+
+        if (len - i >= 4) {
+            uint64_t v;
+
+            RtlCopyMemory(&v, &in[i], sizeof(uint64_t));
+
+            if (!(v & NON_ASCII_MASK)) {
+                v = upcase_ascii4(v);
+                RtlCopyMemory(&out[i], &v, sizeof(uint64_t));
+                i += 4;
+                continue;
+            }
+        }
+
+        c = in[i];
+
+        if (c < 0x80)
+            out[i] = c >= 'a' && c <= 'z' ? c - 0x20 : c;
+        else
+            out[i] = RtlUpcaseUnicodeChar(c);
+
+        i++;
+    }
+}
+
+// Returns the same as calc_crc32c(0xffffffff, ...) on the upcased name, i.e. dir_child's hash_uc.
+uint32_t calc_name_hash_uc(_In_ PUNICODE_STRING name) {
+    WCHAR buf[UPCASE_CHUNK];
+    ULONG len = name->Length / sizeof(WCHAR), off = 0;
+    uint32_t hash = 0xffffffff;
+
+    while (off < len) {
+        ULONG n = min(len - off, UPCASE_CHUNK);
+
+        upcase_chars(buf, &name->Buffer[off], n);
+        hash = calc_crc32c(hash, (uint8_t*)buf, n * sizeof(WCHAR));
+
+        off += n;
+    }
+
+    return hash;
+}
+
+// Checks whether name, once upcased, is the same as the already-upcased name_uc.
+bool name_equal_uc(_In_ PUNICODE_STRING name_uc, _In_ PUNICODE_STRING name) {
+    WCHAR buf[UPCASE_CHUNK];
+    ULONG len = name->Length / sizeof(WCHAR), off = 0;
+
+    if (name_uc->Length != name->Length)
+        return false;
+
+    while (off < len) {
+        ULONG n = min(len - off, UPCASE_CHUNK);
+
+        upcase_chars(buf, &name->Buffer[off], n);
+
+        if (RtlCompareMemory(buf, &name_uc->Buffer[off], n * sizeof(WCHAR)) != n * sizeof(WCHAR))
+            return false;
+
+        off += n;
+    }
+
+    return true;
+}
+
 NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, uint64_t* inode, dir_child** pdc, bool case_sensitive) {
     NTSTATUS Status;
-    UNICODE_STRING fnus;
     uint32_t hash;
     LIST_ENTRY* le;
     uint8_t c;
     bool locked = false;
 
-    if (!case_sensitive) {
-        Status = RtlUpcaseUnicodeString(&fnus, filename, true);
-
-        if (!NT_SUCCESS(Status)) {
-            ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
-            return Status;
-        }
-    } else
-        fnus = *filename;
-
     Status = check_file_name_valid(filename, false, false);
     if (!NT_SUCCESS(Status))
         return Status;
 
-    hash = calc_crc32c(0xffffffff, (uint8_t*)fnus.Buffer, fnus.Length);
+    if (case_sensitive)
+        hash = calc_crc32c(0xffffffff, (uint8_t*)filename->Buffer, filename->Length);
+    else
+        hash = calc_name_hash_uc(filename);
 
     c = hash >> 24;
 
@@ -217,24 +298,9 @@ NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, uin
             dir_child* dc = CONTAINING_RECORD(le, dir_child, list_entry_hash);
 
             if (dc->hash == hash) {
-                if (dc->name.Length == fnus.Length && RtlCompareMemory(dc->name.Buffer, fnus.Buffer, fnus.Length) == fnus.Length) {
+                if (dc->name.Length == filename->Length && RtlCompareMemory(dc->name.Buffer, filename->Buffer, filename->Length) == filename->Length) {
                     if (dc->key.obj_type == TYPE_ROOT_ITEM) {
-                        LIST_ENTRY* le2;
-
-                        *subvol = NULL;
-
-                        le2 = fcb->Vcb->roots.Flink;
-                        while (le2 != &fcb->Vcb->roots) {
-                            root* r2 = CONTAINING_RECORD(le2, root, list_entry);
-
-                            if (r2->id == dc->key.obj_id) {
-                                *subvol = r2;
-                                break;
-                            }
-
-                            le2 = le2->Flink;
-                        }
-
+                        *subvol = find_root_by_id(fcb->Vcb, dc->key.obj_id);
                         *inode = SUBVOL_ROOT_INODE;
                     } else {
                         *subvol = fcb->subvol;
@@ -264,24 +330,9 @@ NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, uin
             dir_child* dc = CONTAINING_RECORD(le, dir_child, list_entry_hash_uc);
 
             if (dc->hash_uc == hash) {
-                if (dc->name_uc.Length == fnus.Length && RtlCompareMemory(dc->name_uc.Buffer, fnus.Buffer, fnus.Length) == fnus.Length) {
+                if (name_equal_uc(&dc->name_uc, filename)) {
                     if (dc->key.obj_type == TYPE_ROOT_ITEM) {
-                        LIST_ENTRY* le2;
-
-                        *subvol = NULL;
-
-                        le2 = fcb->Vcb->roots.Flink;
-                        while (le2 != &fcb->Vcb->roots) {
-                            root* r2 = CONTAINING_RECORD(le2, root, list_entry);
-
-                            if (r2->id == dc->key.obj_id) {
-                                *subvol = r2;
-                                break;
-                            }
-
-                            le2 = le2->Flink;
-                        }
-
+                        *subvol = find_root_by_id(fcb->Vcb, dc->key.obj_id);
                         *inode = SUBVOL_ROOT_INODE;
                     } else {
                         *subvol = fcb->subvol;
@@ -308,9 +359,6 @@ end:
     if (locked)
         ExReleaseResourceLite(&fcb->nonpaged->dir_children_lock);
 
-    if (!case_sensitive)
-        ExFreePool(fnus.Buffer);
-
     return Status;
 }
 
@@ -704,67 +752,33 @@ NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lo
     KEY searchkey;
     traverse_ptr tp, next_tp;
     NTSTATUS Status;
-    fcb *fcb, *deleted_fcb = NULL;
+    fcb* fcb;
     bool atts_set = false, sd_set = false, no_data;
-    LIST_ENTRY* lastle = NULL;
     EXTENT_DATA* ed = NULL;
-    uint64_t fcbs_version = 0;
     uint32_t hash;
 
     hash = calc_crc32c(0xffffffff, (uint8_t*)&inode, sizeof(uint64_t));
 
     acquire_fcb_lock_shared(Vcb);
 
-    if (subvol->fcbs_ptrs[hash >> 24]) {
-        LIST_ENTRY* le = subvol->fcbs_ptrs[hash >> 24];
+    fcb = find_fcb_in_subvol(subvol, inode, hash);
 
-        while (le != &subvol->fcbs) {
-            fcb = CONTAINING_RECORD(le, struct _fcb, list_entry);
-
-            if (fcb->inode == inode) {
-                if (!fcb->ads) {
-                    if (fcb->deleted)
-                        deleted_fcb = fcb;
-                    else {
+    if (fcb) {
 #ifdef DEBUG_FCB_REFCOUNTS
-                        LONG rc = InterlockedIncrement(&fcb->refcount);
+        LONG rc = InterlockedIncrement(&fcb->refcount);
 
-                        WARN("fcb %p: refcount now %i (subvol %I64x, inode %I64x)\n", fcb, rc, fcb->subvol->id, fcb->inode);
+        WARN("fcb %p: refcount now %i (subvol %I64x, inode %I64x)\n", fcb, rc, fcb->subvol->id, fcb->inode);
 #else
-                        InterlockedIncrement(&fcb->refcount);
+        InterlockedIncrement(&fcb->refcount);
 #endif
 
-                        *pfcb = fcb;
-                        release_fcb_lock(Vcb);
-                        return STATUS_SUCCESS;
-                    }
-                }
-            } else if (fcb->hash > hash) {
-                if (deleted_fcb) {
-                    InterlockedIncrement(&deleted_fcb->refcount);
-                    *pfcb = deleted_fcb;
-                    release_fcb_lock(Vcb);
-                    return STATUS_SUCCESS;
-                }
-
-                lastle = le->Blink;
-                fcbs_version = subvol->fcbs_version;
-
-                break;
-            }
-
-            le = le->Flink;
-        }
+        *pfcb = fcb;
+        release_fcb_lock(Vcb);
+        return STATUS_SUCCESS;
     }
 
     release_fcb_lock(Vcb);
 
-    if (deleted_fcb) {
-        InterlockedIncrement(&deleted_fcb->refcount);
-        *pfcb = deleted_fcb;
-        return STATUS_SUCCESS;
-    }
-
     fcb = create_fcb(Vcb, pooltype);
     if (!fcb) {
         ERR("out of memory\n");
@@ -1058,10 +1072,13 @@ NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lo
 
                         // We have to test against our copy rather than the source, as RtlValidRelativeSecurityDescriptor
                         // will fail if the ACLs aren't 32-bit aligned.
-                        if (!RtlValidRelativeSecurityDescriptor(fcb->sd, di->m, 0))
+                        if (!RtlValidRelativeSecurityDescriptor(fcb->sd, di->m, 0)) {
                             ExFreePool(fcb->sd);
-                        else
+                            fcb->sd = NULL;
+                        } else {
+                            share_fcb_sd(fcb);
                             sd_set = true;
+                        }
                     }
                 } else if (tp.item->key.offset == EA_PROP_COMPRESSION_HASH && di->n == sizeof(EA_PROP_COMPRESSION) - 1 && RtlCompareMemory(EA_PROP_COMPRESSION, di->name, di->n) == di->n) {
                     if (di->m > 0) {
@@ -1254,100 +1271,40 @@ NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lo
 
     acquire_fcb_lock_exclusive(Vcb);
 
-    if (lastle && subvol->fcbs_version == fcbs_version) {
-        InsertHeadList(lastle, &fcb->list_entry);
-
-        if (!subvol->fcbs_ptrs[hash >> 24] || CONTAINING_RECORD(subvol->fcbs_ptrs[hash >> 24], struct _fcb, list_entry)->hash > hash)
-            subvol->fcbs_ptrs[hash >> 24] = &fcb->list_entry;
-    } else {
-        lastle = NULL;
-
-        if (subvol->fcbs_ptrs[hash >> 24]) {
-            LIST_ENTRY* le = subvol->fcbs_ptrs[hash >> 24];
+    // another thread may have opened the same inode while we weren't holding the lock
+    {
+        struct _fcb* fcb2 = find_fcb_in_subvol(subvol, inode, hash);
 
-            while (le != &subvol->fcbs) {
-                struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry);
-
-                if (fcb2->inode == inode) {
-                    if (!fcb2->ads) {
-                        if (fcb2->deleted)
-                            deleted_fcb = fcb2;
-                        else {
+        if (fcb2) {
 #ifdef DEBUG_FCB_REFCOUNTS
-                            LONG rc = InterlockedIncrement(&fcb2->refcount);
+            LONG rc = InterlockedIncrement(&fcb2->refcount);
 
-                            WARN("fcb %p: refcount now %i (subvol %I64x, inode %I64x)\n", fcb2, rc, fcb2->subvol->id, fcb2->inode);
+            WARN("fcb %p: refcount now %i (subvol %I64x, inode %I64x)\n", fcb2, rc, fcb2->subvol->id, fcb2->inode);
 #else
-                            InterlockedIncrement(&fcb2->refcount);
+            InterlockedIncrement(&fcb2->refcount);
 #endif
 
-                            *pfcb = fcb2;
-                            reap_fcb(fcb);
-                            release_fcb_lock(Vcb);
-                            return STATUS_SUCCESS;
-                        }
-                    }
-                } else if (fcb2->hash > hash) {
-                    if (deleted_fcb) {
-                        InterlockedIncrement(&deleted_fcb->refcount);
-                        *pfcb = deleted_fcb;
-                        reap_fcb(fcb);
-                        release_fcb_lock(Vcb);
-                        return STATUS_SUCCESS;
-                    }
-
-                    lastle = le->Blink;
-                    break;
-                }
-
-                le = le->Flink;
-            }
-        }
-
-        if (fcb->type == BTRFS_TYPE_DIRECTORY && fcb->atts & FILE_ATTRIBUTE_REPARSE_POINT && fcb->reparse_xattr.Length == 0) {
-            fcb->atts &= ~FILE_ATTRIBUTE_REPARSE_POINT;
-
-            if (!Vcb->readonly && !is_subvol_readonly(subvol, Irp)) {
-                fcb->atts_changed = true;
-                mark_fcb_dirty(fcb);
-            }
-        }
-
-        if (!lastle) {
-            uint8_t c = hash >> 24;
-
-            if (c != 0xff) {
-                uint8_t d = c + 1;
-
-                do {
-                    if (subvol->fcbs_ptrs[d]) {
-                        lastle = subvol->fcbs_ptrs[d]->Blink;
-                        break;
-                    }
-
-                    d++;
-                } while (d != 0);
-            }
+            *pfcb = fcb2;
+            reap_fcb(fcb);
+            release_fcb_lock(Vcb);
+            return STATUS_SUCCESS;
         }
+    }
 
-        if (lastle) {
-            InsertHeadList(lastle, &fcb->list_entry);
-
-            if (lastle == &subvol->fcbs || (CONTAINING_RECORD(lastle, struct _fcb, list_entry)->hash >> 24) != (hash >> 24))
-                subvol->fcbs_ptrs[hash >> 24] = &fcb->list_entry;
-        } else {
-            InsertTailList(&subvol->fcbs, &fcb->list_entry);
+    if (fcb->type == BTRFS_TYPE_DIRECTORY && fcb->atts & FILE_ATTRIBUTE_REPARSE_POINT && fcb->reparse_xattr.Length == 0) {
+        fcb->atts &= ~FILE_ATTRIBUTE_REPARSE_POINT;
 
-            if (fcb->list_entry.Blink == &subvol->fcbs || (CONTAINING_RECORD(fcb->list_entry.Blink, struct _fcb, list_entry)->hash >> 24) != (hash >> 24))
-                subvol->fcbs_ptrs[hash >> 24] = &fcb->list_entry;
+        if (!Vcb->readonly && !is_subvol_readonly(subvol, Irp)) {
+            fcb->atts_changed = true;
+            mark_fcb_dirty(fcb);
         }
     }
 
+    add_fcb_to_subvol(fcb);
+
     if (fcb->inode == SUBVOL_ROOT_INODE && fcb->subvol->id == BTRFS_ROOT_FSTREE && fcb->subvol != Vcb->root_fileref->fcb->subvol)
         fcb->atts |= FILE_ATTRIBUTE_HIDDEN;
 
-    subvol->fcbs_version++;
-
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
 
     release_fcb_lock(Vcb);
@@ -1464,20 +1421,11 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
     if (streampart) {
         bool locked = false;
         LIST_ENTRY* le;
-        UNICODE_STRING name_uc;
         dir_child* dc = NULL;
         fcb* fcb;
         struct _fcb* duff_fcb = NULL;
         file_ref* duff_fr = NULL;
 
-        if (!case_sensitive) {
-            Status = RtlUpcaseUnicodeString(&name_uc, name, true);
-            if (!NT_SUCCESS(Status)) {
-                ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
-                return Status;
-            }
-        }
-
         if (!ExIsResourceAcquiredSharedLite(&sf->fcb->nonpaged->dir_children_lock)) {
             ExAcquireResourceSharedLite(&sf->fcb->nonpaged->dir_children_lock, true);
             locked = true;
@@ -1489,7 +1437,7 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
 
             if (dc2->index == 0) {
                 if ((case_sensitive && dc2->name.Length == name->Length && RtlCompareMemory(dc2->name.Buffer, name->Buffer, dc2->name.Length) == dc2->name.Length) ||
-                    (!case_sensitive && dc2->name_uc.Length == name_uc.Length && RtlCompareMemory(dc2->name_uc.Buffer, name_uc.Buffer, dc2->name_uc.Length) == dc2->name_uc.Length)
+                    (!case_sensitive && name_equal_uc(&dc2->name_uc, name))
                 ) {
                     dc = dc2;
                     break;
@@ -1504,9 +1452,6 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
             if (locked)
                 ExReleaseResourceLite(&sf->fcb->nonpaged->dir_children_lock);
 
-            if (!case_sensitive)
-                ExFreePool(name_uc.Buffer);
-
             return STATUS_OBJECT_NAME_NOT_FOUND;
         }
 
@@ -1514,9 +1459,6 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
             if (locked)
                 ExReleaseResourceLite(&sf->fcb->nonpaged->dir_children_lock);
 
-            if (!case_sensitive)
-                ExFreePool(name_uc.Buffer);
-
             increase_fileref_refcount(dc->fileref);
             *psf2 = dc->fileref;
             return STATUS_SUCCESS;
@@ -1525,9 +1467,6 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
         if (locked)
             ExReleaseResourceLite(&sf->fcb->nonpaged->dir_children_lock);
 
-        if (!case_sensitive)
-            ExFreePool(name_uc.Buffer);
-
         Status = open_fcb_stream(Vcb, dc, sf->fcb, &fcb, Irp);
         if (!NT_SUCCESS(Status)) {
             ERR("open_fcb_stream returned %08lx\n", Status);
@@ -1538,29 +1477,23 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
 
         acquire_fcb_lock_exclusive(Vcb);
 
-        if (sf->fcb->subvol->fcbs_ptrs[fcb->hash >> 24]) {
-            le = sf->fcb->subvol->fcbs_ptrs[fcb->hash >> 24];
+        le = fcb_hash_bucket(sf->fcb->subvol, fcb->hash)->Flink;
 
-            while (le != &sf->fcb->subvol->fcbs) {
-                struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry);
+        while (le != fcb_hash_bucket(sf->fcb->subvol, fcb->hash)) {
+            struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry_hash);
 
-                if (fcb2->inode == fcb->inode) {
-                    if (fcb2->ads && fcb2->adshash == fcb->adshash) { // FIXME - handle hash collisions
-                        duff_fcb = fcb;
-                        fcb = fcb2;
-                        break;
-                    }
-                } else if (fcb2->hash > fcb->hash)
-                    break;
-
-                le = le->Flink;
+            if (fcb2->inode == fcb->inode && fcb2->ads && fcb2->adshash == fcb->adshash) { // FIXME - handle hash collisions
+                duff_fcb = fcb;
+                fcb = fcb2;
+                break;
             }
+
+            le = le->Flink;
         }
 
         if (!duff_fcb) {
-            InsertHeadList(&sf->fcb->list_entry, &fcb->list_entry);
+            add_fcb_to_subvol(fcb);
             InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
-            fcb->subvol->fcbs_version++;
         }
 
         release_fcb_lock(Vcb);
@@ -2192,7 +2125,6 @@ static NTSTATUS file_create2(_In_ PIRP Irp, _Requires_exclusive_lock_held_(_Curr
     file_ref* fileref;
     dir_child* dc;
     ANSI_STRING utf8as;
-    LIST_ENTRY* lastle = NULL;
     file_ref* existing_fileref = NULL;
 #ifdef DEBUG_FCB_REFCOUNTS
     LONG rc;
@@ -2355,54 +2287,10 @@ static NTSTATUS file_create2(_In_ PIRP Irp, _Requires_exclusive_lock_held_(_Curr
 
     acquire_fcb_lock_exclusive(Vcb);
 
-    if (fcb->subvol->fcbs_ptrs[fcb->hash >> 24]) {
-        LIST_ENTRY* le = fcb->subvol->fcbs_ptrs[fcb->hash >> 24];
-
-        while (le != &fcb->subvol->fcbs) {
-            struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry);
-
-            if (fcb2->hash > fcb->hash) {
-                lastle = le->Blink;
-                break;
-            }
-
-            le = le->Flink;
-        }
-    }
-
-    if (!lastle) {
-        uint8_t c = fcb->hash >> 24;
-
-        if (c != 0xff) {
-            uint8_t d = c + 1;
-
-            do {
-                if (fcb->subvol->fcbs_ptrs[d]) {
-                    lastle = fcb->subvol->fcbs_ptrs[d]->Blink;
-                    break;
-                }
-
-                d++;
-            } while (d != 0);
-        }
-    }
-
-    if (lastle) {
-        InsertHeadList(lastle, &fcb->list_entry);
-
-        if (lastle == &fcb->subvol->fcbs || (CONTAINING_RECORD(lastle, struct _fcb, list_entry)->hash >> 24) != (fcb->hash >> 24))
-            fcb->subvol->fcbs_ptrs[fcb->hash >> 24] = &fcb->list_entry;
-    } else {
-        InsertTailList(&fcb->subvol->fcbs, &fcb->list_entry);
-
-        if (fcb->list_entry.Blink == &fcb->subvol->fcbs || (CONTAINING_RECORD(fcb->list_entry.Blink, struct _fcb, list_entry)->hash >> 24) != (fcb->hash >> 24))
-            fcb->subvol->fcbs_ptrs[fcb->hash >> 24] = &fcb->list_entry;
-    }
+    add_fcb_to_subvol(fcb);
 
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
 
-    fcb->subvol->fcbs_version++;
-
     release_fcb_lock(Vcb);
 
     mark_fcb_dirty(fcb);
@@ -2538,31 +2426,14 @@ static NTSTATUS file_create2(_In_ PIRP Irp, _Requires_exclusive_lock_held_(_Curr
             }
         }
     } else {
-        UNICODE_STRING fpusuc;
-
-        Status = RtlUpcaseUnicodeString(&fpusuc, fpus, true);
-        if (!NT_SUCCESS(Status)) {
-            ExReleaseResourceLite(&parfileref->fcb->nonpaged->dir_children_lock);
-            ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
-            reap_fileref(Vcb, fileref);
-
-            ExAcquireResourceExclusiveLite(parfileref->fcb->Header.Resource, true);
-            parfileref->fcb->inode_item.st_size -= utf8len * 2;
-            ExReleaseResourceLite(parfileref->fcb->Header.Resource);
-
-            ExFreePool(utf8);
-
-            return Status;
-        }
-
-        uint32_t dc_hash = calc_crc32c(0xffffffff, (uint8_t*)fpusuc.Buffer, fpusuc.Length);
+        uint32_t dc_hash = calc_name_hash_uc(fpus);
 
         if (parfileref->fcb->hash_ptrs_uc[dc_hash >> 24]) {
             LIST_ENTRY* le = parfileref->fcb->hash_ptrs_uc[dc_hash >> 24];
             while (le != &parfileref->fcb->dir_children_hash_uc) {
                 dc = CONTAINING_RECORD(le, dir_child, list_entry_hash_uc);
 
-                if (dc->hash_uc == dc_hash && dc->name.Length == fpusuc.Length && RtlCompareMemory(dc->name.Buffer, fpusuc.Buffer, fpusuc.Length) == fpusuc.Length) {
+                if (dc->hash_uc == dc_hash && name_equal_uc(&dc->name_uc, fpus)) {
                     existing_fileref = dc->fileref;
                     break;
                 } else if (dc->hash_uc > dc_hash)
@@ -2571,8 +2442,6 @@ static NTSTATUS file_create2(_In_ PIRP Irp, _Requires_exclusive_lock_held_(_Curr
                 le = le->Flink;
             }
         }
-
-        ExFreePool(fpusuc.Buffer);
     }
 
     if (existing_fileref) {
@@ -2841,9 +2710,8 @@ static NTSTATUS create_stream(_Requires_lock_held_(_Curr_->tree_lock) _Requires_
     fcb->deleted = true;
 
     acquire_fcb_lock_exclusive(Vcb);
-    InsertHeadList(&parfileref->fcb->list_entry, &fcb->list_entry); // insert in list after parent fcb
+    add_fcb_to_subvol(fcb);
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
-    parfileref->fcb->subvol->fcbs_version++;
     release_fcb_lock(Vcb);
 
     mark_fcb_dirty(fcb);
@@ -4109,13 +3977,181 @@ end:
     return Status;
 }
 
+#define INODE_REF_CACHE_BUCKETS 1024
+#define INODE_REF_CACHE_MAX 4096
+
+typedef struct {
+    uint64_t subvol;
+    uint64_t inode;
+    uint64_t parent;
+    LIST_ENTRY list_entry_hash;
+    LIST_ENTRY list_entry_lru;
+    USHORT name_len;
+    WCHAR name[1];
+} inode_ref_cache_entry;
+
+NTSTATUS init_inode_ref_cache(_In_ device_extension* Vcb) {
+    inode_ref_cache_info* irc = &Vcb->inode_ref_cache;
+
+    irc->buckets = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY) * INODE_REF_CACHE_BUCKETS, ALLOC_TAG);
+    if (!irc->buckets) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (ULONG i = 0; i < INODE_REF_CACHE_BUCKETS; i++) {
+        InitializeListHead(&irc->buckets[i]);
+    }
+
+    ExInitializeFastMutex(&irc->mutex);
+    InitializeListHead(&irc->lru);
+    irc->num_entries = 0;
+    irc->hits = 0;
+    irc->misses = 0;
+
+    return STATUS_SUCCESS;
+}
+
+void free_inode_ref_cache(_In_ device_extension* Vcb) {
+    inode_ref_cache_info* irc = &Vcb->inode_ref_cache;
+
+    if (!irc->buckets)
+        return;
+
+    while (!IsListEmpty(&irc->lru)) {
+        inode_ref_cache_entry* ent = CONTAINING_RECORD(RemoveHeadList(&irc->lru), inode_ref_cache_entry, list_entry_lru);
+
+        ExFreePool(ent);
+    }
+
+    ExFreePool(irc->buckets);
+    irc->buckets = NULL;
+}
+
+static __inline LIST_ENTRY* inode_ref_cache_bucket(inode_ref_cache_info* irc, uint64_t subvol, uint64_t inode) {
+    return &irc->buckets[(inode ^ (subvol << 10)) & (INODE_REF_CACHE_BUCKETS - 1)];
+}
+
+static inode_ref_cache_entry* find_inode_ref_cache_entry(inode_ref_cache_info* irc, uint64_t subvol, uint64_t inode) {
+    LIST_ENTRY* bucket = inode_ref_cache_bucket(irc, subvol, inode);
+    LIST_ENTRY* le = bucket->Flink;
+
+    while (le != bucket) {
+        inode_ref_cache_entry* ent = CONTAINING_RECORD(le, inode_ref_cache_entry, list_entry_hash);
+
+        if (ent->inode == inode && ent->subvol == subvol)
+            return ent;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
+// On success, name is a copy which the caller has to free.
+static bool get_cached_inode_ref(device_extension* Vcb, uint64_t subvol, uint64_t inode, uint64_t* parent, PUNICODE_STRING name) {
+    inode_ref_cache_info* irc = &Vcb->inode_ref_cache;
+    inode_ref_cache_entry* ent;
+    bool ret = false;
+
+    ExAcquireFastMutex(&irc->mutex);
+
+    ent = find_inode_ref_cache_entry(irc, subvol, inode);
+
+    if (ent) {
+        name->Buffer = ExAllocatePoolWithTag(PagedPool, ent->name_len, ALLOC_TAG);
+
+        if (name->Buffer) {
+            RtlCopyMemory(name->Buffer, ent->name, ent->name_len);
+            name->Length = name->MaximumLength = ent->name_len;
+            *parent = ent->parent;
+
+            RemoveEntryList(&ent->list_entry_lru);
+            InsertTailList(&irc->lru, &ent->list_entry_lru);
+
+            ret = true;
+        }
+    }
+
+    if (ret)
+        irc->hits++;
+    else
+        irc->misses++;
+
+    ExReleaseFastMutex(&irc->mutex);
+
+    return ret;
+}
+
+static void add_cached_inode_ref(device_extension* Vcb, uint64_t subvol, uint64_t inode, uint64_t parent, PUNICODE_STRING name) {
+    inode_ref_cache_info* irc = &Vcb->inode_ref_cache;
+    inode_ref_cache_entry* ent;
+
+    if (name->Length == 0)
+        return;
+
+    ent = ExAllocatePoolWithTag(PagedPool, offsetof(inode_ref_cache_entry, name[0]) + name->Length, ALLOC_TAG);
+    if (!ent) // not an error - we'll just have to search again next time
+        return;
+
+    ent->subvol = subvol;
+    ent->inode = inode;
+    ent->parent = parent;
+    ent->name_len = name->Length;
+    RtlCopyMemory(ent->name, name->Buffer, name->Length);
+
+    ExAcquireFastMutex(&irc->mutex);
+
+    if (find_inode_ref_cache_entry(irc, subvol, inode)) { // another thread beat us to it
+        ExReleaseFastMutex(&irc->mutex);
+        ExFreePool(ent);
+        return;
+    }
+
+    if (irc->num_entries == INODE_REF_CACHE_MAX) {
+        inode_ref_cache_entry* old = CONTAINING_RECORD(RemoveHeadList(&irc->lru), inode_ref_cache_entry, list_entry_lru);
+
+        RemoveEntryList(&old->list_entry_hash);
+        ExFreePool(old);
+        irc->num_entries--;
+    }
+
+    InsertTailList(inode_ref_cache_bucket(irc, subvol, inode), &ent->list_entry_hash);
+    InsertTailList(&irc->lru, &ent->list_entry_lru);
+    irc->num_entries++;
+
+    ExReleaseFastMutex(&irc->mutex);
+}
+
+// Called when inode is renamed or unlinked. Anything we miss gets caught by open_fileref_by_inode
+// checking that the name it's been given still leads to the right inode.
+void forget_inode_ref(_In_ device_extension* Vcb, _In_ uint64_t subvol, _In_ uint64_t inode) {
+    inode_ref_cache_info* irc = &Vcb->inode_ref_cache;
+    inode_ref_cache_entry* ent;
+
+    ExAcquireFastMutex(&irc->mutex);
+
+    ent = find_inode_ref_cache_entry(irc, subvol, inode);
+
+    if (ent) {
+        RemoveEntryList(&ent->list_entry_hash);
+        RemoveEntryList(&ent->list_entry_lru);
+        irc->num_entries--;
+    }
+
+    ExReleaseFastMutex(&irc->mutex);
+
+    if (ent)
+        ExFreePool(ent);
+}
+
 NTSTATUS open_fileref_by_inode(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb,
                                root* subvol, uint64_t inode, file_ref** pfr, PIRP Irp) {
     NTSTATUS Status;
     fcb* fcb;
     uint64_t parent = 0;
     UNICODE_STRING name;
-    bool hl_alloc = false;
+    bool hl_alloc = false, use_cache = true, cached = false;
     file_ref *parfr, *fr;
 
     Status = open_fcb(Vcb, subvol, inode, 0, NULL, true, NULL, &fcb, PagedPool, Irp);
@@ -4164,7 +4200,11 @@ NTSTATUS open_fileref_by_inode(_Requires_exclusive_lock_held_(_Curr_->fcb_lock)
 
         ExReleaseResourceLite(&Vcb->dirty_filerefs_lock);
 
-        {
+retry:
+        if (use_cache && get_cached_inode_ref(Vcb, subvol->id, fcb->inode, &parent, &name)) {
+            hl_alloc = true;
+            cached = true;
+        } else {
             KEY searchkey;
             traverse_ptr tp;
 
@@ -4284,6 +4324,9 @@ NTSTATUS open_fileref_by_inode(_Requires_exclusive_lock_held_(_Curr_->fcb_lock)
                 else
                     break;
             } while (true);
+
+            if (parent != 0 && parent != fcb->inode)
+                add_cached_inode_ref(Vcb, subvol->id, fcb->inode, parent, &name);
         }
 
         if (parent == 0) {
@@ -4333,17 +4376,7 @@ NTSTATUS open_fileref_by_inode(_Requires_exclusive_lock_held_(_Curr_->fcb_lock)
                 return STATUS_INTERNAL_ERROR;
             }
 
-            le = Vcb->roots.Flink;
-            while (le != &Vcb->roots) {
-                root* r2 = CONTAINING_RECORD(le, root, list_entry);
-
-                if (r2->id == tp.item->key.offset) {
-                    r = r2;
-                    break;
-                }
-
-                le = le->Flink;
-            }
+            r = find_root_by_id(Vcb, tp.item->key.offset);
 
             if (!r) {
                 ERR("couldn't find subvol %I64x\n", tp.item->key.offset);
@@ -4411,6 +4444,20 @@ NTSTATUS open_fileref_by_inode(_Requires_exclusive_lock_held_(_Curr_->fcb_lock)
     } else {
         Status = open_fileref_by_inode(Vcb, subvol, parent, &parfr, Irp);
         if (!NT_SUCCESS(Status)) {
+            if (hl_alloc)
+                ExFreePool(name.Buffer);
+
+            if (cached) { // parent from a stale cache entry - do it properly
+                forget_inode_ref(Vcb, subvol->id, fcb->inode);
+
+                parent = 0;
+                hl_alloc = false;
+                use_cache = false;
+                cached = false;
+
+                goto retry;
+            }
+
             ERR("open_fileref_by_inode returned %08lx\n", Status);
             free_fcb(fcb);
             return Status;
@@ -4422,6 +4469,22 @@ NTSTATUS open_fileref_by_inode(_Requires_exclusive_lock_held_(_Curr_->fcb_lock)
     if (hl_alloc)
         ExFreePool(name.Buffer);
 
+    if (cached && (!NT_SUCCESS(Status) || fr->fcb != fcb)) { // stale cache entry - do it properly
+        if (NT_SUCCESS(Status))
+            free_fileref(fr);
+
+        free_fileref(parfr);
+
+        forget_inode_ref(Vcb, subvol->id, fcb->inode);
+
+        parent = 0;
+        hl_alloc = false;
+        use_cache = false;
+        cached = false;
+
+        goto retry;
+    }
+
     if (!NT_SUCCESS(Status)) {
         ERR("open_fileref_child returned %08lx\n", Status);
 
@@ -4556,19 +4619,8 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
             RtlCopyMemory(&inode, fn.Buffer, sizeof(uint64_t));
             RtlCopyMemory(&subvol_id, (uint8_t*)fn.Buffer + sizeof(uint64_t), sizeof(uint64_t));
 
-            if (subvol_id == BTRFS_ROOT_FSTREE || (subvol_id >= 0x100 && subvol_id < 0x8000000000000000)) {
-                LIST_ENTRY* le = Vcb->roots.Flink;
-                while (le != &Vcb->roots) {
-                    root* r = CONTAINING_RECORD(le, root, list_entry);
-
-                    if (r->id == subvol_id) {
-                        subvol = r;
-                        break;
-                    }
-
-                    le = le->Flink;
-                }
-            }
+            if (subvol_id == BTRFS_ROOT_FSTREE || (subvol_id >= 0x100 && subvol_id < 0x8000000000000000))
+                subvol = find_root_by_id(Vcb, subvol_id);
 
             if (!subvol) {
                 WARN("subvol %I64x not found\n", subvol_id);
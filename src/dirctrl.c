@@ -189,21 +189,7 @@ static NTSTATUS query_dir_item(fcb* fcb, ccb* ccb, void* buf, LONG* len, PIRP Ir
     IrpSp = IoGetCurrentIrpStackLocation(Irp);
 
     if (de->key.obj_type == TYPE_ROOT_ITEM) { // subvol
-        LIST_ENTRY* le;
-
-        r = NULL;
-
-        le = fcb->Vcb->roots.Flink;
-        while (le != &fcb->Vcb->roots) {
-            root* subvol = CONTAINING_RECORD(le, root, list_entry);
-
-            if (subvol->id == de->key.obj_id) {
-                r = subvol;
-                break;
-            }
-
-            le = le->Flink;
-        }
+        r = find_root_by_id(fcb->Vcb, de->key.obj_id);
 
         if (r && r->parent != fcb->subvol->id && (!de->dc || !de->dc->root_dir))
             r = NULL;
@@ -905,22 +891,13 @@ static NTSTATUS query_directory(PIRP Irp) {
 
     if (specific_file) {
         bool found = false;
-        UNICODE_STRING us;
         LIST_ENTRY* le;
         uint32_t hash;
         uint8_t c;
 
-        us.Buffer = NULL;
-
-        if (!ccb->case_sensitive) {
-            Status = RtlUpcaseUnicodeString(&us, &ccb->query_string, true);
-            if (!NT_SUCCESS(Status)) {
-                ERR("RtlUpcaseUnicodeString returned %08lx\n", Status);
-                goto end;
-            }
-
-            hash = calc_crc32c(0xffffffff, (uint8_t*)us.Buffer, us.Length);
-        } else
+        if (!ccb->case_sensitive)
+            hash = calc_name_hash_uc(&ccb->query_string);
+        else
             hash = calc_crc32c(0xffffffff, (uint8_t*)ccb->query_string.Buffer, ccb->query_string.Length);
 
         c = hash >> 24;
@@ -956,7 +933,7 @@ static NTSTATUS query_directory(PIRP Irp) {
                     dir_child* dc2 = CONTAINING_RECORD(le, dir_child, list_entry_hash_uc);
 
                     if (dc2->hash_uc == hash) {
-                        if (dc2->name_uc.Length == us.Length && RtlCompareMemory(dc2->name_uc.Buffer, us.Buffer, us.Length) == us.Length) {
+                        if (name_equal_uc(&dc2->name_uc, &ccb->query_string)) {
                             found = true;
 
                             de.key = dc2->key;
@@ -975,9 +952,6 @@ static NTSTATUS query_directory(PIRP Irp) {
             }
         }
 
-        if (us.Buffer)
-            ExFreePool(us.Buffer);
-
         if (!found) {
             Status = STATUS_NO_SUCH_FILE;
             goto end;
@@ -2116,6 +2116,75 @@ void add_changed_extent_ref(chunk* c, uint64_t address, uint64_t size, uint64_t
     ce->count += count;
 }
 
+static changed_extent* find_new_changed_extent(chunk* c, uint64_t address, uint64_t size, uint64_t root, uint64_t objid, uint64_t offset) {
+    LIST_ENTRY* le;
+
+    le = c->changed_extents.Flink;
+    while (le != &c->changed_extents) {
+        changed_extent* ce = CONTAINING_RECORD(le, changed_extent, list_entry);
+
+        if (ce->address == address && ce->size == size) {
+            changed_extent_ref* cer;
+
+            // only extents created in this transaction and referenced by just the one EXTENT_DATA
+
+            if (ce->old_count != 0 || ce->count != 1 || ce->superseded || !IsListEmpty(&ce->old_refs))
+                return NULL;
+
+            if (ce->refs.Flink == &ce->refs || ce->refs.Flink->Flink != &ce->refs)
+                return NULL;
+
+            cer = CONTAINING_RECORD(ce->refs.Flink, changed_extent_ref, list_entry);
+
+            if (cer->type != TYPE_EXTENT_DATA_REF || cer->edr.root != root || cer->edr.objid != objid || cer->edr.offset != offset || cer->edr.count != 1)
+                return NULL;
+
+            return ce;
+        }
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
+bool merge_changed_extents(chunk* c, uint64_t address, uint64_t size, uint64_t address2, uint64_t size2, uint64_t root, uint64_t objid,
+                           uint64_t offset, uint64_t offset2) {
+    changed_extent *ce, *ce2;
+    bool ret = false;
+
+    if (address2 != address + size)
+        return false;
+
+    ExAcquireResourceExclusiveLite(&c->changed_extents_lock, true);
+
+    ce = find_new_changed_extent(c, address, size, root, objid, offset);
+    if (!ce)
+        goto end;
+
+    ce2 = find_new_changed_extent(c, address2, size2, root, objid, offset2);
+    if (!ce2 || ce2->no_csum != ce->no_csum)
+        goto end;
+
+    ce->size += size2;
+    ce->old_size = ce->size;
+
+    while (!IsListEmpty(&ce2->refs)) {
+        changed_extent_ref* cer = CONTAINING_RECORD(RemoveHeadList(&ce2->refs), changed_extent_ref, list_entry);
+        ExFreePool(cer);
+    }
+
+    RemoveEntryList(&ce2->list_entry);
+    ExFreePool(ce2);
+
+    ret = true;
+
+end:
+    ExReleaseResourceLite(&c->changed_extents_lock);
+
+    return ret;
+}
+
 uint64_t find_extent_shared_tree_refcount(device_extension* Vcb, uint64_t address, uint64_t parent, PIRP Irp) {
     NTSTATUS Status;
     KEY searchkey;
@@ -835,7 +835,6 @@ static NTSTATUS create_directory_fcb(device_extension* Vcb, root* r, fcb* parfcb
     acquire_fcb_lock_exclusive(Vcb);
     add_fcb_to_subvol(fcb);
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
-    r->fcbs_version++;
     release_fcb_lock(Vcb);
 
     mark_fcb_dirty(fcb);
@@ -845,66 +844,106 @@ static NTSTATUS create_directory_fcb(device_extension* Vcb, root* r, fcb* parfcb
     return STATUS_SUCCESS;
 }
 
-void add_fcb_to_subvol(_In_ _Requires_exclusive_lock_held_(_Curr_->Vcb->fcb_lock) fcb* fcb) {
-    LIST_ENTRY* lastle = NULL;
-    uint32_t hash = fcb->hash;
-
-    if (fcb->subvol->fcbs_ptrs[hash >> 24]) {
-        LIST_ENTRY* le = fcb->subvol->fcbs_ptrs[hash >> 24];
-
-        while (le != &fcb->subvol->fcbs) {
-            struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry);
+#define FCB_HASH_INITIAL_SIZE 256
 
-            if (fcb2->hash > hash) {
-                lastle = le->Blink;
-                break;
-            }
+NTSTATUS init_fcb_hash(root* r) {
+    r->fcbs_hash = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY) * FCB_HASH_INITIAL_SIZE, ALLOC_TAG);
+    if (!r->fcbs_hash) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-            le = le->Flink;
-        }
+    for (ULONG i = 0; i < FCB_HASH_INITIAL_SIZE; i++) {
+        InitializeListHead(&r->fcbs_hash[i]);
     }
 
-    if (!lastle) {
-        uint8_t c = hash >> 24;
+    r->fcbs_hash_size = FCB_HASH_INITIAL_SIZE;
+    r->num_fcbs = 0;
+
+    return STATUS_SUCCESS;
+}
 
-        if (c != 0xff) {
-            uint8_t d = c + 1;
+// Doubles the number of buckets once there's an average of two FCBs in each, rehashing everything on
+// r->fcbs. Returns false if we couldn't get the memory, in which case the old buckets are left alone.
+static bool grow_fcb_hash(_Requires_exclusive_lock_held_(_Curr_->Vcb->fcb_lock) root* r) {
+    LIST_ENTRY* buckets;
+    ULONG size = r->fcbs_hash_size * 2;
+    LIST_ENTRY* le;
 
-            do {
-                if (fcb->subvol->fcbs_ptrs[d]) {
-                    lastle = fcb->subvol->fcbs_ptrs[d]->Blink;
-                    break;
-                }
+    buckets = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY) * size, ALLOC_TAG);
+    if (!buckets)
+        return false;
 
-                d++;
-            } while (d != 0);
-        }
+    for (ULONG i = 0; i < size; i++) {
+        InitializeListHead(&buckets[i]);
     }
 
-    if (lastle) {
-        InsertHeadList(lastle, &fcb->list_entry);
+    le = r->fcbs.Flink;
+    while (le != &r->fcbs) {
+        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry);
 
-        if (lastle == &fcb->subvol->fcbs || (CONTAINING_RECORD(lastle, struct _fcb, list_entry)->hash >> 24) != (hash >> 24))
-            fcb->subvol->fcbs_ptrs[hash >> 24] = &fcb->list_entry;
-    } else {
-        InsertTailList(&fcb->subvol->fcbs, &fcb->list_entry);
+        InsertTailList(&buckets[fcb->hash & (size - 1)], &fcb->list_entry_hash);
 
-        if (fcb->list_entry.Blink == &fcb->subvol->fcbs || (CONTAINING_RECORD(fcb->list_entry.Blink, struct _fcb, list_entry)->hash >> 24) != (hash >> 24))
-            fcb->subvol->fcbs_ptrs[hash >> 24] = &fcb->list_entry;
+        le = le->Flink;
     }
+
+    ExFreePool(r->fcbs_hash);
+
+    r->fcbs_hash = buckets;
+    r->fcbs_hash_size = size;
+
+    return true;
+}
+
+void add_fcb_to_subvol(_In_ _Requires_exclusive_lock_held_(_Curr_->Vcb->fcb_lock) fcb* fcb) {
+    root* r = fcb->subvol;
+
+    InsertTailList(&r->fcbs, &fcb->list_entry);
+    r->num_fcbs++;
+
+    // If we can't grow the table, the FCB still has to go in a bucket - the chains just get longer.
+    if (r->num_fcbs <= r->fcbs_hash_size * 2 || !grow_fcb_hash(r))
+        InsertTailList(fcb_hash_bucket(r, fcb->hash), &fcb->list_entry_hash);
 }
 
 void remove_fcb_from_subvol(_In_ _Requires_exclusive_lock_held_(_Curr_->Vcb->fcb_lock) fcb* fcb) {
-    uint8_t c = fcb->hash >> 24;
+    RemoveEntryList(&fcb->list_entry);
+    RemoveEntryList(&fcb->list_entry_hash);
+    fcb->subvol->num_fcbs--;
+}
 
-    if (fcb->subvol->fcbs_ptrs[c] == &fcb->list_entry) {
-        if (fcb->list_entry.Flink != &fcb->subvol->fcbs && (CONTAINING_RECORD(fcb->list_entry.Flink, struct _fcb, list_entry)->hash >> 24) == c)
-            fcb->subvol->fcbs_ptrs[c] = fcb->list_entry.Flink;
-        else
-            fcb->subvol->fcbs_ptrs[c] = NULL;
+// Returns the FCB for the main stream of inode, preferring one that hasn't been deleted. The caller
+// needs to hold fcb_lock, and to take its own reference.
+fcb* find_fcb_in_subvol(_In_ _Requires_lock_held_(_Curr_->Vcb->fcb_lock) root* r, _In_ uint64_t inode, _In_ uint32_t hash) {
+    LIST_ENTRY* bucket = fcb_hash_bucket(r, hash);
+    LIST_ENTRY* le = bucket->Flink;
+    fcb* deleted_fcb = NULL;
+
+    while (le != bucket) {
+        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_hash);
+
+        if (fcb->inode == inode && !fcb->ads) {
+            if (!fcb->deleted)
+                return fcb;
+
+            deleted_fcb = fcb;
+        }
+
+        le = le->Flink;
     }
 
-    RemoveEntryList(&fcb->list_entry);
+    return deleted_fcb;
+}
+
+// Puts newfcb in the place of oldfcb, which must have the same subvol and inode.
+void replace_fcb_in_subvol(_In_ fcb* oldfcb, _In_ fcb* newfcb) {
+    InsertHeadList(oldfcb->list_entry.Blink, &newfcb->list_entry);
+    InsertHeadList(oldfcb->list_entry_hash.Blink, &newfcb->list_entry_hash);
+
+    RemoveEntryList(&oldfcb->list_entry);
+    RemoveEntryList(&oldfcb->list_entry_hash);
+
+    oldfcb->list_entry.Flink = oldfcb->list_entry.Blink = NULL;
 }
 
 static NTSTATUS move_across_subvols(file_ref* fileref, ccb* ccb, file_ref* destdir, PANSI_STRING utf8, PUNICODE_STRING fnus, PIRP Irp, LIST_ENTRY* rollback) {
@@ -1067,16 +1106,16 @@ static NTSTATUS move_across_subvols(file_ref* fileref, ccb* ccb, file_ref* destd
                         le2 = le2->Flink;
                     }
 
-                    add_fcb_to_subvol(me->dummyfcb);
-                    remove_fcb_from_subvol(me->fileref->fcb);
+                    replace_fcb_in_subvol(me->fileref->fcb, me->dummyfcb);
                     add_fcb_to_subvol(me->fileref->fcb);
                 } else {
+                    remove_fcb_from_subvol(me->fileref->fcb);
+
                     me->fileref->fcb->subvol = me->parent->fileref->fcb->subvol;
                     me->fileref->fcb->inode = me->parent->fileref->fcb->inode;
                     me->fileref->fcb->hash = me->parent->fileref->fcb->hash;
 
-                    // put stream after parent in FCB list
-                    InsertHeadList(&me->parent->fileref->fcb->list_entry, &me->fileref->fcb->list_entry);
+                    add_fcb_to_subvol(me->fileref->fcb);
                 }
 
                 me->fileref->fcb->created = true;
@@ -1419,9 +1458,6 @@ end:
         ExFreePool(me);
     }
 
-    destdir->fcb->subvol->fcbs_version++;
-    fileref->fcb->subvol->fcbs_version++;
-
     release_fcb_lock(fileref->fcb->Vcb);
 
     return Status;
@@ -1568,7 +1604,9 @@ static NTSTATUS rename_stream_to_file(device_extension* Vcb, file_ref* fileref,
     fileref->fcb->inode_item = ofr->fcb->inode_item;
 
     fileref->fcb->sd = ofr->fcb->sd;
+    fileref->fcb->sd_entry = ofr->fcb->sd_entry;
     ofr->fcb->sd = NULL;
+    ofr->fcb->sd_entry = NULL;
 
     fileref->fcb->deleted = ofr->fcb->deleted;
     fileref->fcb->atts = ofr->fcb->atts;
@@ -1639,13 +1677,7 @@ static NTSTATUS rename_stream_to_file(device_extension* Vcb, file_ref* fileref,
     fileref->fcb->adsdata.Buffer = NULL;
     fileref->fcb->adsdata.Length = fileref->fcb->adsdata.MaximumLength = 0;
 
-    InsertHeadList(ofr->fcb->list_entry.Blink, &fileref->fcb->list_entry);
-
-    if (fileref->fcb->subvol->fcbs_ptrs[fileref->fcb->hash >> 24] == &ofr->fcb->list_entry)
-        fileref->fcb->subvol->fcbs_ptrs[fileref->fcb->hash >> 24] = &fileref->fcb->list_entry;
-
-    RemoveEntryList(&ofr->fcb->list_entry);
-    ofr->fcb->list_entry.Flink = ofr->fcb->list_entry.Blink = NULL;
+    replace_fcb_in_subvol(ofr->fcb, fileref->fcb);
 
     mark_fcb_dirty(fileref->fcb);
 
@@ -1795,7 +1827,6 @@ static NTSTATUS rename_stream_to_file(device_extension* Vcb, file_ref* fileref,
     acquire_fcb_lock_exclusive(Vcb);
     add_fcb_to_subvol(dummyfcb);
     InsertTailList(&Vcb->all_fcbs, &dummyfcb->list_entry_all);
-    dummyfcb->subvol->fcbs_version++;
     release_fcb_lock(Vcb);
 
     // FIXME - dummyfileref as well?
@@ -2019,7 +2050,6 @@ static NTSTATUS rename_stream(device_extension* Vcb, file_ref* fileref, ccb* ccb
     acquire_fcb_lock_exclusive(Vcb);
     add_fcb_to_subvol(dummyfcb);
     InsertTailList(&Vcb->all_fcbs, &dummyfcb->list_entry_all);
-    dummyfcb->subvol->fcbs_version++;
     release_fcb_lock(Vcb);
 
     mark_fcb_dirty(dummyfcb);
@@ -2394,13 +2424,7 @@ static NTSTATUS rename_file_to_stream(device_extension* Vcb, file_ref* fileref,
 
     InsertTailList(&Vcb->all_fcbs, &dummyfcb->list_entry_all);
 
-    InsertHeadList(fileref->fcb->list_entry.Blink, &dummyfcb->list_entry);
-
-    if (fileref->fcb->subvol->fcbs_ptrs[dummyfcb->hash >> 24] == &fileref->fcb->list_entry)
-        fileref->fcb->subvol->fcbs_ptrs[dummyfcb->hash >> 24] = &dummyfcb->list_entry;
-
-    RemoveEntryList(&fileref->fcb->list_entry);
-    fileref->fcb->list_entry.Flink = fileref->fcb->list_entry.Blink = NULL;
+    replace_fcb_in_subvol(fileref->fcb, dummyfcb);
 
     mark_fcb_dirty(dummyfcb);
 
@@ -2480,6 +2504,36 @@ end:
     return Status;
 }
 
+// Makes fileref's cached path stale, and so those of everything below it.
+void invalidate_cached_path(file_ref* fileref) {
+    device_extension* Vcb = fileref->fcb->Vcb;
+
+    ExAcquireFastMutex(&Vcb->path_cache_mutex);
+    fileref->name_generation++;
+    ExReleaseFastMutex(&Vcb->path_cache_mutex);
+}
+
+// While a rename is in progress names and parents are changing underneath us, so
+// nothing gets cached until it's finished. Only the renamed fileref's path becomes
+// stale once it is - children of filerefs that were replaced along the way won't
+// match their new parent's path.
+
+static void suspend_path_cache(device_extension* Vcb) {
+    ExAcquireFastMutex(&Vcb->path_cache_mutex);
+    Vcb->path_cache_suspended++;
+    ExReleaseFastMutex(&Vcb->path_cache_mutex);
+}
+
+static void resume_path_cache(device_extension* Vcb, file_ref* fileref) {
+    ExAcquireFastMutex(&Vcb->path_cache_mutex);
+
+    if (fileref)
+        fileref->name_generation++;
+
+    Vcb->path_cache_suspended--;
+    ExReleaseFastMutex(&Vcb->path_cache_mutex);
+}
+
 static NTSTATUS set_rename_information(device_extension* Vcb, PIRP Irp, PFILE_OBJECT FileObject, PFILE_OBJECT tfo, bool ex) {
     FILE_RENAME_INFORMATION_EX* fri = Irp->AssociatedIrp.SystemBuffer;
     fcb* fcb = FileObject->FsContext;
@@ -2541,6 +2595,8 @@ static NTSTATUS set_rename_information(device_extension* Vcb, PIRP Irp, PFILE_OB
     ExAcquireResourceExclusiveLite(&Vcb->fileref_lock, true);
     ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
 
+    suspend_path_cache(Vcb);
+
     if (fcb->inode == SUBVOL_ROOT_INODE && fcb->subvol->id == BTRFS_ROOT_FSTREE) {
         WARN("not allowing \\$Root to be renamed\n");
         Status = STATUS_ACCESS_DENIED;
@@ -2577,6 +2633,8 @@ static NTSTATUS set_rename_information(device_extension* Vcb, PIRP Irp, PFILE_OB
         goto end;
     }
 
+    forget_inode_ref(Vcb, fcb->subvol->id, fcb->inode);
+
     fnus.Buffer = fn;
     fnus.Length = fnus.MaximumLength = (uint16_t)(fnlen * sizeof(WCHAR));
 
@@ -3116,6 +3174,8 @@ end:
     else
         do_rollback(Vcb, &rollback);
 
+    resume_path_cache(Vcb, fileref);
+
     ExReleaseResourceLite(fcb->Header.Resource);
     ExReleaseResourceLite(&Vcb->fileref_lock);
     ExReleaseResourceLite(&Vcb->tree_lock);
@@ -4181,7 +4241,7 @@ static NTSTATUS fill_in_file_position_information(FILE_POSITION_INFORMATION* fpi
     return STATUS_SUCCESS;
 }
 
-NTSTATUS fileref_get_filename(file_ref* fileref, PUNICODE_STRING fn, USHORT* name_offset, ULONG* preqlen) {
+static NTSTATUS build_fileref_filename(file_ref* fileref, PUNICODE_STRING fn, USHORT* name_offset, ULONG* preqlen) {
     file_ref* fr;
     NTSTATUS Status;
     ULONG reqlen = 0;
@@ -4190,24 +4250,6 @@ NTSTATUS fileref_get_filename(file_ref* fileref, PUNICODE_STRING fn, USHORT* nam
 
     // FIXME - we need a lock on filerefs' filepart
 
-    if (fileref == fileref->fcb->Vcb->root_fileref) {
-        if (fn->MaximumLength >= sizeof(WCHAR)) {
-            fn->Buffer[0] = '\\';
-            fn->Length = sizeof(WCHAR);
-
-            if (name_offset)
-                *name_offset = 0;
-
-            return STATUS_SUCCESS;
-        } else {
-            if (preqlen)
-                *preqlen = sizeof(WCHAR);
-            fn->Length = 0;
-
-            return STATUS_BUFFER_OVERFLOW;
-        }
-    }
-
     fr = fileref;
     offset = 0;
 
@@ -4262,12 +4304,174 @@ NTSTATUS fileref_get_filename(file_ref* fileref, PUNICODE_STRING fn, USHORT* nam
         if (name_offset)
             *name_offset = offset;
 
+        if (preqlen)
+            *preqlen = reqlen;
+
         Status = STATUS_SUCCESS;
     }
 
     return Status;
 }
 
+// Called with path_cache_mutex held.
+void release_cached_path(cached_path* cp) {
+    while (cp && --cp->refcount == 0) {
+        cached_path* prefix = cp->prefix;
+
+        ExFreePool(cp);
+
+        cp = prefix;
+    }
+}
+
+// A fileref's path is still good if its name hasn't changed since it was built, and it was built
+// from what's now its parent's path.
+static __inline bool path_link_current(file_ref* fr) {
+    cached_path* prefix = fr->parent->parent ? fr->parent->path : NULL;
+
+    return fr->path && fr->path->generation == fr->name_generation && fr->path->prefix == prefix;
+}
+
+// Returns the highest fileref between fileref and the root whose path needs building, or NULL if
+// they're all current.
+static file_ref* first_stale_path(file_ref* fileref) {
+    file_ref* fr = fileref;
+    file_ref* stale = NULL;
+
+    while (fr->parent) {
+        if (!path_link_current(fr))
+            stale = fr;
+
+        fr = fr->parent;
+    }
+
+    return stale;
+}
+
+// Builds fr's path on top of its parent's, which must either be current or be the root.
+static bool build_cached_path(file_ref* fr) {
+    cached_path* prefix = fr->parent->parent ? fr->parent->path : NULL;
+    cached_path* cp;
+    ULONG len;
+
+    if (!fr->dc)
+        return false;
+
+    len = (prefix ? prefix->length : 0) + sizeof(WCHAR) + fr->dc->name.Length;
+
+    if (len > 0xffff)
+        return false;
+
+    cp = ExAllocatePoolWithTag(PagedPool, offsetof(cached_path, name[0]) + sizeof(WCHAR) + fr->dc->name.Length, ALLOC_TAG);
+    if (!cp) {
+        ERR("out of memory\n");
+        return false;
+    }
+
+    cp->prefix = prefix;
+    cp->refcount = 1;
+    cp->generation = fr->name_generation;
+    cp->length = (USHORT)len;
+    cp->name_length = sizeof(WCHAR) + fr->dc->name.Length;
+
+    cp->name[0] = fr->fcb->ads ? ':' : '\\';
+    RtlCopyMemory(&cp->name[1], fr->dc->name.Buffer, fr->dc->name.Length);
+
+    if (prefix)
+        prefix->refcount++;
+
+    if (fr->path)
+        release_cached_path(fr->path);
+
+    fr->path = cp;
+
+    return true;
+}
+
+// Called with path_cache_mutex held. Ancestors get their paths cached on the way
+// down, so that siblings only have to add their own names.
+static cached_path* get_cached_path(file_ref* fileref) {
+    file_ref* fr;
+
+    if (!fileref->parent)
+        return NULL;
+
+    while ((fr = first_stale_path(fileref))) {
+        if (!build_cached_path(fr))
+            return NULL;
+    }
+
+    return fileref->path;
+}
+
+// Each entry only holds its own name, so we fill in the components back to front. If the buffer's
+// too short, we give as much of the start of the path as will fit.
+static void copy_cached_path(cached_path* cp, PUNICODE_STRING fn) {
+    while (cp) {
+        USHORT off = cp->length - cp->name_length;
+
+        if (off < fn->MaximumLength)
+            RtlCopyMemory((uint8_t*)fn->Buffer + off, cp->name, min(cp->name_length, fn->MaximumLength - off));
+
+        cp = cp->prefix;
+    }
+}
+
+NTSTATUS fileref_get_filename(file_ref* fileref, PUNICODE_STRING fn, USHORT* name_offset, ULONG* preqlen) {
+    device_extension* Vcb = fileref->fcb->Vcb;
+    cached_path* cp;
+    NTSTATUS Status;
+
+    if (fileref == Vcb->root_fileref) {
+        if (fn->MaximumLength >= sizeof(WCHAR)) {
+            fn->Buffer[0] = '\\';
+            fn->Length = sizeof(WCHAR);
+
+            if (name_offset)
+                *name_offset = 0;
+
+            return STATUS_SUCCESS;
+        } else {
+            if (preqlen)
+                *preqlen = sizeof(WCHAR);
+            fn->Length = 0;
+
+            return STATUS_BUFFER_OVERFLOW;
+        }
+    }
+
+    ExAcquireFastMutex(&Vcb->path_cache_mutex);
+
+    cp = Vcb->path_cache_suspended == 0 ? get_cached_path(fileref) : NULL;
+
+    if (!cp) {
+        ExReleaseFastMutex(&Vcb->path_cache_mutex);
+        return build_fileref_filename(fileref, fn, name_offset, preqlen);
+    }
+
+    copy_cached_path(cp, fn);
+
+    if (cp->length > fn->MaximumLength) {
+        fn->Length = fn->MaximumLength;
+
+        Status = STATUS_BUFFER_OVERFLOW;
+    } else {
+        fn->Length = cp->length;
+
+        if (name_offset)
+            *name_offset = cp->length - cp->name_length + sizeof(WCHAR);
+
+        Status = STATUS_SUCCESS;
+    }
+
+    if (preqlen)
+        *preqlen = cp->length;
+
+    ExReleaseFastMutex(&Vcb->path_cache_mutex);
+
+    return Status;
+}
+
 static NTSTATUS fill_in_file_name_information(FILE_NAME_INFORMATION* fni, fcb* fcb, file_ref* fileref, LONG* length) {
     ULONG reqlen;
     UNICODE_STRING fn;
@@ -871,7 +871,7 @@ static bool insert_tree_extent(device_extension* Vcb, uint8_t level, uint64_t ro
 
 NTSTATUS get_tree_new_address(device_extension* Vcb, tree* t, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
-    chunk *origchunk = NULL, *c;
+    chunk *origchunk = NULL, *lastchunk = NULL, *c;
     LIST_ENTRY* le;
     uint64_t flags, addr;
 
@@ -887,6 +887,21 @@ NTSTATUS get_tree_new_address(device_extension* Vcb, tree* t, PIRP Irp, LIST_ENT
             insert_tree_extent(Vcb, t->header.level, t->root->id, origchunk, &addr, Irp, rollback)) {
             t->new_address = addr;
             t->has_new_address = true;
+            Vcb->last_tree_alloc = addr;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    // Failing that, try to put the tree straight after the last one we allocated in this
+    // transaction, so that new trees end up together rather than wherever there's a gap.
+    if (Vcb->last_tree_alloc != 0) {
+        lastchunk = get_chunk_from_address(Vcb, Vcb->last_tree_alloc);
+
+        if (lastchunk && lastchunk != origchunk && !lastchunk->readonly && !lastchunk->reloc && lastchunk->chunk_item->type == flags &&
+            insert_tree_extent(Vcb, t->header.level, t->root->id, lastchunk, &addr, Irp, rollback)) {
+            t->new_address = addr;
+            t->has_new_address = true;
+            Vcb->last_tree_alloc = addr;
             return STATUS_SUCCESS;
         }
     }
@@ -900,12 +915,13 @@ NTSTATUS get_tree_new_address(device_extension* Vcb, tree* t, PIRP Irp, LIST_ENT
         if (!c->readonly && !c->reloc) {
             acquire_chunk_lock(c, Vcb);
 
-            if (c != origchunk && c->chunk_item->type == flags && (c->chunk_item->size - c->used) >= Vcb->superblock.node_size) {
+            if (c != origchunk && c != lastchunk && c->chunk_item->type == flags && (c->chunk_item->size - c->used) >= Vcb->superblock.node_size) {
                 if (insert_tree_extent(Vcb, t->header.level, t->root->id, c, &addr, Irp, rollback)) {
                     release_chunk_lock(c, Vcb);
                     ExReleaseResourceLite(&Vcb->chunk_lock);
                     t->new_address = addr;
                     t->has_new_address = true;
+                    Vcb->last_tree_alloc = addr;
                     return STATUS_SUCCESS;
                 }
             }
@@ -934,6 +950,7 @@ NTSTATUS get_tree_new_address(device_extension* Vcb, tree* t, PIRP Irp, LIST_ENT
             ExReleaseResourceLite(&Vcb->chunk_lock);
             t->new_address = addr;
             t->has_new_address = true;
+            Vcb->last_tree_alloc = addr;
             return STATUS_SUCCESS;
         }
     }
@@ -1699,6 +1716,7 @@ NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, bool no_
         wtc[bit_num].stripes_left = 0;
         wtc[bit_num].parity1 = wtc[bit_num].parity2 = wtc[bit_num].scratch = NULL;
         wtc[bit_num].mdl = wtc[bit_num].parity1_mdl = wtc[bit_num].parity2_mdl = NULL;
+        wtc[bit_num].callback = NULL;
 
         Status = write_data(Vcb, tw->address, tw->data, tw->length, &wtc[bit_num], NULL, NULL, false, 0, HighPagePriority);
         if (!NT_SUCCESS(Status)) {
@@ -1817,13 +1835,111 @@ void calc_tree_checksum(device_extension* Vcb, tree_header* th) {
     }
 }
 
+void serialize_tree(device_extension* Vcb, tree* t, uint8_t* data) {
+    uint8_t* body = data + sizeof(tree_header);
+    LIST_ENTRY* le;
+
+    RtlCopyMemory(data, &t->header, sizeof(tree_header));
+    RtlZeroMemory(body, Vcb->superblock.node_size - sizeof(tree_header));
+
+    if (t->header.level == 0) {
+        leaf_node* itemptr = (leaf_node*)body;
+        int i = 0;
+        uint8_t* dataptr = data + Vcb->superblock.node_size;
+
+        le = t->itemlist.Flink;
+        while (le != &t->itemlist) {
+            tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
+            if (!td->ignore) {
+                dataptr = dataptr - td->size;
+
+                itemptr[i].key = td->key;
+                itemptr[i].offset = (uint32_t)((uint8_t*)dataptr - (uint8_t*)body);
+                itemptr[i].size = td->size;
+                i++;
+
+                if (td->size > 0)
+                    RtlCopyMemory(dataptr, td->data, td->size);
+            }
+
+            le = le->Flink;
+        }
+    } else {
+        internal_node* itemptr = (internal_node*)body;
+        int i = 0;
+
+        le = t->itemlist.Flink;
+        while (le != &t->itemlist) {
+            tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
+            if (!td->ignore) {
+                itemptr[i].key = td->key;
+                itemptr[i].address = td->treeholder.address;
+                itemptr[i].generation = td->treeholder.generation;
+                i++;
+            }
+
+            le = le->Flink;
+        }
+    }
+
+    calc_tree_checksum(Vcb, (tree_header*)data);
+}
+
+static void sort_trees_by_address(tree** trees, ULONG num_trees) {
+    ULONG start, end, root, child;
+    tree* t;
+
+    // heapsort - there can be tens of thousands of dirty trees, so an
+    // insertion sort isn't good enough here
+
+    if (num_trees < 2)
+        return;
+
+    start = num_trees / 2;
+    end = num_trees;
+
+    while (end > 1) {
+        if (start > 0)
+            start--;
+        else {
+            end--;
+
+            t = trees[end];
+            trees[end] = trees[0];
+            trees[0] = t;
+        }
+
+        root = start;
+
+        while ((child = (2 * root) + 1) < end) {
+            if (child + 1 < end && trees[child + 1]->new_address > trees[child]->new_address)
+                child++;
+
+            if (trees[root]->new_address >= trees[child]->new_address)
+                break;
+
+            t = trees[root];
+            trees[root] = trees[child];
+            trees[child] = t;
+
+            root = child;
+        }
+    }
+}
+
 static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
     ULONG level;
-    uint8_t *data, *body;
+    uint8_t* data;
     NTSTATUS Status;
     LIST_ENTRY* le;
     LIST_ENTRY tree_writes;
     tree_write* tw;
+    ULONG i, num_trees = 0, max_trees = 0;
+    tree** trees = NULL;
+    uint8_t** bufs = NULL;
+#ifdef DEBUG_FLUSH_TIMES
+    LARGE_INTEGER freq, time1, time2;
+#endif
 
     TRACE("(%p)\n", Vcb);
 
@@ -1906,8 +2022,38 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
     le = Vcb->trees.Flink;
     while (le != &Vcb->trees) {
         tree* t = CONTAINING_RECORD(le, tree, list_entry);
-        LIST_ENTRY* le2;
+
+        if (t->write)
+            max_trees++;
+
+        le = le->Flink;
+    }
+
+    if (max_trees == 0)
+        return STATUS_SUCCESS;
+
+    trees = ExAllocatePoolWithTag(PagedPool, sizeof(tree*) * max_trees, ALLOC_TAG);
+    if (!trees) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    bufs = ExAllocatePoolWithTag(PagedPool, sizeof(uint8_t*) * max_trees, ALLOC_TAG);
+    if (!bufs) {
+        ERR("out of memory\n");
+        ExFreePool(trees);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+#ifdef DEBUG_FLUSH_TIMES
+    time1 = KeQueryPerformanceCounter(&freq);
+#endif
+
+    le = Vcb->trees.Flink;
+    while (le != &Vcb->trees) {
+        tree* t = CONTAINING_RECORD(le, tree, list_entry);
 #ifdef DEBUG_PARANOID
+        LIST_ENTRY* le2;
         uint32_t num_items = 0, size = 0;
         bool crash = false;
 #endif
@@ -1987,98 +2133,72 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
             t->header.fs_uuid = Vcb->superblock.metadata_uuid;
             t->has_address = true;
 
-            data = ExAllocatePoolWithTag(NonPagedPool, Vcb->superblock.node_size, ALLOC_TAG);
-            if (!data) {
-                ERR("out of memory\n");
-                Status = STATUS_INSUFFICIENT_RESOURCES;
-                goto end;
-            }
-
-            body = data + sizeof(tree_header);
-
-            RtlCopyMemory(data, &t->header, sizeof(tree_header));
-            RtlZeroMemory(body, Vcb->superblock.node_size - sizeof(tree_header));
-
-            if (t->header.level == 0) {
-                leaf_node* itemptr = (leaf_node*)body;
-                int i = 0;
-                uint8_t* dataptr = data + Vcb->superblock.node_size;
-
-                le2 = t->itemlist.Flink;
-                while (le2 != &t->itemlist) {
-                    tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                    if (!td->ignore) {
-                        dataptr = dataptr - td->size;
+            trees[num_trees] = t;
+            num_trees++;
+        }
 
-                        itemptr[i].key = td->key;
-                        itemptr[i].offset = (uint32_t)((uint8_t*)dataptr - (uint8_t*)body);
-                        itemptr[i].size = td->size;
-                        i++;
+        le = le->Flink;
+    }
 
-                        if (td->size > 0)
-                            RtlCopyMemory(dataptr, td->data, td->size);
-                    }
+    sort_trees_by_address(trees, num_trees);
 
-                    le2 = le2->Flink;
-                }
-            } else {
-                internal_node* itemptr = (internal_node*)body;
-                int i = 0;
+    // Trees next to each other on disk get serialized straight into a shared
+    // buffer, so that we can write them in one go without copying them again.
 
-                le2 = t->itemlist.Flink;
-                while (le2 != &t->itemlist) {
-                    tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                    if (!td->ignore) {
-                        itemptr[i].key = td->key;
-                        itemptr[i].address = td->treeholder.address;
-                        itemptr[i].generation = td->treeholder.generation;
-                        i++;
-                    }
+    i = 0;
+    while (i < num_trees) {
+        ULONG j = i + 1;
+        chunk* c = get_chunk_from_address(Vcb, trees[i]->new_address);
 
-                    le2 = le2->Flink;
-                }
-            }
+        if (!c) {
+            ERR("could not find chunk for address %I64x\n", trees[i]->new_address);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
 
-            calc_tree_checksum(Vcb, (tree_header*)data);
+        while (j < num_trees && trees[j]->new_address == trees[j - 1]->new_address + Vcb->superblock.node_size &&
+               trees[j]->new_address < c->offset + c->chunk_item->size) {
+            j++;
+        }
 
-            tw = ExAllocatePoolWithTag(PagedPool, sizeof(tree_write), ALLOC_TAG);
-            if (!tw) {
-                ERR("out of memory\n");
-                ExFreePool(data);
-                Status = STATUS_INSUFFICIENT_RESOURCES;
-                goto end;
-            }
+        data = ExAllocatePoolWithTag(NonPagedPool, (j - i) * Vcb->superblock.node_size, ALLOC_TAG);
+        if (!data) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
 
-            tw->address = t->new_address;
-            tw->length = Vcb->superblock.node_size;
-            tw->data = data;
-            tw->allocated = false;
+        tw = ExAllocatePoolWithTag(PagedPool, sizeof(tree_write), ALLOC_TAG);
+        if (!tw) {
+            ERR("out of memory\n");
+            ExFreePool(data);
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
 
-            if (IsListEmpty(&tree_writes))
-                InsertTailList(&tree_writes, &tw->list_entry);
-            else {
-                bool inserted = false;
+        tw->address = trees[i]->new_address;
+        tw->length = (j - i) * Vcb->superblock.node_size;
+        tw->data = data;
+        tw->allocated = false;
 
-                le2 = tree_writes.Flink;
-                while (le2 != &tree_writes) {
-                    tree_write* tw2 = CONTAINING_RECORD(le2, tree_write, list_entry);
+        InsertTailList(&tree_writes, &tw->list_entry);
 
-                    if (tw2->address > tw->address) {
-                        InsertHeadList(le2->Blink, &tw->list_entry);
-                        inserted = true;
-                        break;
-                    }
+        while (i < j) {
+            bufs[i] = data;
+            data += Vcb->superblock.node_size;
+            i++;
+        }
+    }
 
-                    le2 = le2->Flink;
-                }
+    // The headers of all the trees are now final, so the nodes can be built
+    // and checksummed in any order - farm this out to the calc threads.
+    do_calc_job_trees(Vcb, trees, bufs, num_trees);
 
-                if (!inserted)
-                    InsertTailList(&tree_writes, &tw->list_entry);
-            }
-        }
+#ifdef DEBUG_FLUSH_TIMES
+    time2 = KeQueryPerformanceCounter(NULL);
 
-        le = le->Flink;
-    }
+    ERR("serialized %lu trees in %I64u (freq = %I64u)\n", num_trees, time2.QuadPart - time1.QuadPart, freq.QuadPart);
+#endif
 
     Status = do_tree_writes(Vcb, &tree_writes, false);
     if (!NT_SUCCESS(Status)) {
@@ -2099,6 +2219,9 @@ end:
         ExFreePool(tw);
     }
 
+    ExFreePool(bufs);
+    ExFreePool(trees);
+
     return Status;
 }
 
@@ -4803,56 +4926,111 @@ end:
     }
 }
 
-NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
+// This is as close as we get to delayed allocation. Paging writes have to be finished before we
+// return, and Cc's pages are the only copy of the data, so we can't hold it back until the commit
+// to decide where it goes. Instead the file's allocation window (see reserve_alloc_window) puts
+// successive writes next to each other on disk, and here we turn those runs into single extents.
+static NTSTATUS coalesce_new_extents(fcb* fcb) {
+    LIST_ENTRY* le;
+
+    le = fcb->extents.Flink;
+    while (le != &fcb->extents && le->Flink != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+        extent* nextext = CONTAINING_RECORD(le->Flink, extent, list_entry);
+        EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ext->extent_data.data;
+        EXTENT_DATA2* ned2 = (EXTENT_DATA2*)nextext->extent_data.data;
+        chunk* c;
+
+        if (!ext->inserted || !nextext->inserted || ext->ignore || nextext->ignore)
+            goto next;
+
+        if (ext->extent_data.type != EXTENT_TYPE_REGULAR || nextext->extent_data.type != EXTENT_TYPE_REGULAR)
+            goto next;
+
+        if (ext->extent_data.compression != BTRFS_COMPRESSION_NONE || nextext->extent_data.compression != BTRFS_COMPRESSION_NONE ||
+            ext->extent_data.encryption != BTRFS_ENCRYPTION_NONE || nextext->extent_data.encryption != BTRFS_ENCRYPTION_NONE ||
+            ext->extent_data.encoding != BTRFS_ENCODING_NONE || nextext->extent_data.encoding != BTRFS_ENCODING_NONE)
+            goto next;
+
+        if (ed2->size == 0 || ned2->size == 0 || ed2->offset != 0 || ned2->offset != 0 || ed2->num_bytes != ed2->size || ned2->num_bytes != ned2->size)
+            goto next;
+
+        if (nextext->offset != ext->offset + ed2->num_bytes || ned2->address != ed2->address + ed2->size || ed2->size + ned2->size > MAX_EXTENT_SIZE)
+            goto next;
+
+        if (!ext->csum != !nextext->csum)
+            goto next;
+
+        c = get_chunk_from_address(fcb->Vcb, ed2->address);
+
+        if (!c || ned2->address + ned2->size > c->offset + c->chunk_item->size)
+            goto next;
+
+        if (ext->csum) {
+            ULONG len = (ULONG)((ed2->size + ned2->size) >> fcb->Vcb->sector_shift);
+            void* csum;
+
+            csum = ExAllocatePoolWithTag(NonPagedPool, len * fcb->Vcb->csum_size, ALLOC_TAG);
+            if (!csum) {
+                ERR("out of memory\n");
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            if (!merge_changed_extents(c, ed2->address, ed2->size, ned2->address, ned2->size, fcb->subvol->id, fcb->inode, ext->offset, nextext->offset)) {
+                ExFreePool(csum);
+                goto next;
+            }
+
+            RtlCopyMemory(csum, ext->csum, (ULONG)((ed2->size * fcb->Vcb->csum_size) >> fcb->Vcb->sector_shift));
+            RtlCopyMemory((uint8_t*)csum + ((ed2->size * fcb->Vcb->csum_size) >> fcb->Vcb->sector_shift), nextext->csum,
+                          (ULONG)((ned2->size * fcb->Vcb->csum_size) >> fcb->Vcb->sector_shift));
+
+            ExFreePool(ext->csum);
+            ext->csum = csum;
+        } else if (!merge_changed_extents(c, ed2->address, ed2->size, ned2->address, ned2->size, fcb->subvol->id, fcb->inode, ext->offset, nextext->offset))
+            goto next;
+
+        ext->extent_data.generation = fcb->Vcb->superblock.generation;
+        ext->extent_data.decoded_size += nextext->extent_data.decoded_size;
+        ext->unique = ext->unique && nextext->unique;
+        ed2->size += ned2->size;
+        ed2->num_bytes += ned2->num_bytes;
+
+        RemoveEntryList(&nextext->list_entry);
+
+        if (nextext->csum)
+            ExFreePool(nextext->csum);
+
+        ExFreePool(nextext);
+
+        // see if we can merge the following extent too
+        continue;
+
+next:
+        le = le->Flink;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// The parts of flushing an FCB which look things up in the trees or change extent refs,
+// and so have to be done on the flush thread. This also fills in the offset of the
+// existing INODE_ITEM, which flush_fcb_items needs.
+static NTSTATUS flush_fcb_tree(fcb* fcb, bool cache, LIST_ENTRY* batchlist, uint64_t* ii_offset, PIRP Irp) {
     traverse_ptr tp;
     KEY searchkey;
     NTSTATUS Status;
     INODE_ITEM* ii;
-    uint64_t ii_offset;
 #ifdef DEBUG_PARANOID
     uint64_t old_size = 0;
     bool extents_changed;
 #endif
 
-    if (fcb->ads) {
-        if (fcb->deleted) {
-            Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, fcb->adsxattr.Buffer, fcb->adsxattr.Length, fcb->adshash);
-            if (!NT_SUCCESS(Status)) {
-                ERR("delete_xattr returned %08lx\n", Status);
-                goto end;
-            }
-        } else {
-            Status = set_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, fcb->adsxattr.Buffer, fcb->adsxattr.Length,
-                               fcb->adshash, (uint8_t*)fcb->adsdata.Buffer, fcb->adsdata.Length);
-            if (!NT_SUCCESS(Status)) {
-                ERR("set_xattr returned %08lx\n", Status);
-                goto end;
-            }
-        }
-
-        Status = STATUS_SUCCESS;
-        goto end;
-    }
-
-    if (fcb->deleted) {
-        Status = insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, fcb->inode, TYPE_INODE_ITEM, 0xffffffffffffffff, NULL, 0, Batch_DeleteInode);
-        if (!NT_SUCCESS(Status)) {
-            ERR("insert_tree_item_batch returned %08lx\n", Status);
-            goto end;
-        }
-
-        if (fcb->marked_as_orphan) {
-            Status = insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, BTRFS_ORPHAN_INODE_OBJID, TYPE_ORPHAN_INODE,
-                                            fcb->inode, NULL, 0, Batch_Delete);
-            if (!NT_SUCCESS(Status)) {
-                ERR("insert_tree_item_batch returned %08lx\n", Status);
-                goto end;
-            }
-        }
+    // give back any space we reserved for writing but didn't use
+    release_alloc_window(fcb);
 
-        Status = STATUS_SUCCESS;
-        goto end;
-    }
+    if (fcb->ads || fcb->deleted)
+        return STATUS_SUCCESS;
 
 #ifdef DEBUG_PARANOID
     extents_changed = fcb->extents_changed;
@@ -4902,6 +5080,14 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
         if (!IsListEmpty(&fcb->extents)) {
             rationalize_extents(fcb, Irp);
 
+            // join up newly-written extents which ended up next to each other on disk
+
+            Status = coalesce_new_extents(fcb);
+            if (!NT_SUCCESS(Status)) {
+                ERR("coalesce_new_extents returned %08lx\n", Status);
+                return Status;
+            }
+
             // merge together adjacent EXTENT_DATAs pointing to same extent
 
             le = fcb->extents.Flink;
@@ -4927,8 +5113,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                 csum = ExAllocatePoolWithTag(NonPagedPool, len * fcb->Vcb->csum_size, ALLOC_TAG);
                                 if (!csum) {
                                     ERR("out of memory\n");
-                                    Status = STATUS_INSUFFICIENT_RESOURCES;
-                                    goto end;
+                                    return STATUS_INSUFFICIENT_RESOURCES;
                                 }
 
                                 RtlCopyMemory(csum, ext->csum, (ULONG)((ed2->num_bytes * fcb->Vcb->csum_size) >> fcb->Vcb->sector_shift));
@@ -4958,7 +5143,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                                                 fcb->inode_item.flags & BTRFS_INODE_NODATASUM, false, Irp);
                                 if (!NT_SUCCESS(Status)) {
                                     ERR("update_changed_extent_ref returned %08lx\n", Status);
-                                    goto end;
+                                    return Status;
                                 }
                             }
 
@@ -4977,7 +5162,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
             Status = insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, fcb->inode, TYPE_EXTENT_DATA, 0, NULL, 0, Batch_DeleteExtentData);
             if (!NT_SUCCESS(Status)) {
                 ERR("insert_tree_item_batch returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         }
 
@@ -4996,15 +5181,14 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                 Status = insert_sparse_extent(fcb, batchlist, last_end, ext->offset - last_end);
                 if (!NT_SUCCESS(Status)) {
                     ERR("insert_sparse_extent returned %08lx\n", Status);
-                    goto end;
+                    return Status;
                 }
             }
 
             ed = ExAllocatePoolWithTag(PagedPool, ext->datalen, ALLOC_TAG);
             if (!ed) {
                 ERR("out of memory\n");
-                Status = STATUS_INSUFFICIENT_RESOURCES;
-                goto end;
+                return STATUS_INSUFFICIENT_RESOURCES;
             }
 
             RtlCopyMemory(ed, &ext->extent_data, ext->datalen);
@@ -5013,7 +5197,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                             ed, ext->datalen, Batch_Insert);
             if (!NT_SUCCESS(Status)) {
                 ERR("insert_tree_item_batch returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
 
             if (ed->type == EXTENT_TYPE_PREALLOC)
@@ -5040,7 +5224,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
             Status = insert_sparse_extent(fcb, batchlist, last_end, sector_align(fcb->inode_item.st_size, fcb->Vcb->superblock.sector_size) - last_end);
             if (!NT_SUCCESS(Status)) {
                 ERR("insert_sparse_extent returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         }
 
@@ -5064,7 +5248,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
         Status = find_item(fcb->Vcb, fcb->subvol, &tp, &searchkey, false, Irp);
         if (!NT_SUCCESS(Status)) {
             ERR("error - find_item returned %08lx\n", Status);
-            goto end;
+            return Status;
         }
 
         if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
@@ -5072,8 +5256,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                 ii = ExAllocatePoolWithTag(PagedPool, sizeof(INODE_ITEM), ALLOC_TAG);
                 if (!ii) {
                     ERR("out of memory\n");
-                    Status = STATUS_INSUFFICIENT_RESOURCES;
-                    goto end;
+                    return STATUS_INSUFFICIENT_RESOURCES;
                 }
 
                 RtlCopyMemory(ii, &fcb->inode_item, sizeof(INODE_ITEM));
@@ -5081,14 +5264,13 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                 Status = insert_tree_item(fcb->Vcb, fcb->subvol, fcb->inode, TYPE_INODE_ITEM, 0, ii, sizeof(INODE_ITEM), NULL, Irp);
                 if (!NT_SUCCESS(Status)) {
                     ERR("insert_tree_item returned %08lx\n", Status);
-                    goto end;
+                    return Status;
                 }
 
-                ii_offset = 0;
+                *ii_offset = 0;
             } else {
                 ERR("could not find INODE_ITEM for inode %I64x in subvol %I64x\n", fcb->inode, fcb->subvol->id);
-                Status = STATUS_INTERNAL_ERROR;
-                goto end;
+                return STATUS_INTERNAL_ERROR;
             }
         } else {
 #ifdef DEBUG_PARANOID
@@ -5097,14 +5279,14 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
             old_size = ii2->st_size;
 #endif
 
-            ii_offset = tp.item->key.offset;
+            *ii_offset = tp.item->key.offset;
         }
 
         if (!cache) {
             Status = delete_tree_item(fcb->Vcb, &tp);
             if (!NT_SUCCESS(Status)) {
                 ERR("delete_tree_item returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else {
             searchkey.obj_id = fcb->inode;
@@ -5114,13 +5296,12 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
             Status = find_item(fcb->Vcb, fcb->subvol, &tp, &searchkey, false, Irp);
             if (!NT_SUCCESS(Status)) {
                 ERR("error - find_item returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
 
             if (keycmp(tp.item->key, searchkey)) {
                 ERR("could not find INODE_ITEM for inode %I64x in subvol %I64x\n", fcb->inode, fcb->subvol->id);
-                Status = STATUS_INTERNAL_ERROR;
-                goto end;
+                return STATUS_INTERNAL_ERROR;
             } else
                 RtlCopyMemory(tp.item->data, &fcb->inode_item, min(tp.item->size, sizeof(INODE_ITEM)));
         }
@@ -5132,16 +5313,62 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
         }
 #endif
     } else
-        ii_offset = 0;
+        *ii_offset = 0;
 
-    fcb->created = false;
+    return STATUS_SUCCESS;
+}
 
-    if (!cache && fcb->inode_item_changed) {
-        ii = ExAllocatePoolWithTag(PagedPool, sizeof(INODE_ITEM), ALLOC_TAG);
-        if (!ii) {
-            ERR("out of memory\n");
-            Status = STATUS_INSUFFICIENT_RESOURCES;
-            goto end;
+// The rest of flushing an FCB, which only adds items to batchlist and touches nothing
+// but the FCB itself - so flush_dirty_fcbs can do this for many FCBs at once.
+static NTSTATUS flush_fcb_items(fcb* fcb, bool cache, LIST_ENTRY* batchlist, uint64_t ii_offset) {
+    NTSTATUS Status;
+    INODE_ITEM* ii;
+
+    if (fcb->ads) {
+        if (fcb->deleted) {
+            Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, fcb->adsxattr.Buffer, fcb->adsxattr.Length, fcb->adshash);
+            if (!NT_SUCCESS(Status)) {
+                ERR("delete_xattr returned %08lx\n", Status);
+                return Status;
+            }
+        } else {
+            Status = set_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, fcb->adsxattr.Buffer, fcb->adsxattr.Length,
+                               fcb->adshash, (uint8_t*)fcb->adsdata.Buffer, fcb->adsdata.Length);
+            if (!NT_SUCCESS(Status)) {
+                ERR("set_xattr returned %08lx\n", Status);
+                return Status;
+            }
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    if (fcb->deleted) {
+        Status = insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, fcb->inode, TYPE_INODE_ITEM, 0xffffffffffffffff, NULL, 0, Batch_DeleteInode);
+        if (!NT_SUCCESS(Status)) {
+            ERR("insert_tree_item_batch returned %08lx\n", Status);
+            return Status;
+        }
+
+        if (fcb->marked_as_orphan) {
+            Status = insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, BTRFS_ORPHAN_INODE_OBJID, TYPE_ORPHAN_INODE,
+                                            fcb->inode, NULL, 0, Batch_Delete);
+            if (!NT_SUCCESS(Status)) {
+                ERR("insert_tree_item_batch returned %08lx\n", Status);
+                return Status;
+            }
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    fcb->created = false;
+
+    if (!cache && fcb->inode_item_changed) {
+        ii = ExAllocatePoolWithTag(PagedPool, sizeof(INODE_ITEM), ALLOC_TAG);
+        if (!ii) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
         }
 
         RtlCopyMemory(ii, &fcb->inode_item, sizeof(INODE_ITEM));
@@ -5150,7 +5377,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                         Batch_Insert);
         if (!NT_SUCCESS(Status)) {
             ERR("insert_tree_item_batch returned %08lx\n", Status);
-            goto end;
+            return Status;
         }
 
         fcb->inode_item_changed = false;
@@ -5162,13 +5389,13 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                EA_NTACL_HASH, (uint8_t*)fcb->sd, (uint16_t)RtlLengthSecurityDescriptor(fcb->sd));
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else {
             Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, EA_NTACL, sizeof(EA_NTACL) - 1, EA_NTACL_HASH);
             if (!NT_SUCCESS(Status)) {
                 ERR("delete_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         }
 
@@ -5204,13 +5431,13 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                EA_DOSATTRIB_HASH, val2, (uint16_t)(val + sizeof(val) - val2));
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else {
             Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, EA_DOSATTRIB, sizeof(EA_DOSATTRIB) - 1, EA_DOSATTRIB_HASH);
             if (!NT_SUCCESS(Status)) {
                 ERR("delete_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         }
 
@@ -5224,13 +5451,13 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                EA_REPARSE_HASH, (uint8_t*)fcb->reparse_xattr.Buffer, (uint16_t)fcb->reparse_xattr.Length);
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else {
             Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, EA_REPARSE, sizeof(EA_REPARSE) - 1, EA_REPARSE_HASH);
             if (!NT_SUCCESS(Status)) {
                 ERR("delete_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         }
 
@@ -5243,13 +5470,13 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                EA_EA_HASH, (uint8_t*)fcb->ea_xattr.Buffer, (uint16_t)fcb->ea_xattr.Length);
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else {
             Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, EA_EA, sizeof(EA_EA) - 1, EA_EA_HASH);
             if (!NT_SUCCESS(Status)) {
                 ERR("delete_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         }
 
@@ -5261,7 +5488,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
             Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, EA_PROP_COMPRESSION, sizeof(EA_PROP_COMPRESSION) - 1, EA_PROP_COMPRESSION_HASH);
             if (!NT_SUCCESS(Status)) {
                 ERR("delete_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else if (fcb->prop_compression == PropCompression_Zlib) {
             static const char zlib[] = "zlib";
@@ -5270,7 +5497,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                EA_PROP_COMPRESSION_HASH, (uint8_t*)zlib, sizeof(zlib) - 1);
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else if (fcb->prop_compression == PropCompression_LZO) {
             static const char lzo[] = "lzo";
@@ -5279,7 +5506,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                EA_PROP_COMPRESSION_HASH, (uint8_t*)lzo, sizeof(lzo) - 1);
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         } else if (fcb->prop_compression == PropCompression_ZSTD) {
             static const char zstd[] = "zstd";
@@ -5288,7 +5515,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                EA_PROP_COMPRESSION_HASH, (uint8_t*)zstd, sizeof(zstd) - 1);
             if (!NT_SUCCESS(Status)) {
                 ERR("set_xattr returned %08lx\n", Status);
-                goto end;
+                return Status;
             }
         }
 
@@ -5310,7 +5537,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                     Status = delete_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, xa->data, xa->namelen, hash);
                     if (!NT_SUCCESS(Status)) {
                         ERR("delete_xattr returned %08lx\n", Status);
-                        goto end;
+                        return Status;
                     }
 
                     RemoveEntryList(&xa->list_entry);
@@ -5320,7 +5547,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                        hash, (uint8_t*)&xa->data[xa->namelen], xa->valuelen);
                     if (!NT_SUCCESS(Status)) {
                         ERR("set_xattr returned %08lx\n", Status);
-                        goto end;
+                        return Status;
                     }
 
                     xa->dirty = false;
@@ -5338,7 +5565,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                               sizeof(EA_CASE_SENSITIVE) - 1, EA_CASE_SENSITIVE_HASH);
         if (!NT_SUCCESS(Status)) {
             ERR("delete_xattr returned %08lx\n", Status);
-            goto end;
+            return Status;
         }
 
         fcb->case_sensitive_set = false;
@@ -5347,7 +5574,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                            sizeof(EA_CASE_SENSITIVE) - 1, EA_CASE_SENSITIVE_HASH, (uint8_t*)"1", 1);
         if (!NT_SUCCESS(Status)) {
             ERR("set_xattr returned %08lx\n", Status);
-            goto end;
+            return Status;
         }
 
         fcb->case_sensitive_set = true;
@@ -5358,15 +5585,16 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                                         fcb->inode, NULL, 0, Batch_Insert);
         if (!NT_SUCCESS(Status)) {
             ERR("insert_tree_item_batch returned %08lx\n", Status);
-            goto end;
+            return Status;
         }
 
         fcb->marked_as_orphan = true;
     }
 
-    Status = STATUS_SUCCESS;
+    return STATUS_SUCCESS;
+}
 
-end:
+static void clear_fcb_dirty(fcb* fcb) {
     if (fcb->dirty) {
         bool lock = false;
 
@@ -5382,10 +5610,40 @@ end:
         if (lock)
             ExReleaseResourceLite(&fcb->Vcb->dirty_fcbs_lock);
     }
+}
+
+NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
+    NTSTATUS Status;
+    uint64_t ii_offset;
+
+    Status = flush_fcb_tree(fcb, cache, batchlist, &ii_offset, Irp);
+
+    if (NT_SUCCESS(Status))
+        Status = flush_fcb_items(fcb, cache, batchlist, ii_offset);
+
+    clear_fcb_dirty(fcb);
 
     return Status;
 }
 
+// run on the calc threads by flush_dirty_fcbs
+void flush_fcb_part_items(flush_fcb_part* part) {
+    for (ULONG i = 0; i < part->num_fcbs; i++) {
+        fcb* fcb = part->fcbs[i];
+        NTSTATUS Status;
+
+        ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
+        Status = flush_fcb_items(fcb, false, &part->batchlist, part->ii_offsets[i]);
+        ExReleaseResourceLite(fcb->Header.Resource);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("flush_fcb_items returned %08lx\n", Status);
+            part->Status = Status;
+            return;
+        }
+    }
+}
+
 void add_trim_entry_avoid_sb(device_extension* Vcb, device* dev, uint64_t address, uint64_t size) {
     int i;
     ULONG sblen = (ULONG)sector_align(sizeof(superblock), Vcb->superblock.sector_size);
@@ -5419,6 +5677,9 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
 
     TRACE("dropping chunk %I64x\n", c->offset);
 
+    if (Vcb->last_tree_alloc >= c->offset && Vcb->last_tree_alloc < c->offset + c->chunk_item->size)
+        Vcb->last_tree_alloc = 0;
+
     if (c->chunk_item->type & BLOCK_FLAG_RAID0)
         factor = c->chunk_item->num_stripes;
     else if (c->chunk_item->type & BLOCK_FLAG_RAID10)
@@ -5855,6 +6116,40 @@ NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* p
 
     parity2 = (((ps->address - c->offset) / ps_length) + c->chunk_item->num_stripes - 1) % c->chunk_item->num_stripes;
 
+    // Set unallocated data to 0, and mark it as present so we don't have to read it - if the
+    // rest of the stripe is free space, we can write the whole thing without any reads.
+    le = c->space.Flink;
+    while (le != &c->space) {
+        space* s = CONTAINING_RECORD(le, space, list_entry);
+
+        if (s->address + s->size > ps->address && s->address < ps->address + ps_length) {
+            uint64_t start = max(ps->address, s->address);
+            uint64_t end = min(ps->address + ps_length, s->address + s->size);
+
+            RtlZeroMemory(ps->data + start - ps->address, (ULONG)(end - start));
+            RtlClearBits(&ps->bmp, (ULONG)((start - ps->address) >> Vcb->sector_shift), (ULONG)((end - start) >> Vcb->sector_shift));
+        } else if (s->address >= ps->address + ps_length)
+            break;
+
+        le = le->Flink;
+    }
+
+    le = c->deleting.Flink;
+    while (le != &c->deleting) {
+        space* s = CONTAINING_RECORD(le, space, list_entry);
+
+        if (s->address + s->size > ps->address && s->address < ps->address + ps_length) {
+            uint64_t start = max(ps->address, s->address);
+            uint64_t end = min(ps->address + ps_length, s->address + s->size);
+
+            RtlZeroMemory(ps->data + start - ps->address, (ULONG)(end - start));
+            RtlClearBits(&ps->bmp, (ULONG)((start - ps->address) >> Vcb->sector_shift), (ULONG)((end - start) >> Vcb->sector_shift));
+        } else if (s->address >= ps->address + ps_length)
+            break;
+
+        le = le->Flink;
+    }
+
     // read data (or reconstruct if degraded)
 
     runlength = RtlFindFirstRunClear(&ps->bmp, &index);
@@ -5892,37 +6187,6 @@ NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* p
         }
     }
 
-    // set unallocated data to 0
-    le = c->space.Flink;
-    while (le != &c->space) {
-        space* s = CONTAINING_RECORD(le, space, list_entry);
-
-        if (s->address + s->size > ps->address && s->address < ps->address + ps_length) {
-            uint64_t start = max(ps->address, s->address);
-            uint64_t end = min(ps->address + ps_length, s->address + s->size);
-
-            RtlZeroMemory(ps->data + start - ps->address, (ULONG)(end - start));
-        } else if (s->address >= ps->address + ps_length)
-            break;
-
-        le = le->Flink;
-    }
-
-    le = c->deleting.Flink;
-    while (le != &c->deleting) {
-        space* s = CONTAINING_RECORD(le, space, list_entry);
-
-        if (s->address + s->size > ps->address && s->address < ps->address + ps_length) {
-            uint64_t start = max(ps->address, s->address);
-            uint64_t end = min(ps->address + ps_length, s->address + s->size);
-
-            RtlZeroMemory(ps->data + start - ps->address, (ULONG)(end - start));
-        } else if (s->address >= ps->address + ps_length)
-            break;
-
-        le = le->Flink;
-    }
-
     stripe = (parity2 + 1) % c->chunk_item->num_stripes;
 
     data = ps->data;
@@ -7356,12 +7620,262 @@ static NTSTATUS check_for_orphans(device_extension* Vcb, PIRP Irp) {
     return STATUS_SUCCESS;
 }
 
+static __inline bool fcb_inode_less(fcb* fcb1, fcb* fcb2) {
+    if (fcb1->subvol->id != fcb2->subvol->id)
+        return fcb1->subvol->id < fcb2->subvol->id;
+
+    return fcb1->inode < fcb2->inode;
+}
+
+static void sort_fcbs_by_inode(fcb** fcbs, ULONG num_fcbs) {
+    ULONG start, end, root, child;
+    fcb* f;
+
+    // heapsort, as with sort_trees_by_address
+
+    if (num_fcbs < 2)
+        return;
+
+    start = num_fcbs / 2;
+    end = num_fcbs;
+
+    while (end > 1) {
+        if (start > 0)
+            start--;
+        else {
+            end--;
+
+            f = fcbs[end];
+            fcbs[end] = fcbs[0];
+            fcbs[0] = f;
+        }
+
+        root = start;
+
+        while ((child = (2 * root) + 1) < end) {
+            if (child + 1 < end && fcb_inode_less(fcbs[child], fcbs[child + 1]))
+                child++;
+
+            if (!fcb_inode_less(fcbs[root], fcbs[child]))
+                break;
+
+            f = fcbs[root];
+            fcbs[root] = fcbs[child];
+            fcbs[child] = f;
+
+            root = child;
+        }
+    }
+}
+
+// Moves everything in batchlist2 into batchlist. Items end up exactly where insert_tree_item_batch
+// would have put them had they been added to batchlist one by one, after what was already there.
+static void merge_batch_list(LIST_ENTRY* batchlist, LIST_ENTRY* batchlist2) {
+    while (!IsListEmpty(batchlist2)) {
+        batch_root* br2 = CONTAINING_RECORD(RemoveHeadList(batchlist2), batch_root, list_entry);
+        batch_root* br = NULL;
+        LIST_ENTRY* le;
+
+        le = batchlist->Flink;
+        while (le != batchlist) {
+            batch_root* br3 = CONTAINING_RECORD(le, batch_root, list_entry);
+
+            if (br3->r == br2->r) {
+                br = br3;
+                break;
+            }
+
+            le = le->Flink;
+        }
+
+        if (!br) {
+            InsertTailList(batchlist, &br2->list_entry);
+            continue;
+        }
+
+        // both lists are sorted, so we only need to walk br->items once
+
+        le = br->items.Flink;
+        while (!IsListEmpty(&br2->items)) {
+            batch_item* bi2 = CONTAINING_RECORD(RemoveHeadList(&br2->items), batch_item, list_entry);
+
+            while (le != &br->items) {
+                batch_item* bi = CONTAINING_RECORD(le, batch_item, list_entry);
+                int cmp = keycmp(bi->key, bi2->key);
+
+                if (cmp == 1 || (cmp == 0 && bi2->operation < bi->operation))
+                    break;
+
+                le = le->Flink;
+            }
+
+            InsertTailList(le, &bi2->list_entry);
+        }
+
+        ExFreePool(br2);
+    }
+}
+
+static __inline bool fcb_to_flush(device_extension* Vcb, fcb* fcb, bool deleted) {
+    if (deleted)
+        return fcb->deleted;
+    else
+        return fcb->subvol != Vcb->root_root;
+}
+
+static NTSTATUS flush_dirty_fcbs_serial(device_extension* Vcb, bool deleted, LIST_ENTRY* batchlist, PIRP Irp) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+
+    le = Vcb->dirty_fcbs.Flink;
+    while (le != &Vcb->dirty_fcbs) {
+        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_dirty);
+        LIST_ENTRY* le2 = le->Flink;
+
+        if (fcb_to_flush(Vcb, fcb, deleted)) {
+            ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
+            Status = flush_fcb(fcb, false, batchlist, Irp);
+            ExReleaseResourceLite(fcb->Header.Resource);
+
+            free_fcb(fcb);
+
+            if (!NT_SUCCESS(Status)) {
+                ERR("flush_fcb returned %08lx\n", Status);
+                clear_batch_list(Vcb, batchlist);
+                return Status;
+            }
+        }
+
+        le = le2;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+#define FLUSH_FCBS_PER_PART 256
+
+/* Flushes either the deleted FCBs on the dirty list, or those not in the root tree. The
+ * parts of flush_fcb which need the trees are done one by one on this thread; the rest,
+ * which is most of the work when lots of inodes have had their metadata changed, is
+ * split by inode range between the calc threads, each with its own batch list. The
+ * batch lists are merged in order afterwards, so the result is the same as if we had
+ * done it all here. The caller holds dirty_fcbs_lock. */
+static NTSTATUS flush_dirty_fcbs(device_extension* Vcb, bool deleted, LIST_ENTRY* batchlist, ULONG* num_flushed, PIRP Irp) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    ULONG num_fcbs = 0, num_done, num_parts, i;
+    uint64_t* ii_offsets;
+    fcb** fcbs;
+    flush_fcb_part* parts;
+
+    le = Vcb->dirty_fcbs.Flink;
+    while (le != &Vcb->dirty_fcbs) {
+        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_dirty);
+
+        if (fcb_to_flush(Vcb, fcb, deleted))
+            num_fcbs++;
+
+        le = le->Flink;
+    }
+
+    *num_flushed = num_fcbs;
+
+    if (num_fcbs == 0)
+        return STATUS_SUCCESS;
+
+    num_parts = min(Vcb->calcthreads.num_threads, (num_fcbs + FLUSH_FCBS_PER_PART - 1) / FLUSH_FCBS_PER_PART);
+
+    ii_offsets = ExAllocatePoolWithTag(PagedPool, num_fcbs * (sizeof(uint64_t) + sizeof(fcb*)), ALLOC_TAG);
+    if (!ii_offsets) {
+        WARN("out of memory, flushing FCBs one by one\n");
+        return flush_dirty_fcbs_serial(Vcb, deleted, batchlist, Irp);
+    }
+
+    parts = ExAllocatePoolWithTag(PagedPool, num_parts * sizeof(flush_fcb_part), ALLOC_TAG);
+    if (!parts) {
+        WARN("out of memory, flushing FCBs one by one\n");
+        ExFreePool(ii_offsets);
+        return flush_dirty_fcbs_serial(Vcb, deleted, batchlist, Irp);
+    }
+
+    fcbs = (fcb**)&ii_offsets[num_fcbs];
+
+    i = 0;
+    le = Vcb->dirty_fcbs.Flink;
+    while (le != &Vcb->dirty_fcbs) {
+        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_dirty);
+
+        if (fcb_to_flush(Vcb, fcb, deleted)) {
+            fcbs[i] = fcb;
+            i++;
+        }
+
+        le = le->Flink;
+    }
+
+    sort_fcbs_by_inode(fcbs, num_fcbs);
+
+    for (num_done = 0; num_done < num_fcbs; num_done++) {
+        fcb* fcb = fcbs[num_done];
+
+        ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
+        Status = flush_fcb_tree(fcb, false, batchlist, &ii_offsets[num_done], Irp);
+        ExReleaseResourceLite(fcb->Header.Resource);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("flush_fcb_tree returned %08lx\n", Status);
+            num_done++;
+            goto end;
+        }
+    }
+
+    for (i = 0; i < num_parts; i++) {
+        ULONG first = (ULONG)(((uint64_t)num_fcbs * i) / num_parts);
+        ULONG last = (ULONG)(((uint64_t)num_fcbs * (i + 1)) / num_parts);
+
+        parts[i].fcbs = &fcbs[first];
+        parts[i].ii_offsets = &ii_offsets[first];
+        parts[i].num_fcbs = last - first;
+        parts[i].Status = STATUS_SUCCESS;
+        InitializeListHead(&parts[i].batchlist);
+    }
+
+    if (num_parts == 1)
+        flush_fcb_part_items(&parts[0]);
+    else
+        do_calc_job_fcbs(Vcb, parts, num_parts);
+
+    Status = STATUS_SUCCESS;
+
+    for (i = 0; i < num_parts; i++) {
+        if (NT_SUCCESS(Status) && !NT_SUCCESS(parts[i].Status))
+            Status = parts[i].Status;
+
+        merge_batch_list(batchlist, &parts[i].batchlist);
+    }
+
+end:
+    for (i = 0; i < num_done; i++) {
+        clear_fcb_dirty(fcbs[i]);
+        free_fcb(fcbs[i]);
+    }
+
+    if (!NT_SUCCESS(Status))
+        clear_batch_list(Vcb, batchlist);
+
+    ExFreePool(parts);
+    ExFreePool(ii_offsets);
+
+    return Status;
+}
+
 static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     LIST_ENTRY *le, batchlist;
     bool cache_changed = false;
     volume_device_extension* vde;
     bool no_cache = false;
+    ULONG num_fcbs;
 #ifdef DEBUG_FLUSH_TIMES
     uint64_t filerefs = 0, fcbs = 0;
     LARGE_INTEGER freq, time1, time2;
@@ -7378,6 +7892,17 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     time1 = KeQueryPerformanceCounter(&freq);
 #endif
 
+    // Asynchronous data writes are sent off under the tree lock, which we now have exclusively,
+    // so no more can start - but we mustn't commit until the ones in flight have hit the disk.
+    wait_for_inflight_writes(Vcb, NULL);
+    rollback_failed_async_writes(Vcb);
+    reap_async_writes(Vcb);
+
+    if (!NT_SUCCESS(Vcb->inflight_writes_status)) {
+        ERR("asynchronous data write failed (%08lx), not committing\n", Vcb->inflight_writes_status);
+        return Vcb->inflight_writes_status;
+    }
+
     Status = check_for_orphans(Vcb, Irp);
     if (!NT_SUCCESS(Status)) {
         ERR("check_for_orphans returned %08lx\n", Status);
@@ -7420,32 +7945,16 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
 
     ExAcquireResourceExclusiveLite(&Vcb->dirty_fcbs_lock, true);
 
-    le = Vcb->dirty_fcbs.Flink;
-    while (le != &Vcb->dirty_fcbs) {
-        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_dirty);
-        LIST_ENTRY* le2 = le->Flink;
-
-        if (fcb->deleted) {
-            ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
-            Status = flush_fcb(fcb, false, &batchlist, Irp);
-            ExReleaseResourceLite(fcb->Header.Resource);
-
-            free_fcb(fcb);
-
-            if (!NT_SUCCESS(Status)) {
-                ERR("flush_fcb returned %08lx\n", Status);
-                clear_batch_list(Vcb, &batchlist);
-                ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
-                return Status;
-            }
+    Status = flush_dirty_fcbs(Vcb, true, &batchlist, &num_fcbs, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("flush_dirty_fcbs returned %08lx\n", Status);
+        ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
+        return Status;
+    }
 
 #ifdef DEBUG_FLUSH_TIMES
-            fcbs++;
+    fcbs += num_fcbs;
 #endif
-        }
-
-        le = le2;
-    }
 
     Status = commit_batch_list(Vcb, &batchlist, Irp);
     if (!NT_SUCCESS(Status)) {
@@ -7454,30 +7963,16 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
         return Status;
     }
 
-    le = Vcb->dirty_fcbs.Flink;
-    while (le != &Vcb->dirty_fcbs) {
-        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_dirty);
-        LIST_ENTRY* le2 = le->Flink;
-
-        if (fcb->subvol != Vcb->root_root) {
-            ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
-            Status = flush_fcb(fcb, false, &batchlist, Irp);
-            ExReleaseResourceLite(fcb->Header.Resource);
-            free_fcb(fcb);
-
-            if (!NT_SUCCESS(Status)) {
-                ERR("flush_fcb returned %08lx\n", Status);
-                ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
-                return Status;
-            }
+    Status = flush_dirty_fcbs(Vcb, false, &batchlist, &num_fcbs, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("flush_dirty_fcbs returned %08lx\n", Status);
+        ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
+        return Status;
+    }
 
 #ifdef DEBUG_FLUSH_TIMES
-            fcbs++;
+    fcbs += num_fcbs;
 #endif
-        }
-
-        le = le2;
-    }
 
     ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
 
@@ -7490,7 +7985,7 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
 #ifdef DEBUG_FLUSH_TIMES
     time2 = KeQueryPerformanceCounter(NULL);
 
-    ERR("flushed %I64u fcbs in %I64u (freq = %I64u)\n", filerefs, time2.QuadPart - time1.QuadPart, freq.QuadPart);
+    ERR("flushed %I64u fcbs in %I64u (freq = %I64u)\n", fcbs, time2.QuadPart - time1.QuadPart, freq.QuadPart);
 #endif
 
     // no need to get dirty_subvols_lock here, as we have tree_lock exclusively
@@ -7744,6 +8239,7 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
 
         if (IsListEmpty(&r->fcbs)) {
             ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
+            ExFreePool(r->fcbs_hash);
             ExFreePool(r->nonpaged);
             ExFreePool(r);
         } else
@@ -7764,6 +8260,9 @@ NTSTATUS do_write(device_extension* Vcb, PIRP Irp) {
 
     Status = do_write2(Vcb, Irp, &rollback);
 
+    // only a hint for the trees of one transaction - by the next one it's likely to be stale
+    Vcb->last_tree_alloc = 0;
+
     if (!NT_SUCCESS(Status)) {
         ERR("do_write2 returned %08lx, dropping into readonly mode\n", Status);
         Vcb->readonly = true;
@@ -184,6 +184,7 @@ static NTSTATUS snapshot_tree_copy(device_extension* Vcb, uint64_t addr, root* s
     KeInitializeEvent(&wtc.Event, NotificationEvent, false);
     InitializeListHead(&wtc.stripes);
     wtc.stripes_left = 0;
+    wtc.callback = NULL;
 
     Status = write_data(Vcb, t.new_address, buf, Vcb->superblock.node_size, &wtc, NULL, NULL, false, 0, NormalPagePriority);
     if (!NT_SUCCESS(Status)) {
@@ -1005,7 +1006,6 @@ static NTSTATUS create_subvol(device_extension* Vcb, PFILE_OBJECT FileObject, vo
     acquire_fcb_lock_exclusive(Vcb);
     add_fcb_to_subvol(rootfcb);
     InsertTailList(&Vcb->all_fcbs, &rootfcb->list_entry_all);
-    r->fcbs_version++;
     release_fcb_lock(Vcb);
 
     rootfcb->Header.IsFastIoPossible = fast_io_possible(rootfcb);
@@ -1136,7 +1136,7 @@ end:
         }
 
         if (r) {
-            RemoveEntryList(&r->list_entry);
+            remove_root_from_list(Vcb, r);
             InsertTailList(&Vcb->drop_roots, &r->list_entry);
         }
     }
@@ -3695,21 +3695,15 @@ static NTSTATUS check_inode_used(_In_ _Requires_exclusive_lock_held_(_Curr_->tre
     KEY searchkey;
     traverse_ptr tp;
     NTSTATUS Status;
-    uint8_t c = hash >> 24;
+    LIST_ENTRY* le = fcb_hash_bucket(subvol, hash)->Flink;
 
-    if (subvol->fcbs_ptrs[c]) {
-        LIST_ENTRY* le = subvol->fcbs_ptrs[c];
+    while (le != fcb_hash_bucket(subvol, hash)) {
+        struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry_hash);
 
-        while (le != &subvol->fcbs) {
-            struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry);
-
-            if (fcb2->inode == inode)
-                return STATUS_SUCCESS;
-            else if (fcb2->hash > hash)
-                break;
+        if (fcb2->inode == inode)
+            return STATUS_SUCCESS;
 
-            le = le->Flink;
-        }
+        le = le->Flink;
     }
 
     searchkey.obj_id = inode;
@@ -4074,8 +4068,6 @@ static NTSTATUS mknod(device_extension* Vcb, PFILE_OBJECT FileObject, void* data
     if (!parccb->user_set_write_time)
         parfcb->inode_item.st_mtime = now;
 
-    parfcb->subvol->fcbs_version++;
-
     ExReleaseResourceLite(parfcb->Header.Resource);
     release_fcb_lock(Vcb);
     ExReleaseResourceLite(&Vcb->fileref_lock);
@@ -4280,8 +4272,7 @@ static NTSTATUS fsctl_set_xattr(device_extension* Vcb, PFILE_OBJECT FileObject,
             goto end;
         }
 
-        if (fcb->sd)
-            ExFreePool(fcb->sd);
+        free_fcb_sd(fcb);
 
         if (bsxa->valuelen > 0 && RtlValidRelativeSecurityDescriptor(bsxa->data + bsxa->namelen, bsxa->valuelen, 0)) {
             fcb->sd = ExAllocatePoolWithTag(PagedPool, bsxa->valuelen, ALLOC_TAG);
@@ -4292,8 +4283,7 @@ static NTSTATUS fsctl_set_xattr(device_extension* Vcb, PFILE_OBJECT FileObject,
             }
 
             RtlCopyMemory(fcb->sd, bsxa->data + bsxa->namelen, bsxa->valuelen);
-        } else if (fcb->sd)
-            fcb->sd = NULL;
+        }
 
         fcb->sd_dirty = true;
 
@@ -4525,23 +4515,12 @@ static NTSTATUS reserve_subvol(device_extension* Vcb, PFILE_OBJECT FileObject, P
 }
 
 static NTSTATUS get_subvol_path(device_extension* Vcb, uint64_t id, WCHAR* out, ULONG outlen, PIRP Irp) {
-    LIST_ENTRY* le;
-    root* r = NULL;
+    root* r;
     NTSTATUS Status;
     file_ref* fr;
     UNICODE_STRING us;
 
-    le = Vcb->roots.Flink;
-    while (le != &Vcb->roots) {
-        root* r2 = CONTAINING_RECORD(le, root, list_entry);
-
-        if (r2->id == id) {
-            r = r2;
-            break;
-        }
-
-        le = le->Flink;
-    }
+    r = find_root_by_id(Vcb, id);
 
     if (!r) {
         ERR("couldn't find subvol %I64x\n", id);
@@ -5177,6 +5156,77 @@ static NTSTATUS add_csum_sparse_extents(device_extension* Vcb, uint64_t sparse_e
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS query_io_queue_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    if (!data || length < sizeof(btrfs_io_queue_stats))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    get_io_queue_stats(Vcb, data);
+
+    *retlen = sizeof(btrfs_io_queue_stats);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS query_read_ahead_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    btrfs_read_ahead_stats* stats = data;
+
+    if (!data || length < sizeof(btrfs_read_ahead_stats))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    stats->read_ahead_max = Vcb->options.read_ahead_max;
+    stats->cached_read_bytes = Vcb->read_ahead_stats.cached_read_bytes;
+    stats->read_ahead_bytes = Vcb->read_ahead_stats.read_ahead_bytes;
+    stats->demand_read_bytes = Vcb->read_ahead_stats.demand_read_bytes;
+    stats->window_grows = Vcb->read_ahead_stats.window_grows;
+    stats->window_shrinks = Vcb->read_ahead_stats.window_shrinks;
+
+    *retlen = sizeof(btrfs_read_ahead_stats);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS query_inode_ref_cache_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    btrfs_inode_ref_cache_stats* stats = data;
+
+    if (!data || length < sizeof(btrfs_inode_ref_cache_stats))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    ExAcquireFastMutex(&Vcb->inode_ref_cache.mutex);
+
+    stats->num_entries = Vcb->inode_ref_cache.num_entries;
+    stats->hits = Vcb->inode_ref_cache.hits;
+    stats->misses = Vcb->inode_ref_cache.misses;
+
+    ExReleaseFastMutex(&Vcb->inode_ref_cache.mutex);
+
+    *retlen = sizeof(btrfs_inode_ref_cache_stats);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS query_sd_cache_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    btrfs_sd_cache_stats* stats = data;
+
+    if (!data || length < sizeof(btrfs_sd_cache_stats))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    ExAcquireFastMutex(&Vcb->sd_cache.mutex);
+
+    stats->num_entries = Vcb->sd_cache.num_entries;
+    stats->bytes = Vcb->sd_cache.bytes;
+    stats->bytes_saved = Vcb->sd_cache.bytes_saved;
+    stats->hits = Vcb->sd_cache.hits;
+    stats->misses = Vcb->sd_cache.misses;
+    stats->synth_hits = Vcb->sd_cache.synth_hits;
+    stats->synth_misses = Vcb->sd_cache.synth_misses;
+
+    ExReleaseFastMutex(&Vcb->sd_cache.mutex);
+
+    *retlen = sizeof(btrfs_sd_cache_stats);
+
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS get_csum_info(device_extension* Vcb, PFILE_OBJECT FileObject, btrfs_csum_info* buf, ULONG buflen,
                               ULONG_PTR* retlen, KPROCESSOR_MODE processor_mode) {
     NTSTATUS Status;
@@ -5913,6 +5963,26 @@ NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP* Pirp, uint32_t type) {
                                    Irp->RequestorMode);
             break;
 
+        case FSCTL_BTRFS_GET_IO_QUEUE_STATS:
+            Status = query_io_queue_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                          IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
+        case FSCTL_BTRFS_GET_READ_AHEAD_STATS:
+            Status = query_read_ahead_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                            IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
+        case FSCTL_BTRFS_GET_INODE_REF_CACHE_STATS:
+            Status = query_inode_ref_cache_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                                 IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
+        case FSCTL_BTRFS_GET_SD_CACHE_STATS:
+            Status = query_sd_cache_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                          IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
         default:
             WARN("unknown control code %lx (DeviceType = %lx, Access = %lx, Function = %lx, Method = %lx)\n",
                           IrpSp->Parameters.FileSystemControl.FsControlCode, (IrpSp->Parameters.FileSystemControl.FsControlCode & 0xff0000) >> 16,
@@ -15,7 +15,13 @@
  * You should have received a copy of the GNU Lesser General Public Licence
  * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
 
+#ifndef CRC_XOR_FUZZ // tests/crc_xor_fuzz.c builds us in user mode
 #include "btrfs_drv.h"
+#endif
+
+#ifdef _AMD64_
+#include <emmintrin.h>
+#endif
 
 static const uint8_t glog[] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26,
                              0x4c, 0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0,
@@ -107,7 +113,21 @@ __inline static uint32_t galois_double_mask32(uint32_t v) {
 #endif
 
 void galois_double(uint8_t* data, uint32_t len) {
-    // FIXME - SIMD?
+#if defined(_AMD64_)
+    // SSE2 is always available on amd64
+    const __m128i poly = _mm_set1_epi8(0x1d), zero = _mm_setzero_si128();
+
+    while (len >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)data);
+        __m128i mask = _mm_cmplt_epi8(v, zero); // top bit set
+
+        v = _mm_xor_si128(_mm_add_epi8(v, v), _mm_and_si128(mask, poly));
+        _mm_storeu_si128((__m128i*)data, v);
+
+        data += 16;
+        len -= 16;
+    }
+#endif
 
 #if defined(_AMD64_) || defined(_ARM64_)
     while (len > sizeof(uint64_t)) {
@@ -139,3 +159,47 @@ void galois_double(uint8_t* data, uint32_t len) {
         len--;
     }
 }
+
+// addition in GF(2^8), which is what RAID5 parity and the P stripe of RAID6 are made of
+void __stdcall do_xor_basic(uint8_t* buf1, uint8_t* buf2, uint32_t len) {
+    uint32_t j;
+
+#if defined(_ARM_) || defined(_ARM64_)
+    uint64x2_t x1, x2;
+
+    if (((uintptr_t)buf1 & 0xf) == 0 && ((uintptr_t)buf2 & 0xf) == 0) {
+        while (len >= 16) {
+            x1 = vld1q_u64((const uint64_t*)buf1);
+            x2 = vld1q_u64((const uint64_t*)buf2);
+            x1 = veorq_u64(x1, x2);
+            vst1q_u64((uint64_t*)buf1, x1);
+
+            buf1 += 16;
+            buf2 += 16;
+            len -= 16;
+        }
+    }
+#endif
+
+#if defined(_AMD64_) || defined(_ARM64_)
+    while (len >= 8) {
+        *(uint64_t*)buf1 ^= *(uint64_t*)buf2;
+        buf1 += 8;
+        buf2 += 8;
+        len -= 8;
+    }
+#endif
+
+    while (len >= 4) {
+        *(uint32_t*)buf1 ^= *(uint32_t*)buf2;
+        buf1 += 4;
+        buf2 += 4;
+        len -= 4;
+    }
+
+    for (j = 0; j < len; j++) {
+        *buf1 ^= *buf2;
+        buf1++;
+        buf2++;
+    }
+}
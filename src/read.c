@@ -2792,6 +2792,138 @@ typedef struct {
     size_t length;
 } comp_calc_job;
 
+// Replaces runs of uncompressed read_parts which are next to each other both on disk and in
+// the output buffer with a single part, so that e.g. a file written in lots of little appends
+// doesn't turn into one device I/O per extent. The checksums are concatenated, so they're
+// still all checked by read_data.
+__attribute__((nonnull(1, 2)))
+static NTSTATUS coalesce_read_parts(device_extension* Vcb, LIST_ENTRY* read_parts, POOL_TYPE pool_type) {
+    LIST_ENTRY* le = read_parts->Flink;
+
+    while (le != read_parts) {
+        read_part* first = CONTAINING_RECORD(le, read_part, list_entry);
+        read_part* last = first;
+        read_part* rp2;
+        LIST_ENTRY* le2;
+        unsigned int num_parts = 1;
+        uint32_t read = first->read, to_read = first->to_read;
+        bool buf_free = first->buf_free || first->bumpoff != 0;
+
+        if (first->compression != BTRFS_COMPRESSION_NONE) {
+            le = le->Flink;
+            continue;
+        }
+
+        le2 = le->Flink;
+        while (le2 != read_parts) {
+            read_part* rp = CONTAINING_RECORD(le2, read_part, list_entry);
+
+            if (rp->compression != BTRFS_COMPRESSION_NONE || rp->c != first->c || rp->addr != last->addr + last->to_read ||
+                rp->data != (uint8_t*)last->data + last->read || last->bumpoff + last->read != last->to_read || rp->bumpoff != 0 ||
+                (rp->csum && !first->csum) || (!rp->csum && first->csum))
+                break;
+
+            if (rp->buf_free)
+                buf_free = true;
+
+            read += rp->read;
+            to_read += rp->to_read;
+            num_parts++;
+            last = rp;
+
+            le2 = le2->Flink;
+        }
+
+        if (num_parts == 1) {
+            le = le->Flink;
+            continue;
+        }
+
+        rp2 = ExAllocatePoolWithTag(pool_type, sizeof(read_part), ALLOC_TAG);
+        if (!rp2) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        rp2->addr = first->addr;
+        rp2->c = first->c;
+        rp2->read = read;
+        rp2->to_read = to_read;
+        rp2->bumpoff = first->bumpoff;
+        rp2->data = first->data;
+        rp2->compression = BTRFS_COMPRESSION_NONE;
+        rp2->num_extents = 1;
+        rp2->extents[0] = first->extents[0];
+
+        if (first->csum) {
+            uint8_t* csum;
+
+            rp2->csum = ExAllocatePoolWithTag(pool_type, (to_read >> Vcb->sector_shift) * Vcb->csum_size, ALLOC_TAG);
+            if (!rp2->csum) {
+                ERR("out of memory\n");
+                ExFreePool(rp2);
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            rp2->csum_free = true;
+
+            csum = rp2->csum;
+            le2 = le;
+            for (unsigned int i = 0; i < num_parts; i++) {
+                read_part* rp = CONTAINING_RECORD(le2, read_part, list_entry);
+                ULONG csum_len = (rp->to_read >> Vcb->sector_shift) * Vcb->csum_size;
+
+                RtlCopyMemory(csum, rp->csum, csum_len);
+                csum += csum_len;
+
+                le2 = le2->Flink;
+            }
+        } else {
+            rp2->csum = NULL;
+            rp2->csum_free = false;
+        }
+
+        if (buf_free) {
+            rp2->buf = ExAllocatePoolWithTag(pool_type, to_read, ALLOC_TAG);
+            if (!rp2->buf) {
+                ERR("out of memory\n");
+
+                if (rp2->csum)
+                    ExFreePool(rp2->csum);
+
+                ExFreePool(rp2);
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            rp2->buf_free = true;
+            rp2->mdl = false;
+        } else { // all the parts were reading straight into the output buffer, so it's contiguous
+            rp2->buf = first->buf;
+            rp2->buf_free = false;
+            rp2->mdl = first->mdl;
+        }
+
+        InsertHeadList(le->Blink, &rp2->list_entry);
+
+        for (unsigned int i = 0; i < num_parts; i++) {
+            read_part* rp = CONTAINING_RECORD(le, read_part, list_entry);
+
+            le = le->Flink;
+
+            if (rp->buf_free)
+                ExFreePool(rp->buf);
+
+            if (rp->csum_free)
+                ExFreePool(rp->csum);
+
+            RemoveEntryList(&rp->list_entry);
+            ExFreePool(rp);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
 __attribute__((nonnull(1, 2)))
 NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULONG* pbr, PIRP Irp) {
     NTSTATUS Status;
@@ -2811,6 +2943,9 @@ NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULO
         return STATUS_END_OF_FILE;
     }
 
+    if (fcb->nonpaged->inflight_writes != 0)
+        wait_for_inflight_writes(fcb->Vcb, fcb);
+
     InitializeListHead(&read_parts);
     InitializeListHead(&calc_jobs);
 
@@ -2956,7 +3091,7 @@ NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULO
                         goto exit;
                     }
 
-                    rp->mdl = (Irp && Irp->MdlAddress) ? true : false;
+                    rp->mdl = Irp && Irp->MdlAddress;
                     rp->extents[0].off = start + bytes_read - ext->offset;
                     rp->bumpoff = 0;
                     rp->num_extents = 1;
@@ -3011,6 +3146,20 @@ NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULO
                         goto exit;
                     }
 
+                    // We can read straight into the caller's pages and verify the checksums in place, except:
+                    // - for paging I/O, Mm can put its dummy page into the MDL several times over, so read_data
+                    //   has to bounce the data through pool if there's anything to check;
+                    // - for user-mode buffers, another thread can write to the pages while we're reading into
+                    //   them, which would look like corruption - and read_data would go on to "repair" it;
+                    // - for striped chunks, read_data builds its per-device MDLs by copying the caller's PFNs,
+                    //   which only works if our part of the buffer starts on a page boundary.
+                    if (rp->mdl) {
+                        bool striped = rp->c->chunk_item->type & (BLOCK_FLAG_RAID0 | BLOCK_FLAG_RAID10 | BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6);
+                        bool aligned = MmGetMdlByteOffset(Irp->MdlAddress) == 0 && (bytes_read & (PAGE_SIZE - 1)) == 0;
+
+                        rp->mdl = ((Irp->Flags & IRP_PAGING_IO || Irp->RequestorMode == UserMode) && ext->csum) || (striped && !aligned);
+                    }
+
                     if (ext->csum) {
                         if (ed->compression == BTRFS_COMPRESSION_NONE) {
                             rp->csum = (uint8_t*)ext->csum + (fcb->Vcb->csum_size * (rp->extents[0].off >> fcb->Vcb->sector_shift));
@@ -3064,6 +3213,14 @@ nextitem:
         le = le->Flink;
     }
 
+    if (!IsListEmpty(&read_parts) && read_parts.Flink->Flink != &read_parts) { // at least two entries in list
+        Status = coalesce_read_parts(fcb->Vcb, &read_parts, pool_type);
+        if (!NT_SUCCESS(Status)) {
+            ERR("coalesce_read_parts returned %08lx\n", Status);
+            goto exit;
+        }
+    }
+
     if (!IsListEmpty(&read_parts) && read_parts.Flink->Flink != &read_parts) { // at least two entries in list
         read_part* last_rp = CONTAINING_RECORD(read_parts.Flink, read_part, list_entry);
 
@@ -3325,6 +3482,486 @@ exit:
     return Status;
 }
 
+struct async_read_context;
+
+typedef struct {
+    struct async_read_context* context;
+    PIRP Irp;
+    PMDL mdl;
+    uint8_t* buf;
+    uint32_t to_read;
+    uint32_t bumpoff;
+    uint32_t read;
+    uint8_t* dest;
+    void* csum;
+    NTSTATUS Status;
+    device* dev;
+    LIST_ENTRY list_entry;
+} async_read_part;
+
+typedef struct {
+    device_extension* Vcb;
+    fcb* fcb;
+    PIRP Irp;
+    ULONG length;
+    LONG parts_left;
+    bool verify;
+    PIO_WORKITEM work_item;
+    LIST_ENTRY parts;
+} async_read_context;
+
+static void free_async_read_context(async_read_context* context) {
+    while (!IsListEmpty(&context->parts)) {
+        async_read_part* part = CONTAINING_RECORD(RemoveHeadList(&context->parts), async_read_part, list_entry);
+
+        if (part->Irp)
+            IoFreeIrp(part->Irp);
+
+        if (part->mdl)
+            IoFreeMdl(part->mdl);
+
+        if (part->buf)
+            ExFreePool(part->buf);
+
+        ExFreePool(part);
+    }
+
+    IoFreeWorkItem(context->work_item);
+
+    ExFreePool(context);
+}
+
+static void complete_async_read(async_read_context* context, NTSTATUS Status) {
+    PIRP Irp = context->Irp;
+
+    Irp->IoStatus.Status = Status;
+    Irp->IoStatus.Information = NT_SUCCESS(Status) ? context->length : 0;
+
+    ExReleaseResourceForThreadLite(context->fcb->Header.Resource, (ERESOURCE_THREAD)Irp | 3);
+
+    free_async_read_context(context);
+
+    IoCompleteRequest(Irp, IO_DISK_INCREMENT);
+}
+
+// Called from a system worker thread if a device returned an error or if we need to check the
+// checksums, neither of which we can do at DISPATCH_LEVEL. Not on our own I/O threads: we're
+// still holding the FCB shared, and they could all be stuck behind a writer waiting for it. If
+// anything's wrong we throw away what we've got and post the read to be done the slow way, which
+// knows how to try the other mirrors.
+_Function_class_(IO_WORKITEM_ROUTINE)
+static void __stdcall async_read_verify(PDEVICE_OBJECT DeviceObject, PVOID con) {
+    async_read_context* context = con;
+    device_extension* Vcb = context->Vcb;
+    PIRP Irp = context->Irp;
+    LIST_ENTRY* le;
+
+    UNUSED(DeviceObject);
+
+    le = context->parts.Flink;
+    while (le != &context->parts) {
+        async_read_part* part = CONTAINING_RECORD(le, async_read_part, list_entry);
+
+        if (!NT_SUCCESS(part->Status)) {
+            WARN("device returned %08lx, retrying synchronously\n", part->Status);
+            goto retry;
+        }
+
+        if (part->csum && !NT_SUCCESS(check_csum(context->Vcb, part->buf, part->to_read >> context->Vcb->sector_shift, part->csum))) {
+            WARN("checksum error, retrying synchronously\n");
+            goto retry;
+        }
+
+        RtlCopyMemory(part->dest, part->buf + part->bumpoff, part->read);
+
+        le = le->Flink;
+    }
+
+    complete_async_read(context, STATUS_SUCCESS);
+
+    return;
+
+retry:
+    ExReleaseResourceForThreadLite(context->fcb->Header.Resource, (ERESOURCE_THREAD)Irp | 3);
+
+    free_async_read_context(context);
+
+    if (!add_thread_job(Vcb, Irp)) {
+        Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+}
+
+// May be called at DISPATCH_LEVEL.
+static void async_read_finished(async_read_context* context) {
+    LIST_ENTRY* le;
+    bool need_thread = context->verify;
+
+    le = context->parts.Flink;
+    while (le != &context->parts) {
+        async_read_part* part = CONTAINING_RECORD(le, async_read_part, list_entry);
+
+        if (!NT_SUCCESS(part->Status)) {
+            need_thread = true;
+            break;
+        }
+
+        le = le->Flink;
+    }
+
+    if (need_thread) {
+        IoQueueWorkItem(context->work_item, async_read_verify, DelayedWorkQueue, context);
+        return;
+    }
+
+    le = context->parts.Flink;
+    while (le != &context->parts) {
+        async_read_part* part = CONTAINING_RECORD(le, async_read_part, list_entry);
+
+        RtlCopyMemory(part->dest, part->buf + part->bumpoff, part->read);
+
+        le = le->Flink;
+    }
+
+    complete_async_read(context, STATUS_SUCCESS);
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+static NTSTATUS __stdcall async_read_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID conptr) {
+    async_read_part* part = conptr;
+    async_read_context* context = (async_read_context*)part->context;
+
+    UNUSED(DeviceObject);
+
+    part->Status = Irp->IoStatus.Status;
+
+    if (InterlockedDecrement(&context->parts_left) == 0)
+        async_read_finished(context);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+static NTSTATUS add_async_read_part(async_read_context* context, extent* ext, uint64_t off, uint32_t read, uint8_t* dest) {
+    device_extension* Vcb = context->Vcb;
+    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ext->extent_data.data;
+    async_read_part* part;
+    uint64_t addr;
+    chunk* c;
+    CHUNK_ITEM_STRIPE* cis;
+    uint16_t i, orig_ls;
+    PIO_STACK_LOCATION IrpSp;
+
+    addr = ed2->address + ed2->offset + off;
+
+    c = get_chunk_from_address(Vcb, addr);
+    if (!c) {
+        ERR("get_chunk_from_address(%I64x) failed\n", addr);
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    // Striped and parity RAID are left to read_data, which knows how to put them back together.
+    if (c->chunk_item->type & (BLOCK_FLAG_RAID0 | BLOCK_FLAG_RAID10 | BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6))
+        return STATUS_NOT_SUPPORTED;
+
+    cis = (CHUNK_ITEM_STRIPE*)&c->chunk_item[1];
+
+    orig_ls = i = c->last_stripe;
+
+    while (!c->devices[i] || !c->devices[i]->devobj) {
+        i = (i + 1) % c->chunk_item->num_stripes;
+
+        if (i == orig_ls)
+            return STATUS_DEVICE_NOT_READY;
+    }
+
+    // we'd need to copy the data out of the system buffer ourselves
+    if (c->devices[i]->devobj->Flags & DO_BUFFERED_IO)
+        return STATUS_NOT_SUPPORTED;
+
+    c->last_stripe = (i + 1) % c->chunk_item->num_stripes;
+
+    part = ExAllocatePoolWithTag(NonPagedPool, sizeof(async_read_part), ALLOC_TAG);
+    if (!part) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(part, sizeof(async_read_part));
+
+    InsertTailList(&context->parts, &part->list_entry);
+
+    part->context = (struct async_read_context*)context;
+    part->dev = c->devices[i];
+    part->read = read;
+    part->dest = dest;
+    part->bumpoff = addr & (Vcb->superblock.sector_size - 1);
+    part->to_read = (uint32_t)sector_align(read + part->bumpoff, Vcb->superblock.sector_size);
+    part->Status = STATUS_PENDING;
+
+    addr -= part->bumpoff;
+
+    if (ext->csum) {
+        part->csum = (uint8_t*)ext->csum + (Vcb->csum_size * (off >> Vcb->sector_shift));
+        context->verify = true;
+    }
+
+    part->buf = ExAllocatePoolWithTag(NonPagedPool, part->to_read, ALLOC_TAG);
+    if (!part->buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    part->mdl = IoAllocateMdl(part->buf, part->to_read, false, false, NULL);
+    if (!part->mdl) {
+        ERR("IoAllocateMdl failed\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    MmBuildMdlForNonPagedPool(part->mdl);
+
+    part->Irp = IoAllocateIrp(part->dev->devobj->StackSize, false);
+    if (!part->Irp) {
+        ERR("IoAllocateIrp failed\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    IrpSp = IoGetNextIrpStackLocation(part->Irp);
+    IrpSp->MajorFunction = IRP_MJ_READ;
+    IrpSp->MinorFunction = IRP_MN_NORMAL;
+    IrpSp->FileObject = part->dev->fileobj;
+
+    if (part->dev->devobj->Flags & DO_DIRECT_IO)
+        part->Irp->MdlAddress = part->mdl;
+    else
+        part->Irp->UserBuffer = part->buf;
+
+    IrpSp->Parameters.Read.Length = part->to_read;
+    IrpSp->Parameters.Read.ByteOffset.QuadPart = addr - c->offset + cis[i].offset;
+
+    IoSetCompletionRoutine(part->Irp, async_read_completion, part, true, true, true);
+
+    return STATUS_SUCCESS;
+}
+
+// Tries to satisfy an asynchronous non-cached read without tying up a thread: we send the device
+// IRPs, return STATUS_PENDING, and finish the request from the completion routines. Returns false
+// if this read isn't one we can do like this, in which case the caller posts it as before.
+// The caller must have acquired fcb->Header.Resource shared; if we return true, it's no longer
+// theirs to release.
+static bool read_file_async(device_extension* Vcb, fcb* fcb, PIRP Irp) {
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    uint64_t start = IrpSp->Parameters.Read.ByteOffset.QuadPart;
+    ULONG length = IrpSp->Parameters.Read.Length;
+    uint64_t pos, end;
+    uint8_t* data;
+    async_read_context* context;
+    LIST_ENTRY* le;
+    NTSTATUS Status;
+
+    if (!(Irp->Flags & IRP_NOCACHE) || Irp->Flags & IRP_PAGING_IO || IrpSp->MinorFunction != IRP_MN_NORMAL)
+        return false;
+
+    if (fcb->ads || fcb->type == BTRFS_TYPE_DIRECTORY || !Vcb->log_to_phys_loaded)
+        return false;
+
+    // read_file will wait for these
+    if (fcb->nonpaged->inflight_writes != 0)
+        return false;
+
+    // leave the edge cases to do_read
+    if (length == 0 || start + length > (uint64_t)fcb->Header.ValidDataLength.QuadPart)
+        return false;
+
+    if (!FsRtlCheckLockForReadAccess(&fcb->lock, Irp))
+        return false;
+
+    if (!lock_irp_buffer(Irp))
+        return false;
+
+    data = map_user_buffer(Irp, NormalPagePriority);
+    if (!data)
+        return false;
+
+    context = ExAllocatePoolWithTag(NonPagedPool, sizeof(async_read_context), ALLOC_TAG);
+    if (!context) {
+        ERR("out of memory\n");
+        return false;
+    }
+
+    // allocated now so the completion routine can't fail to get one
+    context->work_item = IoAllocateWorkItem(Vcb->devobj);
+    if (!context->work_item) {
+        ERR("out of memory\n");
+        ExFreePool(context);
+        return false;
+    }
+
+    context->Vcb = Vcb;
+    context->fcb = fcb;
+    context->Irp = Irp;
+    context->length = length;
+    context->verify = false;
+    InitializeListHead(&context->parts);
+
+    pos = start;
+    end = start + length;
+
+    le = fcb->extents.Flink;
+    while (le != &fcb->extents && pos < end) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+        EXTENT_DATA* ed = &ext->extent_data;
+        EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
+        uint64_t len, off;
+        uint32_t read;
+
+        le = le->Flink;
+
+        if (ext->ignore)
+            continue;
+
+        if (ed->type != EXTENT_TYPE_REGULAR && ed->type != EXTENT_TYPE_PREALLOC)
+            goto fail;
+
+        len = ed2->num_bytes;
+
+        if (ext->offset + len <= pos)
+            continue;
+
+        if (ext->offset >= end)
+            break;
+
+        if (ext->offset > pos) { // hole
+            RtlZeroMemory(data + pos - start, (size_t)(ext->offset - pos));
+            pos = ext->offset;
+        }
+
+        if (ed->compression != BTRFS_COMPRESSION_NONE || ed->encryption != BTRFS_ENCRYPTION_NONE || ed->encoding != BTRFS_ENCODING_NONE)
+            goto fail;
+
+        off = pos - ext->offset;
+        read = (uint32_t)min(len - off, end - pos);
+
+        if (ed->type == EXTENT_TYPE_PREALLOC || ed2->size == 0)
+            RtlZeroMemory(data + pos - start, read);
+        else {
+            Status = add_async_read_part(context, ext, off, read, data + pos - start);
+            if (!NT_SUCCESS(Status)) {
+                if (Status != STATUS_NOT_SUPPORTED)
+                    WARN("add_async_read_part returned %08lx\n", Status);
+
+                goto fail;
+            }
+        }
+
+        pos += read;
+    }
+
+    if (pos < end)
+        RtlZeroMemory(data + pos - start, (size_t)(end - pos));
+
+    if (diskacc) {
+        PETHREAD thread = NULL;
+
+        if (Irp->Tail.Overlay.Thread && !IoIsSystemThread(Irp->Tail.Overlay.Thread))
+            thread = Irp->Tail.Overlay.Thread;
+        else if (!IoIsSystemThread(PsGetCurrentThread()))
+            thread = PsGetCurrentThread();
+
+        if (thread)
+            fPsUpdateDiskCounters(PsGetThreadProcess(thread), length, 0, 1, 0, 0);
+    }
+
+    // From here on the request belongs to the completion routines. The extra count stops
+    // them finishing it before we've sent everything off.
+
+    IoMarkIrpPending(Irp);
+    ExSetResourceOwnerPointer(fcb->Header.Resource, (PVOID)((ULONG_PTR)Irp | 3));
+
+    context->parts_left = 1;
+
+    le = context->parts.Flink;
+    while (le != &context->parts) {
+        async_read_part* part = CONTAINING_RECORD(le, async_read_part, list_entry);
+
+        le = le->Flink;
+
+        InterlockedIncrement(&context->parts_left);
+        IoCallDriver(part->dev->devobj, part->Irp);
+    }
+
+    if (InterlockedDecrement(&context->parts_left) == 0)
+        async_read_finished(context);
+
+    return true;
+
+fail:
+    free_async_read_context(context);
+
+    return false;
+}
+
+// Cc's read-ahead granularity is fixed unless we change it, so we keep track of whether each handle
+// is being read sequentially. The window doubles on each sequential read, up to the ReadAheadMax
+// option, and halves on each random one. As the granularity is always a power of two of at least
+// 128 KB, Cc's read-ahead stays aligned to the compressed extent size and the 64 KB stripe length.
+// We're only holding the FCB shared, so two reads on the same handle can race here - that's fine,
+// this is only a heuristic.
+static void update_read_ahead(device_extension* Vcb, PFILE_OBJECT FileObject, uint64_t start, ULONG length) {
+    ccb* ccb = FileObject->FsContext2;
+    ULONG gran;
+
+    if (!ccb || FileObject->Flags & FO_RANDOM_ACCESS) // Cc doesn't read ahead for these anyway
+        return;
+
+    gran = ccb->read_ahead_granularity != 0 ? ccb->read_ahead_granularity : READ_AHEAD_GRANULARITY;
+
+    if (start == ccb->read_ahead_next || FileObject->Flags & FO_SEQUENTIAL_ONLY) {
+        if (gran < Vcb->options.read_ahead_max) {
+            gran <<= 1;
+            InterlockedIncrement64((LONG64*)&Vcb->read_ahead_stats.window_grows);
+        }
+    } else if (gran > READ_AHEAD_GRANULARITY) {
+        gran >>= 1;
+        InterlockedIncrement64((LONG64*)&Vcb->read_ahead_stats.window_shrinks);
+    }
+
+    ccb->read_ahead_next = start + length;
+
+    if (gran != ccb->read_ahead_granularity) {
+        ccb->read_ahead_granularity = gran;
+        CcSetReadAheadGranularity(FileObject, gran);
+    }
+}
+
+// Small files have their data inline in the metadata, so we already have it in memory. If the
+// file isn't cached or mapped by anybody, we can copy it straight from the extent rather than
+// setting up a cache map and faulting in a page. As nobody's written to it through Cc, there's
+// nothing more recent than what's in fcb->extents.
+static bool is_inline_only(fcb* fcb, PFILE_OBJECT FileObject) {
+    LIST_ENTRY* le;
+    bool inline_ext = false;
+
+    if (fcb->ads || fcb->type != BTRFS_TYPE_FILE || FileObject->SectionObjectPointer->DataSectionObject)
+        return false;
+
+    le = fcb->extents.Flink;
+    while (le != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+        if (!ext->ignore) {
+            if (inline_ext || ext->extent_data.type != EXTENT_TYPE_INLINE)
+                return false;
+
+            inline_ext = true;
+        }
+
+        le = le->Flink;
+    }
+
+    return inline_ext;
+}
+
 NTSTATUS do_read(PIRP Irp, bool wait, ULONG* bytes_read) {
     PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
     PFILE_OBJECT FileObject = IrpSp->FileObject;
@@ -3385,6 +4022,12 @@ NTSTATUS do_read(PIRP Irp, bool wait, ULONG* bytes_read) {
             Status = Irp->IoStatus.Status;
             Irp->IoStatus.Information += addon;
             *bytes_read = (ULONG)Irp->IoStatus.Information;
+
+            InterlockedExchangeAdd64((LONG64*)&fcb->Vcb->read_ahead_stats.cached_read_bytes, *bytes_read);
+
+            // not before the read - if Cc can't wait, the IRP comes back to us and we'd count it twice
+            if (NT_SUCCESS(Status))
+                update_read_ahead(fcb->Vcb, FileObject, start, length);
         } else
             ERR("EXCEPTION - %08lx\n", Status);
 
@@ -3411,6 +4054,49 @@ NTSTATUS do_read(PIRP Irp, bool wait, ULONG* bytes_read) {
         length = (ULONG)(fcb->Header.ValidDataLength.QuadPart - start);
     }
 
+    if (!(Irp->Flags & IRP_NOCACHE) && !FileObject->PrivateCacheMap && is_inline_only(fcb, FileObject)) {
+        NTSTATUS Status;
+        uint8_t* buf;
+
+        // Cached reads don't come with an MDL, so data is the caller's own address. Read into pool,
+        // and copy it out where we can catch a bad buffer, as CcCopyRead would.
+
+        buf = ExAllocatePoolWithTag(PagedPool, length, ALLOC_TAG);
+        if (!buf) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        Status = read_file(fcb, buf, start, length, bytes_read, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("read_file returned %08lx\n", Status);
+            ExFreePool(buf);
+            return Status;
+        }
+
+        try {
+            if (Irp->RequestorMode == UserMode)
+                ProbeForWrite(data, *bytes_read, sizeof(uint8_t));
+
+            RtlCopyMemory(data, buf, *bytes_read);
+        } except (EXCEPTION_EXECUTE_HANDLER) {
+            Status = GetExceptionCode();
+        }
+
+        ExFreePool(buf);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("EXCEPTION - %08lx\n", Status);
+            *bytes_read = 0;
+            return Status;
+        }
+
+        *bytes_read += addon;
+        Irp->IoStatus.Information = *bytes_read;
+
+        return Status;
+    }
+
     if (!(Irp->Flags & IRP_NOCACHE)) {
         NTSTATUS Status = STATUS_SUCCESS;
 
@@ -3455,6 +4141,12 @@ NTSTATUS do_read(PIRP Irp, bool wait, ULONG* bytes_read) {
             Status = Irp->IoStatus.Status;
             Irp->IoStatus.Information += addon;
             *bytes_read = (ULONG)Irp->IoStatus.Information;
+
+            InterlockedExchangeAdd64((LONG64*)&fcb->Vcb->read_ahead_stats.cached_read_bytes, *bytes_read);
+
+            // not before the read - if Cc can't wait, the IRP comes back to us and we'd count it twice
+            if (NT_SUCCESS(Status))
+                update_read_ahead(fcb->Vcb, FileObject, start, length);
         } else
             ERR("EXCEPTION - %08lx\n", Status);
 
@@ -3484,6 +4176,14 @@ NTSTATUS do_read(PIRP Irp, bool wait, ULONG* bytes_read) {
 
         Irp->IoStatus.Information = *bytes_read;
 
+        if (NT_SUCCESS(Status) && Irp->Flags & IRP_PAGING_IO && !(fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE)) {
+            // acquire_for_read_ahead leaves the top-level IRP set to this
+            if (IoGetTopLevelIrp() == (PIRP)FSRTL_CACHE_TOP_LEVEL_IRP)
+                InterlockedExchangeAdd64((LONG64*)&fcb->Vcb->read_ahead_stats.read_ahead_bytes, *bytes_read);
+            else
+                InterlockedExchangeAdd64((LONG64*)&fcb->Vcb->read_ahead_stats.demand_read_bytes, *bytes_read);
+        }
+
         if (diskacc && Status != STATUS_PENDING) {
             PETHREAD thread = NULL;
 
@@ -3602,6 +4302,11 @@ NTSTATUS __stdcall drv_read(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
         acquired_fcb_lock = true;
     }
 
+    if (!wait && acquired_fcb_lock && read_file_async(Vcb, fcb, Irp)) {
+        Status = STATUS_PENDING;
+        goto exit2;
+    }
+
     Status = do_read(Irp, wait, &bytes_read);
 
     if (acquired_fcb_lock)
@@ -21,6 +21,8 @@
 extern UNICODE_STRING log_device, log_file, registry_path;
 extern LIST_ENTRY uid_map_list, gid_map_list;
 extern ERESOURCE mapping_lock;
+extern LIST_ENTRY VcbList;
+extern ERESOURCE global_loading_lock;
 
 #ifdef _DEBUG
 extern HANDLE log_handle;
@@ -33,12 +35,25 @@ WORK_QUEUE_ITEM wqi;
 
 static const WCHAR option_mounted[] = L"Mounted";
 
+// Cc wants its read-ahead granularity to be a power of two
+static uint32_t read_ahead_max(uint32_t val) {
+    uint32_t ret = READ_AHEAD_GRANULARITY;
+
+    if (val > READ_AHEAD_MAX_LIMIT)
+        val = READ_AHEAD_MAX_LIMIT;
+
+    while (ret <= val / 2)
+        ret <<= 1;
+
+    return ret;
+}
+
 NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     BTRFS_UUID* uuid = &Vcb->superblock.uuid;
     mount_options* options = &Vcb->options;
     UNICODE_STRING path, ignoreus, compressus, compressforceus, compresstypeus, readonlyus, zliblevelus, flushintervalus,
                    maxinlineus, subvolidus, skipbalanceus, nobarrierus, notrimus, clearcacheus, allowdegradedus, zstdlevelus,
-                   norootdirus;
+                   norootdirus, readaheadmaxus;
     OBJECT_ATTRIBUTES oa;
     NTSTATUS Status;
     ULONG i, j, kvfilen, index, retlen;
@@ -53,6 +68,7 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     options->zstd_level = mount_zstd_level;
     options->flush_interval = mount_flush_interval;
     options->max_inline = min(mount_max_inline, Vcb->superblock.node_size - sizeof(tree_header) - sizeof(leaf_node) - sizeof(EXTENT_DATA) + 1);
+    options->read_ahead_max = read_ahead_max(mount_read_ahead_max);
     options->skip_balance = mount_skip_balance;
     options->no_barrier = mount_no_barrier;
     options->no_trim = mount_no_trim;
@@ -123,6 +139,7 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     RtlInitUnicodeString(&allowdegradedus, L"AllowDegraded");
     RtlInitUnicodeString(&zstdlevelus, L"ZstdLevel");
     RtlInitUnicodeString(&norootdirus, L"NoRootDir");
+    RtlInitUnicodeString(&readaheadmaxus, L"ReadAheadMax");
 
     do {
         Status = ZwEnumerateValueKey(h, index, KeyValueFullInformation, kvfi, kvfilen, &retlen);
@@ -199,6 +216,10 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
                 DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
 
                 options->no_root_dir = *val;
+            } else if (FsRtlAreNamesEqual(&readaheadmaxus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->read_ahead_max = read_ahead_max(*val);
             }
         } else if (Status != STATUS_NO_MORE_ENTRIES) {
             ERR("ZwEnumerateValueKey returned %08lx\n", Status);
@@ -547,6 +568,9 @@ static void read_mappings(PUNICODE_STRING regpath) {
     while (!IsListEmpty(&uid_map_list)) {
         uid_map* um = CONTAINING_RECORD(RemoveHeadList(&uid_map_list), uid_map, listentry);
 
+        RemoveEntryList(&um->list_entry_sid_hash);
+        RemoveEntryList(&um->list_entry_uid_hash);
+
         if (um->sid) ExFreePool(um->sid);
         ExFreePool(um);
     }
@@ -625,6 +649,8 @@ static void read_group_mappings(PUNICODE_STRING regpath) {
     while (!IsListEmpty(&gid_map_list)) {
         gid_map* gm = CONTAINING_RECORD(RemoveHeadList(&gid_map_list), gid_map, listentry);
 
+        RemoveEntryList(&gm->list_entry_sid_hash);
+
         if (gm->sid) ExFreePool(gm->sid);
         ExFreePool(gm);
     }
@@ -787,6 +813,22 @@ void read_registry(PUNICODE_STRING regpath, bool refresh) {
 
     ExReleaseResourceLite(&mapping_lock);
 
+    if (refresh) {
+        LIST_ENTRY* le;
+
+        // the SDs we've synthesized have owners and groups from the old mappings
+        ExAcquireResourceSharedLite(&global_loading_lock, true);
+
+        le = VcbList.Flink;
+        while (le != &VcbList) {
+            flush_sd_synth_cache(CONTAINING_RECORD(le, device_extension, list_entry));
+
+            le = le->Flink;
+        }
+
+        ExReleaseResourceLite(&global_loading_lock);
+    }
+
     InitializeObjectAttributes(&oa, regpath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
 
     Status = ZwCreateKey(&h, KEY_QUERY_VALUE | KEY_ENUMERATE_SUB_KEYS, &oa, 0, NULL, REG_OPTION_NON_VOLATILE, &dispos);
@@ -813,6 +855,8 @@ void read_registry(PUNICODE_STRING regpath, bool refresh) {
     get_registry_value(h, L"Readonly", REG_DWORD, &mount_readonly, sizeof(mount_readonly));
     get_registry_value(h, L"ZstdLevel", REG_DWORD, &mount_zstd_level, sizeof(mount_zstd_level));
     get_registry_value(h, L"NoRootDir", REG_DWORD, &mount_no_root_dir, sizeof(mount_no_root_dir));
+    get_registry_value(h, L"IoThreads", REG_DWORD, &mount_io_threads, sizeof(mount_io_threads));
+    get_registry_value(h, L"ReadAheadMax", REG_DWORD, &mount_read_ahead_max, sizeof(mount_read_ahead_max));
 
     if (!refresh)
         get_registry_value(h, L"NoPNP", REG_DWORD, &no_pnp, sizeof(no_pnp));
@@ -46,7 +46,7 @@ typedef struct {
 
 static void log_file_checksum_error(device_extension* Vcb, uint64_t addr, uint64_t devid, uint64_t subvol, uint64_t inode, uint64_t offset) {
     LIST_ENTRY *le, parts;
-    root* r = NULL;
+    root* r;
     KEY searchkey;
     traverse_ptr tp;
     uint64_t dir;
@@ -56,17 +56,7 @@ static void log_file_checksum_error(device_extension* Vcb, uint64_t addr, uint64
     NTSTATUS Status;
     ULONG utf16len;
 
-    le = Vcb->roots.Flink;
-    while (le != &Vcb->roots) {
-        root* r2 = CONTAINING_RECORD(le, root, list_entry);
-
-        if (r2->id == subvol) {
-            r = r2;
-            break;
-        }
-
-        le = le->Flink;
-    }
+    r = find_root_by_id(Vcb, subvol);
 
     if (!r) {
         ERR("could not find subvol %I64x\n", subvol);
@@ -119,19 +109,7 @@ static void log_file_checksum_error(device_extension* Vcb, uint64_t addr, uint64
 
                 InsertTailList(&parts, &pp->list_entry);
 
-                r = NULL;
-
-                le = Vcb->roots.Flink;
-                while (le != &Vcb->roots) {
-                    root* r2 = CONTAINING_RECORD(le, root, list_entry);
-
-                    if (r2->id == tp.item->key.offset) {
-                        r = r2;
-                        break;
-                    }
-
-                    le = le->Flink;
-                }
+                r = find_root_by_id(Vcb, tp.item->key.offset);
 
                 if (!r) {
                     ERR("could not find subvol %I64x\n", tp.item->key.offset);
@@ -2932,6 +2910,11 @@ static NTSTATUS scrub_chunk(device_extension* Vcb, chunk* c, uint64_t* offset, b
 
     ExAcquireResourceSharedLite(&Vcb->tree_lock, true);
 
+    // Writes to NOCOW and prealloc extents go in place, so don't read (or "repair") any which are
+    // still in flight. Ones sent after this are no different from synchronous writes, which also
+    // only hold the tree lock shared.
+    wait_for_inflight_writes(Vcb, NULL);
+
     if (c->chunk_item->type & BLOCK_FLAG_DUPLICATE)
         type = BLOCK_FLAG_DUPLICATE;
     else if (c->chunk_item->type & BLOCK_FLAG_RAID0)
@@ -16,6 +16,7 @@
  * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include "btrfs_drv.h"
+#include "crc32c.h"
 
 #define SEF_DACL_AUTO_INHERIT 0x01
 #define SEF_SACL_AUTO_INHERIT 0x02
@@ -51,8 +52,24 @@ static dacl def_dacls[] = {
 };
 
 extern LIST_ENTRY uid_map_list, gid_map_list;
+extern LIST_ENTRY uid_map_sid_hash[MAPPING_HASH_SIZE], uid_map_uid_hash[MAPPING_HASH_SIZE], gid_map_sid_hash[MAPPING_HASH_SIZE];
 extern ERESOURCE mapping_lock;
 
+static __inline unsigned int mapping_hash(uint32_t val) {
+    return (val * 0x9e3779b1) >> (32 - MAPPING_HASH_BITS);
+}
+
+// Almost all mapped SIDs are either domain accounts or Samba's S-1-22-x-y, which only differ
+// in their last subauthority.
+static __inline unsigned int sid_hash(PSID sid) {
+    sid_header* sh = sid;
+
+    if (sh->elements == 0)
+        return 0;
+
+    return mapping_hash(sh->nums[sh->elements - 1] ^ sh->elements);
+}
+
 void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, uint32_t uid) {
     unsigned int i, np;
     uint8_t numdashes;
@@ -140,6 +157,8 @@ void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, uint32_t uid) {
     um->uid = uid;
 
     InsertTailList(&uid_map_list, &um->listentry);
+    InsertTailList(&uid_map_sid_hash[sid_hash(sid)], &um->list_entry_sid_hash);
+    InsertTailList(&uid_map_uid_hash[mapping_hash(uid)], &um->list_entry_uid_hash);
 }
 
 void add_group_mapping(WCHAR* sidstring, ULONG sidstringlength, uint32_t gid) {
@@ -224,18 +243,20 @@ void add_group_mapping(WCHAR* sidstring, ULONG sidstringlength, uint32_t gid) {
     gm->gid = gid;
 
     InsertTailList(&gid_map_list, &gm->listentry);
+    InsertTailList(&gid_map_sid_hash[sid_hash(sid)], &gm->list_entry_sid_hash);
 }
 
 NTSTATUS uid_to_sid(uint32_t uid, PSID* sid) {
+    LIST_ENTRY* bucket = &uid_map_uid_hash[mapping_hash(uid)];
     LIST_ENTRY* le;
     sid_header* sh;
     UCHAR els;
 
     ExAcquireResourceSharedLite(&mapping_lock, true);
 
-    le = uid_map_list.Flink;
-    while (le != &uid_map_list) {
-        uid_map* um = CONTAINING_RECORD(le, uid_map, listentry);
+    le = bucket->Flink;
+    while (le != bucket) {
+        uid_map* um = CONTAINING_RECORD(le, uid_map, list_entry_uid_hash);
 
         if (um->uid == uid) {
             *sid = ExAllocatePoolWithTag(PagedPool, RtlLengthSid(um->sid), ALLOC_TAG);
@@ -308,14 +329,15 @@ NTSTATUS uid_to_sid(uint32_t uid, PSID* sid) {
 }
 
 uint32_t sid_to_uid(PSID sid) {
+    LIST_ENTRY* bucket = &uid_map_sid_hash[sid_hash(sid)];
     LIST_ENTRY* le;
     sid_header* sh = sid;
 
     ExAcquireResourceSharedLite(&mapping_lock, true);
 
-    le = uid_map_list.Flink;
-    while (le != &uid_map_list) {
-        uid_map* um = CONTAINING_RECORD(le, uid_map, listentry);
+    le = bucket->Flink;
+    while (le != bucket) {
+        uid_map* um = CONTAINING_RECORD(le, uid_map, list_entry_sid_hash);
 
         if (RtlEqualSid(sid, um->sid)) {
             ExReleaseResourceLite(&mapping_lock);
@@ -412,6 +434,302 @@ static ACL* load_default_acl() {
     return acl;
 }
 
+#define SD_CACHE_BUCKETS 256
+#define SD_SYNTH_BUCKETS 256
+
+typedef struct _sd_cache_entry {
+    LIST_ENTRY list_entry;
+    LIST_ENTRY synth_as_parent;
+    LIST_ENTRY synth_as_result;
+    ULONG refcount;
+    uint32_t hash;
+    ULONG length;
+    SECURITY_DESCRIPTOR* sd;
+} sd_cache_entry;
+
+// Remembers what fcb_get_sd synthesized for a given parent SD, owner and group. These don't hold
+// references - they go away when either SD does.
+typedef struct {
+    LIST_ENTRY list_entry;
+    LIST_ENTRY list_entry_parent;
+    LIST_ENTRY list_entry_result;
+    sd_cache_entry* parent;
+    sd_cache_entry* result;
+    uint32_t uid;
+    uint32_t gid;
+    bool is_dir;
+} sd_synth_entry;
+
+NTSTATUS init_sd_cache(_In_ device_extension* Vcb) {
+    sd_cache_info* sdc = &Vcb->sd_cache;
+
+    sdc->buckets = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY) * (SD_CACHE_BUCKETS + SD_SYNTH_BUCKETS), ALLOC_TAG);
+    if (!sdc->buckets) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    sdc->synth_buckets = &sdc->buckets[SD_CACHE_BUCKETS];
+
+    for (ULONG i = 0; i < SD_CACHE_BUCKETS + SD_SYNTH_BUCKETS; i++) {
+        InitializeListHead(&sdc->buckets[i]);
+    }
+
+    ExInitializeFastMutex(&sdc->mutex);
+    sdc->num_entries = 0;
+    sdc->bytes = 0;
+    sdc->bytes_saved = 0;
+    sdc->hits = 0;
+    sdc->misses = 0;
+    sdc->synth_hits = 0;
+    sdc->synth_misses = 0;
+    sdc->synth_generation = 0;
+
+    return STATUS_SUCCESS;
+}
+
+static void free_synth_entry(sd_synth_entry* se) {
+    RemoveEntryList(&se->list_entry);
+    RemoveEntryList(&se->list_entry_parent);
+    RemoveEntryList(&se->list_entry_result);
+    ExFreePool(se);
+}
+
+static void free_sd_cache_entry(sd_cache_info* sdc, sd_cache_entry* ent) {
+    while (!IsListEmpty(&ent->synth_as_parent)) {
+        free_synth_entry(CONTAINING_RECORD(ent->synth_as_parent.Flink, sd_synth_entry, list_entry_parent));
+    }
+
+    while (!IsListEmpty(&ent->synth_as_result)) {
+        free_synth_entry(CONTAINING_RECORD(ent->synth_as_result.Flink, sd_synth_entry, list_entry_result));
+    }
+
+    RemoveEntryList(&ent->list_entry);
+
+    sdc->num_entries--;
+    sdc->bytes -= ent->length;
+
+    ExFreePool(ent);
+}
+
+// Only called once all the FCBs are gone, so anything left here is a leak.
+void free_sd_cache(_In_ device_extension* Vcb) {
+    sd_cache_info* sdc = &Vcb->sd_cache;
+
+    if (!sdc->buckets)
+        return;
+
+    for (ULONG i = 0; i < SD_CACHE_BUCKETS; i++) {
+        while (!IsListEmpty(&sdc->buckets[i])) {
+            sd_cache_entry* ent = CONTAINING_RECORD(sdc->buckets[i].Flink, sd_cache_entry, list_entry);
+
+            ERR("SD cache entry %p still had refcount %lu\n", ent, ent->refcount);
+            free_sd_cache_entry(sdc, ent);
+        }
+    }
+
+    ExFreePool(sdc->buckets);
+    sdc->buckets = NULL;
+}
+
+// Called when the uid and gid mappings are reloaded, as what we've synthesized has the old owner
+// and group SIDs in it. The SDs themselves stay, as FCBs are still using them.
+void flush_sd_synth_cache(_In_ device_extension* Vcb) {
+    sd_cache_info* sdc = &Vcb->sd_cache;
+
+    if (!sdc->buckets)
+        return;
+
+    ExAcquireFastMutex(&sdc->mutex);
+
+    for (ULONG i = 0; i < SD_SYNTH_BUCKETS; i++) {
+        while (!IsListEmpty(&sdc->synth_buckets[i])) {
+            free_synth_entry(CONTAINING_RECORD(sdc->synth_buckets[i].Flink, sd_synth_entry, list_entry));
+        }
+    }
+
+    // so that anything synthesized under the old mappings while we were doing this doesn't get cached
+    sdc->synth_generation++;
+
+    ExReleaseFastMutex(&sdc->mutex);
+}
+
+// Called with the mutex held. On success the FCB's private copy of its SD is replaced by a
+// reference to the shared one.
+static void share_fcb_sd_locked(sd_cache_info* sdc, fcb* fcb) {
+    ULONG length = RtlLengthSecurityDescriptor(fcb->sd);
+    uint32_t hash = calc_crc32c(0xffffffff, (uint8_t*)fcb->sd, length);
+    LIST_ENTRY* bucket = &sdc->buckets[hash % SD_CACHE_BUCKETS];
+    LIST_ENTRY* le;
+    sd_cache_entry* ent;
+
+    le = bucket->Flink;
+    while (le != bucket) {
+        ent = CONTAINING_RECORD(le, sd_cache_entry, list_entry);
+
+        if (ent->hash == hash && ent->length == length && RtlCompareMemory(ent->sd, fcb->sd, length) == length) {
+            ent->refcount++;
+            sdc->hits++;
+            sdc->bytes_saved += length;
+
+            ExFreePool(fcb->sd);
+            fcb->sd = ent->sd;
+            fcb->sd_entry = ent;
+
+            return;
+        }
+
+        le = le->Flink;
+    }
+
+    sdc->misses++;
+
+    ent = ExAllocatePoolWithTag(PagedPool, sizeof(sd_cache_entry) + length, ALLOC_TAG);
+    if (!ent) {
+        ERR("out of memory\n");
+        return;
+    }
+
+    ent->refcount = 1;
+    ent->hash = hash;
+    ent->length = length;
+    ent->sd = (SECURITY_DESCRIPTOR*)&ent[1];
+    RtlCopyMemory(ent->sd, fcb->sd, length);
+    InitializeListHead(&ent->synth_as_parent);
+    InitializeListHead(&ent->synth_as_result);
+    InsertTailList(bucket, &ent->list_entry);
+
+    sdc->num_entries++;
+    sdc->bytes += length;
+
+    ExFreePool(fcb->sd);
+    fcb->sd = ent->sd;
+    fcb->sd_entry = ent;
+}
+
+void share_fcb_sd(_In_ fcb* fcb) {
+    sd_cache_info* sdc = &fcb->Vcb->sd_cache;
+
+    if (!fcb->sd || fcb->sd_entry)
+        return;
+
+    ExAcquireFastMutex(&sdc->mutex);
+    share_fcb_sd_locked(sdc, fcb);
+    ExReleaseFastMutex(&sdc->mutex);
+}
+
+void free_fcb_sd(_In_ fcb* fcb) {
+    sd_cache_info* sdc = &fcb->Vcb->sd_cache;
+    sd_cache_entry* ent = fcb->sd_entry;
+
+    if (!ent) {
+        if (fcb->sd)
+            ExFreePool(fcb->sd);
+
+        fcb->sd = NULL;
+        return;
+    }
+
+    ExAcquireFastMutex(&sdc->mutex);
+
+    fcb->sd = NULL;
+    fcb->sd_entry = NULL;
+
+    ent->refcount--;
+
+    if (ent->refcount == 0)
+        free_sd_cache_entry(sdc, ent);
+    else
+        sdc->bytes_saved -= ent->length;
+
+    ExReleaseFastMutex(&sdc->mutex);
+}
+
+static __inline LIST_ENTRY* sd_synth_bucket(sd_cache_info* sdc, sd_cache_entry* parent, uint32_t uid, uint32_t gid) {
+    return &sdc->synth_buckets[(parent->hash ^ uid ^ (gid << 16) ^ (gid >> 16)) % SD_SYNTH_BUCKETS];
+}
+
+static sd_synth_entry* find_synth_entry(sd_cache_info* sdc, sd_cache_entry* parent, uint32_t uid, uint32_t gid, bool is_dir) {
+    LIST_ENTRY* bucket = sd_synth_bucket(sdc, parent, uid, gid);
+    LIST_ENTRY* le = bucket->Flink;
+
+    while (le != bucket) {
+        sd_synth_entry* se = CONTAINING_RECORD(le, sd_synth_entry, list_entry);
+
+        if (se->parent == parent && se->uid == uid && se->gid == gid && se->is_dir == is_dir)
+            return se;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
+// If we've already synthesized an SD for this parent, owner and group, share that rather than
+// going through SeAssignSecurityEx again.
+static bool get_synthesized_sd(fcb* fcb, struct _fcb* parent, ULONG* generation) {
+    sd_cache_info* sdc = &fcb->Vcb->sd_cache;
+    sd_synth_entry* se;
+    bool ret = false;
+
+    ExAcquireFastMutex(&sdc->mutex);
+
+    *generation = sdc->synth_generation;
+
+    if (parent->sd_entry) {
+        se = find_synth_entry(sdc, parent->sd_entry, fcb->inode_item.st_uid, fcb->inode_item.st_gid, fcb->type == BTRFS_TYPE_DIRECTORY);
+
+        if (se) {
+            se->result->refcount++;
+            sdc->synth_hits++;
+            sdc->bytes_saved += se->result->length;
+
+            fcb->sd = se->result->sd;
+            fcb->sd_entry = se->result;
+
+            ret = true;
+        } else
+            sdc->synth_misses++;
+    }
+
+    ExReleaseFastMutex(&sdc->mutex);
+
+    return ret;
+}
+
+static void cache_synthesized_sd(fcb* fcb, struct _fcb* parent, ULONG generation) {
+    sd_cache_info* sdc = &fcb->Vcb->sd_cache;
+    uint32_t uid = fcb->inode_item.st_uid, gid = fcb->inode_item.st_gid;
+    bool is_dir = fcb->type == BTRFS_TYPE_DIRECTORY;
+    sd_synth_entry* se;
+
+    ExAcquireFastMutex(&sdc->mutex);
+
+    share_fcb_sd_locked(sdc, fcb);
+
+    if (!fcb->sd_entry || !parent->sd_entry || generation != sdc->synth_generation || find_synth_entry(sdc, parent->sd_entry, uid, gid, is_dir))
+        goto end;
+
+    se = ExAllocatePoolWithTag(PagedPool, sizeof(sd_synth_entry), ALLOC_TAG);
+    if (!se) {
+        ERR("out of memory\n");
+        goto end;
+    }
+
+    se->parent = parent->sd_entry;
+    se->result = fcb->sd_entry;
+    se->uid = uid;
+    se->gid = gid;
+    se->is_dir = is_dir;
+
+    InsertTailList(sd_synth_bucket(sdc, se->parent, uid, gid), &se->list_entry);
+    InsertTailList(&se->parent->synth_as_parent, &se->list_entry_parent);
+    InsertTailList(&se->result->synth_as_result, &se->list_entry_result);
+
+end:
+    ExReleaseFastMutex(&sdc->mutex);
+}
+
 static void get_top_level_sd(fcb* fcb) {
     NTSTATUS Status;
     SECURITY_DESCRIPTOR sd;
@@ -517,17 +835,23 @@ void fcb_get_sd(fcb* fcb, struct _fcb* parent, bool look_for_xattr, PIRP Irp) {
     PSECURITY_DESCRIPTOR newsd;
     PACL dacl, sacl;
     PSID owner, group;
-    ULONG abssdlen = 0, dacllen = 0, sacllen = 0, ownerlen = 0, grouplen = 0;
+    ULONG abssdlen = 0, dacllen = 0, sacllen = 0, ownerlen = 0, grouplen = 0, generation;
     uint8_t* buf;
 
-    if (look_for_xattr && get_xattr(fcb->Vcb, fcb->subvol, fcb->inode, EA_NTACL, EA_NTACL_HASH, (uint8_t**)&fcb->sd, (uint16_t*)&buflen, Irp))
+    if (look_for_xattr && get_xattr(fcb->Vcb, fcb->subvol, fcb->inode, EA_NTACL, EA_NTACL_HASH, (uint8_t**)&fcb->sd, (uint16_t*)&buflen, Irp)) {
+        share_fcb_sd(fcb);
         return;
+    }
 
     if (!parent) {
         get_top_level_sd(fcb);
+        share_fcb_sd(fcb);
         return;
     }
 
+    if (get_synthesized_sd(fcb, parent, &generation))
+        return;
+
     SeCaptureSubjectContext(&subjcont);
 
     Status = SeAssignSecurityEx(parent->sd, NULL, (void**)&fcb->sd, NULL, fcb->type == BTRFS_TYPE_DIRECTORY, SEF_DACL_AUTO_INHERIT,
@@ -631,6 +955,8 @@ void fcb_get_sd(fcb* fcb, struct _fcb* parent, bool look_for_xattr, PIRP Irp) {
     ExFreePool(usersid);
     ExFreePool(groupsid);
     ExFreePool(buf);
+
+    cache_synthesized_sd(fcb, parent, generation);
 }
 
 static NTSTATUS get_file_security(PFILE_OBJECT FileObject, SECURITY_DESCRIPTOR* relsd, ULONG* buflen, SECURITY_INFORMATION flags) {
@@ -758,7 +1084,7 @@ static NTSTATUS set_file_security(device_extension* Vcb, PFILE_OBJECT FileObject
     fcb* fcb = FileObject->FsContext;
     ccb* ccb = FileObject->FsContext2;
     file_ref* fileref = ccb ? ccb->fileref : NULL;
-    SECURITY_DESCRIPTOR* oldsd;
+    SECURITY_DESCRIPTOR* newsd;
     LARGE_INTEGER time;
     BTRFS_TIME now;
 
@@ -786,16 +1112,17 @@ static NTSTATUS set_file_security(device_extension* Vcb, PFILE_OBJECT FileObject
         goto end;
     }
 
-    oldsd = fcb->sd;
+    newsd = fcb->sd;
 
-    Status = SeSetSecurityDescriptorInfo(NULL, flags, sd, (void**)&fcb->sd, PagedPool, IoGetFileObjectGenericMapping());
+    Status = SeSetSecurityDescriptorInfo(NULL, flags, sd, (void**)&newsd, PagedPool, IoGetFileObjectGenericMapping());
 
     if (!NT_SUCCESS(Status)) {
         ERR("SeSetSecurityDescriptorInfo returned %08lx\n", Status);
         goto end;
     }
 
-    ExFreePool(oldsd);
+    free_fcb_sd(fcb);
+    fcb->sd = newsd;
 
     KeQuerySystemTime(&time);
     win_time_to_unix(time, &now);
@@ -904,11 +1231,12 @@ end:
 }
 
 static bool search_for_gid(fcb* fcb, PSID sid) {
+    LIST_ENTRY* bucket = &gid_map_sid_hash[sid_hash(sid)];
     LIST_ENTRY* le;
 
-    le = gid_map_list.Flink;
-    while (le != &gid_map_list) {
-        gid_map* gm = CONTAINING_RECORD(le, gid_map, listentry);
+    le = bucket->Flink;
+    while (le != bucket) {
+        gid_map* gm = CONTAINING_RECORD(le, gid_map, list_entry_sid_hash);
 
         if (RtlEqualSid(sid, gm->sid)) {
             fcb->inode_item.st_gid = gm->gid;
@@ -1008,5 +1336,7 @@ NTSTATUS fcb_get_new_sd(fcb* fcb, file_ref* parfileref, ACCESS_STATE* as) {
 
     find_gid(fcb, parfileref ? parfileref->fcb : NULL, &as->SubjectSecurityContext);
 
+    share_fcb_sd(fcb);
+
     return STATUS_SUCCESS;
 }
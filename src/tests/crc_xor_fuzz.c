@@ -0,0 +1,234 @@
+/* Copyright (c) Mark Harmstone 2016-17
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Differential fuzzer for the word-at-a-time checksum and parity code: the slicing-by-8
+ * calc_crc32c_sw in crc32c.c, galois_double in galois.c (the SSE2 loop, the 64-bit loop and
+ * the byte tail) and the XOR functions used for RAID5 and RAID6 parity - do_xor_basic in
+ * galois.c, and do_xor_sse2 and do_xor_avx2 in xor-gas.S. Each is given random data of random
+ * length at random alignments, and compared against the obvious byte-at-a-time version below.
+ *
+ * calc_crc32c_sw is only built in C on architectures other than x86 and amd64, so we include
+ * crc32c.c before defining _AMD64_ to get it; galois.c is built as it would be for amd64.
+ *
+ * It isn't part of the CMake build, as that only targets Windows. On amd64 Linux:
+ *
+ *     gcc -O2 -o crc_xor_fuzz src/tests/crc_xor_fuzz.c src/xor-gas.S && ./crc_xor_fuzz [iterations] [seed] */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef __x86_64__
+#error "amd64 only - this is where the SSE2 and AVX2 versions live"
+#endif
+
+#define __stdcall
+#define __inline inline
+#define _In_
+#define _In_reads_bytes_(x)
+
+#define CRC_XOR_FUZZ
+#include "../crc32c.c"
+
+#define _AMD64_
+#include "../galois.c"
+
+// xor-gas.S follows the Windows calling convention
+typedef void (__attribute__((ms_abi)) *asm_xor_func)(uint8_t* buf1, uint8_t* buf2, uint32_t len);
+
+void __attribute__((ms_abi)) do_xor_sse2(uint8_t* buf1, uint8_t* buf2, uint32_t len);
+void __attribute__((ms_abi)) do_xor_avx2(uint8_t* buf1, uint8_t* buf2, uint32_t len);
+
+#define MAX_LEN 9000
+
+static uint32_t ref_crc32c(uint32_t seed, const uint8_t* msg, uint32_t msglen) {
+    uint32_t rem = seed;
+
+    for (uint32_t i = 0; i < msglen; i++) {
+        rem ^= msg[i];
+
+        for (unsigned int j = 0; j < 8; j++) {
+            rem = (rem >> 1) ^ (rem & 1 ? 0x82f63b78 : 0);
+        }
+    }
+
+    return rem;
+}
+
+static void ref_galois_double(uint8_t* data, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        data[i] = (uint8_t)(data[i] << 1) ^ (data[i] & 0x80 ? 0x1d : 0);
+    }
+}
+
+static void ref_xor(uint8_t* buf1, const uint8_t* buf2, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        buf1[i] ^= buf2[i];
+    }
+}
+
+static uint32_t rnd_state;
+
+static uint32_t rnd(uint32_t n) {
+    // xorshift32 - good enough, and the same everywhere for a given seed
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+
+    return n == 0 ? 0 : rnd_state % n;
+}
+
+static uint32_t gen_len() {
+    // mostly short, so the tails get a good going-over, but sometimes a few pages
+    switch (rnd(4)) {
+        case 0:
+            return rnd(64);
+
+        case 1:
+            return rnd(MAX_LEN + 1);
+
+        case 2:
+            return (rnd(2) + 1) * 4096 + rnd(3) - 1;
+
+        default:
+            return rnd(512);
+    }
+}
+
+static void gen_data(uint8_t* buf, uint32_t len) {
+    uint32_t mode = rnd(8);
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (mode == 0) // lots of top bits set, for galois_double
+            buf[i] = 0x80 | (uint8_t)rnd(0x80);
+        else if (mode == 1)
+            buf[i] = rnd(4) == 0 ? 0xff : 0;
+        else
+            buf[i] = (uint8_t)rnd(0x100);
+    }
+}
+
+static unsigned long failures = 0;
+
+static void fail(const char* impl, const char* func, unsigned long it, const char* what) {
+    failures++;
+
+    if (failures <= 20)
+        fprintf(stderr, "%s: %s: iteration %lu: %s differs\n", impl, func, it, what);
+}
+
+static void check_crc32c(unsigned long it) {
+    uint8_t buf[MAX_LEN + 32];
+    uint32_t len = gen_len(), off = rnd(16), seed = rnd(4) == 0 ? 0xffffffff : rnd_state;
+
+    gen_data(buf + off, len);
+
+    if (ref_crc32c(seed, buf + off, len) != calc_crc32c_sw(seed, buf + off, len))
+        fail("slicing-by-8", "calc_crc32c_sw", it, "checksum");
+}
+
+// 16 bytes of slack either side of the data, so we notice anything written out of bounds
+
+static void check_galois_double(unsigned long it) {
+    uint8_t buf1[MAX_LEN + 32], buf2[MAX_LEN + 32];
+    uint32_t len = gen_len(), off = rnd(16);
+
+    memset(buf1, 0xcc, sizeof(buf1));
+    gen_data(buf1 + 16 + off, len);
+    memcpy(buf2, buf1, sizeof(buf1));
+
+    ref_galois_double(buf1 + 16 + off, len);
+    galois_double(buf2 + 16 + off, len);
+
+    if (memcmp(buf1, buf2, sizeof(buf1)))
+        fail("SSE2", "galois_double", it, "output");
+}
+
+static void check_xor(const char* impl, asm_xor_func asm_func, unsigned long it) {
+    uint8_t buf1[MAX_LEN + 32], buf2[MAX_LEN + 32], src[MAX_LEN + 32];
+    uint32_t len = gen_len(), off1, off2;
+
+    // the SIMD loops only run when both buffers are 16-byte aligned, so make sure that happens often
+    off1 = rnd(16);
+    off2 = rnd(2) == 0 ? off1 : rnd(16);
+
+    memset(buf1, 0xcc, sizeof(buf1));
+    gen_data(buf1 + 16 + off1, len);
+    memcpy(buf2, buf1, sizeof(buf1));
+    gen_data(src + off2, len);
+
+    ref_xor(buf1 + 16 + off1, src + off2, len);
+
+    if (asm_func)
+        asm_func(buf2 + 16 + off1, src + off2, len);
+    else
+        do_xor_basic(buf2 + 16 + off1, src + off2, len);
+
+    if (memcmp(buf1, buf2, sizeof(buf1)))
+        fail(impl, "do_xor", it, "output");
+}
+
+int main(int argc, char* argv[]) {
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+    uint32_t seed = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 0) : 1;
+    static const struct {
+        const char* name;
+        asm_xor_func func;
+        bool avx2;
+    } xor_impls[] = {
+        { "portable", NULL, false },
+        { "SSE2", do_xor_sse2, false },
+        { "AVX2", do_xor_avx2, true }
+    };
+
+    rnd_state = seed != 0 ? seed : 1;
+
+    for (unsigned long it = 0; it < iterations; it++) {
+        check_crc32c(it);
+    }
+
+    printf("calc_crc32c_sw: %lu iterations\n", iterations);
+
+    rnd_state = seed != 0 ? seed : 1;
+
+    for (unsigned long it = 0; it < iterations; it++) {
+        check_galois_double(it);
+    }
+
+    printf("galois_double: %lu iterations\n", iterations);
+
+    for (unsigned int i = 0; i < sizeof(xor_impls) / sizeof(xor_impls[0]); i++) {
+        if (xor_impls[i].avx2 && !__builtin_cpu_supports("avx2")) {
+            printf("do_xor (%s): skipped, CPU doesn't have it\n", xor_impls[i].name);
+            continue;
+        }
+
+        rnd_state = seed != 0 ? seed : 1;
+
+        for (unsigned long it = 0; it < iterations; it++) {
+            check_xor(xor_impls[i].name, xor_impls[i].func, it);
+        }
+
+        printf("do_xor (%s): %lu iterations\n", xor_impls[i].name, iterations);
+    }
+
+    printf("%lu failures\n", failures);
+
+    return failures == 0 ? 0 : 1;
+}
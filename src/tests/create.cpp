@@ -1,4 +1,7 @@
 #include "test.h"
+#include "../btrfsioctl.h"
+#include <chrono>
+#include <random>
 
 #define FSCTL_CREATE_OR_GET_OBJECT_ID CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 48, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
@@ -20,6 +23,191 @@ static OBJECT_BASIC_INFORMATION query_object_basic_information(HANDLE h) {
     return obi;
 }
 
+static unique_handle open_driver_key(const u16string_view& subkey, bool& created) {
+    NTSTATUS Status;
+    HANDLE h;
+    UNICODE_STRING us;
+    OBJECT_ATTRIBUTES oa;
+    ULONG dispos;
+    u16string path = u"\\Registry\\Machine\\SYSTEM\\CurrentControlSet\\Services\\btrfs\\";
+
+    path += subkey;
+
+    oa.Length = sizeof(oa);
+    oa.RootDirectory = nullptr;
+
+    us.Length = us.MaximumLength = path.length() * sizeof(char16_t);
+    us.Buffer = (WCHAR*)path.data();
+    oa.ObjectName = &us;
+
+    oa.Attributes = OBJ_CASE_INSENSITIVE;
+    oa.SecurityDescriptor = nullptr;
+    oa.SecurityQualityOfService = nullptr;
+
+    Status = NtCreateKey(&h, KEY_SET_VALUE | DELETE, &oa, 0, nullptr, REG_OPTION_NON_VOLATILE, &dispos);
+
+    if (Status != STATUS_SUCCESS)
+        throw ntstatus_error(Status);
+
+    created = dispos == REG_CREATED_NEW_KEY;
+
+    return unique_handle(h);
+}
+
+static void set_dword_value(HANDLE h, const u16string_view& name, uint32_t val) {
+    NTSTATUS Status;
+    UNICODE_STRING us;
+
+    us.Length = us.MaximumLength = name.length() * sizeof(char16_t);
+    us.Buffer = (WCHAR*)name.data();
+
+    Status = NtSetValueKey(h, &us, 0, REG_DWORD, &val, sizeof(val));
+
+    if (Status != STATUS_SUCCESS)
+        throw ntstatus_error(Status);
+}
+
+static void delete_value(HANDLE h, const u16string_view& name, bool missing_ok = false) {
+    NTSTATUS Status;
+    UNICODE_STRING us;
+
+    us.Length = us.MaximumLength = name.length() * sizeof(char16_t);
+    us.Buffer = (WCHAR*)name.data();
+
+    Status = NtDeleteValueKey(h, &us);
+
+    if (Status == STATUS_OBJECT_NAME_NOT_FOUND && missing_ok)
+        return;
+
+    if (Status != STATUS_SUCCESS)
+        throw ntstatus_error(Status);
+}
+
+static void delete_key(HANDLE h) {
+    NTSTATUS Status;
+
+    Status = NtDeleteKey(h);
+
+    if (Status != STATUS_SUCCESS)
+        throw ntstatus_error(Status);
+}
+
+static u16string token_owner_sid() {
+    NTSTATUS Status;
+    HANDLE h;
+    alignas(TOKEN_OWNER) uint8_t buf[256];
+    ULONG retlen;
+
+    Status = NtOpenProcessToken(NtCurrentProcess(), TOKEN_QUERY, &h);
+
+    if (Status != STATUS_SUCCESS)
+        throw ntstatus_error(Status);
+
+    unique_handle token(h);
+
+    Status = NtQueryInformationToken(token.get(), TokenOwner, buf, sizeof(buf), &retlen);
+
+    if (Status != STATUS_SUCCESS)
+        throw ntstatus_error(Status);
+
+    auto sid = (SID*)((TOKEN_OWNER*)buf)->Owner;
+    uint64_t auth = 0;
+
+    for (unsigned int i = 0; i < 6; i++) {
+        auth = (auth << 8) | sid->IdentifierAuthority.Value[i];
+    }
+
+    auto s = fmt::format("S-{}-{}", sid->Revision, auth);
+
+    for (unsigned int i = 0; i < sid->SubAuthorityCount; i++) {
+        s += fmt::format("-{}", sid->SubAuthority[i]);
+    }
+
+    return u16string(s.begin(), s.end());
+}
+
+static btrfs_inode_info query_inode_info(HANDLE h) {
+    NTSTATUS Status;
+    btrfs_inode_info bii;
+    IO_STATUS_BLOCK iosb;
+
+    auto ev = create_event();
+
+    Status = NtFsControlFile(h, ev.get(), nullptr, nullptr, &iosb,
+                             FSCTL_BTRFS_GET_INODE_INFO, nullptr, 0,
+                             &bii, sizeof(bii));
+
+    if (Status == STATUS_PENDING) {
+        Status = NtWaitForSingleObject(ev.get(), false, nullptr);
+        if (Status != STATUS_SUCCESS)
+            throw ntstatus_error(Status);
+
+        Status = iosb.Status;
+    }
+
+    if (Status != STATUS_SUCCESS)
+        throw ntstatus_error(Status);
+
+    return bii;
+}
+
+static void create_subvol(HANDLE dir, u16string_view name) {
+    NTSTATUS Status;
+    IO_STATUS_BLOCK iosb;
+    vector<uint8_t> buf(offsetof(btrfs_create_subvol, name) + (name.size() * sizeof(char16_t)));
+
+    auto& bcs = *(btrfs_create_subvol*)buf.data();
+
+    bcs.readonly = false;
+    bcs.posix = false;
+    bcs.namelen = (USHORT)(name.size() * sizeof(char16_t));
+    memcpy(bcs.name, name.data(), bcs.namelen);
+
+    auto ev = create_event();
+
+    Status = NtFsControlFile(dir, ev.get(), nullptr, nullptr, &iosb,
+                             FSCTL_BTRFS_CREATE_SUBVOL, buf.data(), (ULONG)buf.size(),
+                             nullptr, 0);
+
+    if (Status == STATUS_PENDING) {
+        Status = NtWaitForSingleObject(ev.get(), false, nullptr);
+        if (Status != STATUS_SUCCESS)
+            throw ntstatus_error(Status);
+
+        Status = iosb.Status;
+    }
+
+    if (Status != STATUS_SUCCESS)
+        throw ntstatus_error(Status);
+}
+
+static u16string mapping_name(unsigned int i) {
+    auto s = fmt::format("S-1-5-21-1000-2000-3000-{}", 100000 + i);
+
+    return u16string(s.begin(), s.end());
+}
+
+static void create_and_delete_files(const u16string& dir, unsigned int num_files, const string& desc) {
+    chrono::steady_clock::duration elapsed{};
+
+    test("Create and delete files (" + desc + ")", [&]() {
+        auto start = chrono::steady_clock::now();
+
+        for (unsigned int i = 0; i < num_files; i++) {
+            auto s = fmt::format("{}", i);
+
+            create_file(dir + u"\\" + u16string(s.begin(), s.end()), DELETE, 0, 0, FILE_CREATE,
+                        FILE_NON_DIRECTORY_FILE | FILE_DELETE_ON_CLOSE, FILE_CREATED);
+        }
+
+        elapsed = chrono::steady_clock::now() - start;
+    });
+
+    if (elapsed.count() != 0)
+        fmt::print("Created and deleted {} files {} in {} us\n", num_files, desc,
+                   chrono::duration_cast<chrono::microseconds>(elapsed).count());
+}
+
 void test_create(const u16string& dir) {
     unique_handle h;
 
@@ -698,6 +886,331 @@ void test_create(const u16string& dir) {
         create_file(dir + u"\\CON", MAXIMUM_ALLOWED, 0, 0, FILE_CREATE, 0, FILE_CREATED);
     });
 
+    test("Create directory", [&]() {
+        create_file(dir + u"\\notify", FILE_LIST_DIRECTORY, 0, 0, FILE_CREATE, FILE_DIRECTORY_FILE, FILE_CREATED);
+    });
+
+    {
+        static const unsigned int num_files = 1000;
+
+        create_and_delete_files(dir + u"\\notify", num_files, "without watchers");
+
+        unique_handle dirh;
+
+        test("Open directory", [&]() {
+            dirh = create_file(dir + u"\\notify", FILE_LIST_DIRECTORY, 0,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               FILE_OPEN, FILE_DIRECTORY_FILE, FILE_OPENED);
+        });
+
+        if (dirh) {
+            IO_STATUS_BLOCK iosb;
+            uint8_t buf[4096];
+            auto ev = create_event();
+
+            // the watch stays registered after this completes, until the handle is closed
+            test("Watch directory", [&]() {
+                auto Status = NtNotifyChangeDirectoryFile(dirh.get(), ev.get(), nullptr, nullptr, &iosb, buf, sizeof(buf),
+                                                          FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE,
+                                                          false);
+
+                if (Status != STATUS_PENDING)
+                    throw ntstatus_error(Status);
+            });
+
+            create_and_delete_files(dir + u"\\notify", num_files, "with watcher");
+
+            dirh.reset();
+        }
+    }
+
+    test("Create directory", [&]() {
+        create_file(dir + u"\\sdshare", MAXIMUM_ALLOWED, 0, 0, FILE_CREATE, FILE_DIRECTORY_FILE, FILE_CREATED);
+    });
+
+    test("Create files", [&]() {
+        create_file(dir + u"\\sdshare\\file1", MAXIMUM_ALLOWED, 0, 0, FILE_CREATE, 0, FILE_CREATED);
+        create_file(dir + u"\\sdshare\\file2", MAXIMUM_ALLOWED, 0, 0, FILE_CREATE, 0, FILE_CREATED);
+    });
+
+    // both files inherit the same SD, so will be sharing a copy of it
+    test("Clear DACL of file 1", [&]() {
+        auto h = create_file(dir + u"\\sdshare\\file1", WRITE_DAC, 0, 0, FILE_OPEN, 0, FILE_OPENED);
+
+        set_dacl(h.get(), 0);
+    });
+
+    test("Try to open file 1", [&]() {
+        exp_status([&]() {
+            create_file(dir + u"\\sdshare\\file1", FILE_READ_DATA, 0, 0, FILE_OPEN, 0, FILE_OPENED);
+        }, STATUS_ACCESS_DENIED);
+    });
+
+    test("Open file 2", [&]() {
+        create_file(dir + u"\\sdshare\\file2", FILE_READ_DATA, 0, 0, FILE_OPEN, 0, FILE_OPENED);
+    });
+
+    test("Create directory", [&]() {
+        create_file(dir + u"\\mappings", FILE_LIST_DIRECTORY, 0, 0, FILE_CREATE, FILE_DIRECTORY_FILE, FILE_CREATED);
+    });
+
+    {
+        static const unsigned int num_files = 1000, num_mappings = 10000;
+        static const uint32_t owner_uid = 99999;
+
+        create_and_delete_files(dir + u"\\mappings", num_files, "without mappings");
+
+        // The mappings only mean anything to our driver, and we can only see when it has picked
+        // them up by asking it for the uid it gave a new file.
+        if (fstype == fs_type::btrfs) {
+            // removes whatever we managed to add, even if a test below throws
+            struct mappings_restorer {
+                ~mappings_restorer() {
+                    try {
+                        if (umh) {
+                            for (unsigned int i = 0; i < added; i++) {
+                                delete_value(umh.get(), mapping_name(i), true);
+                            }
+
+                            if (!owner.empty())
+                                delete_value(umh.get(), owner, true);
+
+                            if (umh_created)
+                                delete_key(umh.get());
+                        }
+
+                        if (gmh) {
+                            for (unsigned int i = 0; i < added; i++) {
+                                delete_value(gmh.get(), mapping_name(i), true);
+                            }
+
+                            if (gmh_created)
+                                delete_key(gmh.get());
+                        }
+                    } catch (const exception& e) {
+                        fmt::print(stderr, "Could not remove user and group mappings: {}\n", e.what());
+                    }
+                }
+
+                unique_handle umh, gmh;
+                bool umh_created = false, gmh_created = false;
+                unsigned int added = 0;
+                u16string owner;
+            } maps;
+
+            // Creating a file looks up the owner's SID in the user mappings, and the owner and every
+            // group in its token in the group mappings. Apart from the owner's user mapping, which
+            // tells us when the driver has reread the key, none of these SIDs will be mapped, which
+            // used to mean walking every mapping for each of them.
+            test("Add user and group mappings", [&]() {
+                maps.umh = open_driver_key(u"Mappings", maps.umh_created);
+                maps.gmh = open_driver_key(u"GroupMappings", maps.gmh_created);
+
+                for (unsigned int i = 0; i < num_mappings; i++) {
+                    maps.added = i + 1;
+                    set_dword_value(maps.umh.get(), mapping_name(i), 100000 + i);
+                    set_dword_value(maps.gmh.get(), mapping_name(i), 100000 + i);
+                }
+
+                // written last, so once the driver has seen this it has seen everything else too
+                maps.owner = token_owner_sid();
+                set_dword_value(maps.umh.get(), maps.owner, owner_uid);
+            });
+
+            bool reloaded = false;
+
+            // the driver rereads the mappings from a work item when its key changes
+            if (!maps.owner.empty()) {
+                test("Wait for driver to reload mappings", [&]() {
+                    auto start = chrono::steady_clock::now();
+
+                    do {
+                        auto h = create_file(dir + u"\\mappings\\reload", DELETE | FILE_READ_ATTRIBUTES, 0, 0,
+                                             FILE_CREATE, FILE_NON_DIRECTORY_FILE | FILE_DELETE_ON_CLOSE,
+                                             FILE_CREATED);
+
+                        if (query_inode_info(h.get()).st_uid == owner_uid) {
+                            reloaded = true;
+                            return;
+                        }
+
+                        h.reset();
+
+                        Sleep(100);
+                    } while (chrono::steady_clock::now() - start < chrono::seconds(30));
+
+                    throw runtime_error("Driver did not reload mappings within 30 seconds");
+                });
+            }
+
+            if (reloaded) {
+                create_and_delete_files(dir + u"\\mappings", num_files, fmt::format("with {} mappings", num_mappings));
+
+                test("Remove user and group mappings", [&]() {
+                    for (unsigned int i = 0; i < num_mappings; i++) {
+                        delete_value(maps.umh.get(), mapping_name(i));
+                        delete_value(maps.gmh.get(), mapping_name(i));
+                    }
+
+                    delete_value(maps.umh.get(), maps.owner);
+                });
+            }
+        }
+    }
+
+    test("Create directory", [&]() {
+        create_file(dir + u"\\casefold", FILE_LIST_DIRECTORY, 0, 0, FILE_CREATE, FILE_DIRECTORY_FILE, FILE_CREATED);
+    });
+
+    {
+        static const unsigned int num_names = 1000, num_opens = 20000;
+        static const u16string_view prefixes[] = {
+            u"Document ", u"IMG_", u"setup-x64-v", u"Quarterly Report Q", u"node_modules.", u"README-",
+            u"Résumé ", u"Übersicht ", u"Отчёт ", u"写真", u"Σημειώσεις ", u"файл_"
+        };
+        static const u16string_view suffixes[] = {
+            u".docx", u".JPG", u".exe", u".pdf", u".js", u".md", u".txt", u".xlsx", u".png", u".Json"
+        };
+        vector<u16string> names;
+
+        for (unsigned int i = 0; i < num_names; i++) {
+            auto s = fmt::format("{}", i);
+
+            names.emplace_back(u16string(prefixes[i % size(prefixes)]) + u16string(s.begin(), s.end()) +
+                               u16string(suffixes[i % size(suffixes)]));
+        }
+
+        // opens are case-insensitive, so we look these up by their upcased hash
+        auto swap_case = [](u16string s) {
+            for (auto& c : s) {
+                if (c >= 'a' && c <= 'z')
+                    c -= 'a' - 'A';
+                else if (c >= 'A' && c <= 'Z')
+                    c += 'a' - 'A';
+            }
+
+            return s;
+        };
+
+        test("Create files", [&]() {
+            for (const auto& n : names) {
+                create_file(dir + u"\\casefold\\" + n, MAXIMUM_ALLOWED, 0, 0, FILE_CREATE, 0, FILE_CREATED);
+            }
+        });
+
+        chrono::steady_clock::duration elapsed{};
+
+        test("Open files with different case", [&]() {
+            mt19937 gen(0);
+            uniform_int_distribution<size_t> dist(0, names.size() - 1);
+
+            auto start = chrono::steady_clock::now();
+
+            for (unsigned int i = 0; i < num_opens; i++) {
+                create_file(dir + u"\\casefold\\" + swap_case(names[dist(gen)]), FILE_READ_ATTRIBUTES,
+                            0, 0, FILE_OPEN, 0, FILE_OPENED);
+            }
+
+            elapsed = chrono::steady_clock::now() - start;
+        });
+
+        if (elapsed.count() != 0)
+            fmt::print("Opened {} files case-insensitively in {} us\n", num_opens,
+                       chrono::duration_cast<chrono::microseconds>(elapsed).count());
+    }
+
+    if (fstype == fs_type::btrfs) {
+        static const unsigned int num_names = 2000;
+
+        // reference for the driver's UTF-8 conversion, which is what the 255-byte limit is checked against
+        auto utf8_len = [](const u16string& s) {
+            size_t len = 0;
+
+            for (size_t i = 0; i < s.size(); i++) {
+                if (s[i] < 0x80)
+                    len++;
+                else if (s[i] < 0x800)
+                    len += 2;
+                else if ((s[i] & 0xfc00) == 0xd800 && i + 1 < s.size() && (s[i + 1] & 0xfc00) == 0xdc00) {
+                    len += 4;
+                    i++;
+                } else
+                    len += 3;
+            }
+
+            return len;
+        };
+
+        test("Create directory", [&]() {
+            create_file(dir + u"\\utf8fuzz", FILE_LIST_DIRECTORY, 0, 0, FILE_CREATE, FILE_DIRECTORY_FILE, FILE_CREATED);
+        });
+
+        test("Create files with random names", [&]() {
+            static const char16_t ascii[] = u"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_";
+            mt19937 gen(0);
+            uniform_int_distribution<unsigned int> kind_dist(0, 4), run_dist(0, 40);
+            uniform_int_distribution<unsigned int> ascii_dist(0, size(ascii) - 2), bmp_dist(0, 0xfff);
+
+            for (unsigned int i = 0; i < num_names; i++) {
+                auto s = fmt::format("{}_", i);
+                u16string name(s.begin(), s.end());
+
+                // mix ASCII runs of all lengths with one-, two-, and three-byte characters and surrogate pairs,
+                // so that the vector loops stop at every offset
+                while (true) {
+                    auto kind = kind_dist(gen);
+                    u16string piece;
+
+                    if (kind <= 1) {
+                        auto run = run_dist(gen);
+
+                        for (unsigned int j = 0; j < run; j++) {
+                            piece += ascii[ascii_dist(gen)];
+                        }
+                    } else if (kind == 2)
+                        piece = (char16_t)(0xc0 + (bmp_dist(gen) % 0x700));
+                    else if (kind == 3)
+                        piece = (char16_t)(0x4e00 + bmp_dist(gen));
+                    else {
+                        piece = (char16_t)(0xd800 | (bmp_dist(gen) & 0x3ff));
+                        piece += (char16_t)(0xdc00 | (bmp_dist(gen) & 0x3ff));
+                    }
+
+                    if (name.size() + piece.size() > 255)
+                        break;
+
+                    name += piece;
+                }
+
+                if (utf8_len(name) > 255) {
+                    exp_status([&]() {
+                        create_file(dir + u"\\utf8fuzz\\" + name, MAXIMUM_ALLOWED, 0, 0, FILE_CREATE, 0, FILE_CREATED);
+                    }, STATUS_OBJECT_NAME_INVALID);
+
+                    // trim the name until it fits, and check the driver agrees with us about where that is
+                    do {
+                        name.pop_back();
+
+                        if (!name.empty() && (name.back() & 0xfc00) == 0xd800)
+                            name.pop_back();
+                    } while (utf8_len(name) > 255);
+                }
+
+                create_file(dir + u"\\utf8fuzz\\" + name, MAXIMUM_ALLOWED, 0, 0, FILE_CREATE, 0, FILE_CREATED);
+
+                auto items = query_dir<FILE_DIRECTORY_INFORMATION>(dir + u"\\utf8fuzz", name);
+
+                if (items.size() != 1)
+                    throw formatted_error("{} entries returned for name {}, expected 1.", items.size(), i);
+
+                auto& fdi = *static_cast<const FILE_DIRECTORY_INFORMATION*>(items.front());
+
+                if (name != u16string_view((char16_t*)fdi.FileName, fdi.FileNameLength / sizeof(char16_t)))
+                    throw formatted_error("FileName did not match for name {}.", i);
+            }
+        });
+    }
+
     // FIXME - if we try to open file with invalid name, do we get NOT_FOUND or INVALID?
 
     // FIXME - test all the variations of NtQueryInformationFile
@@ -1187,6 +1700,164 @@ void test_open_id(HANDLE token, const u16string& dir) {
         h.reset();
     }
 
+    {
+        static const unsigned int depth = 32, num_opens = 10000;
+        vector<uint64_t> ids;
+        u16string path = dir;
+
+        test("Create deep directory tree", [&]() {
+            for (unsigned int i = 0; i < depth; i++) {
+                path += u"\\deep" + u16string(1, u'a' + (i % 26));
+
+                auto h = create_file(path, FILE_READ_ATTRIBUTES, 0, 0, FILE_CREATE,
+                                     FILE_DIRECTORY_FILE, FILE_CREATED);
+
+                ids.push_back(query_information<FILE_INTERNAL_INFORMATION>(h.get()).IndexNumber.QuadPart);
+            }
+
+            auto h = create_file(path + u"\\file", FILE_READ_ATTRIBUTES, 0, 0, FILE_CREATE,
+                                 FILE_NON_DIRECTORY_FILE, FILE_CREATED);
+
+            ids.push_back(query_information<FILE_INTERNAL_INFORMATION>(h.get()).IndexNumber.QuadPart);
+        });
+
+        test("Open directory", [&]() {
+            dirh = create_file(dir, MAXIMUM_ALLOWED, 0,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               FILE_OPEN, FILE_DIRECTORY_FILE, FILE_OPENED);
+        });
+
+        if (dirh && ids.size() == depth + 1) {
+            chrono::steady_clock::duration elapsed{};
+
+            test("Open random inodes in deep tree by ID", [&]() {
+                mt19937 gen(0);
+                uniform_int_distribution<size_t> dist(0, ids.size() - 1);
+
+                auto start = chrono::steady_clock::now();
+
+                for (unsigned int i = 0; i < num_opens; i++) {
+                    auto id = ids[dist(gen)];
+
+                    open_by_id(dirh.get(), id, FILE_READ_ATTRIBUTES, 0, 0, FILE_OPEN,
+                               0, FILE_OPENED);
+                }
+
+                elapsed = chrono::steady_clock::now() - start;
+            });
+
+            if (elapsed.count() != 0)
+                fmt::print("Opened {} files by ID in {} us ({:.2f} us per open)\n", num_opens,
+                           chrono::duration_cast<chrono::microseconds>(elapsed).count(),
+                           (double)chrono::duration_cast<chrono::microseconds>(elapsed).count() / num_opens);
+        }
+
+        dirh.reset();
+    }
+
+    if (fstype == fs_type::btrfs) {
+        static const unsigned int num_subvols = 10000, num_opens = 10000;
+        vector<uint64_t> subvol_ids;
+
+        test("Create directory", [&]() {
+            dirh = create_file(dir + u"\\subvols", FILE_ADD_SUBDIRECTORY, 0, 0, FILE_CREATE,
+                               FILE_DIRECTORY_FILE, FILE_CREATED);
+        });
+
+        if (dirh) {
+            test("Create subvolumes", [&]() {
+                for (unsigned int i = 0; i < num_subvols; i++) {
+                    auto s = fmt::format("subvol{}", i);
+
+                    create_subvol(dirh.get(), u16string(s.begin(), s.end()));
+                }
+            });
+
+            test("Get subvolume IDs", [&]() {
+                for (unsigned int i = 0; i < num_subvols; i++) {
+                    auto s = fmt::format("\\subvols\\subvol{}", i);
+
+                    auto h = create_file(dir + u16string(s.begin(), s.end()), FILE_READ_ATTRIBUTES, 0, 0,
+                                         FILE_OPEN, FILE_DIRECTORY_FILE, FILE_OPENED);
+
+                    subvol_ids.push_back(query_inode_info(h.get()).subvol);
+                }
+            });
+
+            dirh.reset();
+        }
+
+        test("Open directory", [&]() {
+            dirh = create_file(dir, MAXIMUM_ALLOWED, 0,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               FILE_OPEN, FILE_DIRECTORY_FILE, FILE_OPENED);
+        });
+
+        if (dirh && subvol_ids.size() == num_subvols) {
+            chrono::steady_clock::duration elapsed{};
+
+            test("Open random subvolumes by ID", [&]() {
+                mt19937 gen(0);
+                uniform_int_distribution<size_t> dist(0, subvol_ids.size() - 1);
+
+                auto start = chrono::steady_clock::now();
+
+                for (unsigned int i = 0; i < num_opens; i++) {
+                    array<uint8_t, 16> id;
+                    uint64_t inode = 0x100; // SUBVOL_ROOT_INODE
+
+                    // FILE_ID_128: the inode number, followed by the subvolume ID
+                    memcpy(id.data(), &inode, sizeof(uint64_t));
+                    memcpy(id.data() + sizeof(uint64_t), &subvol_ids[dist(gen)], sizeof(uint64_t));
+
+                    open_by_id(dirh.get(), id, FILE_READ_ATTRIBUTES, 0, 0, FILE_OPEN,
+                               0, FILE_OPENED);
+                }
+
+                elapsed = chrono::steady_clock::now() - start;
+            });
+
+            if (elapsed.count() != 0)
+                fmt::print("Opened {} of {} subvolumes by ID in {} us ({:.2f} us per open)\n", num_opens, num_subvols,
+                           chrono::duration_cast<chrono::microseconds>(elapsed).count(),
+                           (double)chrono::duration_cast<chrono::microseconds>(elapsed).count() / num_opens);
+
+            elapsed = {};
+
+            test("Open random subvolumes by path", [&]() {
+                mt19937 gen(0);
+                uniform_int_distribution<unsigned int> dist(0, num_subvols - 1);
+
+                auto start = chrono::steady_clock::now();
+
+                for (unsigned int i = 0; i < num_opens; i++) {
+                    auto s = fmt::format("\\subvols\\subvol{}", dist(gen));
+
+                    create_file(dir + u16string(s.begin(), s.end()), FILE_READ_ATTRIBUTES, 0, 0,
+                                FILE_OPEN, FILE_DIRECTORY_FILE, FILE_OPENED);
+                }
+
+                elapsed = chrono::steady_clock::now() - start;
+            });
+
+            if (elapsed.count() != 0)
+                fmt::print("Opened {} of {} subvolumes by path in {} us ({:.2f} us per open)\n", num_opens, num_subvols,
+                           chrono::duration_cast<chrono::microseconds>(elapsed).count(),
+                           (double)chrono::duration_cast<chrono::microseconds>(elapsed).count() / num_opens);
+        }
+
+        dirh.reset();
+
+        test("Delete subvolumes", [&]() {
+            for (unsigned int i = 0; i < num_subvols; i++) {
+                auto s = fmt::format("\\subvols\\subvol{}", i);
+
+                create_file(dir + u16string(s.begin(), s.end()), DELETE, 0, 0, FILE_OPEN,
+                            FILE_DIRECTORY_FILE | FILE_DELETE_ON_CLOSE, FILE_OPENED);
+            }
+        });
+    }
+
     disable_token_privileges(token);
 
     test("Create file", [&]() {
@@ -0,0 +1,246 @@
+/* Copyright (c) Mark Harmstone 2016-17
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Differential fuzzer for the block functions behind calc_sha256 and blake2b: sha256_block_shani
+ * in sha256.c, and blake2b_block_ssse3 and blake2b_block_avx2 in blake2b-ref.c. Each one that the
+ * CPU supports is compared against the portable block function from the same file, both on its
+ * own with random state, and through the whole hash with random input of random length at a
+ * random alignment. The portable versions are first checked against the published test vectors.
+ *
+ * It isn't part of the CMake build, as that only targets Windows. On Linux:
+ *
+ *     gcc -O2 -o hash_fuzz src/tests/hash_fuzz.c && ./hash_fuzz [iterations] [seed] */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cpuid.h>
+
+#if !defined(__x86_64__) && !defined(__i386__)
+#error "x86 only - this is where the SIMD versions live"
+#endif
+
+#ifdef __x86_64__
+#define _AMD64_
+#else
+#define _X86_
+#endif
+
+#include "../sha256.c"
+#include "../blake2b-ref.c"
+
+#define MAX_LEN 4200
+
+static uint32_t rnd_state;
+
+static uint32_t rnd(uint32_t n) {
+    // xorshift32 - good enough, and the same everywhere for a given seed
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+
+    return n == 0 ? 0 : rnd_state % n;
+}
+
+static uint64_t rnd64() {
+    uint64_t v = rnd(0xffffffff);
+
+    return (v << 32) | rnd(0xffffffff);
+}
+
+static void gen_data(uint8_t* buf, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        buf[i] = (uint8_t)rnd(0x100);
+    }
+}
+
+static uint32_t gen_len() {
+    // lengths either side of the block boundaries matter most, as that's where the padding changes
+    if (rnd(2) == 0) {
+        uint32_t block = rnd(2) == 0 ? CHUNK_SIZE : BLAKE2B_BLOCKBYTES;
+        uint32_t len = (rnd(MAX_LEN / block) * block) + rnd(3);
+
+        if (rnd(2) == 0) // where SHA-256's padding spills over into another block
+            len += CHUNK_SIZE - TOTAL_LEN_LEN - 1;
+
+        return len > 0 ? len - 1 : 0;
+    }
+
+    return rnd(MAX_LEN - 64);
+}
+
+static unsigned long failures = 0;
+
+static void fail(const char* impl, const char* func, unsigned long it, const char* what) {
+    failures++;
+
+    if (failures <= 20)
+        fprintf(stderr, "%s: %s: iteration %lu: %s differs\n", impl, func, it, what);
+}
+
+static void check_known_answers() {
+    static const uint8_t sha256_abc[] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+    };
+    static const uint8_t blake2b_abc[] = {
+        0xba, 0x80, 0xa5, 0x3f, 0x98, 0x1c, 0x4d, 0x0d, 0x6a, 0x27, 0x97, 0xb6, 0x9f, 0x12, 0xf6, 0xe9,
+        0x4c, 0x21, 0x2f, 0x14, 0x68, 0x5a, 0xc4, 0xb7, 0x4b, 0x12, 0xbb, 0x6f, 0xdb, 0xff, 0xa2, 0xd1,
+        0x7d, 0x87, 0xc5, 0x39, 0x2a, 0xab, 0x79, 0x2d, 0xc2, 0x52, 0xd5, 0xde, 0x45, 0x33, 0xcc, 0x95,
+        0x18, 0xd3, 0x8a, 0xa8, 0xdb, 0xf1, 0x92, 0x5a, 0xb9, 0x23, 0x86, 0xed, 0xd4, 0x00, 0x99, 0x23
+    };
+    uint8_t hash[64];
+
+    calc_sha256(hash, "abc", 3);
+
+    if (memcmp(hash, sha256_abc, sizeof(sha256_abc)))
+        fail("portable", "calc_sha256", 0, "test vector");
+
+    blake2b(hash, sizeof(blake2b_abc), "abc", 3);
+
+    if (memcmp(hash, blake2b_abc, sizeof(blake2b_abc)))
+        fail("portable", "blake2b", 0, "test vector");
+}
+
+static void check_sha256(const char* impl, sha256_block_func func, unsigned long it) {
+    uint32_t h1[8], h2[8];
+    uint8_t buf[MAX_LEN + 64], hash1[32], hash2[32];
+    uint32_t len, off;
+
+    for (unsigned int i = 0; i < 8; i++) {
+        h1[i] = h2[i] = rnd(0xffffffff);
+    }
+
+    gen_data(buf, CHUNK_SIZE);
+
+    sha256_block_sw(h1, buf);
+    func(h2, buf);
+
+    if (memcmp(h1, h2, sizeof(h1)))
+        fail(impl, "sha256_block", it, "state");
+
+    len = gen_len();
+    off = rnd(64);
+    gen_data(buf + off, len);
+
+    sha256_block = sha256_block_sw;
+    calc_sha256(hash1, buf + off, len);
+
+    sha256_block = func;
+    calc_sha256(hash2, buf + off, len);
+
+    if (memcmp(hash1, hash2, sizeof(hash1)))
+        fail(impl, "calc_sha256", it, "hash");
+}
+
+static void check_blake2b(const char* impl, blake2b_block_func func, unsigned long it) {
+    uint64_t h1[8], h2[8], t[2], f[2];
+    uint8_t buf[MAX_LEN + 64], hash1[BLAKE2B_OUTBYTES], hash2[BLAKE2B_OUTBYTES];
+    uint32_t len, off, outlen;
+
+    for (unsigned int i = 0; i < 8; i++) {
+        h1[i] = h2[i] = rnd64();
+    }
+
+    // the counter is usually small, but make sure its top half and the last-block flags get used too
+    t[0] = rnd(2) == 0 ? rnd(MAX_LEN) : rnd64();
+    t[1] = rnd(4) == 0 ? rnd64() : 0;
+    f[0] = rnd(2) == 0 ? 0 : (uint64_t)-1;
+    f[1] = rnd(4) == 0 ? (uint64_t)-1 : 0;
+
+    off = rnd(64);
+    gen_data(buf + off, BLAKE2B_BLOCKBYTES);
+
+    blake2b_block_ref(h1, buf + off, t, f);
+    func(h2, buf + off, t, f);
+
+    if (memcmp(h1, h2, sizeof(h1)))
+        fail(impl, "blake2b_block", it, "state");
+
+    len = gen_len();
+    off = rnd(64);
+    outlen = rnd(4) == 0 ? rnd(BLAKE2B_OUTBYTES) + 1 : 32; // btrfs uses BLAKE2b-256
+    gen_data(buf + off, len);
+
+    memset(hash1, 0, sizeof(hash1));
+    memset(hash2, 0, sizeof(hash2));
+
+    blake2b_block = blake2b_block_ref;
+    blake2b(hash1, outlen, buf + off, len);
+
+    blake2b_block = func;
+    blake2b(hash2, outlen, buf + off, len);
+
+    if (memcmp(hash1, hash2, sizeof(hash1)))
+        fail(impl, "blake2b", it, "hash");
+}
+
+int main(int argc, char* argv[]) {
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+    uint32_t seed = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 0) : 1;
+    unsigned int eax, ebx, ecx, edx;
+    bool have_sse41 = false, have_ssse3 = false, have_avx2 = false, have_sha = false;
+
+    // the same checks as check_cpu in btrfs.c, as GCC's __builtin_cpu_supports doesn't know about SHA
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        have_ssse3 = ecx & bit_SSSE3;
+        have_sse41 = ecx & bit_SSE4_1;
+    }
+
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        have_avx2 = (ebx & bit_AVX2) && __builtin_cpu_supports("avx2");
+        have_sha = ebx & bit_SHA;
+    }
+
+    const struct {
+        const char* name;
+        sha256_block_func sha256;
+        blake2b_block_func blake2b;
+        bool supported;
+    } impls[] = {
+        { "SHA-NI", sha256_block_shani, NULL, have_sha && have_sse41 },
+        { "SSSE3", NULL, blake2b_block_ssse3, have_ssse3 },
+        { "AVX2", NULL, blake2b_block_avx2, have_avx2 }
+    };
+
+    check_known_answers();
+
+    for (unsigned int i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (!impls[i].supported) {
+            printf("%s: skipped, CPU doesn't have it\n", impls[i].name);
+            continue;
+        }
+
+        rnd_state = seed != 0 ? seed : 1;
+
+        for (unsigned long it = 0; it < iterations; it++) {
+            if (impls[i].sha256)
+                check_sha256(impls[i].name, impls[i].sha256, it);
+
+            if (impls[i].blake2b)
+                check_blake2b(impls[i].name, impls[i].blake2b, it);
+        }
+
+        printf("%s: %lu iterations\n", impls[i].name, iterations);
+    }
+
+    printf("%lu failures\n", failures);
+
+    return failures == 0 ? 0 : 1;
+}
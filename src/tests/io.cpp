@@ -2,11 +2,18 @@
 #include <random>
 #include <span>
 #include <array>
+#include <realtimeapiset.h>
+#include <chrono>
+#include <algorithm>
 
 using namespace std;
 
 #define FSCTL_SET_ZERO_DATA CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 50, METHOD_BUFFERED, FILE_WRITE_DATA)
 
+#ifndef FSCTL_GET_RETRIEVAL_POINTERS
+#define FSCTL_GET_RETRIEVAL_POINTERS CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 28, METHOD_NEITHER, FILE_ANY_ACCESS)
+#endif
+
 template<size_t N>
 void adjust_token_privileges(HANDLE token, const array<LUID_AND_ATTRIBUTES, N>& privs) {
     NTSTATUS Status;
@@ -25,6 +32,44 @@ void adjust_token_privileges(HANDLE token, const array<LUID_AND_ATTRIBUTES, N>&
         throw ntstatus_error(Status);
 }
 
+// Returns the number of physically contiguous runs the file is stored in.
+static unsigned int count_fragments(HANDLE h) {
+    NTSTATUS Status;
+    IO_STATUS_BLOCK iosb;
+    int64_t start_vcn = 0;
+    vector<int64_t> buf(2 + (2 * 1024));
+    unsigned int frags = 0;
+    int64_t last_vcn = 0, last_lcn = -1;
+
+    do {
+        Status = NtFsControlFile(h, nullptr, nullptr, nullptr, &iosb, FSCTL_GET_RETRIEVAL_POINTERS,
+                                 &start_vcn, sizeof(start_vcn), buf.data(), buf.size() * sizeof(int64_t));
+
+        if (Status != STATUS_SUCCESS && Status != STATUS_BUFFER_OVERFLOW)
+            throw ntstatus_error(Status);
+
+        // RETRIEVAL_POINTERS_BUFFER: extent count, starting VCN, then (next VCN, LCN) pairs
+        auto count = (uint32_t)buf[0];
+        int64_t vcn = buf[1];
+
+        for (unsigned int i = 0; i < count; i++) {
+            auto next_vcn = buf[2 + (i * 2)];
+            auto lcn = buf[3 + (i * 2)];
+
+            if (lcn != last_lcn + (vcn - last_vcn))
+                frags++;
+
+            last_vcn = vcn;
+            last_lcn = lcn;
+            vcn = next_vcn;
+        }
+
+        start_vcn = vcn;
+    } while (Status == STATUS_BUFFER_OVERFLOW);
+
+    return frags;
+}
+
 void set_allocation(HANDLE h, uint64_t alloc) {
     NTSTATUS Status;
     IO_STATUS_BLOCK iosb;
@@ -1353,5 +1398,521 @@ void test_io(HANDLE token, const u16string& dir) {
         h.reset();
     }
 
+    test("Create file with FILE_NO_INTERMEDIATE_BUFFERING (overlapped)", [&]() {
+        h = create_file(dir + u"\\io9", SYNCHRONIZE | FILE_READ_DATA | FILE_WRITE_DATA, 0, 0,
+                        FILE_CREATE, FILE_NON_DIRECTORY_FILE | FILE_NO_INTERMEDIATE_BUFFERING,
+                        FILE_CREATED);
+    });
+
+    if (h) {
+        static const unsigned int max_depth = 32;
+        static const ULONG block_size = 65536;
+
+        auto random = random_data(block_size * max_depth);
+
+        test("Write file", [&]() {
+            write_file_wait(h.get(), random, 0);
+        });
+
+        for (unsigned int depth = 1; depth <= max_depth; depth *= 2) {
+            test(fmt::format("Read file at queue depth {}", depth), [&]() {
+                vector<uint8_t> buf(random.size());
+                vector<IO_STATUS_BLOCK> iosbs(depth);
+                vector<NTSTATUS> statuses(depth);
+                vector<unique_handle> events;
+
+                for (unsigned int i = 0; i < depth; i++) {
+                    events.push_back(create_event());
+                }
+
+                for (unsigned int i = 0; i < max_depth; i += depth) {
+                    for (unsigned int j = 0; j < depth; j++) {
+                        LARGE_INTEGER off;
+
+                        off.QuadPart = (i + j) * block_size;
+
+                        statuses[j] = NtReadFile(h.get(), events[j].get(), nullptr, nullptr, &iosbs[j],
+                                                 buf.data() + off.QuadPart, block_size, &off, nullptr);
+                    }
+
+                    for (unsigned int j = 0; j < depth; j++) {
+                        NTSTATUS Status = statuses[j];
+
+                        if (Status == STATUS_PENDING) {
+                            Status = NtWaitForSingleObject(events[j].get(), false, nullptr);
+                            if (Status != STATUS_SUCCESS)
+                                throw ntstatus_error(Status);
+
+                            Status = iosbs[j].Status;
+                        }
+
+                        if (Status != STATUS_SUCCESS)
+                            throw ntstatus_error(Status);
+
+                        if (iosbs[j].Information != block_size)
+                            throw formatted_error("iosb.Information was {}, expected {}", iosbs[j].Information, block_size);
+                    }
+                }
+
+                if (memcmp(buf.data(), random.data(), random.size()))
+                    throw runtime_error("Data read did not match data written");
+            });
+        }
+
+        auto random2 = random_data(block_size * max_depth);
+
+        test(fmt::format("Write file at queue depth {}", max_depth), [&]() {
+            vector<IO_STATUS_BLOCK> iosbs(max_depth);
+            vector<NTSTATUS> statuses(max_depth);
+            vector<unique_handle> events;
+
+            for (unsigned int i = 0; i < max_depth; i++) {
+                events.push_back(create_event());
+            }
+
+            for (unsigned int i = 0; i < max_depth; i++) {
+                LARGE_INTEGER off;
+
+                off.QuadPart = i * block_size;
+
+                statuses[i] = NtWriteFile(h.get(), events[i].get(), nullptr, nullptr, &iosbs[i],
+                                          random2.data() + off.QuadPart, block_size, &off, nullptr);
+            }
+
+            for (unsigned int i = 0; i < max_depth; i++) {
+                NTSTATUS Status = statuses[i];
+
+                if (Status == STATUS_PENDING) {
+                    Status = NtWaitForSingleObject(events[i].get(), false, nullptr);
+                    if (Status != STATUS_SUCCESS)
+                        throw ntstatus_error(Status);
+
+                    Status = iosbs[i].Status;
+                }
+
+                if (Status != STATUS_SUCCESS)
+                    throw ntstatus_error(Status);
+
+                if (iosbs[i].Information != block_size)
+                    throw formatted_error("iosb.Information was {}, expected {}", iosbs[i].Information, block_size);
+            }
+        });
+
+        test("Read file", [&]() {
+            auto ret = read_file_wait(h.get(), random2.size(), 0);
+
+            if (ret.size() != random2.size())
+                throw formatted_error("{} bytes read, expected {}", ret.size(), random2.size());
+
+            if (memcmp(ret.data(), random2.data(), random2.size()))
+                throw runtime_error("Data read did not match data written");
+        });
+
+        h.reset();
+    }
+
+    test("Create file with FILE_NO_INTERMEDIATE_BUFFERING (large)", [&]() {
+        h = create_file(dir + u"\\io10", SYNCHRONIZE | FILE_READ_DATA | FILE_WRITE_DATA, 0, 0,
+                        FILE_CREATE, FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_NO_INTERMEDIATE_BUFFERING,
+                        FILE_CREATED);
+    });
+
+    if (h) {
+        static const ULONG chunk_size = 0x100000;
+        static const unsigned int num_chunks = 64;
+        uint64_t cycles = 0;
+
+        auto random = random_data(chunk_size * num_chunks);
+
+        test("Write file", [&]() {
+            for (unsigned int i = 0; i < num_chunks; i++) {
+                write_file(h.get(), span(random.data() + (i * chunk_size), chunk_size), i * chunk_size);
+            }
+        });
+
+        // reads straight into our buffer, with the checksums verified in place
+        test("Read file", [&]() {
+            vector<uint8_t> buf(chunk_size);
+
+            for (unsigned int i = 0; i < num_chunks; i++) {
+                NTSTATUS Status;
+                IO_STATUS_BLOCK iosb;
+                LARGE_INTEGER off;
+                ULONG64 start, end;
+
+                off.QuadPart = i * chunk_size;
+
+                QueryThreadCycleTime(GetCurrentThread(), &start);
+
+                Status = NtReadFile(h.get(), nullptr, nullptr, nullptr, &iosb, buf.data(), chunk_size, &off, nullptr);
+
+                QueryThreadCycleTime(GetCurrentThread(), &end);
+
+                if (Status != STATUS_SUCCESS)
+                    throw ntstatus_error(Status);
+
+                if (iosb.Information != chunk_size)
+                    throw formatted_error("iosb.Information was {}, expected {}", iosb.Information, chunk_size);
+
+                if (memcmp(buf.data(), random.data() + (i * chunk_size), chunk_size))
+                    throw runtime_error("Data read did not match data written");
+
+                cycles += end - start;
+            }
+        });
+
+        if (cycles != 0)
+            fmt::print("Read {} bytes in {} cycles ({:.2f} bytes per cycle)\n", random.size(), cycles, (double)random.size() / (double)cycles);
+
+        // buffer which is sector-aligned but not page-aligned - on RAID0/10/5/6 this has to be bounced
+        test("Read file into misaligned buffer", [&]() {
+            vector<uint8_t> buf(chunk_size + 0x1000);
+            NTSTATUS Status;
+            IO_STATUS_BLOCK iosb;
+            LARGE_INTEGER off;
+
+            auto ptr = (uint8_t*)(((uintptr_t)buf.data() + 0xfff) & ~(uintptr_t)0xfff) + 0x200;
+
+            off.QuadPart = chunk_size;
+
+            Status = NtReadFile(h.get(), nullptr, nullptr, nullptr, &iosb, ptr, chunk_size, &off, nullptr);
+
+            if (Status != STATUS_SUCCESS)
+                throw ntstatus_error(Status);
+
+            if (iosb.Information != chunk_size)
+                throw formatted_error("iosb.Information was {}, expected {}", iosb.Information, chunk_size);
+
+            if (memcmp(ptr, random.data() + chunk_size, chunk_size))
+                throw runtime_error("Data read did not match data written");
+        });
+
+        test("Set end of file", [&]() {
+            set_end_of_file(h.get(), random.size() - 1000);
+        });
+
+        // short read at the end of the file, which has to go through a bounce buffer
+        test("Read file", [&]() {
+            auto ret = read_file(h.get(), chunk_size, (num_chunks - 1) * chunk_size);
+
+            if (ret.size() != chunk_size - 1000)
+                throw formatted_error("{} bytes read, expected {}", ret.size(), chunk_size - 1000);
+
+            if (memcmp(ret.data(), random.data() + ((num_chunks - 1) * chunk_size), ret.size()))
+                throw runtime_error("Data read did not match data written");
+        });
+
+        h.reset();
+    }
+
+    test("Create file with FILE_NO_INTERMEDIATE_BUFFERING (appends)", [&]() {
+        h = create_file(dir + u"\\io11", SYNCHRONIZE | FILE_READ_DATA | FILE_WRITE_DATA, 0, 0,
+                        FILE_CREATE, FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_NO_INTERMEDIATE_BUFFERING,
+                        FILE_CREATED);
+    });
+
+    if (h) {
+        static const ULONG block_size = 4096;
+        static const unsigned int num_blocks = 256;
+
+        auto random = random_data(block_size * num_blocks);
+
+        // each of these ends up as its own extent, but they'll probably be next to each other on disk
+        test("Write file in small appends", [&]() {
+            for (unsigned int i = 0; i < num_blocks; i++) {
+                write_file(h.get(), span(random.data() + (i * block_size), block_size), i * block_size);
+            }
+        });
+
+        test("Read file", [&]() {
+            auto ret = read_file(h.get(), random.size(), 0);
+
+            if (ret.size() != random.size())
+                throw formatted_error("{} bytes read, expected {}", ret.size(), random.size());
+
+            if (memcmp(ret.data(), random.data(), random.size()))
+                throw runtime_error("Data read did not match data written");
+        });
+
+        h.reset();
+    }
+
+    {
+        static const unsigned int num_files = 1000;
+        static const size_t file_size = 100;
+        vector<vector<uint8_t>> data;
+
+        auto file_name = [&](unsigned int i) {
+            auto s = fmt::format("{}", i);
+
+            return dir + u"\\io12-" + u16string(s.begin(), s.end());
+        };
+
+        for (unsigned int i = 0; i < num_files; i++) {
+            data.emplace_back(random_data(file_size));
+        }
+
+        test("Create small files", [&]() {
+            for (unsigned int i = 0; i < num_files; i++) {
+                auto h = create_file(file_name(i),
+                                     SYNCHRONIZE | FILE_WRITE_DATA, 0, 0, FILE_CREATE,
+                                     FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT, FILE_CREATED);
+
+                write_file(h.get(), data[i]);
+            }
+        });
+
+        chrono::steady_clock::duration elapsed{};
+
+        // Files this small get stored inline, so once they've been flushed this is the small-file
+        // fast path. It'll go through Cc instead if the lazy writer hasn't got to them yet.
+        test("Open, stat and read small files", [&]() {
+            auto start = chrono::steady_clock::now();
+
+            for (unsigned int i = 0; i < num_files; i++) {
+                auto h = create_file(file_name(i),
+                                     SYNCHRONIZE | FILE_READ_DATA, 0, 0, FILE_OPEN,
+                                     FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT, FILE_OPENED);
+
+                auto fsi = query_information<FILE_STANDARD_INFORMATION>(h.get());
+
+                if ((uint64_t)fsi.EndOfFile.QuadPart != file_size)
+                    throw formatted_error("EndOfFile was {}, expected {}", fsi.EndOfFile.QuadPart, file_size);
+
+                auto ret = read_file(h.get(), file_size);
+
+                if (ret.size() != file_size || memcmp(ret.data(), data[i].data(), file_size))
+                    throw runtime_error("Data read did not match data written");
+            }
+
+            elapsed = chrono::steady_clock::now() - start;
+        });
+
+        if (elapsed.count() != 0)
+            fmt::print("Opened, statted and read {} files in {} us ({} us per file)\n", num_files,
+                       chrono::duration_cast<chrono::microseconds>(elapsed).count(),
+                       chrono::duration_cast<chrono::microseconds>(elapsed).count() / num_files);
+    }
+
+    {
+        static const unsigned int num_files = 4;
+        static const ULONG block_size = 0x10000;
+        static const unsigned int num_blocks = 256;
+        vector<unique_handle> files;
+
+        test(fmt::format("Create {} files with FILE_NO_INTERMEDIATE_BUFFERING", num_files), [&]() {
+            for (unsigned int i = 0; i < num_files; i++) {
+                auto s = fmt::format("{}", i);
+
+                files.push_back(create_file(dir + u"\\io13-" + u16string(s.begin(), s.end()),
+                                            SYNCHRONIZE | FILE_READ_DATA | FILE_WRITE_DATA | FILE_READ_ATTRIBUTES, 0, 0,
+                                            FILE_CREATE, FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_NO_INTERMEDIATE_BUFFERING,
+                                            FILE_CREATED));
+            }
+        });
+
+        if (files.size() == num_files) {
+            auto random = random_data(block_size);
+            chrono::steady_clock::duration elapsed{};
+
+            // with the files' appends interleaved like this, each file's allocation window is what
+            // keeps its extents next to each other
+            test("Write files in interleaved appends", [&]() {
+                auto start = chrono::steady_clock::now();
+
+                for (unsigned int i = 0; i < num_blocks; i++) {
+                    for (const auto& h : files) {
+                        write_file(h.get(), random, i * block_size);
+                    }
+                }
+
+                elapsed = chrono::steady_clock::now() - start;
+            });
+
+            if (elapsed.count() != 0) {
+                fmt::print("Wrote {} bytes in {} microseconds\n", (uint64_t)num_files * num_blocks * block_size,
+                           chrono::duration_cast<chrono::microseconds>(elapsed).count());
+            }
+
+            test("Count fragments", [&]() {
+                unsigned int total = 0;
+
+                for (const auto& h : files) {
+                    total += count_fragments(h.get());
+                }
+
+                fmt::print("{} files of {} bytes in {} fragments\n", num_files, num_blocks * block_size, total);
+            });
+        }
+    }
+
     // FIXME - DASD I/O
 }
+
+#ifndef IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS
+#define IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS CTL_CODE(0x56, 0, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#endif
+
+#ifndef IOCTL_DISK_SET_DISK_ATTRIBUTES
+#define IOCTL_DISK_SET_DISK_ATTRIBUTES CTL_CODE(IOCTL_DISK_BASE, 0x003d, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#endif
+
+#ifndef DISK_ATTRIBUTE_READ_ONLY
+#define DISK_ATTRIBUTE_READ_ONLY 0x2
+#endif
+
+struct disk_extent {
+    uint32_t DiskNumber;
+    LARGE_INTEGER StartingOffset;
+    LARGE_INTEGER ExtentLength;
+};
+
+struct volume_disk_extents {
+    uint32_t NumberOfDiskExtents;
+    disk_extent Extents[1];
+};
+
+struct set_disk_attributes {
+    uint32_t Version;
+    BOOLEAN Persist;
+    uint8_t Reserved1[3];
+    uint64_t Attributes;
+    uint64_t AttributesMask;
+    uint32_t Reserved2[4];
+};
+
+static vector<uint32_t> volume_disks(HANDLE h) {
+    NTSTATUS Status;
+    IO_STATUS_BLOCK iosb;
+    vector<uint8_t> buf(offsetof(volume_disk_extents, Extents) + (16 * sizeof(disk_extent)));
+    vector<uint32_t> ret;
+
+    // passed through to the volume
+    Status = NtDeviceIoControlFile(h, nullptr, nullptr, nullptr, &iosb, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS,
+                                   nullptr, 0, buf.data(), buf.size());
+
+    if (Status != STATUS_SUCCESS)
+        throw ntstatus_error(Status);
+
+    const auto& vde = *(volume_disk_extents*)buf.data();
+
+    for (unsigned int i = 0; i < vde.NumberOfDiskExtents; i++) {
+        if (find(ret.begin(), ret.end(), vde.Extents[i].DiskNumber) == ret.end())
+            ret.push_back(vde.Extents[i].DiskNumber);
+    }
+
+    return ret;
+}
+
+static void set_disk_read_only(uint32_t disk, bool read_only) {
+    NTSTATUS Status;
+    IO_STATUS_BLOCK iosb;
+    set_disk_attributes sda;
+
+    auto s = fmt::format("\\??\\PhysicalDrive{}", disk);
+
+    auto h = create_file(u16string(s.begin(), s.end()), SYNCHRONIZE | FILE_READ_DATA | FILE_WRITE_DATA, 0,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_OPEN, FILE_SYNCHRONOUS_IO_NONALERT, FILE_OPENED);
+
+    memset(&sda, 0, sizeof(sda));
+    sda.Version = sizeof(sda);
+    sda.Persist = false;
+    sda.Attributes = read_only ? DISK_ATTRIBUTE_READ_ONLY : 0;
+    sda.AttributesMask = DISK_ATTRIBUTE_READ_ONLY;
+
+    Status = NtDeviceIoControlFile(h.get(), nullptr, nullptr, nullptr, &iosb, IOCTL_DISK_SET_DISK_ATTRIBUTES,
+                                   &sda, sizeof(sda), nullptr, 0);
+
+    if (Status != STATUS_SUCCESS)
+        throw ntstatus_error(Status);
+}
+
+// Makes the disks under the volume read-only, so that writes to them fail, and checks that an
+// asynchronous non-cached write reports the failure and that the volume then refuses to carry on,
+// rather than committing metadata for data that never made it to disk. This leaves the volume
+// read-only until it's remounted, so it isn't part of "all", and it needs to be run as an
+// administrator.
+void test_io_fail(const u16string& dir) {
+    unique_handle h;
+    vector<uint32_t> disks;
+
+    test("Create file with FILE_NO_INTERMEDIATE_BUFFERING (overlapped)", [&]() {
+        h = create_file(dir + u"\\iofail1", SYNCHRONIZE | FILE_READ_DATA | FILE_WRITE_DATA, 0, 0,
+                        FILE_CREATE, FILE_NON_DIRECTORY_FILE | FILE_NO_INTERMEDIATE_BUFFERING,
+                        FILE_CREATED);
+    });
+
+    if (!h)
+        return;
+
+    auto random = random_data(0x10000);
+
+    test("Write file", [&]() {
+        write_file_wait(h.get(), random, 0);
+    });
+
+    test("Get disks", [&]() {
+        disks = volume_disks(h.get());
+
+        if (disks.empty())
+            throw runtime_error("Volume has no disks");
+    });
+
+    if (disks.empty())
+        return;
+
+    struct disks_restorer {
+        ~disks_restorer() {
+            for (auto d : *disks) {
+                try {
+                    set_disk_read_only(d, false);
+                } catch (const exception& e) {
+                    fmt::print(stderr, "Could not make disk {} writable again: {}\n", d, e.what());
+                }
+            }
+        }
+
+        vector<uint32_t>* disks;
+    } restorer{&disks};
+
+    test("Make disks read-only", [&]() {
+        for (auto d : disks) {
+            set_disk_read_only(d, true);
+        }
+    });
+
+    random = random_data(random.size());
+
+    test("Write file", [&]() {
+        exp_status([&]() {
+            write_file_wait(h.get(), random, 0);
+        }, STATUS_MEDIA_WRITE_PROTECTED);
+    });
+
+    h.reset();
+
+    // The next flush should fail and drop the volume into read-only mode. On a write-protected disk
+    // the metadata writes would fail too, so this doesn't show which check stopped the commit - only
+    // that nothing carried on as if the write had succeeded.
+    test("Wait for volume to go read-only", [&]() {
+        for (unsigned int i = 0; i < 120; i++) {
+            try {
+                create_file(dir + u"\\iofail2", SYNCHRONIZE | FILE_READ_DATA | FILE_WRITE_DATA, 0, 0,
+                            FILE_CREATE, FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT,
+                            FILE_CREATED);
+            } catch (const ntstatus_error& e) {
+                if (e.Status == STATUS_MEDIA_WRITE_PROTECTED)
+                    return;
+
+                throw;
+            }
+
+            set_disposition_information(create_file(dir + u"\\iofail2", DELETE, 0, 0, FILE_OPEN,
+                                                    FILE_NON_DIRECTORY_FILE, FILE_OPENED).get(), true);
+
+            Sleep(1000);
+        }
+
+        throw runtime_error("Volume did not go read-only");
+    });
+}
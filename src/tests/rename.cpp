@@ -1247,6 +1247,52 @@ void test_rename(const u16string& dir) {
         h2.reset();
     }
 
+    test("Create directory", [&]() {
+        h = create_file(dir + u"\\renamedir26", MAXIMUM_ALLOWED, 0, 0, FILE_CREATE, FILE_DIRECTORY_FILE, FILE_CREATED);
+    });
+
+    if (h) {
+        test("Create file", [&]() {
+            h2 = create_file(dir + u"\\renamedir26\\file", MAXIMUM_ALLOWED, 0, 0, FILE_CREATE, 0, FILE_CREATED);
+        });
+
+        if (h2) {
+            test("Check name", [&]() {
+                auto fn = query_file_name_information(h2.get());
+
+                static const u16string_view ends_with = u"\\renamedir26\\file";
+
+                if (fn.size() < ends_with.size() || fn.substr(fn.size() - ends_with.size()) != ends_with)
+                    throw runtime_error("Name did not end with \"\\renamedir26\\file\".");
+            });
+
+            h2.reset();
+        }
+
+        test("Rename directory", [&]() {
+            set_rename_information(h.get(), false, nullptr, dir + u"\\renamedir26b");
+        });
+
+        h.reset();
+
+        test("Open file", [&]() {
+            h2 = create_file(dir + u"\\renamedir26b\\file", MAXIMUM_ALLOWED, 0, 0, FILE_OPEN, 0, FILE_OPENED);
+        });
+
+        if (h2) {
+            test("Check name", [&]() {
+                auto fn = query_file_name_information(h2.get());
+
+                static const u16string_view ends_with = u"\\renamedir26b\\file";
+
+                if (fn.size() < ends_with.size() || fn.substr(fn.size() - ends_with.size()) != ends_with)
+                    throw runtime_error("Name did not end with \"\\renamedir26b\\file\".");
+            });
+
+            h2.reset();
+        }
+    }
+
     // FIXME - does SD change when file moved across directories?
     // FIXME - check can't rename root directory?
 }
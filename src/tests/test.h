@@ -127,6 +127,30 @@ NTSTATUS __stdcall NtQueryEvent(HANDLE EventHandle, EVENT_INFORMATION_CLASS Even
                                 PVOID EventInformation, ULONG EventInformationLength,
                                 PULONG ReturnLength);
 
+extern "C"
+NTSTATUS __stdcall NtNotifyChangeDirectoryFile(HANDLE FileHandle, HANDLE Event, PIO_APC_ROUTINE ApcRoutine,
+                                               PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, PVOID Buffer,
+                                               ULONG Length, ULONG CompletionFilter, BOOLEAN WatchTree);
+
+extern "C"
+NTSTATUS __stdcall NtCreateKey(PHANDLE KeyHandle, ACCESS_MASK DesiredAccess, POBJECT_ATTRIBUTES ObjectAttributes,
+                               ULONG TitleIndex, PUNICODE_STRING Class, ULONG CreateOptions, PULONG Disposition);
+
+extern "C"
+NTSTATUS __stdcall NtSetValueKey(HANDLE KeyHandle, PUNICODE_STRING ValueName, ULONG TitleIndex, ULONG Type,
+                                 PVOID Data, ULONG DataSize);
+
+extern "C"
+NTSTATUS __stdcall NtDeleteValueKey(HANDLE KeyHandle, PUNICODE_STRING ValueName);
+
+extern "C"
+NTSTATUS __stdcall NtDeleteKey(HANDLE KeyHandle);
+
+extern "C"
+NTSTATUS __stdcall NtQueryInformationToken(HANDLE TokenHandle, TOKEN_INFORMATION_CLASS TokenInformationClass,
+                                           PVOID TokenInformation, ULONG TokenInformationLength,
+                                           PULONG ReturnLength);
+
 #define NtCurrentProcess() ((HANDLE)(LONG_PTR) -1)
 
 #define FileIdExtdDirectoryInformation ((FILE_INFORMATION_CLASS)60)
@@ -4115,6 +4139,7 @@ void test_overwrite(const std::u16string& dir);
 
 // io.cpp
 void test_io(HANDLE token, const std::u16string& dir);
+void test_io_fail(const std::u16string& dir);
 std::vector<uint8_t> random_data(size_t len);
 void write_file(HANDLE h, std::span<const uint8_t> data, std::optional<uint64_t> offset = std::nullopt);
 void set_end_of_file(HANDLE h, uint64_t eof);
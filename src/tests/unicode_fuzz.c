@@ -0,0 +1,518 @@
+/* Copyright (c) Mark Harmstone 2016-17
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Differential fuzzer for the UTF-8 <-> UTF-16 converters in unicode.c. It runs random input
+ * through the driver's converters, built in user mode, and through the original byte-at-a-time
+ * versions below, and complains if the status, the reported length or the output differ. Each
+ * of the ASCII run implementations - the portable one, SSE2 and (if the CPU has it) AVX2 - gets
+ * a turn.
+ *
+ * It isn't part of the CMake build, as that only targets Windows. On Linux:
+ *
+ *     gcc -O2 -o unicode_fuzz src/tests/unicode_fuzz.c && ./unicode_fuzz [iterations] [seed]
+ *
+ * One difference is expected: when given a buffer, the old utf8_to_utf16 reported a length two
+ * bytes short for every character from U+10000 to U+1FFFF, as it subtracted 0x10000 from the
+ * code point before counting it. The new one reports the real length, which is what the old
+ * one returned when called without a buffer - so that's what we compare against. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(__x86_64__) && !defined(__i386__)
+#error "x86 only - this is where the SIMD versions live"
+#endif
+
+typedef uint32_t ULONG;
+typedef int32_t NTSTATUS;
+typedef uint16_t WCHAR;
+
+#define STATUS_SUCCESS ((NTSTATUS)0x00000000)
+#define STATUS_SOME_NOT_MAPPED ((NTSTATUS)0x00000107)
+#define STATUS_BUFFER_OVERFLOW ((NTSTATUS)0x80000005)
+
+#define RtlCopyMemory memcpy
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define __inline inline
+
+#ifdef __x86_64__
+#define _AMD64_
+#else
+#define _X86_
+#endif
+
+typedef ULONG (*ascii_widen_func)(uint16_t* out, const uint8_t* in, ULONG len);
+typedef ULONG (*ascii_narrow_func)(uint8_t* out, const uint16_t* in, ULONG len);
+
+ULONG ascii_widen_sse2(uint16_t* out, const uint8_t* in, ULONG len);
+ULONG ascii_narrow_sse2(uint8_t* out, const uint16_t* in, ULONG len);
+ULONG ascii_widen_avx2(uint16_t* out, const uint8_t* in, ULONG len);
+ULONG ascii_narrow_avx2(uint8_t* out, const uint16_t* in, ULONG len);
+
+#define UNICODE_FUZZ
+#include "../unicode.c"
+
+// the converters as they were in btrfs.c before unicode.c, kept as they were
+
+static NTSTATUS ref_utf8_to_utf16(WCHAR* dest, ULONG dest_max, ULONG* dest_len, char* src, ULONG src_len) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    uint8_t* in = (uint8_t*)src;
+    uint16_t* out = (uint16_t*)dest;
+    ULONG needed = 0, left = dest_max / sizeof(uint16_t);
+
+    for (ULONG i = 0; i < src_len; i++) {
+        uint32_t cp;
+
+        if (!(in[i] & 0x80))
+            cp = in[i];
+        else if ((in[i] & 0xe0) == 0xc0) {
+            if (i == src_len - 1 || (in[i+1] & 0xc0) != 0x80) {
+                cp = 0xfffd;
+                Status = STATUS_SOME_NOT_MAPPED;
+            } else {
+                cp = ((in[i] & 0x1f) << 6) | (in[i+1] & 0x3f);
+                i++;
+            }
+        } else if ((in[i] & 0xf0) == 0xe0) {
+            if (i >= src_len - 2 || (in[i+1] & 0xc0) != 0x80 || (in[i+2] & 0xc0) != 0x80) {
+                cp = 0xfffd;
+                Status = STATUS_SOME_NOT_MAPPED;
+            } else {
+                cp = ((in[i] & 0xf) << 12) | ((in[i+1] & 0x3f) << 6) | (in[i+2] & 0x3f);
+                i += 2;
+            }
+        } else if ((in[i] & 0xf8) == 0xf0) {
+            if (i >= src_len - 3 || (in[i+1] & 0xc0) != 0x80 || (in[i+2] & 0xc0) != 0x80 || (in[i+3] & 0xc0) != 0x80) {
+                cp = 0xfffd;
+                Status = STATUS_SOME_NOT_MAPPED;
+            } else {
+                cp = ((in[i] & 0x7) << 18) | ((in[i+1] & 0x3f) << 12) | ((in[i+2] & 0x3f) << 6) | (in[i+3] & 0x3f);
+                i += 3;
+            }
+        } else {
+            cp = 0xfffd;
+            Status = STATUS_SOME_NOT_MAPPED;
+        }
+
+        if (cp > 0x10ffff) {
+            cp = 0xfffd;
+            Status = STATUS_SOME_NOT_MAPPED;
+        }
+
+        if (dest) {
+            if (cp <= 0xffff) {
+                if (left < 1)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                *out = (uint16_t)cp;
+                out++;
+
+                left--;
+            } else {
+                if (left < 2)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                cp -= 0x10000;
+
+                *out = 0xd800 | ((cp & 0xffc00) >> 10);
+                out++;
+
+                *out = 0xdc00 | (cp & 0x3ff);
+                out++;
+
+                left -= 2;
+            }
+        }
+
+        if (cp <= 0xffff)
+            needed += sizeof(uint16_t);
+        else
+            needed += 2 * sizeof(uint16_t);
+    }
+
+    if (dest_len)
+        *dest_len = needed;
+
+    return Status;
+}
+
+static NTSTATUS ref_utf16_to_utf8(char* dest, ULONG dest_max, ULONG* dest_len, WCHAR* src, ULONG src_len) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    uint16_t* in = (uint16_t*)src;
+    uint8_t* out = (uint8_t*)dest;
+    ULONG in_len = src_len / sizeof(uint16_t);
+    ULONG needed = 0, left = dest_max;
+
+    for (ULONG i = 0; i < in_len; i++) {
+        uint32_t cp = *in;
+        in++;
+
+        if ((cp & 0xfc00) == 0xd800) {
+            if (i == in_len - 1 || (*in & 0xfc00) != 0xdc00) {
+                cp = 0xfffd;
+                Status = STATUS_SOME_NOT_MAPPED;
+            } else {
+                cp = (cp & 0x3ff) << 10;
+                cp |= *in & 0x3ff;
+                cp += 0x10000;
+
+                in++;
+                i++;
+            }
+        } else if ((cp & 0xfc00) == 0xdc00) {
+            cp = 0xfffd;
+            Status = STATUS_SOME_NOT_MAPPED;
+        }
+
+        if (cp > 0x10ffff) {
+            cp = 0xfffd;
+            Status = STATUS_SOME_NOT_MAPPED;
+        }
+
+        if (dest) {
+            if (cp < 0x80) {
+                if (left < 1)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                *out = (uint8_t)cp;
+                out++;
+
+                left--;
+            } else if (cp < 0x800) {
+                if (left < 2)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                *out = 0xc0 | ((cp & 0x7c0) >> 6);
+                out++;
+
+                *out = 0x80 | (cp & 0x3f);
+                out++;
+
+                left -= 2;
+            } else if (cp < 0x10000) {
+                if (left < 3)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                *out = 0xe0 | ((cp & 0xf000) >> 12);
+                out++;
+
+                *out = 0x80 | ((cp & 0xfc0) >> 6);
+                out++;
+
+                *out = 0x80 | (cp & 0x3f);
+                out++;
+
+                left -= 3;
+            } else {
+                if (left < 4)
+                    return STATUS_BUFFER_OVERFLOW;
+
+                *out = 0xf0 | ((cp & 0x1c0000) >> 18);
+                out++;
+
+                *out = 0x80 | ((cp & 0x3f000) >> 12);
+                out++;
+
+                *out = 0x80 | ((cp & 0xfc0) >> 6);
+                out++;
+
+                *out = 0x80 | (cp & 0x3f);
+                out++;
+
+                left -= 4;
+            }
+        }
+
+        if (cp < 0x80)
+            needed++;
+        else if (cp < 0x800)
+            needed += 2;
+        else if (cp < 0x10000)
+            needed += 3;
+        else
+            needed += 4;
+    }
+
+    if (dest_len)
+        *dest_len = needed;
+
+    return Status;
+}
+
+
+#define MAX_UTF8 512
+#define MAX_UTF16 256
+
+static uint32_t rnd_state;
+
+static uint32_t rnd(uint32_t n) {
+    // xorshift32 - good enough, and the same everywhere for a given seed
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+
+    return n == 0 ? 0 : rnd_state % n;
+}
+
+static ULONG put_utf8(uint8_t* s, ULONG len, uint32_t cp) {
+    if (cp < 0x80 && len >= 1) {
+        s[0] = (uint8_t)cp;
+        return 1;
+    } else if (cp < 0x800 && len >= 2) {
+        s[0] = 0xc0 | (uint8_t)(cp >> 6);
+        s[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    } else if (cp < 0x10000 && len >= 3) {
+        s[0] = 0xe0 | (uint8_t)(cp >> 12);
+        s[1] = 0x80 | ((cp >> 6) & 0x3f);
+        s[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    } else if (cp >= 0x10000 && len >= 4) {
+        s[0] = 0xf0 | (uint8_t)((cp >> 18) & 0x7);
+        s[1] = 0x80 | ((cp >> 12) & 0x3f);
+        s[2] = 0x80 | ((cp >> 6) & 0x3f);
+        s[3] = 0x80 | (cp & 0x3f);
+        return 4;
+    }
+
+    return 0;
+}
+
+// ASCII runs of every length, mixed with characters of every width, and some rubbish
+static ULONG gen_utf8(uint8_t* s) {
+    ULONG len = 0, target = rnd(MAX_UTF8);
+
+    while (len < target) {
+        ULONG n;
+
+        switch (rnd(8)) {
+            case 0:
+            case 1:
+            case 2:
+                n = rnd(40);
+
+                for (ULONG i = 0; i < n && len < target; i++) {
+                    s[len++] = 0x20 + rnd(0x5f);
+                }
+            break;
+
+            case 3:
+                len += put_utf8(&s[len], target - len, 0x80 + rnd(0x780));
+            break;
+
+            case 4:
+                len += put_utf8(&s[len], target - len, 0x800 + rnd(0xf800));
+            break;
+
+            case 5:
+                // includes U+10000 to U+1FFFF, and some past U+10FFFF
+                len += put_utf8(&s[len], target - len, 0x10000 + rnd(0x110000));
+            break;
+
+            case 6: // truncated sequence
+                n = put_utf8(&s[len], target - len, 0x80 + rnd(0x10ff80));
+
+                if (n > 1)
+                    n -= 1 + rnd(n - 1);
+
+                len += n;
+            break;
+
+            case 7:
+                s[len++] = (uint8_t)rnd(0x100);
+            break;
+        }
+    }
+
+    return len;
+}
+
+static ULONG gen_utf16(uint16_t* s) {
+    ULONG len = 0, target = rnd(MAX_UTF16);
+
+    while (len < target) {
+        ULONG n;
+
+        switch (rnd(7)) {
+            case 0:
+            case 1:
+            case 2:
+                n = rnd(40);
+
+                for (ULONG i = 0; i < n && len < target; i++) {
+                    s[len++] = 0x20 + rnd(0x5f);
+                }
+            break;
+
+            case 3:
+                s[len++] = 0x80 + rnd(0x780);
+            break;
+
+            case 4:
+                s[len++] = 0x800 + rnd(0xf800); // includes unpaired surrogates
+            break;
+
+            case 5:
+                if (len + 2 <= target) {
+                    s[len++] = 0xd800 + rnd(0x400);
+                    s[len++] = 0xdc00 + rnd(0x400);
+                } else
+                    s[len++] = 0xd800 + rnd(0x400);
+            break;
+
+            case 6:
+                s[len++] = 0xdc00 + rnd(0x400);
+            break;
+        }
+    }
+
+    return len;
+}
+
+static unsigned long failures = 0;
+
+static void fail(const char* impl, const char* func, unsigned long it, const char* what) {
+    failures++;
+
+    if (failures <= 20)
+        fprintf(stderr, "%s: %s: iteration %lu: %s differs\n", impl, func, it, what);
+}
+
+static void check_utf8_to_utf16(const char* impl, unsigned long it) {
+    uint8_t src[MAX_UTF8];
+    uint16_t out1[MAX_UTF16 * 2 + 8], out2[MAX_UTF16 * 2 + 8];
+    ULONG src_len = gen_utf8(src), len1, len2, needed;
+    NTSTATUS Status1, Status2;
+
+    len1 = len2 = 0xdeadbeef;
+    Status1 = ref_utf8_to_utf16(NULL, 0, &len1, (char*)src, src_len);
+    Status2 = utf8_to_utf16(NULL, 0, &len2, (char*)src, src_len);
+
+    if (Status1 != Status2)
+        fail(impl, "utf8_to_utf16", it, "status without buffer");
+
+    if (len1 != len2)
+        fail(impl, "utf8_to_utf16", it, "length without buffer");
+
+    needed = len1;
+
+    // sometimes big enough, sometimes not, and sometimes an odd number of bytes
+    ULONG dest_max = rnd(3) == 0 ? rnd(needed + 3) : needed + rnd(8);
+
+    if (dest_max > sizeof(out1))
+        dest_max = sizeof(out1);
+
+    memset(out1, 0xcc, sizeof(out1));
+    memset(out2, 0xcc, sizeof(out2));
+    len1 = len2 = 0xdeadbeef;
+
+    Status1 = ref_utf8_to_utf16(out1, dest_max, &len1, (char*)src, src_len);
+    Status2 = utf8_to_utf16(out2, dest_max, &len2, (char*)src, src_len);
+
+    if (Status1 != Status2)
+        fail(impl, "utf8_to_utf16", it, "status");
+
+    if (memcmp(out1, out2, sizeof(out1)))
+        fail(impl, "utf8_to_utf16", it, "output");
+
+    // see above - the old function under-reported U+10000 to U+1FFFF here
+    if (Status1 != STATUS_BUFFER_OVERFLOW && len2 != needed)
+        fail(impl, "utf8_to_utf16", it, "length");
+    else if (Status1 == STATUS_BUFFER_OVERFLOW && len1 != len2)
+        fail(impl, "utf8_to_utf16", it, "length on overflow");
+}
+
+static void check_utf16_to_utf8(const char* impl, unsigned long it) {
+    uint16_t src[MAX_UTF16];
+    uint8_t out1[MAX_UTF16 * 3 + 8], out2[MAX_UTF16 * 3 + 8];
+    ULONG src_len = gen_utf16(src) * sizeof(uint16_t), len1, len2;
+    NTSTATUS Status1, Status2;
+
+    if (src_len > 0 && rnd(8) == 0) // odd number of bytes
+        src_len--;
+
+    len1 = len2 = 0xdeadbeef;
+    Status1 = ref_utf16_to_utf8(NULL, 0, &len1, src, src_len);
+    Status2 = utf16_to_utf8(NULL, 0, &len2, src, src_len);
+
+    if (Status1 != Status2)
+        fail(impl, "utf16_to_utf8", it, "status without buffer");
+
+    if (len1 != len2)
+        fail(impl, "utf16_to_utf8", it, "length without buffer");
+
+    ULONG dest_max = rnd(3) == 0 ? rnd(len1 + 3) : len1 + rnd(8);
+
+    if (dest_max > sizeof(out1))
+        dest_max = sizeof(out1);
+
+    memset(out1, 0xcc, sizeof(out1));
+    memset(out2, 0xcc, sizeof(out2));
+    len1 = len2 = 0xdeadbeef;
+
+    Status1 = ref_utf16_to_utf8((char*)out1, dest_max, &len1, src, src_len);
+    Status2 = utf16_to_utf8((char*)out2, dest_max, &len2, src, src_len);
+
+    if (Status1 != Status2)
+        fail(impl, "utf16_to_utf8", it, "status");
+
+    if (len1 != len2)
+        fail(impl, "utf16_to_utf8", it, "length");
+
+    if (memcmp(out1, out2, sizeof(out1)))
+        fail(impl, "utf16_to_utf8", it, "output");
+}
+
+int main(int argc, char* argv[]) {
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+    uint32_t seed = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 0) : 1;
+    static const struct {
+        const char* name;
+        ascii_widen_func widen;
+        ascii_narrow_func narrow;
+        bool avx2;
+    } impls[] = {
+        { "portable", ascii_widen_ref, ascii_narrow_ref, false },
+        { "SSE2", ascii_widen_sse2, ascii_narrow_sse2, false },
+        { "AVX2", ascii_widen_avx2, ascii_narrow_avx2, true }
+    };
+
+    for (unsigned int i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (impls[i].avx2 && !__builtin_cpu_supports("avx2")) {
+            printf("%s: skipped, CPU doesn't have it\n", impls[i].name);
+            continue;
+        }
+
+        ascii_widen = impls[i].widen;
+        ascii_narrow = impls[i].narrow;
+        rnd_state = seed != 0 ? seed : 1;
+
+        for (unsigned long it = 0; it < iterations; it++) {
+            check_utf8_to_utf16(impls[i].name, it);
+            check_utf16_to_utf8(impls[i].name, it);
+        }
+
+        printf("%s: %lu iterations\n", impls[i].name, iterations);
+    }
+
+    printf("%lu failures\n", failures);
+
+    return failures == 0 ? 0 : 1;
+}
@@ -1899,10 +1899,35 @@ static NTSTATUS handle_batch_collision(device_extension* Vcb, batch_item* bi, tr
     return STATUS_SUCCESS;
 }
 
+/* Like find_item, but for a key which comes after one we've already found in the leaf t.
+ * Rather than going back to the top, we climb only as far as the lowest ancestor of t whose
+ * range includes searchkey, and descend again from there. As commit_batch_list_root
+ * goes through its items in order, this is usually the leaf itself or its parent. */
+__attribute__((nonnull(1,2,3,4)))
+static NTSTATUS find_item_after(device_extension* Vcb, tree* t, traverse_ptr* tp, const KEY* searchkey, PIRP Irp) {
+    while (t->parent) {
+        tree_data* td = next_item(t->parent, t->paritem);
+
+        if (td && keycmp(*searchkey, td->key) == -1)
+            break;
+
+        t = t->parent;
+    }
+
+    return find_item_in_tree(Vcb, t, tp, searchkey, true, 0, Irp);
+}
+
 __attribute__((nonnull(1,2)))
 static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, batch_root* br, PIRP Irp) {
     LIST_ENTRY* le;
     NTSTATUS Status;
+    tree* last_leaf = NULL;
+#ifdef DEBUG_FLUSH_TIMES
+    ULONG num_items = 0, num_leaves = 0;
+    LARGE_INTEGER freq, time1, time2;
+
+    time1 = KeQueryPerformanceCounter(&freq);
+#endif
 
     TRACE("root: %I64x\n", br->r->id);
 
@@ -1920,12 +1945,31 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
 
         TRACE("(%I64x,%x,%I64x)\n", bi->key.obj_id, bi->key.obj_type, bi->key.offset);
 
-        Status = find_item(Vcb, br->r, &tp, &bi->key, true, Irp);
-        if (!NT_SUCCESS(Status)) { // FIXME - handle STATUS_NOT_FOUND
-            ERR("find_item returned %08lx\n", Status);
-            return Status;
+        // Items are sorted, so if the last one was put in a leaf we can start looking from there.
+        // The ranged deletions below can leave tp past where the next item goes, so we don't
+        // remember the leaf after those.
+
+        if (last_leaf) {
+            Status = find_item_after(Vcb, last_leaf, &tp, &bi->key, Irp);
+            if (!NT_SUCCESS(Status)) { // FIXME - handle STATUS_NOT_FOUND
+                ERR("find_item_after returned %08lx\n", Status);
+                return Status;
+            }
+        } else {
+            Status = find_item(Vcb, br->r, &tp, &bi->key, true, Irp);
+            if (!NT_SUCCESS(Status)) { // FIXME - handle STATUS_NOT_FOUND
+                ERR("find_item returned %08lx\n", Status);
+                return Status;
+            }
         }
 
+        last_leaf = NULL;
+
+#ifdef DEBUG_FLUSH_TIMES
+        num_items++;
+        num_leaves++;
+#endif
+
         Status = find_tree_end(tp.tree, &tree_end, &no_end);
         if (!NT_SUCCESS(Status)) {
             ERR("find_tree_end returned %08lx\n", Status);
@@ -2306,6 +2350,10 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                             break;
                     }
 
+#ifdef DEBUG_FLUSH_TIMES
+                    num_items++;
+#endif
+
                     le = le2;
                 } else
                     break;
@@ -2324,11 +2372,20 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                 t->header.generation = Vcb->superblock.generation;
                 t = t->parent;
             }
+
+            last_leaf = tp.tree;
         }
 
         le = le->Flink;
     }
 
+#ifdef DEBUG_FLUSH_TIMES
+    time2 = KeQueryPerformanceCounter(NULL);
+
+    ERR("root %I64x: committed %lu batch items to %lu leaves in %I64u (freq = %I64u)\n", br->r->id, num_items, num_leaves,
+        time2.QuadPart - time1.QuadPart, freq.QuadPart);
+#endif
+
     // FIXME - remove as we are going along
     while (!IsListEmpty(&br->items)) {
         batch_item* bi = CONTAINING_RECORD(RemoveHeadList(&br->items), batch_item, list_entry);
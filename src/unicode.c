@@ -0,0 +1,463 @@
+/* Copyright (c) Mark Harmstone 2016-17
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef UNICODE_FUZZ // tests/unicode_fuzz.c builds us in user mode
+#include "btrfs_drv.h"
+#endif
+
+#if defined(_X86_) || defined(_AMD64_)
+#include <immintrin.h>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define SSE2_TARGET
+#define AVX2_TARGET
+#else
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+/* The ASCII functions copy the run of ASCII characters at the start of in, stopping
+ * at the first character which isn't, and return its length. If out is NULL they
+ * only measure it. Nearly all filenames are entirely ASCII, so this is where the
+ * converters below spend their time. */
+
+static ULONG ascii_widen_ref(uint16_t* out, const uint8_t* in, ULONG len) {
+    ULONG i = 0;
+
+    while (i + sizeof(uint64_t) <= len) {
+        uint64_t v;
+
+        RtlCopyMemory(&v, &in[i], sizeof(uint64_t));
+
+        if (v & 0x8080808080808080)
+            break;
+
+        if (out) {
+            for (unsigned int j = 0; j < sizeof(uint64_t); j++) {
+                out[i + j] = in[i + j];
+            }
+        }
+
+        i += sizeof(uint64_t);
+    }
+
+    while (i < len && !(in[i] & 0x80)) {
+        if (out)
+            out[i] = in[i];
+
+        i++;
+    }
+
+    return i;
+}
+
+static ULONG ascii_narrow_ref(uint8_t* out, const uint16_t* in, ULONG len) {
+    ULONG i = 0;
+
+    while (i + 4 <= len) {
+        uint64_t v;
+
+        RtlCopyMemory(&v, &in[i], sizeof(uint64_t));
+
+        if (v & 0xff80ff80ff80ff80)
+            break;
+
+        if (out) {
+            for (unsigned int j = 0; j < 4; j++) {
+                out[i + j] = (uint8_t)in[i + j];
+            }
+        }
+
+        i += 4;
+    }
+
+    while (i < len && in[i] < 0x80) {
+        if (out)
+            out[i] = (uint8_t)in[i];
+
+        i++;
+    }
+
+    return i;
+}
+
+#if defined(_X86_) || defined(_AMD64_)
+SSE2_TARGET
+ULONG ascii_widen_sse2(uint16_t* out, const uint8_t* in, ULONG len) {
+    ULONG i = 0;
+    __m128i zero = _mm_setzero_si128();
+
+    while (i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&in[i]);
+
+        if (_mm_movemask_epi8(v) != 0)
+            break;
+
+        if (out) {
+            _mm_storeu_si128((__m128i*)&out[i], _mm_unpacklo_epi8(v, zero));
+            _mm_storeu_si128((__m128i*)&out[i + 8], _mm_unpackhi_epi8(v, zero));
+        }
+
+        i += 16;
+    }
+
+    return i + ascii_widen_ref(out ? &out[i] : NULL, &in[i], len - i);
+}
+
+SSE2_TARGET
+ULONG ascii_narrow_sse2(uint8_t* out, const uint16_t* in, ULONG len) {
+    ULONG i = 0;
+    __m128i zero = _mm_setzero_si128();
+    __m128i mask = _mm_set1_epi16((short)0xff80);
+
+    while (i + 16 <= len) {
+        __m128i v1 = _mm_loadu_si128((const __m128i*)&in[i]);
+        __m128i v2 = _mm_loadu_si128((const __m128i*)&in[i + 8]);
+        __m128i high = _mm_and_si128(_mm_or_si128(v1, v2), mask);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, zero)) != 0xffff)
+            break;
+
+        if (out)
+            _mm_storeu_si128((__m128i*)&out[i], _mm_packus_epi16(v1, v2));
+
+        i += 16;
+    }
+
+    return i + ascii_narrow_ref(out ? &out[i] : NULL, &in[i], len - i);
+}
+
+AVX2_TARGET
+ULONG ascii_widen_avx2(uint16_t* out, const uint8_t* in, ULONG len) {
+    ULONG i = 0;
+
+    while (i + 32 <= len) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&in[i]);
+
+        if (_mm256_movemask_epi8(v) != 0)
+            break;
+
+        if (out) {
+            _mm256_storeu_si256((__m256i*)&out[i], _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+            _mm256_storeu_si256((__m256i*)&out[i + 16], _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+        }
+
+        i += 32;
+    }
+
+    return i + ascii_widen_ref(out ? &out[i] : NULL, &in[i], len - i);
+}
+
+AVX2_TARGET
+ULONG ascii_narrow_avx2(uint8_t* out, const uint16_t* in, ULONG len) {
+    ULONG i = 0;
+    __m256i mask = _mm256_set1_epi16((short)0xff80);
+
+    while (i + 32 <= len) {
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)&in[i]);
+        __m256i v2 = _mm256_loadu_si256((const __m256i*)&in[i + 16]);
+
+        if (!_mm256_testz_si256(_mm256_or_si256(v1, v2), mask))
+            break;
+
+        if (out) {
+            // packus works within each 128-bit lane, so put the quadwords back in order afterwards
+            __m256i packed = _mm256_packus_epi16(v1, v2);
+
+            _mm256_storeu_si256((__m256i*)&out[i], _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+        }
+
+        i += 32;
+    }
+
+    return i + ascii_narrow_ref(out ? &out[i] : NULL, &in[i], len - i);
+}
+#endif
+
+ascii_widen_func ascii_widen = ascii_widen_ref;
+ascii_narrow_func ascii_narrow = ascii_narrow_ref;
+
+static __inline uint32_t decode_utf8(const uint8_t* in, ULONG src_len, ULONG* pos, NTSTATUS* Status) {
+    ULONG i = *pos;
+    uint32_t cp;
+
+    if (!(in[i] & 0x80))
+        cp = in[i];
+    else if ((in[i] & 0xe0) == 0xc0) {
+        if (i == src_len - 1 || (in[i+1] & 0xc0) != 0x80) {
+            cp = 0xfffd;
+            *Status = STATUS_SOME_NOT_MAPPED;
+        } else {
+            cp = ((in[i] & 0x1f) << 6) | (in[i+1] & 0x3f);
+            i++;
+        }
+    } else if ((in[i] & 0xf0) == 0xe0) {
+        if (i >= src_len - 2 || (in[i+1] & 0xc0) != 0x80 || (in[i+2] & 0xc0) != 0x80) {
+            cp = 0xfffd;
+            *Status = STATUS_SOME_NOT_MAPPED;
+        } else {
+            cp = ((in[i] & 0xf) << 12) | ((in[i+1] & 0x3f) << 6) | (in[i+2] & 0x3f);
+            i += 2;
+        }
+    } else if ((in[i] & 0xf8) == 0xf0) {
+        if (i >= src_len - 3 || (in[i+1] & 0xc0) != 0x80 || (in[i+2] & 0xc0) != 0x80 || (in[i+3] & 0xc0) != 0x80) {
+            cp = 0xfffd;
+            *Status = STATUS_SOME_NOT_MAPPED;
+        } else {
+            cp = ((in[i] & 0x7) << 18) | ((in[i+1] & 0x3f) << 12) | ((in[i+2] & 0x3f) << 6) | (in[i+3] & 0x3f);
+            i += 3;
+        }
+    } else {
+        cp = 0xfffd;
+        *Status = STATUS_SOME_NOT_MAPPED;
+    }
+
+    if (cp > 0x10ffff) {
+        cp = 0xfffd;
+        *Status = STATUS_SOME_NOT_MAPPED;
+    }
+
+    *pos = i + 1;
+
+    return cp;
+}
+
+// version of RtlUTF8ToUnicodeN for Vista and below
+NTSTATUS utf8_to_utf16(WCHAR* dest, ULONG dest_max, ULONG* dest_len, char* src, ULONG src_len) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    uint8_t* in = (uint8_t*)src;
+    uint16_t* out = (uint16_t*)dest;
+    ULONG needed = 0, left = dest_max / sizeof(uint16_t), i;
+
+    // first pass: work out the length, skipping over runs of ASCII
+
+    i = 0;
+    while (i < src_len) {
+        ULONG run = ascii_widen(NULL, &in[i], src_len - i);
+
+        i += run;
+        needed += run * sizeof(uint16_t);
+
+        if (i == src_len)
+            break;
+
+        if (decode_utf8(in, src_len, &i, &Status) <= 0xffff)
+            needed += sizeof(uint16_t);
+        else
+            needed += 2 * sizeof(uint16_t);
+    }
+
+    if (!dest) {
+        if (dest_len)
+            *dest_len = needed;
+
+        return Status;
+    }
+
+    /* Second pass: convert. If the buffer is too small we still fill as much of it as we
+     * can before returning STATUS_BUFFER_OVERFLOW, as RtlUTF8ToUnicodeN does. */
+
+    i = 0;
+    while (i < src_len) {
+        ULONG run = ascii_widen(out, &in[i], min(src_len - i, left));
+        uint32_t cp;
+
+        i += run;
+        out += run;
+        left -= run;
+
+        if (i == src_len)
+            break;
+
+        cp = decode_utf8(in, src_len, &i, &Status);
+
+        if (cp <= 0xffff) {
+            if (left < 1)
+                return STATUS_BUFFER_OVERFLOW;
+
+            *out = (uint16_t)cp;
+            out++;
+
+            left--;
+        } else {
+            if (left < 2)
+                return STATUS_BUFFER_OVERFLOW;
+
+            cp -= 0x10000;
+
+            *out = 0xd800 | ((cp & 0xffc00) >> 10);
+            out++;
+
+            *out = 0xdc00 | (cp & 0x3ff);
+            out++;
+
+            left -= 2;
+        }
+    }
+
+    if (dest_len)
+        *dest_len = needed;
+
+    return Status;
+}
+
+static __inline uint32_t decode_utf16(const uint16_t* in, ULONG in_len, ULONG* pos, NTSTATUS* Status) {
+    ULONG i = *pos;
+    uint32_t cp = in[i];
+
+    if ((cp & 0xfc00) == 0xd800) {
+        if (i == in_len - 1 || (in[i+1] & 0xfc00) != 0xdc00) {
+            cp = 0xfffd;
+            *Status = STATUS_SOME_NOT_MAPPED;
+        } else {
+            cp = (cp & 0x3ff) << 10;
+            cp |= in[i+1] & 0x3ff;
+            cp += 0x10000;
+
+            i++;
+        }
+    } else if ((cp & 0xfc00) == 0xdc00) {
+        cp = 0xfffd;
+        *Status = STATUS_SOME_NOT_MAPPED;
+    }
+
+    if (cp > 0x10ffff) {
+        cp = 0xfffd;
+        *Status = STATUS_SOME_NOT_MAPPED;
+    }
+
+    *pos = i + 1;
+
+    return cp;
+}
+
+// version of RtlUnicodeToUTF8N for Vista and below
+NTSTATUS utf16_to_utf8(char* dest, ULONG dest_max, ULONG* dest_len, WCHAR* src, ULONG src_len) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    uint16_t* in = (uint16_t*)src;
+    uint8_t* out = (uint8_t*)dest;
+    ULONG in_len = src_len / sizeof(uint16_t);
+    ULONG needed = 0, left = dest_max, i;
+
+    // first pass: work out the length, skipping over runs of ASCII
+
+    i = 0;
+    while (i < in_len) {
+        ULONG run = ascii_narrow(NULL, &in[i], in_len - i);
+        uint32_t cp;
+
+        i += run;
+        needed += run;
+
+        if (i == in_len)
+            break;
+
+        cp = decode_utf16(in, in_len, &i, &Status);
+
+        if (cp < 0x80)
+            needed++;
+        else if (cp < 0x800)
+            needed += 2;
+        else if (cp < 0x10000)
+            needed += 3;
+        else
+            needed += 4;
+    }
+
+    if (!dest) {
+        if (dest_len)
+            *dest_len = needed;
+
+        return Status;
+    }
+
+    /* Second pass: convert. If the buffer is too small we still fill as much of it as we
+     * can before returning STATUS_BUFFER_OVERFLOW, as RtlUnicodeToUTF8N does. */
+
+    i = 0;
+    while (i < in_len) {
+        ULONG run = ascii_narrow(out, &in[i], min(in_len - i, left));
+        uint32_t cp;
+
+        i += run;
+        out += run;
+        left -= run;
+
+        if (i == in_len)
+            break;
+
+        cp = decode_utf16(in, in_len, &i, &Status);
+
+        if (cp < 0x80) {
+            if (left < 1)
+                return STATUS_BUFFER_OVERFLOW;
+
+            *out = (uint8_t)cp;
+            out++;
+
+            left--;
+        } else if (cp < 0x800) {
+            if (left < 2)
+                return STATUS_BUFFER_OVERFLOW;
+
+            *out = 0xc0 | ((cp & 0x7c0) >> 6);
+            out++;
+
+            *out = 0x80 | (cp & 0x3f);
+            out++;
+
+            left -= 2;
+        } else if (cp < 0x10000) {
+            if (left < 3)
+                return STATUS_BUFFER_OVERFLOW;
+
+            *out = 0xe0 | ((cp & 0xf000) >> 12);
+            out++;
+
+            *out = 0x80 | ((cp & 0xfc0) >> 6);
+            out++;
+
+            *out = 0x80 | (cp & 0x3f);
+            out++;
+
+            left -= 3;
+        } else {
+            if (left < 4)
+                return STATUS_BUFFER_OVERFLOW;
+
+            *out = 0xf0 | ((cp & 0x1c0000) >> 18);
+            out++;
+
+            *out = 0x80 | ((cp & 0x3f000) >> 12);
+            out++;
+
+            *out = 0x80 | ((cp & 0xfc0) >> 6);
+            out++;
+
+            *out = 0x80 | (cp & 0x3f);
+            out++;
+
+            left -= 4;
+        }
+    }
+
+    if (dest_len)
+        *dest_len = needed;
+
+    return Status;
+}
@@ -17,10 +17,19 @@
 
 #include "btrfs_drv.h"
 
+// how long a low-priority job can wait before it's allowed to jump the queue, in 100ns units
+#define LOW_PRIORITY_MAX_WAIT 10000000 // 1 second
+
+// how many reads in a row we do before letting a waiting write through
+#define MAX_READS_IN_ROW 4
+
+extern tIoGetIoPriorityHint fIoGetIoPriorityHint;
+
 typedef struct {
     device_extension* Vcb;
     PIRP Irp;
-    WORK_QUEUE_ITEM item;
+    uint64_t queued;
+    LIST_ENTRY list_entry;
 } job_info;
 
 NTSTATUS do_read_job(PIRP Irp) {
@@ -92,10 +101,8 @@ NTSTATUS do_write_job(device_extension* Vcb, PIRP Irp) {
     return Status;
 }
 
-_Function_class_(WORKER_THREAD_ROUTINE)
-static void __stdcall do_job(void* context) {
-    job_info* ji = context;
-    PIO_STACK_LOCATION IrpSp = ji->Irp ? IoGetCurrentIrpStackLocation(ji->Irp) : NULL;
+static void do_job(job_info* ji) {
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(ji->Irp);
 
     if (IrpSp->MajorFunction == IRP_MJ_READ) {
         do_read_job(ji->Irp);
@@ -106,59 +113,178 @@ static void __stdcall do_job(void* context) {
     ExFreePool(ji);
 }
 
-bool add_thread_job(device_extension* Vcb, PIRP Irp) {
+static unsigned int get_io_queue(PIRP Irp) {
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+
+    if (fIoGetIoPriorityHint && fIoGetIoPriorityHint(Irp) < IoPriorityNormal)
+        return io_queue_low;
+
+    return IrpSp->MajorFunction == IRP_MJ_READ ? io_queue_read : io_queue_write;
+}
+
+// called with spinlock held
+static job_info* get_next_job(drv_io_threads* iot) {
+    unsigned int queue;
     job_info* ji;
+    uint64_t wait;
 
-    ji = ExAllocatePoolWithTag(NonPagedPool, sizeof(job_info), ALLOC_TAG);
-    if (!ji) {
+    if (!IsListEmpty(&iot->queues[io_queue_low])) {
+        ji = CONTAINING_RECORD(iot->queues[io_queue_low].Flink, job_info, list_entry);
+
+        if (KeQueryInterruptTime() - ji->queued >= LOW_PRIORITY_MAX_WAIT) {
+            queue = io_queue_low;
+            goto found;
+        }
+    }
+
+    // Reads go first, as someone is usually waiting for them - but don't let a stream of reads
+    // hold up writes indefinitely.
+
+    if (!IsListEmpty(&iot->queues[io_queue_read]) && (iot->reads_in_row < MAX_READS_IN_ROW || IsListEmpty(&iot->queues[io_queue_write]))) {
+        queue = io_queue_read;
+        iot->reads_in_row++;
+    } else if (!IsListEmpty(&iot->queues[io_queue_write])) {
+        queue = io_queue_write;
+        iot->reads_in_row = 0;
+    } else if (!IsListEmpty(&iot->queues[io_queue_low]))
+        queue = io_queue_low;
+    else
+        return NULL;
+
+found:
+    ji = CONTAINING_RECORD(RemoveHeadList(&iot->queues[queue]), job_info, list_entry);
+
+    wait = KeQueryInterruptTime() - ji->queued;
+
+    iot->stats.queue_depth[queue]--;
+    iot->stats.jobs[queue]++;
+    iot->stats.wait_time[queue] += wait;
+
+    if (wait > iot->stats.max_wait_time[queue])
+        iot->stats.max_wait_time[queue] = wait;
+
+    return ji;
+}
+
+_Function_class_(KSTART_ROUTINE)
+void __stdcall io_thread(void* context) {
+    drv_io_thread* thread = context;
+    device_extension* Vcb = thread->DeviceObject->DeviceExtension;
+    drv_io_threads* iot = &Vcb->iothreads;
+
+    ObReferenceObject(thread->DeviceObject);
+
+    while (true) {
+        KIRQL irql;
+        job_info* ji;
+
+        KeWaitForSingleObject(&iot->semaphore, Executive, KernelMode, false, NULL);
+
+        KeAcquireSpinLock(&iot->spinlock, &irql);
+        ji = get_next_job(iot);
+        KeReleaseSpinLock(&iot->spinlock, irql);
+
+        if (ji)
+            do_job(ji);
+        else if (iot->quit)
+            break;
+    }
+
+    ObDereferenceObject(thread->DeviceObject);
+
+    KeSetEvent(&thread->finished, 0, false);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+void get_io_queue_stats(device_extension* Vcb, btrfs_io_queue_stats* stats) {
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Vcb->iothreads.spinlock, &irql);
+    RtlCopyMemory(stats, &Vcb->iothreads.stats, sizeof(btrfs_io_queue_stats));
+    KeReleaseSpinLock(&Vcb->iothreads.spinlock, irql);
+}
+
+bool lock_irp_buffer(PIRP Irp) {
+    PMDL Mdl;
+    LOCK_OPERATION op;
+    ULONG len;
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+
+    if (Irp->MdlAddress)
+        return true;
+
+    if (IrpSp->MajorFunction == IRP_MJ_READ) {
+        op = IoWriteAccess;
+        len = IrpSp->Parameters.Read.Length;
+    } else if (IrpSp->MajorFunction == IRP_MJ_WRITE) {
+        op = IoReadAccess;
+        len = IrpSp->Parameters.Write.Length;
+    } else {
+        ERR("unexpected major function %u\n", IrpSp->MajorFunction);
+        return false;
+    }
+
+    Mdl = IoAllocateMdl(Irp->UserBuffer, len, false, false, Irp);
+
+    if (!Mdl) {
         ERR("out of memory\n");
         return false;
     }
 
-    ji->Vcb = Vcb;
-    ji->Irp = Irp;
+    try {
+        MmProbeAndLockPages(Mdl, Irp->RequestorMode, op);
+    } except(EXCEPTION_EXECUTE_HANDLER) {
+        ERR("MmProbeAndLockPages raised status %08lx\n", GetExceptionCode());
 
-    if (!Irp->MdlAddress) {
-        PMDL Mdl;
-        LOCK_OPERATION op;
-        ULONG len;
-        PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
-
-        if (IrpSp->MajorFunction == IRP_MJ_READ) {
-            op = IoWriteAccess;
-            len = IrpSp->Parameters.Read.Length;
-        } else if (IrpSp->MajorFunction == IRP_MJ_WRITE) {
-            op = IoReadAccess;
-            len = IrpSp->Parameters.Write.Length;
-        } else {
-            ERR("unexpected major function %u\n", IrpSp->MajorFunction);
-            ExFreePool(ji);
-            return false;
-        }
+        IoFreeMdl(Mdl);
+        Irp->MdlAddress = NULL;
 
-        Mdl = IoAllocateMdl(Irp->UserBuffer, len, false, false, Irp);
+        return false;
+    }
 
-        if (!Mdl) {
-            ERR("out of memory\n");
-            ExFreePool(ji);
-            return false;
-        }
+    return true;
+}
 
-        try {
-            MmProbeAndLockPages(Mdl, Irp->RequestorMode, op);
-        } except(EXCEPTION_EXECUTE_HANDLER) {
-            ERR("MmProbeAndLockPages raised status %08lx\n", GetExceptionCode());
+static void queue_job(device_extension* Vcb, job_info* ji) {
+    unsigned int queue;
+    KIRQL irql;
 
-            IoFreeMdl(Mdl);
-            Irp->MdlAddress = NULL;
-            ExFreePool(ji);
+    queue = get_io_queue(ji->Irp);
+    ji->queued = KeQueryInterruptTime();
 
-            return false;
-        }
+    KeAcquireSpinLock(&Vcb->iothreads.spinlock, &irql);
+
+    InsertTailList(&Vcb->iothreads.queues[queue], &ji->list_entry);
+
+    Vcb->iothreads.stats.queue_depth[queue]++;
+
+    if (Vcb->iothreads.stats.queue_depth[queue] > Vcb->iothreads.stats.max_queue_depth[queue])
+        Vcb->iothreads.stats.max_queue_depth[queue] = Vcb->iothreads.stats.queue_depth[queue];
+
+    KeReleaseSpinLock(&Vcb->iothreads.spinlock, irql);
+
+    KeReleaseSemaphore(&Vcb->iothreads.semaphore, IO_NO_INCREMENT, 1, false);
+}
+
+bool add_thread_job(device_extension* Vcb, PIRP Irp) {
+    job_info* ji;
+
+    ji = ExAllocatePoolWithTag(NonPagedPool, sizeof(job_info), ALLOC_TAG);
+    if (!ji) {
+        ERR("out of memory\n");
+        return false;
+    }
+
+    ji->Vcb = Vcb;
+    ji->Irp = Irp;
+
+    if (!lock_irp_buffer(Irp)) {
+        ExFreePool(ji);
+        return false;
     }
 
-    ExInitializeWorkItem(&ji->item, do_job, ji);
-    ExQueueWorkItem(&ji->item, DelayedWorkQueue);
+    queue_job(Vcb, ji);
 
     return true;
 }
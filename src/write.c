@@ -35,6 +35,49 @@ extern tCcCopyWriteEx fCcCopyWriteEx;
 extern tFsRtlUpdateDiskCounters fFsRtlUpdateDiskCounters;
 extern bool diskacc;
 
+// Look for free space in a stripe which already has writes pending in this transaction. If we can
+// fill the rest of it in, it can be written out in one go without needing to read anything back.
+__attribute__((nonnull(1, 3)))
+static bool find_data_address_in_partial_stripe(chunk* c, uint64_t length, uint64_t* address) {
+    LIST_ENTRY *le, *le2;
+    uint16_t num_data_stripes = c->chunk_item->num_stripes - (c->chunk_item->type & BLOCK_FLAG_RAID5 ? 1 : 2);
+    uint64_t ps_length = num_data_stripes * c->chunk_item->stripe_length;
+    bool found = false;
+
+    if (length >= ps_length)
+        return false;
+
+    ExAcquireResourceSharedLite(&c->partial_stripes_lock, true);
+
+    // both lists are sorted by address
+    le = c->partial_stripes.Flink;
+    le2 = c->space.Flink;
+    while (le != &c->partial_stripes && le2 != &c->space) {
+        partial_stripe* ps = CONTAINING_RECORD(le, partial_stripe, list_entry);
+        space* s = CONTAINING_RECORD(le2, space, list_entry);
+
+        if (s->address + s->size <= ps->address)
+            le2 = le2->Flink;
+        else if (s->address >= ps->address + ps_length)
+            le = le->Flink;
+        else {
+            uint64_t start = max(s->address, ps->address);
+
+            if (s->address + s->size - start >= length) {
+                *address = start;
+                found = true;
+                break;
+            }
+
+            le2 = le2->Flink;
+        }
+    }
+
+    ExReleaseResourceLite(&c->partial_stripes_lock);
+
+    return found;
+}
+
 __attribute__((nonnull(1, 2, 4)))
 bool find_data_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t length, uint64_t* address) {
     LIST_ENTRY* le;
@@ -57,21 +100,24 @@ bool find_data_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t length
     if (IsListEmpty(&c->space_size))
         return false;
 
+    if (c->chunk_item->type & BLOCK_FLAG_RAID5 || c->chunk_item->type & BLOCK_FLAG_RAID6) {
+        if (find_data_address_in_partial_stripe(c, length, address))
+            return true;
+    }
+
     le = c->space_size.Flink;
     while (le != &c->space_size) {
         s = CONTAINING_RECORD(le, space, list_entry_size);
 
-        if (s->size == length) {
-            *address = s->address;
-            return true;
-        } else if (s->size < length) {
+        if (s->size == length)
+            goto found;
+        else if (s->size < length) {
             if (le == c->space_size.Flink)
                 return false;
 
             s = CONTAINING_RECORD(le->Blink, space, list_entry_size);
 
-            *address = s->address;
-            return true;
+            goto found;
         }
 
         le = le->Flink;
@@ -79,12 +125,26 @@ bool find_data_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t length
 
     s = CONTAINING_RECORD(c->space_size.Blink, space, list_entry_size);
 
-    if (s->size > length) {
-        *address = s->address;
-        return true;
-    }
+    if (s->size > length)
+        goto found;
 
     return false;
+
+found:
+    *address = s->address;
+
+    // For parity RAID, start writes of at least a stripe on a stripe boundary if there's room,
+    // so they don't leave partial stripes at both ends.
+    if (c->chunk_item->type & BLOCK_FLAG_RAID5 || c->chunk_item->type & BLOCK_FLAG_RAID6) {
+        uint16_t num_data_stripes = c->chunk_item->num_stripes - (c->chunk_item->type & BLOCK_FLAG_RAID5 ? 1 : 2);
+        uint64_t ps_length = num_data_stripes * c->chunk_item->stripe_length;
+        uint64_t off = (s->address - c->offset) % ps_length;
+
+        if (length >= ps_length && off != 0 && s->address + ps_length - off + length <= s->address + s->size)
+            *address = s->address + ps_length - off;
+    }
+
+    return true;
 }
 
 __attribute__((nonnull(1)))
@@ -2192,6 +2252,370 @@ void get_raid56_lock_range(chunk* c, uint64_t address, uint64_t length, uint64_t
     *locklen = (endoff - startoff) * datastripes;
 }
 
+typedef struct {
+    device_extension* Vcb;
+    fcb* fcb;
+    PIRP Irp;
+    LONG writes_left;
+    NTSTATUS Status;
+    LIST_ENTRY rollback;
+    uint64_t sequence_before;
+    uint64_t sequence_after;
+    PIO_WORKITEM work_item;
+    LIST_ENTRY list_entry;
+    bool holding;
+} async_write_context;
+
+static void inflight_write_started(device_extension* Vcb, fcb* fcb) {
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Vcb->inflight_writes_lock, &irql);
+
+    if (Vcb->inflight_writes++ == 0)
+        KeClearEvent(&Vcb->inflight_writes_event);
+
+    if (fcb && fcb->nonpaged->inflight_writes++ == 0)
+        KeClearEvent(&fcb->nonpaged->inflight_writes_event);
+
+    KeReleaseSpinLock(&Vcb->inflight_writes_lock, irql);
+}
+
+static void inflight_write_finished(device_extension* Vcb, fcb* fcb) {
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Vcb->inflight_writes_lock, &irql);
+
+    if (fcb && --fcb->nonpaged->inflight_writes == 0)
+        KeSetEvent(&fcb->nonpaged->inflight_writes_event, 0, false);
+
+    if (--Vcb->inflight_writes == 0)
+        KeSetEvent(&Vcb->inflight_writes_event, 0, false);
+
+    KeReleaseSpinLock(&Vcb->inflight_writes_lock, irql);
+}
+
+// Waits for any asynchronous data writes to finish, either for one file or, if fcb is NULL, the
+// whole volume. Readers need to do this so they don't see the old contents of the disk, and the
+// flush thread so it doesn't commit metadata pointing to data which isn't there yet.
+__attribute__((nonnull(1)))
+void wait_for_inflight_writes(device_extension* Vcb, fcb* fcb) {
+    if (fcb)
+        KeWaitForSingleObject(&fcb->nonpaged->inflight_writes_event, Executive, KernelMode, false, NULL);
+    else
+        KeWaitForSingleObject(&Vcb->inflight_writes_event, Executive, KernelMode, false, NULL);
+}
+
+static void free_async_write_context(async_write_context* context) {
+    clear_rollback(&context->rollback);
+    IoFreeWorkItem(context->work_item);
+    ExFreePool(context);
+}
+
+// Frees the rollback lists of asynchronous writes which finished at DISPATCH_LEVEL, where we
+// couldn't free the paged pool they're made of.
+void reap_async_writes(device_extension* Vcb) {
+    KIRQL irql;
+    LIST_ENTRY done;
+
+    if (IsListEmpty(&Vcb->async_writes_done))
+        return;
+
+    InitializeListHead(&done);
+
+    KeAcquireSpinLock(&Vcb->inflight_writes_lock, &irql);
+
+    while (!IsListEmpty(&Vcb->async_writes_done)) {
+        InsertTailList(&done, RemoveHeadList(&Vcb->async_writes_done));
+    }
+
+    KeReleaseSpinLock(&Vcb->inflight_writes_lock, irql);
+
+    while (!IsListEmpty(&done)) {
+        free_async_write_context(CONTAINING_RECORD(RemoveHeadList(&done), async_write_context, list_entry));
+    }
+}
+
+// Undoes the in-memory changes made by failed asynchronous writes, as write_file does when a
+// synchronous write fails. Called with the tree lock held exclusively, so nobody else can be
+// changing extents, and by do_write2 before it commits anything. If the file's been written to
+// again since, the rollback would be undoing the wrong thing - in that case we fall back to
+// refusing to commit, which puts the volume into read-only mode.
+void rollback_failed_async_writes(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb) {
+    KIRQL irql;
+    LIST_ENTRY failed;
+
+    if (IsListEmpty(&Vcb->async_writes_failed))
+        return;
+
+    InitializeListHead(&failed);
+
+    KeAcquireSpinLock(&Vcb->inflight_writes_lock, &irql);
+
+    while (!IsListEmpty(&Vcb->async_writes_failed)) {
+        InsertTailList(&failed, RemoveHeadList(&Vcb->async_writes_failed));
+    }
+
+    KeReleaseSpinLock(&Vcb->inflight_writes_lock, irql);
+
+    while (!IsListEmpty(&failed)) {
+        async_write_context* context = NULL;
+        LIST_ENTRY* le;
+
+        // newest first, so that several failed writes to the same file unwind in the right order
+        le = failed.Flink;
+        while (le != &failed) {
+            async_write_context* context2 = CONTAINING_RECORD(le, async_write_context, list_entry);
+
+            if (!context || context2->sequence_after > context->sequence_after)
+                context = context2;
+
+            le = le->Flink;
+        }
+
+        RemoveEntryList(&context->list_entry);
+        InitializeListHead(&context->list_entry);
+
+        if (context->fcb->inode_item.sequence == context->sequence_after) {
+            do_rollback(Vcb, &context->rollback);
+            context->fcb->inode_item.sequence = context->sequence_before;
+        } else {
+            ERR("inode %I64x changed after asynchronous write failed, not rolling back\n", context->fcb->inode);
+            InterlockedCompareExchange(&Vcb->inflight_writes_status, context->Status, STATUS_SUCCESS);
+            clear_rollback(&context->rollback);
+        }
+    }
+}
+
+// Called from a system worker thread when an asynchronous write fails, as we need to be at
+// PASSIVE_LEVEL and to take the tree lock to roll it back. The flush thread may have got there
+// first; either way, we're the ones who complete the IRP.
+_Function_class_(IO_WORKITEM_ROUTINE)
+static void __stdcall async_write_failed(PDEVICE_OBJECT DeviceObject, PVOID con) {
+    async_write_context* context = con;
+    device_extension* Vcb = context->Vcb;
+    PIRP Irp = context->Irp;
+
+    UNUSED(DeviceObject);
+
+    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, true);
+    rollback_failed_async_writes(Vcb);
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    Irp->IoStatus.Status = context->Status;
+    Irp->IoStatus.Information = 0;
+
+    free_async_write_context(context);
+
+    IoCompleteRequest(Irp, IO_DISK_INCREMENT);
+}
+
+static void complete_async_write(async_write_context* context) {
+    device_extension* Vcb = context->Vcb;
+    PIRP Irp = context->Irp;
+    bool holding = context->holding;
+    KIRQL irql;
+
+    if (!NT_SUCCESS(context->Status) && !IsListEmpty(&context->rollback)) {
+        KeAcquireSpinLock(&Vcb->inflight_writes_lock, &irql);
+        InsertTailList(&Vcb->async_writes_failed, &context->list_entry);
+        KeReleaseSpinLock(&Vcb->inflight_writes_lock, irql);
+
+        IoQueueWorkItem(context->work_item, async_write_failed, DelayedWorkQueue, context);
+
+        // only now can do_write2 stop waiting - it'll find us on the list and roll us back itself
+        if (holding)
+            inflight_write_finished(Vcb, NULL);
+
+        return;
+    }
+
+    if (holding)
+        inflight_write_finished(Vcb, NULL);
+
+    Irp->IoStatus.Status = context->Status;
+
+    if (!NT_SUCCESS(context->Status))
+        Irp->IoStatus.Information = 0;
+
+    if (IsListEmpty(&context->rollback) || KeGetCurrentIrql() == PASSIVE_LEVEL)
+        free_async_write_context(context);
+    else {
+        KeAcquireSpinLock(&Vcb->inflight_writes_lock, &irql);
+        InsertTailList(&Vcb->async_writes_done, &context->list_entry);
+        KeReleaseSpinLock(&Vcb->inflight_writes_lock, irql);
+    }
+
+    IoCompleteRequest(Irp, IO_DISK_INCREMENT);
+}
+
+// called from write_data_completion, possibly at DISPATCH_LEVEL
+static void async_write_data_finished(write_data_context* wtc) {
+    async_write_context* context = wtc->callback_context;
+    LIST_ENTRY* le;
+
+    le = wtc->stripes.Flink;
+    while (le != &wtc->stripes) {
+        write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
+
+        if (stripe->status != WriteDataStatus_Ignore && !NT_SUCCESS(stripe->iosb.Status)) {
+            log_device_error(context->Vcb, stripe->device, BTRFS_DEV_STAT_WRITE_ERRORS);
+            // complete_async_write will see this and roll the write back
+            InterlockedCompareExchange(&context->Status, stripe->iosb.Status, STATUS_SUCCESS);
+            break;
+        }
+
+        le = le->Flink;
+    }
+
+    free_write_data_stripes(wtc);
+    ExFreePool(wtc);
+
+    inflight_write_finished(context->Vcb, context->fcb);
+
+    if (InterlockedDecrement(&context->writes_left) == 0)
+        complete_async_write(context);
+}
+
+__attribute__((nonnull(1,2,4,6,7)))
+static NTSTATUS write_data_async(device_extension* Vcb, async_write_context* context, uint64_t address, void* data, uint32_t length,
+                                 PIRP Irp, chunk* c, uint64_t irp_offset, ULONG priority) {
+    write_data_context* wtc;
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+
+    wtc = ExAllocatePoolWithTag(NonPagedPool, sizeof(write_data_context), ALLOC_TAG);
+    if (!wtc) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    KeInitializeEvent(&wtc->Event, NotificationEvent, false);
+    InitializeListHead(&wtc->stripes);
+    wtc->stripes_left = 0;
+    wtc->parity1 = wtc->parity2 = wtc->scratch = NULL;
+    wtc->mdl = wtc->parity1_mdl = wtc->parity2_mdl = NULL;
+    wtc->callback = async_write_data_finished;
+    wtc->callback_context = context;
+
+    try {
+        Status = write_data(Vcb, address, data, length, wtc, Irp, c, true, irp_offset, priority);
+    } except (EXCEPTION_EXECUTE_HANDLER) {
+        Status = GetExceptionCode();
+    }
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("write_data returned %08lx\n", Status);
+        free_write_data_stripes(wtc);
+        ExFreePool(wtc);
+        return Status;
+    }
+
+    if (wtc->stripes_left == 0) {
+        free_write_data_stripes(wtc);
+        ExFreePool(wtc);
+        return STATUS_SUCCESS;
+    }
+
+    InterlockedIncrement(&context->writes_left);
+    inflight_write_started(Vcb, context->fcb);
+
+    // Hold the volume's count until complete_async_write has decided what to do, so that if a
+    // device write fails, do_write2 can't commit the extents in the gap before the failure is queued.
+    // We're under the tree lock here, so the flush thread can't already be waiting on it.
+    if (!context->holding) {
+        inflight_write_started(Vcb, NULL);
+        context->holding = true;
+    }
+
+    // hold an extra count so the completion routines can't free wtc while we're still walking the list
+    InterlockedIncrement(&wtc->stripes_left);
+
+    le = wtc->stripes.Flink;
+    while (le != &wtc->stripes) {
+        write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
+
+        le = le->Flink;
+
+        if (stripe->status != WriteDataStatus_Ignore)
+            IoCallDriver(stripe->device->devobj, stripe->Irp);
+    }
+
+    if (InterlockedDecrement(&wtc->stripes_left) == 0)
+        async_write_data_finished(wtc);
+
+    return STATUS_SUCCESS;
+}
+
+// Tries to do an asynchronous non-cached write without tying up a thread. We do the allocation
+// and extent bookkeeping here as normal, but write_data_complete sends off the device writes
+// without waiting for them, and the IRP is completed when the last one finishes. Returns false
+// if the request hasn't been touched, in which case the caller should post it as before.
+__attribute__((nonnull(1,2)))
+bool write_file_async(device_extension* Vcb, PIRP Irp) {
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    fcb* fcb = IrpSp->FileObject->FsContext;
+    async_write_context* context;
+    NTSTATUS Status;
+
+    if (!(Irp->Flags & IRP_NOCACHE) || Irp->Flags & IRP_PAGING_IO || IrpSp->MinorFunction != IRP_MN_NORMAL)
+        return false;
+
+    if (fcb->ads || fcb->type != BTRFS_TYPE_FILE || write_fcb_compressed(fcb))
+        return false;
+
+    if (!lock_irp_buffer(Irp))
+        return false;
+
+    if (!(Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL)))
+        return false;
+
+    context = ExAllocatePoolWithTag(NonPagedPool, sizeof(async_write_context), ALLOC_TAG);
+    if (!context) {
+        ERR("out of memory\n");
+        return false;
+    }
+
+    // allocated now so we're not stuck if a device write fails
+    context->work_item = IoAllocateWorkItem(Vcb->devobj);
+    if (!context->work_item) {
+        ERR("out of memory\n");
+        ExFreePool(context);
+        return false;
+    }
+
+    context->Vcb = Vcb;
+    context->fcb = fcb;
+    context->Irp = Irp;
+    context->writes_left = 1;
+    context->Status = STATUS_SUCCESS;
+    context->sequence_before = context->sequence_after = 0;
+    context->holding = false;
+    InitializeListHead(&context->rollback);
+
+    reap_async_writes(Vcb);
+
+    IoMarkIrpPending(Irp);
+
+    Irp->Tail.Overlay.DriverContext[0] = context;
+
+    Status = write_file(Vcb, Irp, false, false);
+
+    Irp->Tail.Overlay.DriverContext[0] = NULL;
+
+    if (Status == STATUS_PENDING) { // couldn't get the locks without waiting, so nothing has been sent
+        free_async_write_context(context);
+        return false;
+    }
+
+    if (!NT_SUCCESS(Status))
+        InterlockedCompareExchange(&context->Status, Status, STATUS_SUCCESS);
+
+    if (InterlockedDecrement(&context->writes_left) == 0)
+        complete_async_write(context);
+
+    return true;
+}
+
 __attribute__((nonnull(1,3)))
 NTSTATUS write_data_complete(device_extension* Vcb, uint64_t address, void* data, uint32_t length, PIRP Irp, chunk* c, bool file_write, uint64_t irp_offset, ULONG priority) {
     write_data_context wtc;
@@ -2203,6 +2627,7 @@ NTSTATUS write_data_complete(device_extension* Vcb, uint64_t address, void* data
     wtc.stripes_left = 0;
     wtc.parity1 = wtc.parity2 = wtc.scratch = NULL;
     wtc.mdl = wtc.parity1_mdl = wtc.parity2_mdl = NULL;
+    wtc.callback = NULL;
 
     if (!c) {
         c = get_chunk_from_address(Vcb, address);
@@ -2212,6 +2637,10 @@ NTSTATUS write_data_complete(device_extension* Vcb, uint64_t address, void* data
         }
     }
 
+    // RAID5/6 writes hold a range lock on the chunk, which belongs to this thread, so they stay synchronous
+    if (file_write && Irp && Irp->Tail.Overlay.DriverContext[0] && !(c->chunk_item->type & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6)))
+        return write_data_async(Vcb, Irp->Tail.Overlay.DriverContext[0], address, data, length, Irp, c, irp_offset, priority);
+
     if (c->chunk_item->type & BLOCK_FLAG_RAID5 || c->chunk_item->type & BLOCK_FLAG_RAID6) {
         get_raid56_lock_range(c, address, length, &lockaddr, &locklen);
         chunk_lock_range(Vcb, c, lockaddr, locklen);
@@ -2313,8 +2742,12 @@ static NTSTATUS __stdcall write_data_completion(PDEVICE_OBJECT DeviceObject, PIR
     }
 
 end:
-    if (InterlockedDecrement(&context->stripes_left) == 0)
-        KeSetEvent(&context->Event, 0, false);
+    if (InterlockedDecrement(&context->stripes_left) == 0) {
+        if (context->callback)
+            context->callback(context);
+        else
+            KeSetEvent(&context->Event, 0, false);
+    }
 
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
@@ -2818,23 +3251,15 @@ static void remove_fcb_extent(fcb* fcb, extent* ext, LIST_ENTRY* rollback) {
     }
 }
 
-_Requires_lock_held_(c->lock)
-_When_(return != 0, _Releases_lock_(c->lock))
 __attribute__((nonnull(1,2,3,9)))
-bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk* c, _In_ uint64_t start_data, _In_ uint64_t length, _In_ bool prealloc, _In_opt_ void* data,
-                         _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback, _In_ uint8_t compression, _In_ uint64_t decoded_size, _In_ bool file_write, _In_ uint64_t irp_offset) {
-    uint64_t address;
+static bool add_new_extent(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk* c, _In_ uint64_t address, _In_ uint64_t start_data, _In_ uint64_t length,
+                           _In_ bool prealloc, _In_opt_ void* data, _In_ LIST_ENTRY* rollback, _In_ uint8_t compression, _In_ uint64_t decoded_size) {
     NTSTATUS Status;
     EXTENT_DATA* ed;
     EXTENT_DATA2* ed2;
     uint16_t edsize = (uint16_t)(offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2));
     void* csum = NULL;
 
-    TRACE("(%p, (%I64x, %I64x), %I64x, %I64x, %I64x, %u, %p, %p)\n", Vcb, fcb->subvol->id, fcb->inode, c->offset, start_data, length, prealloc, data, rollback);
-
-    if (!find_data_address_in_chunk(Vcb, c, length, &address))
-        return false;
-
     // add extent data to inode
     ed = ExAllocatePoolWithTag(PagedPool, edsize, ALLOC_TAG);
     if (!ed) {
@@ -2878,9 +3303,6 @@ bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
 
     ExFreePool(ed);
 
-    c->used += length;
-    space_list_subtract(c, address, length, rollback);
-
     fcb->inode_item.st_blocks += decoded_size;
 
     fcb->extents_changed = true;
@@ -2893,6 +3315,28 @@ bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
 
     ExReleaseResourceLite(&c->changed_extents_lock);
 
+    return true;
+}
+
+_Requires_lock_held_(c->lock)
+_When_(return != 0, _Releases_lock_(c->lock))
+__attribute__((nonnull(1,2,3,9)))
+bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk* c, _In_ uint64_t start_data, _In_ uint64_t length, _In_ bool prealloc, _In_opt_ void* data,
+                         _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback, _In_ uint8_t compression, _In_ uint64_t decoded_size, _In_ bool file_write, _In_ uint64_t irp_offset) {
+    uint64_t address;
+    NTSTATUS Status;
+
+    TRACE("(%p, (%I64x, %I64x), %I64x, %I64x, %I64x, %u, %p, %p)\n", Vcb, fcb->subvol->id, fcb->inode, c->offset, start_data, length, prealloc, data, rollback);
+
+    if (!find_data_address_in_chunk(Vcb, c, length, &address))
+        return false;
+
+    if (!add_new_extent(Vcb, fcb, c, address, start_data, length, prealloc, data, rollback, compression, decoded_size))
+        return false;
+
+    c->used += length;
+    space_list_subtract(c, address, length, rollback);
+
     release_chunk_lock(c, Vcb);
 
     if (data) {
@@ -2905,6 +3349,126 @@ bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
     return true;
 }
 
+__attribute__((nonnull(1)))
+void release_alloc_window(fcb* fcb) {
+    chunk* c = fcb->window_chunk;
+
+    if (!c)
+        return;
+
+    if (fcb->window_length > 0) {
+        acquire_chunk_lock(c, fcb->Vcb);
+
+        space_list_add2(&c->space, &c->space_size, fcb->window_address, fcb->window_length, c, NULL);
+        c->used -= fcb->window_length;
+
+        release_chunk_lock(c, fcb->Vcb);
+    }
+
+    fcb->window_chunk = NULL;
+    fcb->window_address = 0;
+    fcb->window_length = 0;
+}
+
+__attribute__((nonnull(1,2)))
+static bool reserve_alloc_window(device_extension* Vcb, fcb* fcb, uint64_t length) {
+    LIST_ENTRY* le;
+    uint64_t address, winlen;
+
+    // Small writers get small windows, so that a file which only ever gets a few KB doesn't tie up
+    // megabytes of the chunk until it's flushed.
+    if (length >= ALLOC_WINDOW_MAX)
+        winlen = length;
+    else
+        winlen = min(length * ALLOC_WINDOW_WRITES, ALLOC_WINDOW_MAX);
+
+    release_alloc_window(fcb);
+
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+
+        if (!c->readonly && !c->reloc && c->chunk_item->type == Vcb->data_flags) {
+            acquire_chunk_lock(c, Vcb);
+
+            if ((c->chunk_item->size - c->used) >= winlen && find_data_address_in_chunk(Vcb, c, winlen, &address)) {
+                // Take the space out of the free list, so that nobody else can use it, and
+                // charge it to the chunk now. Anything we don't use gets put back by
+                // release_alloc_window when the FCB is flushed.
+
+                space_list_subtract2(&c->space, &c->space_size, address, winlen, c, NULL);
+                c->used += winlen;
+                c->changed = true;
+                c->space_changed = true;
+
+                release_chunk_lock(c, Vcb);
+                ExReleaseResourceLite(&Vcb->chunk_lock);
+
+                fcb->window_chunk = c;
+                fcb->window_address = address;
+                fcb->window_length = winlen;
+
+                return true;
+            }
+
+            release_chunk_lock(c, Vcb);
+        }
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+
+    return false;
+}
+
+__attribute__((nonnull(1,2,5,9)))
+static bool insert_extent_window(device_extension* Vcb, fcb* fcb, uint64_t start_data, uint64_t length, void* data,
+                                 PIRP Irp, bool file_write, uint64_t irp_offset, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    uint64_t address;
+
+    // Only use windows for normal writes, which hold the FCB exclusively. The flush thread
+    // (which has tree_lock exclusively) writes the free-space cache, which mustn't leave
+    // any reservations behind.
+    if (fcb->subvol == Vcb->root_root || fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ||
+        !ExIsResourceAcquiredExclusiveLite(fcb->Header.Resource) || ExIsResourceAcquiredExclusiveLite(&Vcb->tree_lock)) {
+        return false;
+    }
+
+    if (fcb->window_chunk && (fcb->window_chunk->readonly || fcb->window_chunk->reloc))
+        release_alloc_window(fcb);
+
+    if (fcb->window_length < length) {
+        if (!reserve_alloc_window(Vcb, fcb, length))
+            return false;
+    }
+
+    address = fcb->window_address;
+
+    if (!add_new_extent(Vcb, fcb, fcb->window_chunk, address, start_data, length, false, data, rollback, BTRFS_COMPRESSION_NONE, length)) {
+        // The window only gets given back when the FCB is flushed, so don't keep
+        // hold of it unless we know the FCB has been marked dirty.
+        release_alloc_window(fcb);
+        return false;
+    }
+
+    // The window was charged to the chunk when we reserved it, so if this write gets rolled back, its
+    // part of the window has to go back on the free list.
+    add_rollback_space(rollback, false, &fcb->window_chunk->space, &fcb->window_chunk->space_size, address, length, fcb->window_chunk);
+
+    fcb->window_address += length;
+    fcb->window_length -= length;
+
+    Status = write_data_complete(Vcb, address, data, (uint32_t)length, Irp, NULL, file_write, irp_offset, NormalPagePriority);
+    if (!NT_SUCCESS(Status))
+        ERR("write_data_complete returned %08lx\n", Status);
+
+    return true;
+}
+
 __attribute__((nonnull(1,2,5,7,10)))
 static bool try_extend_data(device_extension* Vcb, fcb* fcb, uint64_t start_data, uint64_t length, void* data,
                             PIRP Irp, uint64_t* written, bool file_write, uint64_t irp_offset, LIST_ENTRY* rollback) {
@@ -3159,7 +3723,22 @@ static NTSTATUS insert_extent(device_extension* Vcb, fcb* fcb, uint64_t start_da
         bool done = false;
 
         // Rather than necessarily writing the whole extent at once, we deal with it in blocks of 128 MB.
-        // First, see if we can write the extent part to an existing chunk.
+        // First, see if we can put it in the space we've reserved for this file.
+
+        if (insert_extent_window(Vcb, fcb, start_data, newlen, data, Irp, file_write, irp_offset, rollback)) {
+            written += newlen;
+
+            if (written == orig_length)
+                return STATUS_SUCCESS;
+
+            start_data += newlen;
+            irp_offset += newlen;
+            length -= newlen;
+            data = &((uint8_t*)data)[newlen];
+            continue;
+        }
+
+        // Otherwise, see if we can write the extent part to an existing chunk.
 
         ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
 
@@ -4146,7 +4725,8 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
     if (!no_cache && !CcCanIWrite(FileObject, *length, wait, deferred_write))
         return STATUS_PENDING;
 
-    if (!wait && no_cache)
+    // write_file_async puts its context in DriverContext[0] - see write_data_complete
+    if (!wait && no_cache && (!write_irp || !Irp->Tail.Overlay.DriverContext[0]))
         return STATUS_PENDING;
 
     if (no_cache && !paging_io && FileObject->SectionObjectPointer->DataSectionObject) {
@@ -4199,6 +4779,10 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
             acquired_fcb_lock = true;
     }
 
+    // so rollback_failed_async_writes can tell if anyone else has changed the file since
+    if (write_irp && Irp->Tail.Overlay.DriverContext[0])
+        ((async_write_context*)Irp->Tail.Overlay.DriverContext[0])->sequence_before = fcb->inode_item.sequence;
+
     newlength = fcb->ads ? fcb->adsdata.Length : fcb->inode_item.st_size;
 
     if (fcb->deleted)
@@ -4577,6 +5161,9 @@ end:
         TRACE("CurrentByteOffset now: %I64x\n", FileObject->CurrentByteOffset.QuadPart);
     }
 
+    if (acquired_fcb_lock && write_irp && Irp->Tail.Overlay.DriverContext[0])
+        ((async_write_context*)Irp->Tail.Overlay.DriverContext[0])->sequence_after = fcb->inode_item.sequence;
+
     if (acquired_fcb_lock)
         ExReleaseResourceLite(fcb->Header.Resource);
 
@@ -4654,7 +5241,15 @@ NTSTATUS write_file(device_extension* Vcb, PIRP Irp, bool wait, bool deferred_wr
     }
 
 exit:
-    if (NT_SUCCESS(Status))
+    if (Status != STATUS_PENDING && Irp->Tail.Overlay.DriverContext[0]) {
+        async_write_context* context = Irp->Tail.Overlay.DriverContext[0];
+
+        // Some of the data may still be on its way to the disk, so it's too early to know whether
+        // we'll need to undo this - complete_async_write decides.
+        while (!IsListEmpty(&rollback)) {
+            InsertTailList(&context->rollback, RemoveHeadList(&rollback));
+        }
+    } else if (NT_SUCCESS(Status))
         clear_rollback(&rollback);
     else
         do_rollback(Vcb, &rollback);
@@ -4674,6 +5269,7 @@ NTSTATUS __stdcall drv_write(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp) {
     fcb* fcb = FileObject ? FileObject->FsContext : NULL;
     ccb* ccb = FileObject ? FileObject->FsContext2 : NULL;
     bool wait = FileObject ? IoIsOperationSynchronous(Irp) : true;
+    bool async = false;
 
     FsRtlEnterFileSystem();
 
@@ -4745,12 +5341,22 @@ NTSTATUS __stdcall drv_write(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp) {
             if (Irp->Flags & IRP_PAGING_IO)
                 wait = true;
 
-            Status = write_file(Vcb, Irp, wait, false);
+            Irp->Tail.Overlay.DriverContext[0] = NULL;
+
+            if (!wait && write_file_async(Vcb, Irp))
+                async = true;
+            else
+                Status = write_file(Vcb, Irp, wait, false);
         }
     } except (EXCEPTION_EXECUTE_HANDLER) {
         Status = GetExceptionCode();
     }
 
+    if (async) {
+        Status = STATUS_PENDING;
+        goto exit;
+    }
+
 end:
     Irp->IoStatus.Status = Status;
 